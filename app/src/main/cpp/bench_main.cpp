@@ -0,0 +1,501 @@
+// Host benchmark for the generation core: replays benchmark_prompts.json against a GGUF model
+// through the same worker, scheduler and samplers the app uses and prints a JSON report.
+//
+//   assistant_bench -m model.gguf [-p benchmark_prompts.json] [-t threads] [--calibrate] [--rag] [--memory]
+//
+// Prompts are built like RagChatRepository does for a fresh conversation (model-specific chat
+// template, PERSONAL MEMORY / CONTEXT blocks, "Question:"). Retrieval is not simulated: with
+// --memory / --rag every memory_setup / rag_setup entry is put in the prompt.
+
+#include "llama_core.h"
+
+#include "ggml.h"
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+#ifndef BENCH_DEFAULT_PROMPTS
+#define BENCH_DEFAULT_PROMPTS "benchmark_prompts.json"
+#endif
+
+namespace {
+
+struct bench_args {
+    std::string model;
+    std::string prompts = BENCH_DEFAULT_PROMPTS;
+    std::string output;                 // empty = stdout
+    std::string draft;
+    int  threads    = 0;                // 0 = hardware threads
+    int  threads_batch = 0;             // 0 = session_threads_for(threads)
+    int  max_tokens = 96;               // SettingsKeys.MAX_TOKENS default; per-prompt max_tokens wins
+    int  draft_max  = 8;
+    int  lookup     = 0;
+    bool rag        = false;
+    bool memory     = false;
+    bool warmup     = true;
+    bool verbose    = false;
+    bool calibrate  = false;
+    session_config ctx;                 // app defaults unless overridden
+};
+
+// Same fields as BenchmarkPrompt in BenchmarkRunner.kt
+struct bench_prompt {
+    std::string id, category, text, expected_regex, insert_memory, doc_text;
+    int max_tokens = 0;
+};
+
+struct prompt_result {
+    gen_telemetry tel;                  // as measured by the worker
+    std::vector<double> token_ms;       // tel.token_us in ms
+    std::string output;
+    gen_status status = GEN_DONE;
+};
+
+void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s -m MODEL.gguf [options]\n"
+            "  -p, --prompts FILE    benchmark prompts (default: %s)\n"
+            "  -o, --output FILE     write the JSON report here instead of stdout\n"
+            "  -t, --threads N       decode threads, on all but the slowest cores (default: hardware threads)\n"
+            "      --threads-batch N prefill threads, on all cores (default: --threads)\n"
+            "      --calibrate       time candidate core sets first and keep the fastest pools\n"
+            "  -n, --max-tokens N    max tokens for prompts without max_tokens (default: 96)\n"
+            "      --rag             put the rag_setup documents in a CONTEXT block\n"
+            "      --memory          put the memory_setup entries in a PERSONAL MEMORY block\n"
+            "      --draft FILE      draft model for speculative decoding\n"
+            "      --draft-max N     max drafted tokens per step (default: 8)\n"
+            "      --lookup N        prompt-lookup drafting with n-grams up to N\n"
+            "  -c, --ctx-size N      KV cache cells (default: 1536)\n"
+            "  -b, --batch-size N    tokens per scheduler step (default: 256)\n"
+            "      --ubatch-size N   tokens per compute graph (default: 64)\n"
+            "      --cache-type-k T  K cache type: f16, q8_0 or q4_0 (default: f16)\n"
+            "      --cache-type-v T  V cache type: f16, q8_0 or q4_0 (default: f16)\n"
+            "      --flash-attn      use flash attention (implied by a quantized V cache)\n"
+            "      --mem-budget MB   size ctx/ubatch to fit KV + compute buffers in MB\n"
+            "      --no-warmup       skip the warm-up decode\n"
+            "  -v, --verbose         log from llama.cpp and the core to stderr\n",
+            argv0, BENCH_DEFAULT_PROMPTS);
+}
+
+bool parse_kv_type(const char *name, ggml_type *out) {
+    for (ggml_type t : {GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0}) {
+        if (strcmp(name, ggml_type_name(t)) == 0) {
+            *out = t;
+            return true;
+        }
+    }
+    fprintf(stderr, "unsupported cache type: %s\n", name);
+    return false;
+}
+
+bool parse_args(int argc, char **argv, bench_args *a) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&](const char *name) -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "missing value for %s\n", name);
+                return nullptr;
+            }
+            return argv[++i];
+        };
+        const char *v = nullptr;
+        if      (arg == "-m" || arg == "--model")      { if (!(v = value("--model")))      return false; a->model = v; }
+        else if (arg == "-p" || arg == "--prompts")    { if (!(v = value("--prompts")))    return false; a->prompts = v; }
+        else if (arg == "-o" || arg == "--output")     { if (!(v = value("--output")))     return false; a->output = v; }
+        else if (arg == "-t" || arg == "--threads")    { if (!(v = value("--threads")))    return false; a->threads = atoi(v); }
+        else if (arg == "--threads-batch")             { if (!(v = value("--threads-batch"))) return false; a->threads_batch = atoi(v); }
+        else if (arg == "-n" || arg == "--max-tokens") { if (!(v = value("--max-tokens"))) return false; a->max_tokens = atoi(v); }
+        else if (arg == "--draft")                     { if (!(v = value("--draft")))      return false; a->draft = v; }
+        else if (arg == "--draft-max")                 { if (!(v = value("--draft-max")))  return false; a->draft_max = atoi(v); }
+        else if (arg == "--lookup")                    { if (!(v = value("--lookup")))     return false; a->lookup = atoi(v); }
+        else if (arg == "-c" || arg == "--ctx-size")   { if (!(v = value("--ctx-size")))   return false; a->ctx.n_ctx = atoi(v); }
+        else if (arg == "-b" || arg == "--batch-size") { if (!(v = value("--batch-size"))) return false; a->ctx.n_batch = atoi(v); }
+        else if (arg == "--ubatch-size")               { if (!(v = value("--ubatch-size"))) return false; a->ctx.n_ubatch = atoi(v); }
+        else if (arg == "--cache-type-k")              { if (!(v = value("--cache-type-k")) || !parse_kv_type(v, &a->ctx.type_k)) return false; }
+        else if (arg == "--cache-type-v")              { if (!(v = value("--cache-type-v")) || !parse_kv_type(v, &a->ctx.type_v)) return false; }
+        else if (arg == "--flash-attn")                a->ctx.flash_attn = true;
+        else if (arg == "--mem-budget")                { if (!(v = value("--mem-budget"))) return false; a->ctx.memory_budget_mb = atoi(v); }
+        else if (arg == "--rag")                       a->rag = true;
+        else if (arg == "--memory")                    a->memory = true;
+        else if (arg == "--no-warmup")                 a->warmup = false;
+        else if (arg == "--calibrate")                 a->calibrate = true;
+        else if (arg == "-v" || arg == "--verbose")    a->verbose = true;
+        else {
+            fprintf(stderr, "unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    if (a->model.empty()) return false;
+    if (a->threads <= 0) a->threads = (int) std::max(1u, std::thread::hardware_concurrency());
+    return true;
+}
+
+bool load_prompts(const std::string& path, std::vector<bench_prompt> *out) {
+    std::ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "cannot open %s\n", path.c_str());
+        return false;
+    }
+    try {
+        const json doc = json::parse(in);
+        for (const auto &p : doc) {
+            bench_prompt b;
+            b.id             = p.value("id", "");
+            b.category       = p.value("category", "");
+            b.text           = p.value("text", "");
+            b.expected_regex = p.value("expected_regex", "");
+            b.insert_memory  = p.value("insert_memory", "");
+            b.doc_text       = p.value("doc_text", "");
+            b.max_tokens     = p.value("max_tokens", 0);
+            out->push_back(std::move(b));
+        }
+    } catch (const std::exception &e) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), e.what());
+        return false;
+    }
+    return true;
+}
+
+// ---------- prompt building (mirrors domain/prompts) ----------
+
+std::string lowercase(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return (char) std::tolower(c); });
+    return s;
+}
+
+std::string trim(const std::string& s) {
+    size_t b = 0, e = s.size();
+    while (b < e && std::isspace((unsigned char) s[b])) ++b;
+    while (e > b && std::isspace((unsigned char) s[e - 1])) --e;
+    return s.substr(b, e - b);
+}
+
+// PromptTemplateFactory.getSystemPromptForNormal / getSystemPromptForHybrid
+const char *SYSTEM_NORMAL = "- Be helpful and concise\n- Reply only as the assistant\n- Avoid long or fictional conversations";
+const char *SYSTEM_HYBRID = "- Be concise\n- The CONTEXT/MEMORY blocks may be partial; ignore any cut-off sentences and rely on your own knowledge when needed.";
+
+// PromptTemplateFactory.getTemplateForModel + buildPrompt with an empty history
+std::string build_prompt(const std::string& model_file, const std::string& user) {
+    const std::string name = lowercase(model_file);
+    std::string p;
+    if (name.find("qwen") != std::string::npos) {
+        p += "<|im_start|>system\n"; p += SYSTEM_NORMAL; p += "\n<|im_end|>\n";
+        p += "<|im_start|>user\n" + user + "\n<|im_end|>\n<|im_start|>assistant\n";
+    } else if (name.find("gemma") != std::string::npos) {
+        p += "<start_of_turn>system\n"; p += SYSTEM_HYBRID; p += "\n<end_of_turn>\n";
+        p += "<start_of_turn>user\n" + trim(user) + "\n<end_of_turn>\n<start_of_turn>model\n";
+    } else if (name.find("llama") != std::string::npos || name.find("meta") != std::string::npos) {
+        p += "<|begin_of_text|><|start_header_id|>system<|end_header_id|>\n"; p += SYSTEM_NORMAL; p += "\n<|eot_id|>";
+        p += "<|start_header_id|>user<|end_header_id|>\n" + user + "\n<|eot_id|><|start_header_id|>assistant<|end_header_id|>\n";
+    } else {
+        p += SYSTEM_NORMAL; p += "\n\n";
+        p += "User: " + user + "\nAssistant:";
+    }
+    return p;
+}
+
+// PromptTemplate.stopStrings of the template build_prompt picked
+std::vector<std::string> stop_strings(const std::string& model_file) {
+    const std::string name = lowercase(model_file);
+    if (name.find("qwen") != std::string::npos)  return {"<|im_end|>", "<|im_start|>"};
+    if (name.find("gemma") != std::string::npos) return {"<end_of_turn>", "<start_of_turn>"};
+    if (name.find("llama") != std::string::npos || name.find("meta") != std::string::npos) {
+        return {"<|eot_id|>", "<|start_header_id|>"};
+    }
+    return {"\nUser:"};
+}
+
+// RagChatRepository's current message: PERSONAL MEMORY, CONTEXT, then the question
+std::string build_message(const bench_args& a, const std::vector<bench_prompt>& all, const std::string& text) {
+    std::string memory, docs;
+    for (const auto &p : all) {
+        if (p.category == "memory_setup" && !p.insert_memory.empty()) memory += "- " + trim(p.insert_memory) + "\n";
+        if (p.category == "rag_setup" && !p.doc_text.empty()) docs += trim(p.doc_text) + "\n";
+    }
+    std::string m;
+    if (a.memory && !memory.empty()) m += "PERSONAL MEMORY\n" + memory + "---\n";
+    if (a.rag && !docs.empty()) m += "CONTEXT\n" + docs + "\n---\n";
+    m += "Question:\n" + trim(text);
+    return m;
+}
+
+// ---------- measurement ----------
+
+double peak_rss_mb() {
+    struct rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    return (double) ru.ru_maxrss / 1024.0;   // KiB on Linux
+}
+
+// Nearest-rank percentile
+double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    const size_t rank = (size_t) std::ceil(p / 100.0 * (double) v.size());
+    return v[std::min(v.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+double round3(double v) {
+    return std::round(v * 1000.0) / 1000.0;
+}
+
+// Submits one prompt at interactive priority and blocks until it completes
+prompt_result run_prompt(llama_session *session, const std::string& prompt, int max_tokens,
+                         const std::vector<std::string>& stops) {
+    prompt_result r;
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+
+    auto req = std::make_shared<gen_request>();
+    req->priority   = GEN_PRIORITY_INTERACTIVE;
+    req->prompt     = prompt;
+    req->max_tokens = max_tokens;
+    req->stop       = stops;
+    req->cb.on_token = [&](const std::string& text) {
+        r.output += text;
+        return true;
+    };
+    req->cb.on_telemetry = [&](const gen_telemetry& t) {
+        r.tel = t;
+        for (int32_t us : t.token_us) r.token_ms.push_back((double) us / 1000.0);
+    };
+    req->cb.on_complete = [&](gen_status status) {
+        std::lock_guard<std::mutex> lock(m);
+        r.status = status;
+        done = true;
+        cv.notify_all();
+    };
+    worker_submit(session, req, [] { return new gen_worker(); });
+
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&] { return done; });
+    return r;
+}
+
+const char *status_name(gen_status s) {
+    switch (s) {
+        case GEN_DONE:      return "done";
+        case GEN_CANCELLED: return "cancelled";
+        default:            return "failed";
+    }
+}
+
+std::string file_name(const std::string& path) {
+    const size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    bench_args args;
+    if (!parse_args(argc, argv, &args)) {
+        usage(argv[0]);
+        return 2;
+    }
+    std::vector<bench_prompt> prompts;
+    if (!load_prompts(args.prompts, &prompts)) return 1;
+
+    core_log_set_verbose(args.verbose);
+    if (!args.verbose) {
+        llama_log_set([](ggml_log_level level, const char *text, void *) {
+            // CONT continues the previous line at that line's level
+            static ggml_log_level last = GGML_LOG_LEVEL_INFO;
+            if (level != GGML_LOG_LEVEL_CONT) last = level;
+            if (last >= GGML_LOG_LEVEL_WARN) fputs(text, stderr);
+        }, nullptr);
+    }
+    llama_backend_init();
+
+    const int64_t t_load = ggml_time_us();
+    llama_model *model = model_acquire(args.model, /*use_mmap=*/true, /*use_mlock=*/false, /*prefetch=*/true);
+    if (!model) {
+        fprintf(stderr, "failed to load %s\n", args.model.c_str());
+        return 1;
+    }
+    const int64_t load_us = ggml_time_us() - t_load;
+    llama_session *session = session_create(model, args.model, args.threads, args.ctx);
+    if (!session) {
+        model_release(model);
+        fprintf(stderr, "failed to create a context\n");
+        return 1;
+    }
+    if (!args.draft.empty() && !session_attach_draft(session, args.draft, args.draft_max)) {
+        fprintf(stderr, "draft model not usable, continuing without it\n");
+    }
+    if (args.threads_batch > 0) {
+        session_threads threads = session_threads_for(args.threads);
+        threads.batch.n_threads = args.threads_batch;
+        session_set_thread_pools(session, threads);
+    }
+    json calibration = nullptr;
+    if (args.calibrate) {
+        const int64_t t_cal = ggml_time_us();
+        const thread_calibration cal = session_calibrate_threads(session, 64, 8);
+        calibration = {
+            {"candidates",           cal.candidates},
+            {"decode_ms_per_token",  round3(cal.decode_ms_per_token)},
+            {"prefill_ms_per_token", round3(cal.prefill_ms_per_token)},
+            {"ms",                   round3((double) (ggml_time_us() - t_cal) / 1000.0)},
+        };
+    }
+    if (args.lookup > 0) session_configure_lookup(session, args.lookup, args.draft_max);
+    const int64_t warmup_ms = args.warmup ? session_warmup(session) : 0;
+
+    const std::string model_file = file_name(args.model);
+    const std::vector<std::string> stops = stop_strings(model_file);
+    json results = json::array();
+    std::vector<double> all_token_ms, first_token_ms, prefill_ms;
+    int64_t gen_tokens = 0, gen_us = 0;
+    int n_passed = 0, n_checked = 0;
+    const int64_t t_run = ggml_time_us();
+
+    for (const auto &p : prompts) {
+        if (p.text.empty()) continue;   // memory_setup / rag_setup rows
+        const int max_tokens = p.max_tokens > 0 ? p.max_tokens : args.max_tokens;
+        const std::string prompt = build_prompt(model_file, build_message(args, prompts, p.text));
+        prompt_result r = run_prompt(session, prompt, max_tokens, stops);
+
+        const std::string out = trim(r.output);
+        const gen_telemetry &t = r.tel;
+        // Decode phase: from the first streamed token to the last
+        double decode_ms = 0.0;
+        for (double ms : r.token_ms) decode_ms += ms;
+        const double tps = decode_ms > 0.0 ? (double) r.token_ms.size() / (decode_ms / 1000.0) : 0.0;
+        json hist = json::array();
+        for (int32_t n : t.latency_hist) hist.push_back(n);
+
+        json row;
+        row["id"]               = p.id;
+        row["category"]         = p.category;
+        row["status"]           = status_name(r.status);
+        row["prompt_tokens"]    = t.prompt_tokens;
+        row["reused_tokens"]    = t.reused_tokens;
+        row["prefilled_tokens"] = t.prefilled_tokens;
+        row["output_tokens"]    = t.generated_tokens;
+        row["max_tokens"]       = max_tokens;
+        row["tokenize_ms"]      = round3((double) t.tokenize_us / 1000.0);
+        row["prefill_ms"]       = round3((double) t.prefill_us / 1000.0);
+        row["prefill_ubatches"] = t.prefill_ubatches;
+        row["first_sample_ms"]  = round3((double) t.first_sample_us / 1000.0);
+        row["first_token_ms"]   = round3((double) t.first_token_us / 1000.0);
+        row["sample_ms"]        = round3((double) t.sample_us / 1000.0);
+        row["decode_ms"]        = round3(decode_ms);
+        row["decode_steps"]     = t.decode_steps;
+        row["decode_p50_ms"]    = round3((double) t.latency_p50_us / 1000.0);
+        row["decode_p95_ms"]    = round3((double) t.latency_p95_us / 1000.0);
+        row["decode_p99_ms"]    = round3((double) t.latency_p99_us / 1000.0);
+        row["latency_hist"]     = std::move(hist);
+        row["tokens_per_s"]     = round3(tps);
+        row["total_ms"]         = round3((double) t.total_us / 1000.0);
+        if (t.drafted_tokens > 0) {
+            row["drafted_tokens"]  = t.drafted_tokens;
+            row["accepted_tokens"] = t.accepted_tokens;
+        }
+        row["kv_cells_used"]    = t.kv_cells_used;
+        if (t.context_shifts > 0) {
+            row["context_shifts"]   = t.context_shifts;
+            row["discarded_tokens"] = t.discarded_tokens;
+        }
+        row["peak_rss_mb"]      = round3(peak_rss_mb());
+        if (!p.expected_regex.empty()) {
+            // BenchmarkRunner: Regex(rx, IGNORE_CASE).containsMatchIn(output.trim())
+            bool passed = false;
+            try {
+                passed = std::regex_search(out, std::regex(p.expected_regex, std::regex::ECMAScript | std::regex::icase));
+            } catch (const std::regex_error &e) {
+                row["regex_error"] = e.what();
+            }
+            row["expected_regex"] = p.expected_regex;
+            row["passed"] = passed;
+            n_passed  += passed ? 1 : 0;
+            n_checked += 1;
+        } else {
+            row["passed"] = nullptr;
+        }
+        row["output"] = out;
+        results.push_back(std::move(row));
+
+        all_token_ms.insert(all_token_ms.end(), r.token_ms.begin(), r.token_ms.end());
+        first_token_ms.push_back((double) t.first_token_us / 1000.0);
+        prefill_ms.push_back((double) t.prefill_us / 1000.0);
+        gen_tokens += (int64_t) r.token_ms.size();
+        gen_us     += (int64_t) (decode_ms * 1000.0);
+        if (args.verbose) fprintf(stderr, "%s: %s\n", p.id.c_str(), out.c_str());
+    }
+    const int64_t run_us = ggml_time_us() - t_run;
+
+    json report;
+    report["model"]        = model_file;
+    report["model_size_mb"] = round3((double) llama_model_size(model) / (1024.0 * 1024.0));
+    report["n_params"]     = llama_model_n_params(model);
+    report["threads"]      = llama_n_threads(session->ctx);
+    report["threads_batch"] = llama_n_threads_batch(session->ctx);
+    report["decode_cpus"]  = session->threads.decode.cpus;
+    report["batch_cpus"]   = session->threads.batch.cpus;
+    report["calibration"]  = calibration;
+    report["n_ctx"]        = llama_n_ctx(session->ctx);
+    report["n_batch"]      = llama_n_batch(session->ctx);
+    report["n_ubatch"]     = llama_n_ubatch(session->ctx);
+    report["type_k"]       = ggml_type_name(session->config.type_k);
+    report["type_v"]       = ggml_type_name(session->config.type_v);
+    report["flash_attn"]   = session->config.flash_attn;
+    report["mem_budget_mb"] = args.ctx.memory_budget_mb;
+    report["kv_mb"]        = round3((double) session->footprint.kv_bytes / (1024.0 * 1024.0));
+    report["compute_mb"]   = round3((double) session->footprint.compute_bytes / (1024.0 * 1024.0));
+    report["rag"]          = args.rag;
+    report["memory"]       = args.memory;
+    report["draft"]        = args.draft.empty() ? json(nullptr) : json(file_name(args.draft));
+    report["lookup_ngram"] = args.lookup;
+    report["system"]       = llama_print_system_info();
+    report["load_ms"]      = round3((double) load_us / 1000.0);
+    report["warmup_ms"]    = warmup_ms;
+
+    json summary;
+    summary["prompts"]              = (int) results.size();
+    summary["checked"]              = n_checked;
+    summary["passed"]               = n_passed;
+    summary["pass_rate"]            = n_checked > 0 ? round3((double) n_passed / n_checked) : 0.0;
+    summary["prefill_p50_ms"]       = round3(percentile(prefill_ms, 50));
+    summary["first_token_p50_ms"]   = round3(percentile(first_token_ms, 50));
+    summary["first_token_p95_ms"]   = round3(percentile(first_token_ms, 95));
+    summary["decode_p50_ms"]        = round3(percentile(all_token_ms, 50));
+    summary["decode_p95_ms"]        = round3(percentile(all_token_ms, 95));
+    summary["decode_p99_ms"]        = round3(percentile(all_token_ms, 99));
+    summary["tokens_per_s"]         = gen_us > 0 ? round3((double) gen_tokens / ((double) gen_us / 1e6)) : 0.0;
+    summary["total_ms"]             = round3((double) run_us / 1000.0);
+    summary["peak_rss_mb"]          = round3(peak_rss_mb());
+    report["summary"] = std::move(summary);
+    report["results"] = std::move(results);
+
+    session_free(session);
+    llama_backend_free();
+
+    const std::string text = report.dump(2, ' ', false, json::error_handler_t::replace) + "\n";
+    if (args.output.empty()) {
+        fputs(text.c_str(), stdout);
+    } else {
+        std::ofstream f(args.output);
+        if (!(f << text)) {
+            fprintf(stderr, "cannot write %s\n", args.output.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,714 @@
+#include "lexical_index.h"
+#include "vector_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace {
+
+constexpr uint32_t LIDX_MAGIC     = 0x5844494c; // "LIDX"
+constexpr uint32_t LIDX_VERSION   = 1;
+constexpr size_t   HEADER_SIZE    = 64;
+constexpr uint32_t OP_ADD         = 1;
+constexpr uint32_t OP_REMOVE      = 2;
+constexpr size_t   MAX_TERM_BYTES = 64;
+constexpr size_t   MAX_TF         = 0xffff;
+constexpr size_t   SAVE_LOG_BYTES = 4u << 20;    // journal size that triggers a snapshot
+constexpr float    BM25_K1        = 1.2f;
+constexpr float    BM25_B         = 0.75f;
+constexpr float    RRF_K          = 60.0f;
+constexpr uint32_t END_DOC        = UINT32_MAX;
+
+struct lidx_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_docs;
+    uint32_t n_terms;
+    uint8_t  reserved[48];
+};
+static_assert(sizeof(lidx_header) == HEADER_SIZE, "header must be 64 bytes");
+
+struct log_record {
+    uint32_t op;
+    uint32_t len;                               // text bytes following the record
+    int64_t  id;
+};
+
+// ---------- tokenization ----------
+
+const std::unordered_set<std::string_view> & stop_words() {
+    static const std::unordered_set<std::string_view> words = {
+        "a", "an", "the", "and", "or", "but", "for", "to", "of", "in", "on", "at", "by", "with",
+        "is", "are", "am", "was", "were", "be", "been", "being", "have", "has", "had", "do", "does", "did",
+        "my", "your", "our", "their", "his", "her", "its", "that", "this", "these", "those", "what", "which",
+        "who", "when", "where", "why", "how", "can", "could", "will", "would", "should", "may", "might",
+        "i", "you", "he", "she", "it", "we", "they", "me", "him", "us", "them", "myself", "yourself",
+        "so", "if", "as", "from", "not", "no", "all", "any", "some", "just", "than", "then", "there",
+        "about", "into", "also", "very", "too", "here", "out", "up",
+    };
+    return words;
+}
+
+// Folds English plurals onto their singular ("queries" -> "query", "files" -> "file"), like
+// Lucene's minimal English stemmer: cheap, and wrong only on the odd "movies" -> "movy"
+void strip_plural(std::string & w) {
+    const size_t n = w.size();
+    if (n > 4 && w.compare(n - 3, 3, "ies") == 0) {
+        w.replace(n - 3, 3, "y");
+    } else if (n > 3 && w[n - 1] == 's' && w[n - 2] != 's' && w[n - 2] != 'u' && w[n - 2] != 'i') {
+        w.pop_back();
+    }
+}
+
+// True if text[pos..] is an English clitic (s, t, re, ve, ll, d, m) ending the word
+bool is_clitic(const std::string & text, size_t pos) {
+    char tail[3] = {};
+    size_t n = 0;
+    for (; pos + n < text.size(); ++n) {
+        const auto c = (unsigned char) text[pos + n];
+        if (c >= 0x80 || std::isdigit(c)) return false;
+        if (!std::isalpha(c)) break;
+        if (n == 2) return false;
+        tail[n] = (char) std::tolower(c);
+    }
+    const std::string_view t(tail, n);
+    return t == "s" || t == "t" || t == "re" || t == "ve" || t == "ll" || t == "d" || t == "m";
+}
+
+// ---------- varint / byte buffers ----------
+
+inline void put_varint(std::vector<uint8_t> & out, uint32_t v) {
+    while (v >= 0x80) {
+        out.push_back((uint8_t) (v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t) v);
+}
+
+inline uint32_t get_varint(const uint8_t *& p) {
+    uint32_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        const uint8_t b = *p++;
+        v |= (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) return v;
+    }
+}
+
+template <typename T>
+void put(std::vector<uint8_t> & out, const T & v) {
+    const auto * p = (const uint8_t *) &v;
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+// Bounds-checked reader over a loaded snapshot
+struct reader {
+    const uint8_t * p;
+    const uint8_t * end;
+
+    bool take(void * dst, size_t n) {
+        if ((size_t) (end - p) < n) return false;
+        memcpy(dst, p, n);
+        p += n;
+        return true;
+    }
+    template <typename T> bool get(T & v) { return take(&v, sizeof(T)); }
+};
+
+bool write_all(int fd, const uint8_t * data, size_t n) {
+    while (n > 0) {
+        const ssize_t w = write(fd, data, n);
+        if (w <= 0) return false;
+        data += w;
+        n    -= (size_t) w;
+    }
+    return true;
+}
+
+bool read_file(const std::string & path, std::vector<uint8_t> & out) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st{};
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+        out.resize((size_t) st.st_size);
+        ok = pread(fd, out.data(), out.size(), 0) == (ssize_t) out.size();
+    }
+    close(fd);
+    return ok;
+}
+
+} // namespace
+
+// ---------- tokenization ----------
+
+void lexical_index::tokenize(const std::string & text, std::vector<std::string> * out) {
+    out->clear();
+    const auto & stops = stop_words();
+    std::string word;
+    bool clitic = false;                        // inside the "s" of "user's": skipped
+    const auto flush = [&]() {
+        if (word.size() >= 2 && word.size() <= MAX_TERM_BYTES && !stops.count(word)) {
+            strip_plural(word);
+            out->push_back(word);
+        }
+        word.clear();
+    };
+    for (size_t i = 0; i < text.size(); ++i) {
+        const auto c = (unsigned char) text[i];
+        // Latin-1 (U+00A0..BF), general (U+2000..206F) and CJK (U+3000..303F) punctuation
+        // separate words like ASCII punctuation does; U+2019 is the typographic apostrophe
+        size_t punct = 0;
+        if (c == 0xc2 && i + 1 < text.size() && (unsigned char) text[i + 1] >= 0xa0) punct = 2;
+        if ((c == 0xe2 || c == 0xe3) && i + 2 < text.size()) {
+            const auto c1 = (unsigned char) text[i + 1];
+            if ((c == 0xe2 && (c1 == 0x80 || c1 == 0x81)) || (c == 0xe3 && c1 == 0x80)) punct = 3;
+        }
+        const bool apostrophe = c == '\'' || (punct == 3 && text.compare(i, 3, "\xe2\x80\x99") == 0);
+        if (apostrophe) {
+            // Inside a word it may start an English clitic ("user's", "don't"), which is skipped;
+            // otherwise ("l'avion", "O'Neil", quote marks) it just separates words
+            const size_t next = i + (punct ? punct : 1);
+            clitic = !word.empty() && is_clitic(text, next);
+            flush();
+            i = next - 1;
+        } else if (punct) {
+            flush();
+            clitic = false;
+            i += punct - 1;
+        } else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+            if (!clitic) word.push_back((char) c);
+        } else if (c >= 'A' && c <= 'Z') {
+            if (!clitic) word.push_back((char) (c - 'A' + 'a'));
+        } else {
+            flush();
+            clitic = false;
+        }
+    }
+    flush();
+}
+
+// ---------- posting lists ----------
+
+void lexical_index::posting_list::append(uint32_t doc, uint32_t tf, uint32_t len) {
+    tf = std::min<uint32_t>(tf, MAX_TF);
+    if (blocks.empty() || blocks.back().count == BLOCK_SIZE) {
+        block_meta b;
+        b.offset = (uint32_t) bytes.size();
+        blocks.push_back(b);
+    }
+    // Deltas run from the previous block's last doc, so each block decodes on its own
+    const size_t nb = blocks.size();
+    const uint32_t prev = blocks.back().count > 0 ? blocks.back().last_doc
+                        : nb > 1 ? blocks[nb - 2].last_doc : 0;
+    put_varint(bytes, doc - prev);
+    put_varint(bytes, tf);
+
+    block_meta & b = blocks.back();
+    b.last_doc = doc;
+    b.count   += 1;
+    b.max_tf   = std::max(b.max_tf, tf);
+    b.min_len  = std::min(b.min_len, len);
+    max_tf     = std::max(max_tf, tf);
+    min_len    = std::min(min_len, len);
+    n += 1;
+}
+
+uint32_t lexical_index::posting_list::decode(size_t b, uint32_t * docs, uint32_t * tfs) const {
+    const block_meta & m = blocks[b];
+    const uint8_t * p = bytes.data() + m.offset;
+    uint32_t doc = b > 0 ? blocks[b - 1].last_doc : 0;
+    for (uint32_t i = 0; i < m.count; ++i) {
+        doc += get_varint(p);
+        docs[i] = doc;
+        tfs[i]  = get_varint(p);
+    }
+    return m.count;
+}
+
+// Iterates one query term's postings; blocks are decoded only when a doc inside them is needed
+struct lexical_index::cursor {
+    const posting_list * list   = nullptr;
+    float    weight = 0.0f;                     // idf * query tf
+    float    upper  = 0.0f;                     // bound over the whole list
+    size_t   block  = 0;
+    uint32_t pos    = 0;
+    uint32_t count  = 0;
+    uint32_t doc    = END_DOC;
+    uint32_t docs[BLOCK_SIZE];
+    uint32_t tfs[BLOCK_SIZE];
+
+    void load(size_t b) {
+        block = b;
+        pos   = 0;
+        if (b >= list->blocks.size()) {
+            doc = END_DOC;
+            return;
+        }
+        count = list->decode(b, docs, tfs);
+        doc   = docs[0];
+    }
+    void next() {
+        if (++pos < count) doc = docs[pos];
+        else load(block + 1);
+    }
+    // Moves to the first doc >= target, skipping blocks by their last doc
+    void seek(uint32_t target) {
+        if (doc >= target) return;
+        size_t b = block;
+        while (b < list->blocks.size() && list->blocks[b].last_doc < target) ++b;
+        if (b != block) load(b);
+        while (doc < target) next();
+    }
+    // The block a seek(target) would land in, without decoding it
+    const block_meta * shallow(uint32_t target) const {
+        size_t b = block;
+        while (b < list->blocks.size() && list->blocks[b].last_doc < target) ++b;
+        return b < list->blocks.size() ? &list->blocks[b] : nullptr;
+    }
+    uint32_t tf() const { return tfs[pos]; }
+};
+
+// ---------- lifecycle ----------
+
+lexical_index::~lexical_index() {
+    if (dirty_) save();
+    if (log_fd_ >= 0) close(log_fd_);
+}
+
+lexical_index * lexical_index::open(const std::string & path) {
+    auto * idx = new lexical_index();
+    idx->path_ = path;
+    idx->log_fd_ = ::open((path + ".log").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (idx->log_fd_ < 0) {
+        delete idx;
+        return nullptr;
+    }
+    if (!idx->load_snapshot()) {
+        // Missing or unreadable: start over, and forget a journal that belonged to it
+        idx->docs_.clear();
+        idx->live_.clear();
+        idx->total_len_ = 0;
+        idx->term_ids_.clear();
+        idx->terms_.clear();
+        idx->postings_.clear();
+        struct stat st{};
+        if (stat(path.c_str(), &st) == 0 && ftruncate(idx->log_fd_, 0) != 0) {
+            delete idx;
+            return nullptr;
+        }
+    }
+    if (!idx->replay()) {
+        delete idx;
+        return nullptr;
+    }
+    return idx;
+}
+
+bool lexical_index::load_snapshot() {
+    std::vector<uint8_t> data;
+    if (!read_file(path_, data) || data.size() < HEADER_SIZE) return false;
+    lidx_header hdr{};
+    memcpy(&hdr, data.data(), sizeof(hdr));
+    if (hdr.magic != LIDX_MAGIC || hdr.version != LIDX_VERSION) return false;
+
+    reader r{data.data() + HEADER_SIZE, data.data() + data.size()};
+    docs_.resize(hdr.n_docs);
+    for (uint32_t d = 0; d < hdr.n_docs; ++d) {
+        uint32_t alive = 0;
+        if (!r.get(docs_[d].id) || !r.get(docs_[d].len) || !r.get(alive)) return false;
+        docs_[d].alive = alive != 0;
+        if (docs_[d].alive) {
+            live_[docs_[d].id] = d;
+            total_len_ += docs_[d].len;
+        }
+    }
+
+    terms_.resize(hdr.n_terms);
+    postings_.resize(hdr.n_terms);
+    term_ids_.reserve(hdr.n_terms);
+    for (uint32_t t = 0; t < hdr.n_terms; ++t) {
+        uint32_t term_len = 0, n_blocks = 0, n_bytes = 0;
+        posting_list & pl = postings_[t];
+        if (!r.get(term_len) || term_len > MAX_TERM_BYTES) return false;
+        terms_[t].resize(term_len);
+        if (!r.take(&terms_[t][0], term_len) ||
+            !r.get(pl.n) || !r.get(pl.max_tf) || !r.get(pl.min_len) ||
+            !r.get(n_blocks) || !r.get(n_bytes)) return false;
+        if ((size_t) (r.end - r.p) < (size_t) n_blocks * sizeof(block_meta) + n_bytes) return false;
+        pl.blocks.resize(n_blocks);
+        pl.bytes.resize(n_bytes);
+        r.take(pl.blocks.data(), (size_t) n_blocks * sizeof(block_meta));
+        r.take(pl.bytes.data(), n_bytes);
+        for (const block_meta & b : pl.blocks) {
+            // A block must decode within the list and within the doc table
+            if (b.offset > n_bytes || b.count > BLOCK_SIZE || b.last_doc >= hdr.n_docs) return false;
+        }
+        term_ids_[terms_[t]] = t;
+    }
+    return true;
+}
+
+// Re-applies the journal on top of the snapshot; a torn tail record is cut off
+bool lexical_index::replay() {
+    std::vector<uint8_t> data;
+    if (!read_file(path_ + ".log", data)) return false;
+    size_t off = 0;
+    while (data.size() - off >= sizeof(log_record)) {
+        log_record rec;
+        memcpy(&rec, data.data() + off, sizeof(rec));
+        if ((rec.op != OP_ADD && rec.op != OP_REMOVE) || data.size() - off - sizeof(rec) < rec.len) break;
+        if (rec.op == OP_ADD) {
+            add_doc(rec.id, std::string((const char *) data.data() + off + sizeof(rec), rec.len));
+        } else {
+            remove_doc(rec.id);
+        }
+        off += sizeof(rec) + rec.len;
+    }
+    if (off != data.size() && ftruncate(log_fd_, (off_t) off) != 0) return false;
+    log_bytes_ = off;
+    dirty_     = off > 0;
+    return lseek(log_fd_, (off_t) off, SEEK_SET) == (off_t) off;
+}
+
+bool lexical_index::journal(uint32_t op, int64_t id, const std::string & text) {
+    std::vector<uint8_t> buf;
+    buf.reserve(sizeof(log_record) + text.size());
+    const log_record rec{op, (uint32_t) text.size(), id};
+    put(buf, rec);
+    buf.insert(buf.end(), text.begin(), text.end());
+    if (!write_all(log_fd_, buf.data(), buf.size())) return false;
+    log_bytes_ += buf.size();
+    dirty_ = true;
+    return true;
+}
+
+// ---------- updates ----------
+
+void lexical_index::add_doc(int64_t id, const std::string & text) {
+    remove_doc(id);
+
+    std::vector<std::string> words;
+    tokenize(text, &words);
+    std::sort(words.begin(), words.end());
+
+    const auto doc = (uint32_t) docs_.size();
+    const auto len = (uint32_t) words.size();
+    docs_.push_back({id, len, true});
+    live_[id] = doc;
+    total_len_ += len;
+
+    for (size_t i = 0; i < words.size();) {
+        size_t j = i + 1;
+        while (j < words.size() && words[j] == words[i]) ++j;
+        auto it = term_ids_.find(words[i]);
+        if (it == term_ids_.end()) {
+            it = term_ids_.emplace(words[i], (uint32_t) terms_.size()).first;
+            terms_.push_back(words[i]);
+            postings_.emplace_back();
+        }
+        postings_[it->second].append(doc, (uint32_t) (j - i), len);
+        i = j;
+    }
+}
+
+bool lexical_index::remove_doc(int64_t id) {
+    auto it = live_.find(id);
+    if (it == live_.end()) return false;
+    doc_entry & d = docs_[it->second];
+    d.alive = false;
+    total_len_ -= d.len;
+    live_.erase(it);
+    return true;
+}
+
+size_t lexical_index::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return live_.size();
+}
+
+size_t lexical_index::add(const int64_t * ids, const std::string * texts, size_t n) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    size_t added = 0;
+    for (size_t i = 0; i < n; ++i) {
+        // Journal first: an op that never reached the disk must not be visible either
+        if (!journal(OP_ADD, ids[i], texts[i])) break;
+        add_doc(ids[i], texts[i]);
+        ++added;
+    }
+    const bool full = log_bytes_ > SAVE_LOG_BYTES;
+    lock.unlock();
+    if (full) save();
+    return added;
+}
+
+size_t lexical_index::remove(const int64_t * ids, size_t n) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    size_t removed = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (!live_.count(ids[i]) || !journal(OP_REMOVE, ids[i], std::string())) continue;
+        remove_doc(ids[i]);
+        ++removed;
+    }
+    return removed;
+}
+
+bool lexical_index::contains(int64_t id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return live_.count(id) != 0;
+}
+
+// ---------- persistence ----------
+
+bool lexical_index::save() {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (docs_.size() - live_.size() > docs_.size() / 4) drop_dead();
+    if (!write_snapshot()) return false;
+    // The snapshot now holds everything; a crash before this truncate only replays ops twice
+    if (ftruncate(log_fd_, 0) != 0 || lseek(log_fd_, 0, SEEK_SET) != 0) return false;
+    log_bytes_ = 0;
+    dirty_     = false;
+    return true;
+}
+
+bool lexical_index::write_snapshot() {
+    std::vector<uint8_t> buf;
+    lidx_header hdr{};
+    hdr.magic   = LIDX_MAGIC;
+    hdr.version = LIDX_VERSION;
+    hdr.n_docs  = (uint32_t) docs_.size();
+    hdr.n_terms = (uint32_t) terms_.size();
+    put(buf, hdr);
+    for (const doc_entry & d : docs_) {
+        put(buf, d.id);
+        put(buf, d.len);
+        put(buf, (uint32_t) d.alive);
+    }
+    for (size_t t = 0; t < terms_.size(); ++t) {
+        const posting_list & pl = postings_[t];
+        put(buf, (uint32_t) terms_[t].size());
+        buf.insert(buf.end(), terms_[t].begin(), terms_[t].end());
+        put(buf, pl.n);
+        put(buf, pl.max_tf);
+        put(buf, pl.min_len);
+        put(buf, (uint32_t) pl.blocks.size());
+        put(buf, (uint32_t) pl.bytes.size());
+        const auto * blocks = (const uint8_t *) pl.blocks.data();
+        buf.insert(buf.end(), blocks, blocks + pl.blocks.size() * sizeof(block_meta));
+        buf.insert(buf.end(), pl.bytes.begin(), pl.bytes.end());
+    }
+
+    const std::string tmp = path_ + ".tmp";
+    const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    const bool ok = write_all(fd, buf.data(), buf.size()) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path_.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Renumbers the live docs densely and rebuilds every list without the dead ones
+void lexical_index::drop_dead() {
+    std::vector<uint32_t> remap(docs_.size(), END_DOC);
+    std::vector<doc_entry> docs;
+    docs.reserve(live_.size());
+    for (size_t d = 0; d < docs_.size(); ++d) {
+        if (!docs_[d].alive) continue;
+        remap[d] = (uint32_t) docs.size();
+        live_[docs_[d].id] = remap[d];
+        docs.push_back(docs_[d]);
+    }
+
+    std::vector<std::string>  terms;
+    std::vector<posting_list> postings;
+    std::unordered_map<std::string, uint32_t> term_ids;
+    uint32_t doc_buf[BLOCK_SIZE], tf_buf[BLOCK_SIZE];
+    for (size_t t = 0; t < terms_.size(); ++t) {
+        posting_list pl;
+        const posting_list & old = postings_[t];
+        for (size_t b = 0; b < old.blocks.size(); ++b) {
+            const uint32_t n = old.decode(b, doc_buf, tf_buf);
+            for (uint32_t i = 0; i < n; ++i) {
+                const uint32_t doc = remap[doc_buf[i]];
+                if (doc != END_DOC) pl.append(doc, tf_buf[i], docs[doc].len);
+            }
+        }
+        if (pl.n == 0) continue;
+        term_ids.emplace(terms_[t], (uint32_t) terms.size());
+        terms.push_back(std::move(terms_[t]));
+        postings.push_back(std::move(pl));
+    }
+
+    docs_     = std::move(docs);
+    terms_    = std::move(terms);
+    postings_ = std::move(postings);
+    term_ids_ = std::move(term_ids);
+}
+
+// ---------- search ----------
+
+float lexical_index::avg_len() const {
+    return live_.empty() ? 1.0f : std::max(1.0f, (float) ((double) total_len_ / live_.size()));
+}
+
+size_t lexical_index::search(const std::string & query, size_t k, int64_t * out_ids, float * out_scores) const {
+    if (k == 0) return 0;
+    std::vector<std::string> words;
+    tokenize(query, &words);
+    std::sort(words.begin(), words.end());
+
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    const float avgdl = avg_len();
+    // Document frequencies count dead postings as well, so N does too
+    const auto n_docs = (double) docs_.size();
+    const auto bm25 = [avgdl](float weight, uint32_t tf, uint32_t len) {
+        const float norm = BM25_K1 * (1.0f - BM25_B + BM25_B * (float) len / avgdl);
+        return weight * (float) tf * (BM25_K1 + 1.0f) / ((float) tf + norm);
+    };
+
+    std::vector<cursor> cursors;
+    cursors.reserve(words.size());
+    for (size_t i = 0; i < words.size();) {
+        size_t j = i + 1;
+        while (j < words.size() && words[j] == words[i]) ++j;
+        auto it = term_ids_.find(words[i]);
+        if (it != term_ids_.end()) {
+            cursors.emplace_back();
+            cursor & c = cursors.back();
+            c.list = &postings_[it->second];
+            const double df = c.list->n;
+            c.weight = (float) ((j - i) * std::log(1.0 + (n_docs - df + 0.5) / (df + 0.5)));
+            c.upper  = bm25(c.weight, c.list->max_tf, c.list->min_len);
+            c.load(0);
+        }
+        i = j;
+    }
+
+    using hit = std::pair<float, uint32_t>;
+    std::vector<hit> heap;
+    heap.reserve(k + 1);
+    const auto cmp = std::greater<hit>();
+    const auto threshold = [&]() { return heap.size() == k ? heap.front().first : 0.0f; };
+
+    std::vector<cursor *> live;
+    for (cursor & c : cursors) live.push_back(&c);
+    const auto by_doc = [](const cursor * a, const cursor * b) { return a->doc < b->doc; };
+
+    // Block-max WAND: terms sorted by current doc; the pivot is the first doc whose preceding
+    // terms' list bounds could beat the k-th score, then their block bounds must agree too.
+    for (;;) {
+        live.erase(std::remove_if(live.begin(), live.end(),
+                                  [](const cursor * c) { return c->doc == END_DOC; }), live.end());
+        if (live.empty()) break;
+        std::sort(live.begin(), live.end(), by_doc);
+
+        const float theta = threshold();
+        float bound = 0.0f;
+        size_t p = 0;
+        for (; p < live.size(); ++p) {
+            bound += live[p]->upper;
+            if (bound > theta) break;
+        }
+        if (p == live.size()) break;
+        const uint32_t pivot = live[p]->doc;
+        while (p + 1 < live.size() && live[p + 1]->doc == pivot) ++p;
+
+        float block_bound = 0.0f;
+        uint32_t block_end = END_DOC;
+        for (size_t i = 0; i <= p; ++i) {
+            const block_meta * b = live[i]->shallow(pivot);
+            if (!b) continue;                   // list ends before the pivot
+            block_bound += bm25(live[i]->weight, b->max_tf, b->min_len);
+            block_end = std::min(block_end, b->last_doc);
+        }
+        if (block_bound <= theta) {
+            // Nothing before the end of the shortest block (or the next term's doc) can qualify
+            uint32_t next = block_end == END_DOC ? END_DOC : block_end + 1;
+            if (p + 1 < live.size()) next = std::min(next, live[p + 1]->doc);
+            next = std::max(next, pivot + 1);
+            for (size_t i = 0; i <= p; ++i) live[i]->seek(next);
+            continue;
+        }
+
+        if (live[0]->doc == pivot) {
+            const doc_entry & d = docs_[pivot];
+            float s = 0.0f;
+            for (size_t i = 0; i <= p; ++i) s += bm25(live[i]->weight, live[i]->tf(), d.len);
+            if (d.alive && (heap.size() < k || s > theta)) {
+                heap.emplace_back(s, pivot);
+                std::push_heap(heap.begin(), heap.end(), cmp);
+                if (heap.size() > k) {
+                    std::pop_heap(heap.begin(), heap.end(), cmp);
+                    heap.pop_back();
+                }
+            }
+            for (size_t i = 0; i <= p; ++i) live[i]->next();
+        } else {
+            for (size_t i = 0; i < p && live[i]->doc < pivot; ++i) live[i]->seek(pivot);
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), cmp); // descending by score
+    for (size_t i = 0; i < heap.size(); ++i) {
+        out_scores[i] = heap[i].first;
+        out_ids[i]    = docs_[heap[i].second].id;
+    }
+    return heap.size();
+}
+
+// ---------- hybrid ----------
+
+size_t hybrid_search(const lexical_index * lexical, const vector_index * vectors,
+                     const std::string & text, const float * query, size_t k, size_t n_candidates,
+                     float min_vector_score, hybrid_hit * out) {
+    if (k == 0) return 0;
+    n_candidates = std::max(n_candidates, k);
+    std::vector<int64_t> ids(n_candidates);
+    std::vector<float>   scores(n_candidates);
+    std::unordered_map<int64_t, hybrid_hit> fused;
+
+    if (vectors && query) {
+        const size_t n = vectors->search(query, n_candidates, min_vector_score, ids.data(), scores.data());
+        for (size_t r = 0; r < n; ++r) {
+            hybrid_hit & h = fused[ids[r]];
+            h.id            = ids[r];
+            h.score        += 1.0f / (RRF_K + (float) (r + 1));
+            h.vector_score  = scores[r];
+        }
+    }
+    if (lexical) {
+        const size_t n = lexical->search(text, n_candidates, ids.data(), scores.data());
+        for (size_t r = 0; r < n; ++r) {
+            hybrid_hit & h = fused[ids[r]];
+            h.id             = ids[r];
+            h.score         += 1.0f / (RRF_K + (float) (r + 1));
+            h.lexical_score  = scores[r];
+        }
+    }
+
+    std::vector<hybrid_hit> hits;
+    hits.reserve(fused.size());
+    for (const auto & it : fused) hits.push_back(it.second);
+    // Equal fused ranks are broken by the vector side, then by BM25
+    const auto better = [](const hybrid_hit & a, const hybrid_hit & b) {
+        if (a.score != b.score) return a.score > b.score;
+        if (a.vector_score != b.vector_score) return a.vector_score > b.vector_score;
+        return a.lexical_score > b.lexical_score;
+    };
+    const size_t n = std::min(k, hits.size());
+    std::partial_sort(hits.begin(), hits.begin() + n, hits.end(), better);
+    std::copy(hits.begin(), hits.begin() + n, out);
+    return n;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class vector_index;
+
+// BM25 inverted index over short texts (document chunks, memories) keyed by int64 id.
+//
+// Texts are split on anything but ASCII letters/digits (other UTF-8 bytes stay inside words),
+// lowercased, stripped of English stop words and of plural endings. Each term's postings are
+// (doc, tf) pairs in doc order, delta + varint coded in blocks of 128 whose headers carry the
+// block's last doc, highest tf and shortest doc: queries skip whole blocks by doc and prune
+// them by score (block-max WAND) without decoding them.
+//
+// Docs get increasing internal numbers, so adding one only appends to posting lists; replacing
+// or deleting one marks its number dead. Dead postings still count towards document
+// frequencies (as in Lucene) until save() finds more than a quarter of the docs dead and
+// rebuilds the lists without them.
+//
+// On disk: `path` holds a snapshot of the compressed lists (written to a temp file and renamed
+// over it), `path.log` a journal of adds and deletes since then, replayed on open. A torn
+// journal record is dropped; an unreadable snapshot starts the index empty (callers re-add
+// what contains() reports missing).
+class lexical_index {
+public:
+    ~lexical_index();
+
+    // Opens `path` (+ its journal), creating both if missing. Returns nullptr on I/O error.
+    static lexical_index * open(const std::string & path);
+
+    size_t size() const;                        // live docs
+
+    // Inserts or replaces `n` texts. Returns the number indexed.
+    size_t add(const int64_t * ids, const std::string * texts, size_t n);
+    // Returns the number of ids that were present
+    size_t remove(const int64_t * ids, size_t n);
+    bool   contains(int64_t id) const;
+
+    // Top-k docs by BM25 for the query's terms, best first. Returns the count written.
+    size_t search(const std::string & query, size_t k, int64_t * out_ids, float * out_scores) const;
+
+    // Writes the snapshot and empties the journal (dropping dead postings first when they
+    // have piled up). Also done when the journal grows large and on destruction.
+    bool   save();
+
+    // The normalized terms of `text`, in order, as indexed and as queried
+    static void tokenize(const std::string & text, std::vector<std::string> * out);
+
+private:
+    static constexpr uint32_t BLOCK_SIZE = 128;
+
+    struct block_meta {
+        uint32_t last_doc = 0;
+        uint32_t offset   = 0;                  // into posting_list::bytes
+        uint32_t count    = 0;
+        uint32_t max_tf   = 0;
+        uint32_t min_len  = UINT32_MAX;
+    };
+
+    struct posting_list {
+        std::vector<uint8_t>    bytes;          // per posting: varint(doc delta), varint(tf)
+        std::vector<block_meta> blocks;
+        uint32_t n       = 0;                   // postings, dead docs included
+        uint32_t max_tf  = 0;
+        uint32_t min_len = UINT32_MAX;
+
+        void append(uint32_t doc, uint32_t tf, uint32_t len);
+        // Decodes block b into docs/tfs (BLOCK_SIZE each); returns its count
+        uint32_t decode(size_t b, uint32_t * docs, uint32_t * tfs) const;
+    };
+
+    struct doc_entry {
+        int64_t  id    = 0;
+        uint32_t len   = 0;                     // terms
+        bool     alive = false;
+    };
+
+    struct cursor;
+
+    lexical_index() = default;
+
+    void   add_doc(int64_t id, const std::string & text);
+    bool   remove_doc(int64_t id);
+    bool   journal(uint32_t op, int64_t id, const std::string & text);
+    bool   replay();
+    bool   load_snapshot();
+    bool   write_snapshot();
+    void   drop_dead();
+    float  avg_len() const;
+
+    std::string path_;
+    int         log_fd_    = -1;
+    size_t      log_bytes_ = 0;
+    bool        dirty_     = false;             // journal holds ops the snapshot lacks
+
+    std::vector<doc_entry>                  docs_;     // by internal doc number
+    std::unordered_map<int64_t, uint32_t>   live_;     // id -> doc number
+    uint64_t                                total_len_ = 0;   // live docs
+    std::unordered_map<std::string, uint32_t> term_ids_;
+    std::vector<std::string>                terms_;
+    std::vector<posting_list>               postings_;
+
+    mutable std::shared_mutex mutex_;
+};
+
+struct hybrid_hit {
+    int64_t id = 0;
+    float score  = 0.0f;                        // reciprocal rank fusion
+    float vector_score  = -1.0f;                // cosine, -1 if not among the vector candidates
+    float lexical_score = 0.0f;                 // BM25, 0 if not among the lexical candidates
+};
+
+// Reciprocal rank fusion (k = 60) of the BM25 top n_candidates for `text` and the vector top
+// n_candidates for `query` (cosine >= min_vector_score). Either side may be missing (`vectors`
+// or `query` null). Writes the best k hits into out and returns the count.
+size_t hybrid_search(const lexical_index * lexical, const vector_index * vectors,
+                     const std::string & text, const float * query, size_t k, size_t n_candidates,
+                     float min_vector_score, hybrid_hit * out);
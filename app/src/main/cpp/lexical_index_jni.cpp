@@ -0,0 +1,175 @@
+#include "lexical_index.h"
+#include "vector_index.h"
+#include <algorithm>
+#include <android/log.h>
+#include <jni.h>
+#include <string>
+#include <vector>
+
+#define LOG_TAG "LEXICAL_INDEX"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO,  LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+extern "C" {
+
+// ---------- helpers ----------
+
+static lexical_index *index_or_throw(JNIEnv *env, jlong handle) {
+    auto *idx = reinterpret_cast<lexical_index *>(handle);
+    if (!idx) {
+        jclass exc = env->FindClass("java/lang/IllegalStateException");
+        env->ThrowNew(exc, "Invalid lexical index");
+    }
+    return idx;
+}
+
+static std::string to_string(JNIEnv *env, jstring s) {
+    const char *chars = env->GetStringUTFChars(s, nullptr);
+    std::string out(chars);
+    env->ReleaseStringUTFChars(s, chars);
+    return out;
+}
+
+// ---------- JNI: open / close ----------
+
+JNIEXPORT jlong JNICALL
+Java_edu_upt_assistant_LexicalIndexNative_open(JNIEnv *env, jclass, jstring pathJ) {
+    const std::string path = to_string(env, pathJ);
+    lexical_index *idx = lexical_index::open(path);
+    if (!idx) {
+        LOGE("Failed to open lexical index %s", path.c_str());
+        jclass exc = env->FindClass("java/lang/RuntimeException");
+        env->ThrowNew(exc, "Failed to open lexical index");
+        return 0;
+    }
+    LOGI("Opened %s: %zu docs", path.c_str(), idx->size());
+    return reinterpret_cast<jlong>(idx);
+}
+
+// Also writes the snapshot if the journal has anything new
+JNIEXPORT void JNICALL
+Java_edu_upt_assistant_LexicalIndexNative_close(JNIEnv *, jclass, jlong handle) {
+    delete reinterpret_cast<lexical_index *>(handle);
+}
+
+// ---------- JNI: mutation ----------
+
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_LexicalIndexNative_add(JNIEnv *env, jclass, jlong handle, jlongArray idsJ, jobjectArray textsJ) {
+    lexical_index *idx = index_or_throw(env, handle);
+    if (!idx) return 0;
+    const jsize n = env->GetArrayLength(idsJ);
+    if (env->GetArrayLength(textsJ) != n) {
+        jclass exc = env->FindClass("java/lang/IllegalArgumentException");
+        env->ThrowNew(exc, "texts.size must equal ids.size");
+        return 0;
+    }
+    std::vector<int64_t> ids(n);
+    env->GetLongArrayRegion(idsJ, 0, n, reinterpret_cast<jlong *>(ids.data()));
+    std::vector<std::string> texts(n);
+    for (jsize i = 0; i < n; ++i) {
+        auto textJ = (jstring) env->GetObjectArrayElement(textsJ, i);
+        if (textJ) texts[i] = to_string(env, textJ);
+        env->DeleteLocalRef(textJ);
+    }
+    return (jint) idx->add(ids.data(), texts.data(), (size_t) n);
+}
+
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_LexicalIndexNative_delete(JNIEnv *env, jclass, jlong handle, jlongArray idsJ) {
+    lexical_index *idx = index_or_throw(env, handle);
+    if (!idx) return 0;
+    const jsize n = env->GetArrayLength(idsJ);
+    jlong *ids = env->GetLongArrayElements(idsJ, nullptr);
+    const size_t removed = idx->remove(reinterpret_cast<const int64_t *>(ids), (size_t) n);
+    env->ReleaseLongArrayElements(idsJ, ids, JNI_ABORT);
+    return (jint) removed;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_edu_upt_assistant_LexicalIndexNative_save(JNIEnv *env, jclass, jlong handle) {
+    lexical_index *idx = index_or_throw(env, handle);
+    if (!idx) return JNI_FALSE;
+    const bool ok = idx->save();
+    if (!ok) LOGE("Failed to save lexical index snapshot");
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+// ---------- JNI: lookup / search ----------
+
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_LexicalIndexNative_count(JNIEnv *env, jclass, jlong handle) {
+    lexical_index *idx = index_or_throw(env, handle);
+    return idx ? (jint) idx->size() : 0;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_edu_upt_assistant_LexicalIndexNative_contains(JNIEnv *env, jclass, jlong handle, jlong id) {
+    lexical_index *idx = index_or_throw(env, handle);
+    return idx && idx->contains((int64_t) id) ? JNI_TRUE : JNI_FALSE;
+}
+
+// Fills caller-owned outIds/outScores (capacity >= k) with BM25 hits, best first
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_LexicalIndexNative_search(JNIEnv *env, jclass, jlong handle, jstring queryJ,
+                                                 jint k, jlongArray outIdsJ, jfloatArray outScoresJ) {
+    lexical_index *idx = index_or_throw(env, handle);
+    if (!idx) return 0;
+    const jsize cap = std::min(env->GetArrayLength(outIdsJ), env->GetArrayLength(outScoresJ));
+    const size_t topk = (size_t) std::max(0, std::min<jint>(k, cap));
+
+    std::vector<int64_t> ids(topk);
+    std::vector<float> scores(topk);
+    const size_t n = idx->search(to_string(env, queryJ), topk, ids.data(), scores.data());
+
+    env->SetLongArrayRegion(outIdsJ, 0, (jsize) n, reinterpret_cast<const jlong *>(ids.data()));
+    env->SetFloatArrayRegion(outScoresJ, 0, (jsize) n, scores.data());
+    return (jint) n;
+}
+
+// BM25 over `queryJ` and cosine over `vectorJ` against the vector index `vectorHandle` (either may
+// be 0/null), fused by reciprocal rank. Fills the caller's arrays (capacity >= k), best first:
+// fused score, cosine (-1 when not a vector candidate) and BM25 (0 when not a lexical one).
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_LexicalIndexNative_hybridSearch(JNIEnv *env, jclass, jlong handle, jlong vectorHandle,
+                                                       jstring queryJ, jfloatArray vectorJ, jint k, jint candidates,
+                                                       jfloat minVectorScore, jlongArray outIdsJ,
+                                                       jfloatArray outScoresJ, jfloatArray outVectorScoresJ,
+                                                       jfloatArray outLexicalScoresJ) {
+    lexical_index *idx = index_or_throw(env, handle);
+    if (!idx) return 0;
+    auto *vectors = reinterpret_cast<vector_index *>(vectorHandle);
+    std::vector<float> query;
+    if (vectors && vectorJ) {
+        if ((uint32_t) env->GetArrayLength(vectorJ) != vectors->dim()) {
+            jclass exc = env->FindClass("java/lang/IllegalArgumentException");
+            env->ThrowNew(exc, "vector.size must equal the vector index dimension");
+            return 0;
+        }
+        query.resize(vectors->dim());
+        env->GetFloatArrayRegion(vectorJ, 0, (jsize) query.size(), query.data());
+    }
+    const jsize cap = std::min({env->GetArrayLength(outIdsJ), env->GetArrayLength(outScoresJ),
+                                env->GetArrayLength(outVectorScoresJ), env->GetArrayLength(outLexicalScoresJ)});
+    const size_t topk = (size_t) std::max(0, std::min<jint>(k, cap));
+
+    std::vector<hybrid_hit> hits(topk);
+    const size_t n = hybrid_search(idx, vectors, to_string(env, queryJ), query.empty() ? nullptr : query.data(),
+                                   topk, (size_t) std::max(0, candidates), minVectorScore, hits.data());
+
+    std::vector<jlong> ids(n);
+    std::vector<float> scores(n), vector_scores(n), lexical_scores(n);
+    for (size_t i = 0; i < n; ++i) {
+        ids[i]            = hits[i].id;
+        scores[i]         = hits[i].score;
+        vector_scores[i]  = hits[i].vector_score;
+        lexical_scores[i] = hits[i].lexical_score;
+    }
+    env->SetLongArrayRegion(outIdsJ, 0, (jsize) n, ids.data());
+    env->SetFloatArrayRegion(outScoresJ, 0, (jsize) n, scores.data());
+    env->SetFloatArrayRegion(outVectorScoresJ, 0, (jsize) n, vector_scores.data());
+    env->SetFloatArrayRegion(outLexicalScoresJ, 0, (jsize) n, lexical_scores.data());
+    return (jint) n;
+}
+
+} // extern "C"
@@ -0,0 +1,2211 @@
+#include "llama_core.h"
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <map>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#ifdef __ANDROID__
+#include <android/log.h>
+#endif
+
+#define LOG_TAG "LLAMA_JNI"
+#define LOGI(...) core_log(false, __VA_ARGS__)
+#define LOGE(...) core_log(true,  __VA_ARGS__)
+
+// ---------- logging ----------
+
+static std::atomic<bool> g_log_verbose{true};
+
+void core_log_set_verbose(bool verbose) {
+    g_log_verbose = verbose;
+}
+
+#if defined(__GNUC__)
+__attribute__((format(printf, 2, 3)))
+#endif
+static void core_log(bool error, const char *fmt, ...) {
+    if (!error && !g_log_verbose.load(std::memory_order_relaxed)) return;
+    va_list args;
+    va_start(args, fmt);
+#ifdef __ANDROID__
+    __android_log_vprint(error ? ANDROID_LOG_ERROR : ANDROID_LOG_INFO, LOG_TAG, fmt, args);
+#else
+    fprintf(stderr, "%s %s: ", error ? "E" : "I", LOG_TAG);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+#endif
+    va_end(args);
+}
+
+// ---------- helpers ----------
+
+// Clear a llama_batch in a way that's compatible with older headers
+static inline void batch_clear_compat(llama_batch* b) {
+    for (int i = 0; i < b->n_tokens; ++i) {
+        b->token[i]     = 0;
+        b->pos[i]       = 0;
+        b->n_seq_id[i]  = 0;
+        b->seq_id[i][0] = 0;
+        b->logits[i]    = 0;
+    }
+    b->n_tokens = 0;
+}
+
+// Tokenize with parse_special=true so chat headers are treated as single tokens
+std::vector<llama_token> tokenize_with_specials(const llama_vocab* vocab, const char* text) {
+    int32_t needed = llama_tokenize(vocab, text, (int32_t)strlen(text),
+                                    nullptr, 0,
+            /*add_special=*/true,
+            /*parse_special=*/true);
+    if (needed < 0) needed = -needed;
+    std::vector<llama_token> out(needed);
+    int32_t got = llama_tokenize(vocab, text, (int32_t)strlen(text),
+                                 out.data(), (int32_t)out.size(),
+            /*add_special=*/true,
+            /*parse_special=*/true);
+    if (got < 0) {
+        out.clear();
+    } else {
+        out.resize(got);
+    }
+    return out;
+}
+
+// Plain-text tokenization for embedding inputs (no chat headers to parse)
+std::vector<llama_token> tokenize_plain(const llama_vocab* vocab, const char* text, int32_t len) {
+    int32_t needed = llama_tokenize(vocab, text, len, nullptr, 0, /*add_special=*/true, /*parse_special=*/false);
+    if (needed < 0) needed = -needed;
+    std::vector<llama_token> out(needed);
+    int32_t got = llama_tokenize(vocab, text, len, out.data(), (int32_t)out.size(), true, false);
+    out.resize(got < 0 ? 0 : got);
+    return out;
+}
+
+int clamp_threads(int nThreads) {
+    size_t n_cpu = 0;
+    for (const auto &cluster : cpu_clusters()) n_cpu += cluster.size();
+    return nThreads > 0 ? std::min(nThreads, (int) n_cpu) : (int) n_cpu;
+}
+
+// Stop on real special tokens (EOS, EOT, ChatML <|im_end|>) with a fallback
+static inline bool should_stop_generation(llama_token tok,
+                                          const llama_vocab* vocab,
+                                          llama_token tok_eos,
+                                          llama_token tok_im_end,
+                                          llama_token tok_eot) {
+    if (tok == tok_eos) return true;
+    if (tok_eot != -1 && tok == tok_eot) return true;       // Llama 3 end-of-turn
+    if (tok_im_end != -1 && tok == tok_im_end) return true; // ChatML <|im_end|>
+    if (llama_vocab_is_eog(vocab, tok)) return true;        // fallback
+    return false;
+}
+
+// The token's bytes as the vocab decodes them (SentencePiece spaces, BPE byte mapping, byte
+// tokens), control tokens as nothing. A byte token can be part of a character; see text_stream.
+static bool token_to_piece(const llama_vocab *vocab, llama_token tok, std::string *out) {
+    if (out->capacity() < 32) out->reserve(32);
+    out->resize(out->capacity());
+    int32_t n = llama_token_to_piece(vocab, tok, &(*out)[0], (int32_t) out->size(), 0, /*special=*/false);
+    if (n < 0) {
+        out->resize((size_t) -n);
+        n = llama_token_to_piece(vocab, tok, &(*out)[0], (int32_t) out->size(), 0, false);
+    }
+    out->resize(n < 0 ? 0 : (size_t) n);
+    return n >= 0;
+}
+
+// ---------- streaming text ----------
+
+size_t utf8_complete_len(const char *s, size_t n) {
+    // Find the last lead byte among the final four and check its sequence is whole
+    for (size_t back = 1; back <= std::min<size_t>(n, 4); ++back) {
+        const unsigned char c = (unsigned char) s[n - back];
+        if ((c & 0xC0) == 0x80) continue;
+        const size_t len = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return len > back ? n - back : n;
+    }
+    return n;   // only continuation bytes: not UTF-8 we can repair, let it through
+}
+
+bool text_stream_push(text_stream& ts, const char *bytes, size_t n, std::string *out) {
+    ts.held.append(bytes, n);
+    size_t stop_at = std::string::npos;
+    for (const auto &stop : ts.stops) {
+        if (!stop.empty()) stop_at = std::min(stop_at, ts.held.find(stop));
+    }
+    if (stop_at != std::string::npos) {
+        out->assign(ts.held, 0, stop_at);
+        ts.held.clear();
+        return false;
+    }
+    // Keep the longest tail that is the start of a stop string
+    size_t safe = utf8_complete_len(ts.held.data(), ts.held.size());
+    for (const auto &stop : ts.stops) {
+        for (size_t k = std::min(stop.size() - 1, ts.held.size()); k > 0; --k) {
+            if (ts.held.compare(ts.held.size() - k, k, stop, 0, k) == 0) {
+                safe = std::min(safe, ts.held.size() - k);
+                break;
+            }
+        }
+    }
+    out->assign(ts.held, 0, safe);
+    ts.held.erase(0, safe);
+    return true;
+}
+
+void text_stream_flush(text_stream& ts, std::string *out) {
+    out->assign(ts.held, 0, utf8_complete_len(ts.held.data(), ts.held.size()));
+    ts.held.clear();
+}
+
+static inline void session_reset(llama_session* s) {
+    llama_memory_clear(llama_get_memory(s->ctx), true);
+    s->cached.clear();
+    for (auto &tokens : s->seq_cached) tokens.clear();
+}
+
+// Keep the longest common token prefix already in seq 0, drop the diverging tail and
+// prefill only the new suffix. Logits are requested for the final prompt token only.
+// A set `cancel` flag stops between batches; seq 0 then still matches s->cached.
+static bool prefill_reusing_prefix(llama_session* s, const std::vector<llama_token>& tokens,
+                                   llama_batch& batch, int n_batch, int32_t* n_reused,
+                                   const std::atomic<bool>* cancel = nullptr) {
+    const int32_t ntok = (int32_t)tokens.size();
+
+    int32_t n_common = 0;
+    const int32_t n_cached = (int32_t)s->cached.size();
+    while (n_common < n_cached && n_common < ntok && s->cached[n_common] == tokens[n_common]) ++n_common;
+    // Always re-decode at least the last prompt token so there are fresh logits to sample from
+    if (n_common >= ntok) n_common = ntok - 1;
+
+    llama_memory_t mem = llama_get_memory(s->ctx);
+    if (!llama_memory_seq_rm(mem, 0, n_common, -1)) {
+        // e.g. recurrent memory cannot drop a partial sequence
+        session_reset(s);
+        n_common = 0;
+    }
+    s->cached.resize(n_common);
+    *n_reused = n_common;
+
+    for (int32_t cur = n_common; cur < ntok; ) {
+        if (cancel && cancel->load(std::memory_order_relaxed)) return false;
+        batch_clear_compat(&batch);
+        const int32_t nb = std::min(n_batch, ntok - cur);
+        for (int i = 0; i < nb; ++i) {
+            const int32_t pos = cur + i;
+            batch.token[i]     = tokens[pos];
+            batch.pos[i]       = pos;
+            batch.n_seq_id[i]  = 1;
+            batch.seq_id[i][0] = 0;
+            batch.logits[i]    = (pos == ntok - 1) ? 1 : 0;
+        }
+        batch.n_tokens = nb;
+
+        if (llama_decode(s->ctx, batch) != 0) {
+            LOGE("Batch decode failed at pos %d", cur);
+            session_reset(s);
+            return false;
+        }
+        s->cached.insert(s->cached.end(), tokens.begin() + cur, tokens.begin() + cur + nb);
+        cur += nb;
+    }
+    return true;
+}
+
+// At least BOS, at most half the window, so a shift always has something to discard
+static int32_t clamp_keep(const llama_context *ctx, const llama_vocab *vocab, int32_t n_keep) {
+    return std::min(std::max(n_keep, llama_vocab_get_add_bos(vocab) ? 1 : 0), (int32_t) llama_n_ctx(ctx) / 2);
+}
+
+// A prompt too long for the window keeps its first n_keep tokens plus the newest half of the
+// rest, leaving the other half to generate into before the first shift. Returns the number of
+// tokens dropped.
+static int32_t truncate_prompt(std::vector<llama_token>& prompt, int32_t n_ctx, int32_t n_keep) {
+    if ((int32_t) prompt.size() < n_ctx) return 0;
+    const int32_t n_tail = (n_ctx - n_keep) / 2;
+    const int32_t n_drop = (int32_t) prompt.size() - n_keep - n_tail;
+    prompt.erase(prompt.begin() + n_keep, prompt.begin() + n_keep + n_drop);
+    LOGI("Prompt exceeds the context (%d tokens): dropped %d after the first %d", n_ctx, n_drop, n_keep);
+    return n_drop;
+}
+
+// Context shift: drops `n_discard` tokens of `seq` right after its first `n_keep` and slides the
+// rest down to close the gap (RoPE is re-applied by the next decode), so a full window keeps
+// going without re-encoding. `tokens` mirrors the sequence and is updated the same way.
+// Returns false, changing nothing, if the memory can't shift or the range is out of bounds.
+static bool kv_shift(llama_context *ctx, llama_seq_id seq, std::vector<llama_token>& tokens,
+                     int32_t n_keep, int32_t n_discard) {
+    llama_memory_t mem = llama_get_memory(ctx);
+    if (n_discard <= 0 || n_keep < 0 || n_keep + n_discard > (int32_t) tokens.size()) return false;
+    if (!llama_memory_can_shift(mem)) return false;
+    if (!llama_memory_seq_rm(mem, seq, n_keep, n_keep + n_discard)) return false;
+    llama_memory_seq_add(mem, seq, n_keep + n_discard, -1, -n_discard);
+    tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + n_discard);
+    return true;
+}
+
+
+// ---------- model cache ----------
+
+// Weights are loaded once per file and shared by every context opened on them (chat, draft),
+// so recreating a context or changing threads never re-reads and re-faults the GGUF. Entries
+// are refcounted; the model is freed when its last handle is released.
+struct model_entry {
+    llama_model *model = nullptr;
+    std::string path;
+    int32_t refs = 0;
+};
+
+static std::mutex g_models_mutex;
+static std::vector<model_entry> g_models;
+
+// Start kernel readahead of the whole file so the loader's own mmap finds resident pages
+// instead of faulting them in one at a time. The readahead outlives our short mapping.
+static void prefetch_file(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st{};
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *p = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, (size_t) st.st_size, MADV_WILLNEED);
+            munmap(p, (size_t) st.st_size);
+        }
+    }
+    close(fd);
+}
+
+// Returns the cached model for `path` (taking a reference) or loads it. Options only apply
+// to the first load; later callers share whatever is resident.
+llama_model *model_acquire(const std::string& path, bool use_mmap, bool use_mlock, bool prefetch) {
+    std::lock_guard<std::mutex> lock(g_models_mutex);
+    for (auto &e : g_models) {
+        if (e.path == path) {
+            ++e.refs;
+            return e.model;
+        }
+    }
+
+    const int64_t t0 = ggml_time_us();
+    if (prefetch && use_mmap) prefetch_file(path);
+    llama_model_params mparams = llama_model_default_params();
+    mparams.use_mmap  = use_mmap;
+    mparams.use_mlock = use_mlock;
+    llama_model *model = llama_model_load_from_file(path.c_str(), mparams);
+    if (!model) return nullptr;
+    LOGI("Model loaded in %lld ms (mmap=%d, mlock=%d, prefetch=%d)",
+         (long long) ((ggml_time_us() - t0) / 1000), use_mmap, use_mlock, prefetch);
+    g_models.push_back({model, path, 1});
+    return model;
+}
+
+// Takes another reference on a model that is already cached
+bool model_retain(const llama_model *model) {
+    std::lock_guard<std::mutex> lock(g_models_mutex);
+    for (auto &e : g_models) {
+        if (e.model == model) {
+            ++e.refs;
+            return true;
+        }
+    }
+    return false;
+}
+
+void model_release(const llama_model *model) {
+    if (!model) return;
+    std::lock_guard<std::mutex> lock(g_models_mutex);
+    for (auto it = g_models.begin(); it != g_models.end(); ++it) {
+        if (it->model != model) continue;
+        if (--it->refs == 0) {
+            llama_model_free(it->model);
+            g_models.erase(it);
+            LOGI("Model freed");
+        }
+        return;
+    }
+}
+
+std::string model_path_of(const llama_model *model) {
+    std::lock_guard<std::mutex> lock(g_models_mutex);
+    for (const auto &e : g_models) {
+        if (e.model == model) return e.path;
+    }
+    return {};
+}
+
+// ---------- threading ----------
+
+static std::vector<int32_t> allowed_cpus() {
+    std::vector<int32_t> cpus;
+#ifdef __linux__
+    // The process's mask, not the calling thread's (which a pool may have narrowed)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(getpid(), sizeof(set), &set) == 0) {
+        for (int32_t i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &set)) cpus.push_back(i);
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        const int32_t n = (int32_t) std::max(1u, std::thread::hardware_concurrency());
+        for (int32_t i = 0; i < n; ++i) cpus.push_back(i);
+    }
+    return cpus;
+}
+
+static int64_t read_sysfs_int(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    long long v = 0;
+    if (fscanf(f, "%lld", &v) != 1) v = 0;
+    fclose(f);
+    return v;
+}
+
+std::vector<std::vector<int32_t>> cpu_clusters() {
+    // cpu_capacity is what the scheduler itself uses on big.LITTLE; max frequency is close
+    // enough where it's missing
+    std::map<int64_t, std::vector<int32_t>, std::greater<int64_t>> by_speed;
+    char path[128];
+    for (int32_t cpu : allowed_cpus()) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpu_capacity", cpu);
+        int64_t speed = read_sysfs_int(path);
+        if (speed <= 0) {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+            speed = read_sysfs_int(path);
+        }
+        by_speed[speed].push_back(cpu);
+    }
+    std::vector<std::vector<int32_t>> clusters;
+    for (auto &e : by_speed) clusters.push_back(std::move(e.second));
+    return clusters;
+}
+
+session_threads session_threads_for(int threads) {
+    const auto clusters = cpu_clusters();
+    session_threads t;
+    for (const auto &c : clusters) t.batch.cpus.insert(t.batch.cpus.end(), c.begin(), c.end());
+    for (size_t i = 0; i + 1 < std::max<size_t>(clusters.size(), 2); ++i) {
+        t.decode.cpus.insert(t.decode.cpus.end(), clusters[i].begin(), clusters[i].end());
+    }
+    t.batch.n_threads  = std::max(1, threads);
+    t.decode.n_threads = std::max(1, std::min(threads, (int) t.decode.cpus.size()));
+    return t;
+}
+
+static std::string cpu_list(const std::vector<int32_t>& cpus) {
+    if (cpus.empty()) return "any";
+    std::string out;
+    for (int32_t c : cpus) out += (out.empty() ? "" : ",") + std::to_string(c);
+    return out;
+}
+
+// Pins the calling thread to t's cores with t's nice value. Linux only; nice is per thread
+// there and setpriority(PRIO_PROCESS, 0) targets the caller.
+static void thread_place(const thread_spec& t) {
+#ifdef __linux__
+    if (!t.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int32_t c : t.cpus) {
+            if (c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) LOGE("Failed to set affinity to %s", cpu_list(t.cpus).c_str());
+    }
+    if (t.nice != getpriority(PRIO_PROCESS, 0) && setpriority(PRIO_PROCESS, 0, t.nice) != 0) {
+        LOGE("Failed to set nice %d", t.nice);
+    }
+#else
+    (void) t;
+#endif
+}
+
+// ggml only applies a pool's cpumask on glibc Linux and its priorities are SCHED_FIFO levels
+// an app can't use, so the pool is created from a helper thread placed on its cores instead:
+// the workers inherit that thread's affinity and nice value. Created paused, so idle pools
+// don't poll; the first graph resumes them.
+static ggml_threadpool_t threadpool_create(const thread_spec& t) {
+    ggml_threadpool_params params = ggml_threadpool_params_default(t.n_threads);
+    for (int32_t c : t.cpus) {
+        if (c >= 0 && c < GGML_MAX_N_THREADS) params.cpumask[c] = true;
+    }
+    params.paused = true;
+    ggml_threadpool_t tp = nullptr;
+    std::thread([&]() {
+        thread_place(t);
+        tp = ggml_threadpool_new(&params);
+    }).join();
+    return tp;
+}
+
+static void threadpools_free(ggml_threadpool_t a, ggml_threadpool_t b) {
+    if (a) ggml_threadpool_free(a);
+    if (b) ggml_threadpool_free(b);
+}
+
+// Swaps in new pools for the session and its draft. The caller holds s->busy (or still owns
+// s alone), so no graph is running on the old ones.
+static bool session_attach_pools(llama_session *s, const session_threads& t) {
+    ggml_threadpool_t tp_decode = threadpool_create(t.decode);
+    ggml_threadpool_t tp_batch  = threadpool_create(t.batch);
+    if (!tp_decode || !tp_batch) {
+        LOGE("Failed to create threadpools");
+        threadpools_free(tp_decode, tp_batch);
+        return false;
+    }
+    for (llama_session *x : {s, s->draft}) {
+        if (!x) continue;
+        llama_attach_threadpool(x->ctx, tp_decode, tp_batch);
+        llama_set_n_threads(x->ctx, t.decode.n_threads, t.batch.n_threads);
+        x->cparams.n_threads       = t.decode.n_threads;
+        x->cparams.n_threads_batch = t.batch.n_threads;
+    }
+    threadpools_free(s->tp_decode, s->tp_batch);
+    s->tp_decode = tp_decode;
+    s->tp_batch  = tp_batch;
+    s->threads   = t;
+    LOGI("Threads: decode %d on cpus %s (nice %d), batch %d on cpus %s (nice %d)",
+         t.decode.n_threads, cpu_list(t.decode.cpus).c_str(), t.decode.nice,
+         t.batch.n_threads, cpu_list(t.batch.cpus).c_str(), t.batch.nice);
+    return true;
+}
+
+// Sequences the worker can decode together in one context. They share the n_ctx cells
+// (unified KV), so a lone chat still gets the whole context.
+static constexpr int32_t SESSION_N_SEQ = 4;
+
+// ---------- context sizing ----------
+
+// Budget-fitted contexts grow in steps of the flash-attention KV padding, so n_ctx is never
+// rounded up past what was planned
+static constexpr int32_t CTX_STEP      = 256;
+static constexpr int32_t CTX_MIN       = 512;
+static constexpr int32_t UBATCH_MIN    = 32;
+static constexpr int32_t UBATCH_PREFER = 64;    // below this, prefill slows down noticeably
+
+// Hyperparameters the footprint depends on. Head sizes and the FFN width come from GGUF
+// metadata when present (some models don't use n_embd / n_head).
+struct model_shape {
+    int64_t n_layer = 0, n_head = 0, n_head_kv = 0, n_embd = 0;
+    int64_t head_k = 0, head_v = 0, n_ff = 0, n_vocab = 0;
+    int32_t n_ctx_train = 0;
+};
+
+static int64_t model_meta_int(const llama_model *model, const char *arch, const char *key, int64_t fallback) {
+    char name[128], buf[64];
+    snprintf(name, sizeof(name), "%s.%s", arch, key);
+    if (llama_model_meta_val_str(model, name, buf, sizeof(buf)) <= 0) return fallback;
+    const long long v = atoll(buf);   // arrays (per-layer values) don't parse and fall back
+    return v > 0 ? v : fallback;
+}
+
+static model_shape model_shape_of(const llama_model *model) {
+    model_shape m;
+    char arch[64] = "";
+    llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch));
+    m.n_layer     = llama_model_n_layer(model);
+    m.n_head      = std::max(1, llama_model_n_head(model));
+    m.n_head_kv   = std::max(1, llama_model_n_head_kv(model));
+    m.n_embd      = llama_model_n_embd(model);
+    m.head_k      = model_meta_int(model, arch, "attention.key_length", m.n_embd / m.n_head);
+    m.head_v      = model_meta_int(model, arch, "attention.value_length", m.n_embd / m.n_head);
+    m.n_ff        = model_meta_int(model, arch, "feed_forward_length", 4 * m.n_embd);
+    m.n_vocab     = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    m.n_ctx_train = llama_model_n_ctx_train(model);
+    return m;
+}
+
+static int64_t kv_cells(const session_config& cfg) {
+    const int64_t pad = cfg.flash_attn ? 256 : 32;   // llama_kv_cache_unified::get_padding
+    return (cfg.n_ctx + pad - 1) / pad * pad;
+}
+
+static int64_t kv_bytes(const model_shape& m, const session_config& cfg) {
+    return m.n_layer * kv_cells(cfg) * (int64_t) (ggml_row_size(cfg.type_k, m.head_k * m.n_head_kv) +
+                                                  ggml_row_size(cfg.type_v, m.head_v * m.n_head_kv));
+}
+
+// What ggml-alloc reserves for the worst-case n_ubatch graph: logits for every row, one layer's
+// activations, and the KQ mask over all cells. Without flash attention the f32 KQ scores reuse
+// the FFN's memory; with it the mask is live alongside the FFN.
+static int64_t compute_bytes(const model_shape& m, const session_config& cfg) {
+    const int64_t ub   = cfg.n_ubatch;
+    const int64_t n_kv = kv_cells(cfg);
+    const int64_t mask = n_kv * ((ub + 63) / 64 * 64) * 4;   // rows padded to GGML_KQ_MASK_PAD
+    const int64_t ffn  = 3 * m.n_ff * ub * 4;
+    const int64_t rest = m.n_vocab * ub * 4 + 4 * m.n_embd * ub * 4 + (m.head_k + m.head_v) * m.n_head * ub * 4;
+    if (cfg.flash_attn) return rest + ffn + mask;
+    return rest + std::max(ffn, mask + n_kv * ub * m.n_head * 4);
+}
+
+session_footprint session_estimate_footprint(const llama_model *model, const session_config& cfg) {
+    const model_shape m = model_shape_of(model);
+    session_footprint f;
+    f.kv_bytes      = kv_bytes(m, cfg);
+    f.compute_bytes = compute_bytes(m, cfg);
+    return f;
+}
+
+static bool kv_type_supported(ggml_type type, int64_t head) {
+    if (type != GGML_TYPE_F16 && type != GGML_TYPE_Q8_0 && type != GGML_TYPE_Q4_0) return false;
+    return head % ggml_blck_size(type) == 0;   // rows are whole quant blocks
+}
+
+session_config session_plan_config(const llama_model *model, session_config cfg) {
+    const model_shape m = model_shape_of(model);
+    if (!kv_type_supported(cfg.type_k, m.head_k)) {
+        LOGE("K cache type %s not usable with this model, using f16", ggml_type_name(cfg.type_k));
+        cfg.type_k = GGML_TYPE_F16;
+    }
+    if (!kv_type_supported(cfg.type_v, m.head_v)) {
+        LOGE("V cache type %s not usable with this model, using f16", ggml_type_name(cfg.type_v));
+        cfg.type_v = GGML_TYPE_F16;
+    }
+    if (ggml_is_quantized(cfg.type_v) && !cfg.flash_attn) {
+        LOGI("Quantized V cache needs flash attention, enabling it");
+        cfg.flash_attn = true;
+    }
+    const int32_t n_ctx_max = m.n_ctx_train > 0 ? m.n_ctx_train : INT32_MAX;
+    cfg.n_batch  = std::max(cfg.n_batch, 1);
+    cfg.n_ubatch = std::min(std::max(cfg.n_ubatch, 1), cfg.n_batch);
+    cfg.n_ctx    = std::min(std::max(cfg.n_ctx, 1), n_ctx_max);
+    if (cfg.memory_budget_mb <= 0) return cfg;
+
+    // Context first (it is what the user sees), then spend what's left on a wider ubatch
+    const int64_t budget = (int64_t) cfg.memory_budget_mb << 20;
+    auto fits = [&](const session_config& c) { return kv_bytes(m, c) + compute_bytes(m, c) <= budget; };
+    session_config c = cfg;
+    c.n_ubatch = std::min(UBATCH_PREFER, cfg.n_batch);
+    c.n_ctx    = CTX_MIN;
+    if (!fits(c)) c.n_ubatch = std::min(UBATCH_MIN, cfg.n_batch);
+    if (!fits(c)) {
+        LOGE("Memory budget %d MB is below the smallest context (%d cells), using it anyway",
+             cfg.memory_budget_mb, CTX_MIN);
+        c.n_ctx = std::min(CTX_MIN, n_ctx_max);
+        return c;
+    }
+    while (c.n_ctx + CTX_STEP <= n_ctx_max) {
+        session_config next = c;
+        next.n_ctx += CTX_STEP;
+        if (!fits(next)) break;
+        c = next;
+    }
+    while (c.n_ubatch * 2 <= cfg.n_batch) {
+        session_config next = c;
+        next.n_ubatch *= 2;
+        if (!fits(next)) break;
+        c = next;
+    }
+    return c;
+}
+
+// Context for the chat session over an already-acquired model. The session owns one model
+// reference and hands it back in llamaFree.
+llama_session *session_create(llama_model *model, const std::string& path, int threads,
+                              const session_config& requested) {
+    const session_config cfg = session_plan_config(model, requested);
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = cfg.n_ctx;
+    cparams.n_batch         = cfg.n_batch;
+    cparams.n_ubatch        = cfg.n_ubatch;
+    cparams.n_seq_max       = SESSION_N_SEQ;
+    cparams.kv_unified      = true;
+    cparams.n_threads       = threads;
+    cparams.n_threads_batch = threads;
+    cparams.type_k          = cfg.type_k;
+    cparams.type_v          = cfg.type_v;
+    cparams.flash_attn      = cfg.flash_attn;
+
+    llama_context *ctx = llama_init_from_model(model, cparams);
+    if (!ctx) return nullptr;
+
+    auto *session = new llama_session();
+    session->ctx = ctx;
+    session->seq_cached.resize(llama_n_seq_max(ctx) - 1);
+    session->model_path = path;
+    session->cparams = cparams;
+    session->config = cfg;
+    session->config.n_ctx = (int32_t) llama_n_ctx(ctx);
+    session->footprint = session_estimate_footprint(model, session->config);
+    session_attach_pools(session, session_threads_for(threads));   // else llama.cpp's per-graph pool
+    LOGI("Context: ctx=%d, batch=%d, ubatch=%d, kv=%s/%s, flash_attn=%d: KV %.1f MB, compute %.1f MB",
+         session->config.n_ctx, cfg.n_batch, cfg.n_ubatch, ggml_type_name(cfg.type_k),
+         ggml_type_name(cfg.type_v), (int) cfg.flash_attn, session->footprint.kv_bytes / 1048576.0,
+         session->footprint.compute_bytes / 1048576.0);
+    return session;
+}
+
+// ---------- speculative decoding ----------
+
+static constexpr int32_t DRAFT_N_MIN = 2;      // adaptive draft length floor
+static constexpr float   DRAFT_P_MIN = 0.75f;  // stop drafting once the draft model is this unsure
+
+// Same check as common_speculative_are_compatible: drafted token ids are fed to the target
+// as-is, so both vocabularies must agree on type, special tokens and token texts.
+static bool vocab_compatible(const llama_vocab *tgt, const llama_vocab *dft) {
+    if (llama_vocab_type(tgt) != llama_vocab_type(dft)) return false;
+    if (llama_vocab_get_add_bos(tgt) != llama_vocab_get_add_bos(dft) ||
+        llama_vocab_get_add_eos(tgt) != llama_vocab_get_add_eos(dft) ||
+        llama_vocab_bos(tgt) != llama_vocab_bos(dft) ||
+        llama_vocab_eos(tgt) != llama_vocab_eos(dft)) return false;
+
+    const int n_tgt = llama_vocab_n_tokens(tgt);
+    const int n_dft = llama_vocab_n_tokens(dft);
+    if (std::abs(n_tgt - n_dft) > 128) return false;
+    for (int i = 5; i < std::min(n_tgt, n_dft); ++i) {
+        if (strcmp(llama_vocab_get_text(tgt, i), llama_vocab_get_text(dft, i)) != 0) return false;
+    }
+    return true;
+}
+
+static void session_free_draft(llama_session *s) {
+    if (!s->draft) return;
+    const llama_model *model = llama_get_model(s->draft->ctx);
+    llama_free(s->draft->ctx);
+    model_release(model);
+    delete s->draft;
+    s->draft = nullptr;
+    s->n_draft_max = s->n_draft = 0;
+}
+
+// Grow the draft length after a fully accepted draft, shrink it when most of it was rejected
+static void adapt_draft_len(int32_t *n_draft, int32_t n_draft_max, int32_t drafted, int32_t accepted) {
+    if (accepted == drafted) {
+        *n_draft = std::min(*n_draft + 2, n_draft_max);
+    } else if (2 * accepted < drafted) {
+        *n_draft = std::max(*n_draft - 1, DRAFT_N_MIN);
+    }
+}
+
+// Prompt-lookup drafting in the spirit of examples/lookup, without the static corpus: every
+// n-gram of prompt + generated tokens maps to the position that followed its latest
+// occurrence, and a draft is the span after the latest earlier occurrence of the current
+// trailing n-gram (longest n first). Answers that quote the RAG CONTEXT or PERSONAL MEMORY
+// lines verbatim get long drafts accepted without a second model.
+struct ngram_lookup {
+    int32_t n_min = 0;
+    int32_t n_max = 0;
+    std::vector<llama_token> tokens;
+    std::vector<std::unordered_map<uint64_t, int32_t>> next_pos; // [n - 1]: n-gram hash -> continuation index
+
+    static uint64_t hash(const llama_token *t, int32_t n) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (int32_t i = 0; i < n; ++i) h = (h ^ (uint32_t) t[i]) * 0x100000001b3ULL;
+        return h;
+    }
+
+    void reset(int32_t n, const std::vector<llama_token>& history) {
+        n_max = n;
+        n_min = std::min(2, n);
+        tokens.clear();
+        next_pos.assign(n, {});
+        for (llama_token t : history) push(t);
+    }
+
+    // N-grams ending at the previous token are indexed only now that their continuation
+    // exists, so the trailing n-gram never matches itself.
+    void push(llama_token t) {
+        const int32_t i = (int32_t) tokens.size();
+        for (int32_t n = 1; n <= n_max && n <= i; ++n) next_pos[n - 1][hash(&tokens[i - n], n)] = i;
+        tokens.push_back(t);
+    }
+
+    std::vector<llama_token> draft(int32_t n_draft) const {
+        const int32_t size = (int32_t) tokens.size();
+        for (int32_t n = std::min(n_max, size); n >= n_min; --n) {
+            const auto it = next_pos[n - 1].find(hash(&tokens[size - n], n));
+            if (it == next_pos[n - 1].end()) continue;
+            const int32_t c = it->second;
+            if (!std::equal(tokens.begin() + (c - n), tokens.begin() + c, tokens.end() - n)) continue; // hash collision
+            return std::vector<llama_token>(tokens.begin() + c, tokens.begin() + std::min(size, c + n_draft));
+        }
+        return {};
+    }
+};
+
+// Greedily drafts up to n_draft tokens continuing `history` + `last` on the draft context.
+// The draft KV keeps its own prefix, so only tokens the target accepted since the previous
+// call are re-encoded. Drafting stops early when the top-1 probability drops below DRAFT_P_MIN.
+static std::vector<llama_token> draft_generate(llama_session *d, const std::vector<llama_token>& history,
+                                               llama_token last, int32_t n_draft,
+                                               llama_batch& batch, int n_batch) {
+    std::vector<llama_token> out;
+    std::vector<llama_token> prompt;
+    prompt.reserve(history.size() + 1);
+    prompt.insert(prompt.end(), history.begin(), history.end());
+    prompt.push_back(last);
+
+    int32_t n_reused = 0;
+    if (!prefill_reusing_prefix(d, prompt, batch, n_batch, &n_reused)) return out;
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(d->ctx)));
+    for (int32_t i = 0; i < n_draft; ++i) {
+        const float *logits = llama_get_logits_ith(d->ctx, -1);
+        if (!logits) break;
+        int best = 0;
+        for (int t = 1; t < n_vocab; ++t) if (logits[t] > logits[best]) best = t;
+        float sum = 0.0f;
+        for (int t = 0; t < n_vocab; ++t) sum += expf(logits[t] - logits[best]);
+        if (1.0f / sum < DRAFT_P_MIN) break;
+
+        out.push_back(best);
+        if (i + 1 == n_draft) break; // the last draft token never needs its own logits
+
+        batch_clear_compat(&batch);
+        batch.n_tokens     = 1;
+        batch.token[0]     = best;
+        batch.pos[0]       = (llama_pos) d->cached.size();
+        batch.n_seq_id[0]  = 1;
+        batch.seq_id[0][0] = 0;
+        batch.logits[0]    = 1;
+        if (llama_decode(d->ctx, batch) != 0) {
+            session_reset(d);
+            break;
+        }
+        d->cached.push_back(best);
+    }
+    return out;
+}
+
+
+// Everything a saved sequence state depends on: weights, context geometry and KV layout.
+// A snapshot whose fingerprint differs from the live context is rejected on load.
+static std::string state_fingerprint(const llama_session* s) {
+    const llama_model *model = llama_get_model(s->ctx);
+    const size_t slash = s->model_path.find_last_of("/\\");
+    const std::string file = slash == std::string::npos ? s->model_path : s->model_path.substr(slash + 1);
+    char buf[512];
+    snprintf(buf, sizeof(buf), "model=%s;size=%llu;params=%llu;n_ctx=%u;type_k=%s;type_v=%s;flash_attn=%d;swa_full=%d",
+             file.c_str(),
+             (unsigned long long) llama_model_size(model),
+             (unsigned long long) llama_model_n_params(model),
+             llama_n_ctx(s->ctx),
+             ggml_type_name(s->cparams.type_k),
+             ggml_type_name(s->cparams.type_v),
+             (int) s->cparams.flash_attn,
+             (int) s->cparams.swa_full);
+    return buf;
+}
+
+static bool read_text_file(const std::string& path, std::string* out) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    char buf[512];
+    size_t n;
+    out->clear();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) out->append(buf, n);
+    fclose(f);
+    return true;
+}
+
+static bool write_text_file(const std::string& path, const std::string& text) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+    const bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    return (fclose(f) == 0) && ok;
+}
+
+// ---------- sessions ----------
+
+void session_free(llama_session *s) {
+    if (!s) return;
+    worker_stop(s);
+    { std::lock_guard<std::mutex> lock(s->busy); }   // let a blocking call finish
+    session_free_draft(s);
+    const llama_model *model = llama_get_model(s->ctx);
+    llama_free(s->ctx);
+    threadpools_free(s->tp_decode, s->tp_batch);
+    model_release(model);
+    delete s;
+    LOGI("Context freed");
+}
+
+void session_clear(llama_session *s) {
+    std::lock_guard<std::mutex> lock(s->busy);
+    session_reset(s);
+    if (s->draft) session_reset(s->draft);
+    LOGI("KV cache cleared");
+}
+
+// Thread changes apply to the live context (and its draft) without touching the KV cache
+void session_set_threads(llama_session *s, int threads) {
+    session_set_thread_pools(s, session_threads_for(threads));
+}
+
+bool session_set_thread_pools(llama_session *s, const session_threads& threads) {
+    std::lock_guard<std::mutex> lock(s->busy);
+    return session_attach_pools(s, threads);
+}
+
+// The fastest 1..k clusters, each with all and with half of their cores
+static std::vector<thread_spec> thread_candidates() {
+    std::vector<thread_spec> out;
+    std::vector<int32_t> cpus;
+    for (const auto &cluster : cpu_clusters()) {
+        cpus.insert(cpus.end(), cluster.begin(), cluster.end());
+        const int32_t n = (int32_t) cpus.size();
+        for (int32_t k : {n, n / 2}) {
+            if (k < 1) continue;
+            thread_spec t;
+            t.n_threads = k;
+            t.cpus = cpus;
+            out.push_back(std::move(t));
+        }
+    }
+    return out;
+}
+
+// Runs on the calibration thread with s->busy held. The thread is placed like the pool,
+// since it takes part in every graph as the pool's main thread.
+static bool time_thread_spec(llama_session *s, const thread_spec& t, const std::vector<llama_token>& prompt,
+                             int32_t n_decode, double *prefill_ms, double *decode_ms) {
+    session_threads both;
+    both.decode = both.batch = t;
+    if (!session_attach_pools(s, both)) return false;
+    thread_place(t);
+
+    std::vector<llama_token> tokens = prompt;
+    session_reset(s);
+    bool ok = llama_decode(s->ctx, llama_batch_get_one(tokens.data(), 1)) == 0;   // wakes the pools
+    session_reset(s);
+
+    int64_t t0 = ggml_time_us();
+    ok = ok && llama_decode(s->ctx, llama_batch_get_one(tokens.data(), (int32_t) tokens.size())) == 0;
+    llama_synchronize(s->ctx);
+    *prefill_ms = (double) (ggml_time_us() - t0) / 1000.0;
+
+    t0 = ggml_time_us();
+    for (int32_t i = 0; ok && i < n_decode; ++i) {
+        llama_token tok = tokens[(size_t) i % tokens.size()];
+        ok = llama_decode(s->ctx, llama_batch_get_one(&tok, 1)) == 0;
+    }
+    llama_synchronize(s->ctx);
+    *decode_ms = (double) (ggml_time_us() - t0) / 1000.0;
+    session_reset(s);
+    return ok;
+}
+
+thread_calibration session_calibrate_threads(llama_session *s, int32_t n_prefill, int32_t n_decode) {
+    thread_calibration result;
+    std::thread([&]() {
+        std::lock_guard<std::mutex> lock(s->busy);
+        const session_threads before = s->threads;
+        const int32_t n_ctx = (int32_t) llama_n_ctx(s->ctx);
+        n_prefill = std::max(2, std::min({n_prefill, (int32_t) llama_n_batch(s->ctx), n_ctx / 2}));
+        n_decode  = std::max(1, std::min(n_decode, n_ctx / 2));
+
+        // Content doesn't matter for timing, only that every token is a valid id
+        const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(s->ctx)));
+        std::vector<llama_token> prompt((size_t) n_prefill);
+        for (int32_t i = 0; i < n_prefill; ++i) prompt[i] = (llama_token) ((int64_t) (i + 1) * 7919 % n_vocab);
+
+        double best_prefill = 0, best_decode = 0;
+        for (const thread_spec &t : thread_candidates()) {
+            double prefill_ms = 0, decode_ms = 0;
+            if (!time_thread_spec(s, t, prompt, n_decode, &prefill_ms, &decode_ms)) {
+                LOGE("Calibration failed for %d threads on cpus %s", t.n_threads, cpu_list(t.cpus).c_str());
+                continue;
+            }
+            const double prefill = prefill_ms / n_prefill, decode = decode_ms / n_decode;
+            LOGI("Calibration: %d threads on cpus %s: prefill %.2f ms/token, decode %.2f ms/token",
+                 t.n_threads, cpu_list(t.cpus).c_str(), prefill, decode);
+            const bool first = result.candidates++ == 0;
+            if (first || prefill < best_prefill) { best_prefill = prefill; result.threads.batch  = t; }
+            if (first || decode < best_decode)   { best_decode  = decode;  result.threads.decode = t; }
+        }
+        result.prefill_ms_per_token = best_prefill;
+        result.decode_ms_per_token  = best_decode;
+        if (result.candidates == 0) result.threads = before;
+        if (!session_attach_pools(s, result.threads)) session_attach_pools(s, before);
+        llama_perf_context_reset(s->ctx);
+    }).join();
+    return result;
+}
+
+int64_t session_warmup(llama_session *session) {
+    std::lock_guard<std::mutex> lock(session->busy);
+    const int64_t t0 = ggml_time_us();
+
+    std::vector<llama_session *> targets = {session};
+    if (session->draft) targets.push_back(session->draft);
+    for (llama_session *s : targets) {
+        const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(s->ctx));
+        std::vector<llama_token> tmp;
+        const llama_token bos = llama_vocab_bos(vocab);
+        const llama_token eos = llama_vocab_eos(vocab);
+        if (bos != LLAMA_TOKEN_NULL) tmp.push_back(bos);
+        if (eos != LLAMA_TOKEN_NULL) tmp.push_back(eos);
+        if (tmp.empty()) tmp.push_back(0);
+
+        session_reset(s);
+        if (llama_decode(s->ctx, llama_batch_get_one(tmp.data(), (int32_t) tmp.size())) != 0) {
+            LOGE("Warm-up decode failed");
+        }
+        llama_synchronize(s->ctx);
+        session_reset(s);
+        llama_perf_context_reset(s->ctx);
+    }
+
+    const int64_t ms = (ggml_time_us() - t0) / 1000;
+    LOGI("Warm-up took %lld ms", (long long) ms);
+    return ms;
+}
+
+bool session_attach_draft(llama_session *s, const std::string& path, int32_t n_draft_max) {
+    if (n_draft_max <= 0) return false;
+    std::lock_guard<std::mutex> lock(s->busy);
+    session_free_draft(s);
+
+    llama_model *model = model_acquire(path, /*use_mmap=*/true, /*use_mlock=*/false, /*prefetch=*/true);
+    if (!model) {
+        LOGE("Failed to load draft model %s", path.c_str());
+        return false;
+    }
+    if (!vocab_compatible(llama_model_get_vocab(llama_get_model(s->ctx)), llama_model_get_vocab(model))) {
+        LOGE("Draft model vocab does not match the target, speculation disabled");
+        model_release(model);
+        return false;
+    }
+    // Same geometry as the target so every target position fits in the draft KV too
+    llama_context *ctx = llama_init_from_model(model, s->cparams);
+    if (!ctx) {
+        LOGE("Failed to init draft context");
+        model_release(model);
+        return false;
+    }
+
+    if (s->tp_decode) llama_attach_threadpool(ctx, s->tp_decode, s->tp_batch);
+
+    auto *draft = new llama_session();
+    draft->ctx = ctx;
+    draft->model_path = path;
+    draft->cparams = s->cparams;
+    s->draft = draft;
+    s->n_draft_max = std::max<int32_t>(DRAFT_N_MIN, n_draft_max);
+    s->n_draft = std::min<int32_t>(4, s->n_draft_max);
+    LOGI("Draft model attached (n_draft_max=%d)", s->n_draft_max);
+    return true;
+}
+
+void session_detach_draft(llama_session *s) {
+    std::lock_guard<std::mutex> lock(s->busy);
+    session_free_draft(s);
+}
+
+// Ignored while a draft model is attached
+void session_configure_lookup(llama_session *s, int32_t ngram, int32_t n_draft_max) {
+    std::lock_guard<std::mutex> lock(s->busy);
+    const bool on = ngram > 0 && n_draft_max > 0;
+    s->lookup_ngram     = on ? ngram : 0;
+    s->lookup_draft_max = on ? std::max<int32_t>(DRAFT_N_MIN, n_draft_max) : 0;
+    s->lookup_draft     = std::min<int32_t>(4, s->lookup_draft_max);
+    LOGI("Prompt lookup %s (ngram=%d, n_draft_max=%d)", on ? "on" : "off", s->lookup_ngram, s->lookup_draft_max);
+}
+
+static std::vector<llama_token>& seq_tokens(llama_session *s, llama_seq_id seq) {
+    return seq == 0 ? s->cached : s->seq_cached[seq - 1];
+}
+
+// Writes s->state_seq (KV + token list) to `path` and its fingerprint to `path.meta`.
+// Both are written to temporaries and renamed so a crash never leaves a torn snapshot.
+size_t session_state_save(llama_session *s, const std::string& path) {
+    std::lock_guard<std::mutex> lock(s->busy);
+    if (s->state_seq < 0) return 0;
+    const auto &cached = seq_tokens(s, s->state_seq);
+    if (cached.empty()) return 0;
+
+    const int64_t t0 = ggml_time_us();
+    const std::string tmp = path + ".tmp";
+    const std::string meta = path + ".meta";
+    const size_t written = llama_state_seq_save_file(s->ctx, tmp.c_str(), s->state_seq, cached.data(), cached.size());
+    if (written == 0 || !write_text_file(meta + ".tmp", state_fingerprint(s)) ||
+        rename(tmp.c_str(), path.c_str()) != 0 || rename((meta + ".tmp").c_str(), meta.c_str()) != 0) {
+        LOGE("State save failed: %s", path.c_str());
+        remove(tmp.c_str());
+        remove((meta + ".tmp").c_str());
+        return 0;
+    }
+    LOGI("State saved: seq %d, %zu tokens, %zu bytes in %lld ms", s->state_seq, cached.size(), written,
+         (long long) (ggml_time_us() - t0) / 1000);
+    return written;
+}
+
+// Restores into seq 0. The next generation then prefix-matches against the restored tokens
+// as usual. A missing, stale or unreadable snapshot leaves the cache empty.
+int32_t session_state_load(llama_session *s, const std::string& path) {
+    std::lock_guard<std::mutex> lock(s->busy);
+
+    std::string fingerprint;
+    if (!read_text_file(path + ".meta", &fingerprint)) return -1;
+    if (fingerprint != state_fingerprint(s)) {
+        LOGI("State snapshot rejected (fingerprint mismatch): %s", path.c_str());
+        return -1;
+    }
+
+    const int64_t t0 = ggml_time_us();
+    session_reset(s);
+    std::vector<llama_token> tokens(llama_n_ctx(s->ctx));
+    size_t n_tokens = 0;
+    const size_t read = llama_state_seq_load_file(s->ctx, path.c_str(), 0, tokens.data(), tokens.size(), &n_tokens);
+    if (read == 0) {
+        LOGE("State load failed: %s", path.c_str());
+        session_reset(s);
+        return -1;
+    }
+    tokens.resize(n_tokens);
+    s->cached = std::move(tokens);
+    s->state_seq = 0;
+    LOGI("State restored: %zu tokens, %zu bytes in %lld ms", n_tokens, read,
+         (long long) (ggml_time_us() - t0) / 1000);
+    return (int32_t) n_tokens;
+}
+
+// ---------- token counting ----------
+
+// FNV-1a over the bytes, folded with the length and tokenization mode
+static uint64_t token_count_key(const std::string& text, bool add_special) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : text) h = (h ^ c) * 0x100000001b3ULL;
+    h ^= (uint64_t) text.size() * 0x9e3779b97f4a7c15ULL;
+    return add_special ? ~h : h;
+}
+
+void session_count_tokens(llama_session *s, const std::vector<std::string>& texts, bool add_special,
+                          std::vector<int32_t> *out) {
+    const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(s->ctx));
+    token_count_cache &cache = s->token_counts;
+    out->assign(texts.size(), 0);
+
+    std::vector<size_t> misses;
+    std::vector<uint64_t> keys(texts.size());
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        for (size_t i = 0; i < texts.size(); ++i) {
+            keys[i] = token_count_key(texts[i], add_special);
+            const auto it = cache.index.find(keys[i]);
+            if (it == cache.index.end()) { misses.push_back(i); continue; }
+            cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+            (*out)[i] = it->second->second;
+        }
+    }
+    if (misses.empty()) return;
+
+    // Tokenize outside the lock; a null buffer makes llama_tokenize return -(count)
+    for (size_t i : misses) {
+        const std::string &t = texts[i];
+        const int32_t n = llama_tokenize(vocab, t.c_str(), (int32_t) t.size(), nullptr, 0, add_special, /*parse_special=*/true);
+        (*out)[i] = n < 0 ? -n : n;
+    }
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    for (size_t i : misses) {
+        if (cache.index.count(keys[i])) continue;   // duplicate text in this call, or another thread
+        cache.lru.emplace_front(keys[i], (*out)[i]);
+        cache.index[keys[i]] = cache.lru.begin();
+        if (cache.lru.size() > token_count_cache::CAPACITY) {
+            cache.index.erase(cache.lru.back().first);
+            cache.lru.pop_back();
+        }
+    }
+}
+
+std::vector<int32_t> pack_token_budget(const std::vector<int32_t>& counts, int32_t budget, int32_t sep_tokens) {
+    std::vector<int32_t> kept;
+    int32_t used = 0;
+    for (int32_t i = 0; i < (int32_t) counts.size(); ++i) {
+        const int32_t cost = counts[i] + (kept.empty() ? 0 : sep_tokens);
+        if (used + cost > budget) continue;
+        used += cost;
+        kept.push_back(i);
+    }
+    return kept;
+}
+
+// ---------- generation scheduler ----------
+
+// A request while it owns one of the context's sequences
+struct gen_seq {
+    std::shared_ptr<gen_request> req;
+    llama_seq_id id = 0;
+    std::vector<llama_token> prompt;
+    int32_t n_reused = 0;
+    int32_t n_keep   = 0;                    // leading tokens context shifts never discard
+    int32_t n_chunk  = 0;                    // prompt tokens in the current batch
+    int32_t i_batch  = -1;                   // first logits row of this sequence in the batch
+    std::vector<llama_token> drafts;         // decoded after `next` in the current batch
+    llama_token next = LLAMA_TOKEN_NULL;     // sampled and emitted, not yet in the KV cache
+    text_stream text;                        // output not yet passed to on_token
+    std::string piece, out;                  // per-token scratch, reused
+    llama_sampler *sampler = nullptr;
+    ngram_lookup lookup;
+    int32_t n_gen = 0;
+    int64_t t_start = 0, t_tokenized = 0, t_first = 0, t_last_emit = 0;
+    gen_telemetry tel;
+    bool decoding = false;                   // prompt fully in the KV cache
+    bool done     = false;
+    gen_status status = GEN_DONE;
+};
+
+// Per-activation state of the worker: everything derived from the model that every step needs
+struct gen_sched {
+    const llama_vocab *vocab = nullptr;
+    llama_token tok_eos = -1, tok_eot = -1, tok_im_end = -1, tok_gemma_eot = -1;
+    llama_sampler_chain_params sparams{};
+    int32_t n_batch = 0;                     // tokens per scheduler step (the context's n_batch)
+    int32_t placed  = -1;                    // pool the worker thread is placed for (0 decode, 1 batch)
+    llama_batch batch{};
+    llama_batch draft_batch{};
+    bool has_draft_batch = false;
+};
+
+static void sched_init(llama_session *s, gen_sched& g) {
+    g.vocab   = llama_model_get_vocab(llama_get_model(s->ctx));
+    g.tok_eos = llama_vocab_eos(g.vocab);
+    g.tok_eot = llama_vocab_eot(g.vocab);
+    {
+        llama_token tmp[8];
+
+        // ChatML end
+        const char *s1 = "<|im_end|>";
+        int32_t n1 = llama_tokenize(g.vocab, s1, (int32_t)strlen(s1),
+                                    tmp, 8, /*add_special=*/true, /*parse_special=*/true);
+        if (n1 == 1) g.tok_im_end = tmp[0];
+
+        // Gemma end-of-turn
+        const char *s2 = "<end_of_turn>";
+        int32_t n2 = llama_tokenize(g.vocab, s2, (int32_t)strlen(s2),
+                                    tmp, 8, /*add_special=*/true, /*parse_special=*/true);
+        if (n2 == 1) g.tok_gemma_eot = tmp[0];
+    }
+    g.sparams = llama_sampler_chain_default_params();
+    g.n_batch = (int32_t) llama_n_batch(s->ctx);
+    g.batch = llama_batch_init(g.n_batch, 0, 1);
+    g.has_draft_batch = s->draft != nullptr;
+    if (g.has_draft_batch) g.draft_batch = llama_batch_init(g.n_batch, 0, 1);
+}
+
+static void sched_free(gen_sched& g) {
+    llama_batch_free(g.batch);
+    if (g.has_draft_batch) llama_batch_free(g.draft_batch);
+    g = gen_sched{};
+}
+
+static llama_sampler *make_sampler(const gen_sched& g, float temp) {
+    llama_sampler *smpl = llama_sampler_chain_init(g.sparams);
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1));
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temp));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    return smpl;
+}
+
+// Stop check + text callback; false ends the sequence (stop token, stop string or callback)
+static bool seq_emit(const gen_sched& g, gen_seq& q, llama_token tok) {
+    if (should_stop_generation(tok, g.vocab, g.tok_eos, g.tok_im_end, g.tok_eot) ||
+        (g.tok_gemma_eot != -1 && tok == g.tok_gemma_eot)) return false;
+
+    if (!token_to_piece(g.vocab, tok, &q.piece)) return false;
+
+    const int64_t now = ggml_time_us();
+    if (q.t_last_emit > 0) q.tel.token_us.push_back((int32_t) (now - q.t_last_emit));
+    q.t_last_emit = now;
+    const bool go_on = text_stream_push(q.text, q.piece.data(), q.piece.size(), &q.out);
+    if (!q.out.empty() && q.req->cb.on_token && !q.req->cb.on_token(q.out)) return false;
+    return go_on;
+}
+
+// `tok` was just sampled: emit it and decide whether the sequence goes on to decode it
+static void seq_accept(const gen_sched& g, gen_seq& q, llama_token tok) {
+    q.next = tok;
+    if (q.req->cancel.load(std::memory_order_relaxed)) {
+        q.done = true;
+        q.status = GEN_CANCELLED;
+        return;
+    }
+    if (q.req->max_tokens <= 0 || !seq_emit(g, q, tok) || ++q.n_gen >= q.req->max_tokens) q.done = true;
+}
+
+// Drops whatever a sequence holds in the KV cache
+static void seq_evict(llama_session *s, llama_seq_id seq) {
+    llama_memory_seq_rm(llama_get_memory(s->ctx), seq, -1, -1);
+    seq_tokens(s, seq).clear();
+}
+
+// Slides a decoding sequence's window by discarding the older half of what follows n_keep.
+// The draft context is shifted along when it mirrors the same tokens, so it doesn't re-encode
+// the whole history either.
+static bool seq_shift(llama_session *s, gen_seq& q) {
+    auto &tokens = seq_tokens(s, q.id);
+    const int32_t n_discard = ((int32_t) tokens.size() - q.n_keep) / 2;
+    llama_session *d = s->draft;
+    const bool draft_in_sync = d && (int32_t) d->cached.size() >= q.n_keep + n_discard &&
+                               std::equal(tokens.begin(), tokens.begin() + q.n_keep + n_discard, d->cached.begin());
+    if (!kv_shift(s->ctx, q.id, tokens, q.n_keep, n_discard)) return false;
+    if (draft_in_sync && !kv_shift(d->ctx, 0, d->cached, q.n_keep, n_discard)) session_reset(d);
+    ++q.tel.context_shifts;
+    q.tel.discarded_tokens += n_discard;
+    LOGI("Seq %d: context shift discarded %d tokens, %d left", q.id, n_discard, (int32_t) tokens.size());
+    return true;
+}
+
+// Claims the free sequence whose resident tokens share the longest prefix with `prompt`
+// (ties go to the lowest id, so chat keeps landing on seq 0), trims it to that prefix and
+// readies the request for prefill. Returns false if the prompt can't be tokenized.
+static bool seq_begin(llama_session *s, const gen_sched& g, gen_seq& q, const std::vector<bool>& used) {
+    q.t_start = ggml_time_us();
+    q.tel.queue_us = q.t_start - q.req->t_submit_us;
+    q.prompt = tokenize_with_specials(g.vocab, q.req->prompt.c_str());
+    q.t_tokenized = ggml_time_us();
+    q.tel.tokenize_us = q.t_tokenized - q.t_start;
+    if (q.prompt.empty()) { LOGE("Tokenization failed"); return false; }
+
+    q.n_keep = clamp_keep(s->ctx, g.vocab, q.req->n_keep);
+    if (const int32_t n_drop = truncate_prompt(q.prompt, (int32_t) llama_n_ctx(s->ctx), q.n_keep)) {
+        ++q.tel.context_shifts;
+        q.tel.discarded_tokens += n_drop;
+    }
+    const int32_t ntok = (int32_t) q.prompt.size();
+
+    // A lower-priority request leaves the sequence a snapshot would save alone while another is free
+    const bool outranked = q.req->priority < s->state_priority;
+    const bool spare_state = outranked && s->state_seq >= 0 && !used[s->state_seq] &&
+                             std::count(used.begin(), used.end(), false) > 1;
+    int32_t best_common = -1;
+    for (llama_seq_id seq = 0; seq < (llama_seq_id) used.size(); ++seq) {
+        if (used[seq] || (spare_state && seq == s->state_seq)) continue;
+        const auto &cached = seq_tokens(s, seq);
+        int32_t n_common = 0;
+        while (n_common < (int32_t) cached.size() && n_common < ntok && cached[n_common] == q.prompt[n_common]) ++n_common;
+        if (n_common > best_common) {
+            best_common = n_common;
+            q.id = seq;
+        }
+    }
+    if (outranked && q.id == s->state_seq) s->state_seq = -1;
+    // Always re-decode at least the last prompt token so there are fresh logits to sample from
+    int32_t n_common = std::min(best_common, ntok - 1);
+
+    auto &cached = seq_tokens(s, q.id);
+    if (!llama_memory_seq_rm(llama_get_memory(s->ctx), q.id, n_common, -1)) {
+        // e.g. recurrent memory cannot drop a partial sequence
+        seq_evict(s, q.id);
+        n_common = 0;
+    }
+    cached.resize(n_common);
+    q.n_reused = n_common;
+    q.sampler  = make_sampler(g, 0.7f);
+    LOGI("Seq %d: prompt %d tokens, reused %d", q.id, ntok, n_common);
+    return true;
+}
+
+// Prefill is done: sample the first token from the prompt logits with a colder sampler
+static void seq_first_token(llama_session *s, const gen_sched& g, gen_seq& q) {
+    const int64_t t_prefill_done = ggml_time_us();
+    llama_sampler *s_first = make_sampler(g, 0.2f);
+    const llama_token first = llama_sampler_sample(s_first, s->ctx, q.i_batch);
+    llama_sampler_free(s_first);
+    q.t_first = ggml_time_us();
+    q.tel.prefill_us      = t_prefill_done - q.t_tokenized;
+    q.tel.first_sample_us = q.t_first - t_prefill_done;
+    q.tel.sample_us       = q.tel.first_sample_us;
+    q.tel.first_token_us  = q.t_first - q.req->t_submit_us;
+    q.decoding = true;
+    if (!s->draft && s->lookup_ngram > 0) q.lookup.reset(s->lookup_ngram, seq_tokens(s, q.id));
+    seq_accept(g, q, first);
+}
+
+// After the batch decoded `next` (+ drafts): sample every row in order and keep drafts only
+// while they equal what the target samples. The sampler sees exactly the calls plain decoding
+// would make, so the stream is identical with or without drafting.
+static void seq_verify(llama_session *s, const gen_sched& g, gen_seq& q) {
+    auto &tokens = seq_tokens(s, q.id);
+    const bool use_lookup = !s->draft && s->lookup_ngram > 0;
+    tokens.push_back(q.next);
+    if (use_lookup) q.lookup.push(q.next);
+
+    int32_t n_ok = 0;
+    llama_token tok;
+    for (int32_t k = 0; ; ++k) {
+        const int64_t t0 = ggml_time_us();
+        tok = llama_sampler_sample(q.sampler, s->ctx, q.i_batch + k);
+        q.tel.sample_us += ggml_time_us() - t0;
+        if (k == (int32_t) q.drafts.size() || tok != q.drafts[k]) break;
+        // Draft confirmed: it is already in the KV cache
+        if (!seq_emit(g, q, tok)) { q.done = true; break; }
+        tokens.push_back(tok);
+        if (use_lookup) q.lookup.push(tok);
+        ++n_ok;
+        if (++q.n_gen >= q.req->max_tokens) { q.done = true; break; }
+    }
+
+    if (!q.drafts.empty()) {
+        int32_t *n_draft = s->draft ? &s->n_draft : &s->lookup_draft;
+        q.tel.drafted_tokens  += (int32_t) q.drafts.size();
+        q.tel.accepted_tokens += n_ok;
+        adapt_draft_len(n_draft, s->draft ? s->n_draft_max : s->lookup_draft_max, (int32_t) q.drafts.size(), n_ok);
+        // Drop the rejected tail so the KV matches the token list
+        if (!llama_memory_seq_rm(llama_get_memory(s->ctx), q.id, (llama_pos) tokens.size(), -1)) {
+            seq_evict(s, q.id);
+            q.done = true;
+            q.status = GEN_FAILED;
+            return;
+        }
+    }
+    if (!q.done) seq_accept(g, q, tok);
+}
+
+// Adds `q`'s work for this step to the batch: the pending token (plus drafts when it is the
+// only active sequence) while decoding, otherwise the next prompt chunk that fits.
+static void seq_fill_batch(llama_session *s, gen_sched& g, gen_seq& q, bool solo) {
+    llama_batch &batch = g.batch;
+    auto &tokens = seq_tokens(s, q.id);
+    const int32_t n_past = (int32_t) tokens.size();
+    q.i_batch = -1;
+    q.n_chunk = 0;
+
+    auto add = [&](llama_token tok, llama_pos pos, bool logits) {
+        const int32_t i = batch.n_tokens++;
+        batch.token[i]     = tok;
+        batch.pos[i]       = pos;
+        batch.n_seq_id[i]  = 1;
+        batch.seq_id[i][0] = q.id;
+        batch.logits[i]    = logits ? 1 : 0;
+    };
+
+    if (q.decoding) {
+        q.drafts.clear();
+        const int32_t room = std::min<int32_t>({q.req->max_tokens - q.n_gen,
+                                                (int32_t) llama_n_ctx(s->ctx) - n_past - 1,
+                                                g.n_batch - batch.n_tokens - 1});
+        if (solo && room > 0) {
+            if (s->draft && g.has_draft_batch) {
+                q.drafts = draft_generate(s->draft, tokens, q.next, std::min(s->n_draft, room), g.draft_batch, g.n_batch);
+            } else if (!s->draft && s->lookup_ngram > 0) {
+                q.drafts = q.lookup.draft(std::min(s->lookup_draft, room));
+            }
+        }
+        q.i_batch = batch.n_tokens;
+        add(q.next, n_past, true);
+        for (size_t k = 0; k < q.drafts.size(); ++k) add(q.drafts[k], n_past + 1 + (llama_pos) k, true);
+        return;
+    }
+
+    const int32_t ntok = (int32_t) q.prompt.size();
+    q.n_chunk = std::min(g.n_batch - batch.n_tokens, ntok - n_past);
+    for (int32_t k = 0; k < q.n_chunk; ++k) {
+        const int32_t pos = n_past + k;
+        if (pos == ntok - 1) q.i_batch = batch.n_tokens;
+        add(q.prompt[pos], pos, pos == ntok - 1);
+    }
+}
+
+// Nearest-rank percentile of an ascending list
+static int64_t percentile_sorted(const std::vector<int32_t>& v, int pct) {
+    if (v.empty()) return 0;
+    const size_t rank = (v.size() * (size_t) pct + 99) / 100;
+    return v[std::max<size_t>(rank, 1) - 1];
+}
+
+// Fills in the totals and context state for a sequence that just finished
+static void seq_telemetry(llama_session *s, gen_seq& q) {
+    gen_telemetry &t = q.tel;
+    const int64_t now = ggml_time_us();
+    t.status           = q.status;
+    t.prompt_tokens    = (int32_t) q.prompt.size();
+    t.reused_tokens    = q.n_reused;
+    t.prefilled_tokens = q.prompt.empty() ? 0 : (int32_t) q.prompt.size() - q.n_reused;
+    t.generated_tokens = q.n_gen;
+    t.decode_us        = q.t_first > 0 ? now - q.t_first : 0;
+    t.total_us         = now - q.req->t_submit_us;
+
+    std::vector<int32_t> sorted(t.token_us);
+    std::sort(sorted.begin(), sorted.end());
+    t.latency_p50_us = percentile_sorted(sorted, 50);
+    t.latency_p95_us = percentile_sorted(sorted, 95);
+    t.latency_p99_us = percentile_sorted(sorted, 99);
+    for (int32_t us : t.token_us) {
+        int32_t b = 0;
+        while (b < GEN_LATENCY_BUCKETS - 1 && us >= (1000 << b)) ++b;
+        ++t.latency_hist[b];
+    }
+
+    llama_memory_t mem = llama_get_memory(s->ctx);
+    t.kv_cells_used = 0;
+    for (llama_seq_id seq = 0; seq < (llama_seq_id) llama_n_seq_max(s->ctx); ++seq) {
+        const llama_pos p_max = llama_memory_seq_pos_max(mem, seq);
+        if (p_max >= 0) t.kv_cells_used += p_max - llama_memory_seq_pos_min(mem, seq) + 1;
+    }
+    t.kv_cells_total  = (int32_t) llama_n_ctx(s->ctx);
+    t.n_threads       = llama_n_threads(s->ctx);
+    t.n_threads_batch = llama_n_threads_batch(s->ctx);
+    t.n_batch         = (int32_t) llama_n_batch(s->ctx);
+    t.n_ubatch        = (int32_t) llama_n_ubatch(s->ctx);
+}
+
+static void seq_finish(llama_session *s, gen_seq& q) {
+    seq_telemetry(s, q);
+    const gen_telemetry &t = q.tel;
+    if (t.context_shifts > 0) {
+        LOGI("Seq %d: %d context shifts discarded %d tokens", q.id, t.context_shifts, t.discarded_tokens);
+    }
+    if (t.drafted_tokens > 0) {
+        LOGI("%s: accepted %d of %d drafted tokens (n_draft now %d)", s->draft ? "Speculative" : "Prompt lookup",
+             t.accepted_tokens, t.drafted_tokens, s->draft ? s->n_draft : s->lookup_draft);
+    }
+    LOGI("Seq %d: prompt %d (+%d reused) in %.1f ms / %d ubatches, first token %.1f ms, "
+         "%d tokens in %.1f ms (p50 %.1f p95 %.1f ms), KV %d/%d, threads %d/%d",
+         q.id, t.prefilled_tokens, t.reused_tokens, t.prefill_us / 1000.0, t.prefill_ubatches,
+         t.first_token_us / 1000.0, t.generated_tokens, t.decode_us / 1000.0,
+         t.latency_p50_us / 1000.0, t.latency_p95_us / 1000.0,
+         t.kv_cells_used, t.kv_cells_total, t.n_threads, t.n_threads_batch);
+    text_stream_flush(q.text, &q.out);
+    if (!q.out.empty() && q.req->cb.on_token) q.req->cb.on_token(q.out);
+    if (q.req->cb.on_telemetry) q.req->cb.on_telemetry(t);
+    if (q.sampler) llama_sampler_free(q.sampler);
+    q.sampler = nullptr;
+    if (q.status == GEN_CANCELLED) LOGI("Seq %d cancelled after %d tokens", q.id, q.n_gen);
+    else if (q.status == GEN_FAILED) LOGE("Seq %d failed after %d tokens", q.id, q.n_gen);
+    else LOGI("Seq %d completed: %d tokens", q.id, q.n_gen);
+}
+
+// One scheduler step over all active sequences: a single llama_decode carrying every pending
+// token and as much prompt as fits, then per-sequence sampling and stop handling.
+static void sched_step(llama_session *s, gen_sched& g, std::vector<gen_seq>& active) {
+    const int32_t n_ctx = (int32_t) llama_n_ctx(s->ctx);
+    for (auto &q : active) {
+        if (!q.done && q.req->cancel.load(std::memory_order_relaxed)) {
+            q.done = true;
+            q.status = GEN_CANCELLED;
+        }
+        // The pending token needs a position inside the window
+        if (!q.done && q.decoding && (int32_t) seq_tokens(s, q.id).size() + 1 >= n_ctx && !seq_shift(s, q)) {
+            LOGE("Seq %d: context full and the KV cache can't shift", q.id);
+            q.done = true;
+            q.status = GEN_FAILED;
+        }
+    }
+
+    batch_clear_compat(&g.batch);
+    int32_t n_live = 0;
+    for (auto &q : active) n_live += q.done ? 0 : 1;
+    // Decoding sequences first so a long prompt never starves them
+    for (int pass = 0; pass < 2; ++pass) {
+        for (auto &q : active) {
+            if (q.done || q.decoding != (pass == 0)) continue;
+            if (g.batch.n_tokens >= g.n_batch) { q.i_batch = -1; q.n_chunk = 0; continue; }
+            seq_fill_batch(s, g, q, n_live == 1);
+        }
+    }
+    if (g.batch.n_tokens == 0) return;
+
+    // The worker is the main thread of whichever pool computes this batch (one-token ubatches
+    // go to the decode pool): keep it on that pool's cores and park the other pool
+    const int32_t pool = g.batch.n_tokens > 1 ? 1 : 0;
+    if (pool != g.placed && s->tp_decode) {
+        thread_place(pool ? s->threads.batch : s->threads.decode);
+        ggml_threadpool_pause(pool ? s->tp_decode : s->tp_batch);
+        g.placed = pool;
+    }
+    const int32_t ret = llama_decode(s->ctx, g.batch);
+    if (ret == 1) {
+        // Out of KV cells: drop idle sequences' cached prompts first, then slide the longest
+        // decoding sequence's window, and only then drop the newest lowest-priority active
+        // sequence. Nothing was committed, so the next step retries.
+        std::vector<bool> used(llama_n_seq_max(s->ctx), false);
+        for (auto &q : active) used[q.id] = !q.done;
+        bool freed = false;
+        for (llama_seq_id seq = 0; seq < (llama_seq_id) used.size(); ++seq) {
+            if (!used[seq] && !seq_tokens(s, seq).empty()) {
+                seq_evict(s, seq);
+                freed = true;
+            }
+        }
+        if (freed) return;
+        gen_seq *longest = nullptr;
+        for (auto &q : active) {
+            if (!q.done && q.decoding && (!longest || seq_tokens(s, q.id).size() > seq_tokens(s, longest->id).size())) longest = &q;
+        }
+        if (longest && seq_shift(s, *longest)) return;
+        gen_seq *victim = nullptr;
+        for (auto &q : active) {
+            if (!q.done && (!victim || q.req->priority <= victim->req->priority)) victim = &q;
+        }
+        if (victim) {
+            LOGE("KV cache full, dropping seq %d", victim->id);
+            seq_evict(s, victim->id);
+            victim->done = true;
+            victim->status = GEN_FAILED;
+        }
+        return;
+    }
+    if (ret != 0) {
+        LOGE("Streaming decode failed (%d)", ret);
+        session_reset(s);
+        for (auto &q : active) {
+            if (!q.done) { q.done = true; q.status = GEN_FAILED; }
+        }
+        return;
+    }
+
+    const int32_t n_ubatch = (int32_t) llama_n_ubatch(s->ctx);
+    for (auto &q : active) {
+        if (q.done) continue;
+        if (q.decoding) {
+            if (q.i_batch >= 0) ++q.tel.decode_steps;
+        } else if (q.n_chunk > 0) {
+            q.tel.prefill_ubatches += (q.n_chunk + n_ubatch - 1) / n_ubatch;
+        }
+    }
+    for (auto &q : active) {
+        if (q.done) continue;
+        if (q.decoding) {
+            if (q.i_batch >= 0) seq_verify(s, g, q);
+        } else if (q.n_chunk > 0) {
+            auto &tokens = seq_tokens(s, q.id);
+            tokens.insert(tokens.end(), q.prompt.begin() + tokens.size(), q.prompt.begin() + tokens.size() + q.n_chunk);
+            if (tokens.size() == q.prompt.size()) seq_first_token(s, g, q);
+        }
+    }
+}
+
+// ---------- generation worker ----------
+
+static std::atomic<int64_t> g_next_request_id{1};
+
+// Heap order: higher priority first, then submission order
+static bool request_after(const std::shared_ptr<gen_request>& a, const std::shared_ptr<gen_request>& b) {
+    if (a->priority != b->priority) return a->priority < b->priority;
+    return a->seq > b->seq;
+}
+
+static void request_complete(const std::shared_ptr<gen_request>& req, gen_status status) {
+    if (req->cb.on_complete) req->cb.on_complete(status);
+    req->cb = gen_callbacks{};
+}
+
+// Admits queued requests into free sequences and runs batched steps until nothing is left.
+// session->busy is held while any sequence is active, so other context operations wait for
+// an idle worker instead of pulling the KV cache from under a generation.
+static void worker_loop(llama_session *session) {
+    gen_worker *w = session->worker;
+    if (w->on_thread_start) w->on_thread_start();
+
+    const size_t n_seq = (size_t) llama_n_seq_max(session->ctx);
+    std::vector<gen_seq> active;
+    std::unique_lock<std::mutex> busy(session->busy, std::defer_lock);
+    gen_sched g;
+
+    for (;;) {
+        std::vector<std::shared_ptr<gen_request>> admitted;
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(w->mutex);
+            if (active.empty()) {
+                if (busy.owns_lock()) {
+                    sched_free(g);
+                    busy.unlock();
+                }
+                w->cv.wait(lock, [w] { return w->stop || !w->queue.empty(); });
+            }
+            stopping = w->stop;
+            while (!stopping && active.size() + admitted.size() < n_seq && !w->queue.empty()) {
+                std::pop_heap(w->queue.begin(), w->queue.end(), request_after);
+                admitted.push_back(std::move(w->queue.back()));
+                w->queue.pop_back();
+                w->running.push_back(admitted.back());
+            }
+        }
+        if (stopping) {
+            // worker_stop completes whatever is still queued
+            for (auto &q : active) {
+                if (!q.done) { q.done = true; q.status = GEN_CANCELLED; }
+            }
+        } else if (!busy.owns_lock()) {
+            busy.lock();
+            sched_init(session, g);
+        }
+
+        for (auto &req : admitted) {
+            std::vector<bool> used(n_seq, false);
+            for (auto &q : active) used[q.id] = true;
+            gen_seq q;
+            q.req = req;
+            q.text.stops = req->stop;
+            if (req->cancel.load()) {
+                q.done = true;
+                q.status = GEN_CANCELLED;
+            } else if (!seq_begin(session, g, q, used)) {
+                q.done = true;
+                q.status = GEN_FAILED;
+            }
+            active.push_back(std::move(q));
+        }
+
+        if (!stopping) sched_step(session, g, active);
+
+        // Retire finished sequences; their tokens stay cached in the KV for prefix reuse
+        for (size_t i = 0; i < active.size(); ) {
+            if (!active[i].done) { ++i; continue; }
+            gen_seq q = std::move(active[i]);
+            active.erase(active.begin() + (long) i);
+            seq_finish(session, q);
+            if (q.req->priority >= session->state_priority) {
+                session->state_seq = q.id;
+                session->state_priority = q.req->priority;
+            }
+            {
+                std::lock_guard<std::mutex> lock(w->mutex);
+                w->running.erase(std::find(w->running.begin(), w->running.end(), q.req));
+            }
+            request_complete(q.req, q.status);
+        }
+        if (stopping) break;
+    }
+    if (busy.owns_lock()) {
+        sched_free(g);
+        busy.unlock();
+    }
+    if (w->on_thread_stop) w->on_thread_stop();
+}
+
+// Cancels the running requests, completes the queued ones as cancelled and joins the thread
+void worker_stop(llama_session *session) {
+    gen_worker *w = session->worker;
+    if (!w) return;
+    std::vector<std::shared_ptr<gen_request>> pending;
+    {
+        std::lock_guard<std::mutex> lock(w->mutex);
+        w->stop = true;
+        for (auto &req : w->running) req->cancel = true;
+        pending.swap(w->queue);
+    }
+    w->cv.notify_all();
+    if (w->thread.joinable()) w->thread.join();
+    for (auto &req : pending) request_complete(req, GEN_CANCELLED);
+    delete w;
+    session->worker = nullptr;
+}
+
+// Queues a request on the session's worker (starting it if needed) and returns its id
+int64_t worker_submit(llama_session *session, std::shared_ptr<gen_request> req,
+                      const std::function<gen_worker *()>& make_worker) {
+    static std::mutex create_mutex;
+    req->id = g_next_request_id.fetch_add(1);
+    req->t_submit_us = ggml_time_us();
+    gen_worker *w;
+    {
+        std::lock_guard<std::mutex> lock(create_mutex);
+        if (!session->worker) {
+            session->worker = make_worker();
+            session->worker->thread = std::thread(worker_loop, session);
+        }
+        w = session->worker;
+    }
+    {
+        std::lock_guard<std::mutex> lock(w->mutex);
+        req->seq = w->next_seq++;
+        w->queue.push_back(req);
+        std::push_heap(w->queue.begin(), w->queue.end(), request_after);
+    }
+    w->cv.notify_one();
+    return req->id;
+}
+
+// A running request stops before its next decode step; a queued one is removed and completed
+// on the calling thread. Returns false if the request already finished.
+bool worker_cancel(llama_session *session, int64_t request_id) {
+    gen_worker *w = session->worker;
+    if (!w) return false;
+    std::shared_ptr<gen_request> removed;
+    {
+        std::lock_guard<std::mutex> lock(w->mutex);
+        for (auto &req : w->running) {
+            if (req->id == request_id) {
+                req->cancel = true;
+                return true;
+            }
+        }
+        auto it = std::find_if(w->queue.begin(), w->queue.end(),
+                               [request_id](const std::shared_ptr<gen_request>& r) { return r->id == request_id; });
+        if (it == w->queue.end()) return false;
+        removed = std::move(*it);
+        w->queue.erase(it);
+        std::make_heap(w->queue.begin(), w->queue.end(), request_after);
+    }
+    request_complete(removed, GEN_CANCELLED);
+    return true;
+}
+
+// ---------- embeddings ----------
+
+llama_embedder *embedder_create(const std::string& path, int threads, std::string *error) {
+    llama_model *model = model_acquire(path, /*use_mmap=*/true, /*use_mlock=*/false, /*prefetch=*/true);
+    if (!model) {
+        *error = "Failed to load embedding model";
+        return nullptr;
+    }
+    if (llama_model_has_encoder(model) && llama_model_has_decoder(model)) {
+        model_release(model);
+        *error = "Encoder-decoder models are not supported for embeddings";
+        return nullptr;
+    }
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 2048;
+    cparams.n_batch         = 2048;
+    cparams.n_ubatch        = 2048;
+    cparams.n_seq_max       = 32;
+    cparams.kv_unified      = true;   // sequences share the n_ctx budget of one batch
+    cparams.embeddings      = true;
+    cparams.pooling_type    = LLAMA_POOLING_TYPE_UNSPECIFIED; // model default (mean/cls/last)
+    cparams.n_threads       = threads;
+    cparams.n_threads_batch = threads;
+
+    llama_context *ctx = llama_init_from_model(model, cparams);
+    if (ctx && (llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE ||
+                llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_RANK)) {
+        // We need one vector per text; fall back to mean pooling for models without a pooling head
+        llama_free(ctx);
+        cparams.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        ctx = llama_init_from_model(model, cparams);
+    }
+    if (!ctx) {
+        model_release(model);
+        *error = "Failed to init embedding context";
+        return nullptr;
+    }
+    llama_set_embeddings(ctx, true);
+
+    auto *emb = new llama_embedder();
+    emb->ctx       = ctx;
+    emb->n_embd    = llama_model_n_embd(model);
+    emb->n_batch   = (int32_t) llama_n_batch(ctx);
+    emb->n_seq_max = (int32_t) llama_n_seq_max(ctx);
+    emb->n_max_tok = std::min(emb->n_batch, llama_model_n_ctx_train(model));
+    LOGI("Embedding context initialized (dim=%d, pooling=%d, batch=%d, seqs=%d, threads=%d)",
+         emb->n_embd, (int) llama_pooling_type(ctx), emb->n_batch, emb->n_seq_max, threads);
+    return emb;
+}
+
+void embedder_free(llama_embedder *emb) {
+    if (!emb) return;
+    const llama_model *model = llama_get_model(emb->ctx);
+    llama_free(emb->ctx);
+    model_release(model);
+    delete emb;
+    LOGI("Embedding context freed");
+}
+
+// Decode the packed sequences and write each pooled, L2-normalized vector to its output row
+static bool embed_flush(llama_embedder* emb, llama_batch& batch, std::vector<int32_t>& rows, float* out) {
+    if (rows.empty()) return true;
+    // Embeddings don't depend on earlier batches; drop whatever a causal model left behind
+    llama_memory_t mem = llama_get_memory(emb->ctx);
+    if (mem) llama_memory_clear(mem, true);
+
+    const bool ok = llama_decode(emb->ctx, batch) == 0;
+    for (size_t s = 0; ok && s < rows.size(); ++s) {
+        const float *v = llama_get_embeddings_seq(emb->ctx, (llama_seq_id) s);
+        if (!v) continue;
+        float *dst = out + (size_t) rows[s] * emb->n_embd;
+        double sum = 0.0;
+        for (int i = 0; i < emb->n_embd; ++i) sum += (double) v[i] * v[i];
+        const float inv = sum > 0.0 ? (float) (1.0 / std::sqrt(sum)) : 0.0f;
+        for (int i = 0; i < emb->n_embd; ++i) dst[i] = v[i] * inv;
+    }
+    batch_clear_compat(&batch);
+    rows.clear();
+    return ok;
+}
+
+bool embedder_embed(llama_embedder *emb, const std::vector<std::string>& texts, std::vector<float> *out) {
+    const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(emb->ctx));
+    std::vector<std::vector<llama_token>> tokens(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        tokens[i] = tokenize_plain(vocab, texts[i].data(), (int32_t) texts[i].size());
+    }
+    return embedder_embed_tokens(emb, tokens, out);
+}
+
+bool embedder_embed_tokens(llama_embedder *emb, const std::vector<std::vector<llama_token>>& texts,
+                           std::vector<float> *out) {
+    const int32_t n_texts = (int32_t) texts.size();
+    out->assign((size_t) n_texts * emb->n_embd, 0.0f);
+
+    const int64_t t0 = ggml_time_us();
+    llama_batch batch = llama_batch_init(emb->n_batch, 0, 1);
+    std::vector<int32_t> rows;
+    int n_decodes = 0;
+    bool ok = true;
+
+    for (int32_t i = 0; i < n_texts && ok; ++i) {
+        const std::vector<llama_token>& tokens = texts[i];
+        if (tokens.empty()) continue;
+        const int32_t ntok = std::min((int32_t) tokens.size(), emb->n_max_tok);
+
+        if (batch.n_tokens + ntok > emb->n_batch || (int32_t) rows.size() == emb->n_seq_max) {
+            ok = embed_flush(emb, batch, rows, out->data());
+            ++n_decodes;
+        }
+        const llama_seq_id seq = (llama_seq_id) rows.size();
+        for (int32_t p = 0; p < ntok; ++p) {
+            const int32_t k = batch.n_tokens++;
+            batch.token[k]     = tokens[p];
+            batch.pos[k]       = p;
+            batch.n_seq_id[k]  = 1;
+            batch.seq_id[k][0] = seq;
+            batch.logits[k]    = 1;
+        }
+        rows.push_back(i);
+    }
+    if (ok && !rows.empty()) {
+        ok = embed_flush(emb, batch, rows, out->data());
+        ++n_decodes;
+    }
+    llama_batch_free(batch);
+
+    if (!ok) {
+        LOGE("Embedding decode failed");
+        return false;
+    }
+    LOGI("Embedded %d texts in %d decodes, %lld ms", (int) n_texts, n_decodes,
+         (long long) (ggml_time_us() - t0) / 1000);
+    return true;
+}
+
+// ---------- ingestion ----------
+
+// Content tokens only: chunk boundaries decide where the model's special tokens go
+static std::vector<llama_token> tokenize_content(const llama_vocab *vocab, const char *text, size_t len) {
+    int32_t needed = llama_tokenize(vocab, text, (int32_t) len, nullptr, 0, /*add_special=*/false, /*parse_special=*/false);
+    if (needed < 0) needed = -needed;
+    std::vector<llama_token> out(needed);
+    const int32_t got = llama_tokenize(vocab, text, (int32_t) len, out.data(), (int32_t) out.size(), false, false);
+    out.resize(got < 0 ? 0 : got);
+    return out;
+}
+
+static std::string detokenize(const llama_vocab *vocab, const llama_token *tokens, int32_t n) {
+    std::string out((size_t) n * 4 + 16, '\0');
+    int32_t got = llama_detokenize(vocab, tokens, n, &out[0], (int32_t) out.size(), /*remove_special=*/false,
+                                   /*unparse_special=*/false);
+    if (got < 0) {
+        out.resize((size_t) -got);
+        got = llama_detokenize(vocab, tokens, n, &out[0], (int32_t) out.size(), false, false);
+    }
+    out.resize(got < 0 ? 0 : (size_t) got);
+    const size_t b = out.find_first_not_of(" \t\r\n");
+    const size_t e = out.find_last_not_of(" \t\r\n");
+    return b == std::string::npos ? std::string() : out.substr(b, e - b + 1);
+}
+
+// Single producer, single consumer; the producer blocks while the queue is full
+struct chunk_queue {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<ingest_chunk> items;
+    size_t capacity = 1;
+    bool done = false;        // producer finished
+    bool cancelled = false;   // consumer stopped early
+
+    bool push(ingest_chunk&& c) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return items.size() < capacity || cancelled; });
+        if (cancelled) return false;
+        items.push_back(std::move(c));
+        cv.notify_all();
+        return true;
+    }
+    bool pop(ingest_chunk *out) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return !items.empty() || done; });
+        if (items.empty()) return false;
+        *out = std::move(items.front());
+        items.pop_front();
+        cv.notify_all();
+        return true;
+    }
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        cv.notify_all();
+    }
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        cv.notify_all();
+    }
+};
+
+// Cuts a token stream into overlapping chunks. Once a chunk has min_tok tokens of its own it
+// ends at a paragraph break, or at a sentence end picked by a hash of the last few tokens
+// (1 in 4): cut points depend only on the nearby text, so after an edit the chunking falls
+// back in step with the old one within a chunk or two. Without such a point by max_tok it
+// ends at the last sentence end seen, or right there.
+struct ingest_chunker {
+    static constexpr int32_t WINDOW = 4;
+
+    const llama_vocab *vocab = nullptr;
+    std::vector<llama_token> prefix, suffix;    // the model's special tokens around each text
+    int32_t min_tok = 0;
+    int32_t max_tok = 0;
+    int32_t overlap = 0;
+    std::function<bool(ingest_chunk&&)> emit;   // false once the consumer stopped
+
+    std::vector<llama_token> cur;
+    int32_t n_overlap = 0;                      // leading tokens of cur repeated from the last chunk
+    int32_t last_sentence = 0;                  // cur length after the latest sentence end (0 = none)
+    llama_token window[WINDOW] = {};
+    uint64_t n_seen = 0;
+    bool prev_newline = false;
+    int32_t index = 0;
+    std::string piece;
+
+    bool push(llama_token tok) {
+        cur.push_back(tok);
+        window[n_seen++ % WINDOW] = tok;
+        token_to_piece(vocab, tok, &piece);
+        const size_t last = piece.find_last_not_of(" \t\r\n");
+        const bool newline   = piece.find('\n') != std::string::npos;
+        const bool ends_line = newline && (last == std::string::npos || piece.find('\n', last) != std::string::npos);
+        const bool paragraph = newline && (prev_newline || piece.find("\n\n") != std::string::npos);
+        const bool sentence  = newline || (last != std::string::npos && strchr(".!?", piece[last]) != nullptr);
+        prev_newline = ends_line;
+
+        const int32_t len = (int32_t) cur.size() - n_overlap;
+        if (sentence) {
+            if (len >= min_tok && (paragraph || window_hash() % 4 == 0)) return cut((int32_t) cur.size());
+            last_sentence = (int32_t) cur.size();
+        }
+        if (len >= max_tok) {
+            return cut(last_sentence - n_overlap >= min_tok / 2 ? last_sentence : (int32_t) cur.size());
+        }
+        return true;
+    }
+
+    bool finish() {
+        return (int32_t) cur.size() > n_overlap ? cut((int32_t) cur.size()) : true;
+    }
+
+    uint64_t window_hash() const {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (int32_t i = 0; i < WINDOW; ++i) {
+            h = (h ^ (uint32_t) window[(n_seen + i) % WINDOW]) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    bool word_start(int32_t i) {
+        token_to_piece(vocab, cur[i], &piece);
+        return !piece.empty() && isspace((unsigned char) piece[0]);
+    }
+
+    // Emits cur[0, n); the next chunk starts with its last `overlap` tokens and what follows
+    bool cut(int32_t n) {
+        ingest_chunk c;
+        c.index = index++;
+        c.tokens.reserve(prefix.size() + n + suffix.size());
+        c.tokens.insert(c.tokens.end(), prefix.begin(), prefix.end());
+        c.tokens.insert(c.tokens.end(), cur.begin(), cur.begin() + n);
+        c.tokens.insert(c.tokens.end(), suffix.begin(), suffix.end());
+        c.hash = 0xcbf29ce484222325ULL;
+        for (llama_token t : c.tokens) c.hash = (c.hash ^ (uint32_t) t) * 0x100000001b3ULL;
+        c.text = detokenize(vocab, cur.data(), n);
+
+        // The overlap starts on a word so the next chunk's text doesn't open mid-word
+        int32_t from = std::max(0, n - overlap);
+        while (from < n && !word_start(from)) ++from;
+        const int32_t keep = from < n ? n - from : 0;
+        cur.erase(cur.begin(), cur.begin() + (n - keep));
+        n_overlap = keep;
+        last_sentence = 0;
+        return emit(std::move(c));
+    }
+};
+
+// Reads through `read_some` (bytes written, 0 at the end, < 0 on error) on a helper thread that
+// tokenizes and chunks; the calling thread embeds full batches and runs the callbacks
+static bool ingest_run(llama_embedder *emb, const std::function<ssize_t(char *, size_t)>& read_some,
+                       uint64_t total, const ingest_config& cfg, const std::unordered_set<uint64_t>& known,
+                       const ingest_callbacks& cb, ingest_stats *stats, std::string *error) {
+    const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(emb->ctx));
+    const int64_t t0 = ggml_time_us();
+    ingest_stats st;
+    st.bytes_total = total;
+
+    ingest_chunker ck;
+    ck.vocab = vocab;
+    {
+        // Whatever add_special puts around a one-word text goes around every chunk
+        const std::vector<llama_token> with = tokenize_plain(vocab, "a", 1);
+        const std::vector<llama_token> bare = tokenize_content(vocab, "a", 1);
+        const auto it = std::search(with.begin(), with.end(), bare.begin(), bare.end());
+        if (!bare.empty() && it != with.end()) {
+            ck.prefix.assign(with.begin(), it);
+            ck.suffix.assign(it + (ptrdiff_t) bare.size(), with.end());
+        }
+    }
+    const int32_t limit = std::max(8, emb->n_max_tok - (int32_t) (ck.prefix.size() + ck.suffix.size()));
+    const int32_t target = std::max(8, std::min(cfg.chunk_tokens, limit));
+    ck.overlap = std::max(0, std::min(cfg.overlap_tokens, std::min(target / 2, limit / 4)));
+    ck.max_tok = std::max(1, std::min(target + target / 2, limit - ck.overlap));
+    ck.min_tok = std::min(target / 2, ck.max_tok);
+
+    chunk_queue queue;
+    queue.capacity = std::max<size_t>(1, cfg.queue_chunks);
+    ck.emit = [&queue](ingest_chunk&& c) { return queue.push(std::move(c)); };
+
+    std::atomic<uint64_t> bytes_read{0};
+    std::string read_error;
+    std::thread producer([&] {
+        std::vector<char> buf(std::max<size_t>(cfg.buffer_bytes, 256));
+        std::string pending;
+        bool ok = true, eof = false;
+        while (ok && !eof) {
+            const ssize_t n = read_some(buf.data(), buf.size());
+            if (n < 0) {
+                read_error = "Failed to read the document";
+                break;
+            }
+            eof = n == 0;
+            pending.append(buf.data(), (size_t) n);
+            bytes_read += (uint64_t) n;
+
+            // Line by line, so a line tokenizes the same wherever the reads happen to fall
+            size_t start = 0;
+            while (ok) {
+                const size_t nl = pending.find('\n', start);
+                size_t end = nl == std::string::npos ? start : nl + 1;
+                if (nl == std::string::npos && eof) {
+                    end = pending.size();
+                } else if (nl == std::string::npos && pending.size() - start >= buf.size()) {
+                    // A line longer than the buffer: after its last space, else on a character boundary
+                    const size_t sp = pending.find_last_of(" \t");
+                    end = sp != std::string::npos && sp > start
+                        ? sp + 1 : start + utf8_complete_len(pending.data() + start, pending.size() - start);
+                }
+                if (end == start) break;
+                for (llama_token tok : tokenize_content(vocab, pending.data() + start, end - start)) {
+                    if (!(ok = ck.push(tok))) break;
+                }
+                start = end;
+            }
+            pending.erase(0, start);
+        }
+        if (ok && read_error.empty()) ck.finish();
+        queue.finish();
+    });
+
+    const auto progress = [&]() {
+        st.bytes_read = bytes_read;
+        st.t_us = ggml_time_us() - t0;
+        if (cb.on_progress) cb.on_progress(st);
+    };
+
+    std::unordered_set<uint64_t> seen;
+    std::vector<ingest_chunk> batch;
+    std::vector<std::vector<llama_token>> inputs;
+    std::vector<float> vectors;
+    int32_t batch_tokens = 0;
+    bool ok = true, cancelled = false;
+
+    const auto flush = [&]() {
+        if (batch.empty()) return;
+        inputs.clear();
+        for (const ingest_chunk& c : batch) inputs.push_back(c.tokens);
+        if (!embedder_embed_tokens(emb, inputs, &vectors)) {
+            *error = "Embedding decode failed";
+            ok = false;
+            return;
+        }
+        for (size_t i = 0; i < batch.size() && !cancelled; ++i) {
+            ++st.embedded;
+            cancelled = !cb.on_chunk(batch[i], vectors.data() + i * (size_t) emb->n_embd);
+        }
+        batch.clear();
+        batch_tokens = 0;
+        progress();
+    };
+
+    ingest_chunk c;
+    while (ok && !cancelled && queue.pop(&c)) {
+        ++st.chunks;
+        if (known.count(c.hash) || !seen.insert(c.hash).second) {
+            ++st.reused;
+            cancelled = !cb.on_chunk(c, nullptr);
+            if (st.reused % 16 == 0) progress();
+            continue;
+        }
+        const int32_t ntok = std::min((int32_t) c.tokens.size(), emb->n_max_tok);
+        if (!batch.empty() && (batch_tokens + ntok > emb->n_batch || (int32_t) batch.size() == emb->n_seq_max)) {
+            flush();
+        }
+        batch_tokens += ntok;
+        batch.push_back(std::move(c));
+    }
+    if (ok && !cancelled) flush();
+    queue.cancel();   // unblocks the producer if we stopped early
+    producer.join();
+
+    if (!read_error.empty()) {
+        *error = read_error;
+        ok = false;
+    }
+    progress();
+    if (stats) *stats = st;
+    LOGI("Ingested %llu bytes: %d chunks, %d embedded, %d reused, %lld ms%s",
+         (unsigned long long) st.bytes_read, st.chunks, st.embedded, st.reused,
+         (long long) st.t_us / 1000, cancelled ? " (cancelled)" : "");
+    return ok;
+}
+
+bool ingest_file(llama_embedder *emb, const std::string& path, const ingest_config& cfg,
+                 const std::unordered_set<uint64_t>& known, const ingest_callbacks& cb,
+                 ingest_stats *stats, std::string *error) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        *error = "Failed to open " + path;
+        return false;
+    }
+    struct stat st{};
+    fstat(fd, &st);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    const bool ok = ingest_run(emb, [fd](char *dst, size_t cap) {
+        ssize_t n;
+        do { n = read(fd, dst, cap); } while (n < 0 && errno == EINTR);
+        return n;
+    }, (uint64_t) st.st_size, cfg, known, cb, stats, error);
+    close(fd);
+    return ok;
+}
+
+bool ingest_text(llama_embedder *emb, const char *text, size_t len, const ingest_config& cfg,
+                 const std::unordered_set<uint64_t>& known, const ingest_callbacks& cb,
+                 ingest_stats *stats, std::string *error) {
+    size_t off = 0;
+    return ingest_run(emb, [&](char *dst, size_t cap) {
+        const size_t n = std::min(cap, len - off);
+        memcpy(dst, text + off, n);
+        off += n;
+        return (ssize_t) n;
+    }, (uint64_t) len, cfg, known, cb, stats, error);
+}
@@ -0,0 +1,379 @@
+#pragma once
+
+#include "llama.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Generation core shared by the JNI bindings (llama_jni.cpp) and the host benchmark CLI
+// (bench_main.cpp). Nothing here depends on JNI or Android; logging goes to logcat on
+// Android and to stderr elsewhere.
+
+struct gen_worker;
+
+// LRU of exact token counts keyed by a 64-bit hash of the text (and how it was tokenized), so
+// system prompts, memories and document chunks are only tokenized once per session
+struct token_count_cache {
+    static constexpr size_t CAPACITY = 4096;
+    std::mutex mutex;
+    std::list<std::pair<uint64_t, int32_t>> lru;   // most recently used first
+    std::unordered_map<uint64_t, std::list<std::pair<uint64_t, int32_t>>::iterator> index;
+};
+
+// One ggml threadpool: its thread count, the cores its threads may run on (empty = anywhere)
+// and their nice value. Single-token decode is latency-bound and slows down on little cores
+// while prefill scales with every core, so each session keeps a pool for each.
+struct thread_spec {
+    int32_t n_threads = 1;
+    std::vector<int32_t> cpus;
+    int32_t nice = 0;
+};
+
+struct session_threads {
+    thread_spec decode;   // one-token ubatches
+    thread_spec batch;    // prefill and multi-sequence steps
+};
+
+// What session_calibrate_threads measured for the pools it picked
+struct thread_calibration {
+    session_threads threads;
+    double  decode_ms_per_token  = 0;
+    double  prefill_ms_per_token = 0;
+    int32_t candidates = 0;
+};
+
+// Shape of a chat context. With memory_budget_mb > 0, session_plan_config replaces n_ctx and
+// n_ubatch with the largest pair whose KV cache and compute buffers fit in the budget.
+struct session_config {
+    int32_t   n_ctx      = 1536;
+    int32_t   n_batch    = 256;
+    int32_t   n_ubatch   = 64;
+    ggml_type type_k     = GGML_TYPE_F16;   // f16, q8_0 or q4_0
+    ggml_type type_v     = GGML_TYPE_F16;   // quantized V needs flash attention
+    bool      flash_attn = false;
+    int32_t   memory_budget_mb = 0;
+};
+
+// Memory a chat context allocates besides the weights, estimated from the model's layer and
+// head metadata. The KV figure is exact for plain attention models; the compute-buffer figure
+// approximates the CPU backend's worst-case graph reservation to within about 10%.
+struct session_footprint {
+    int64_t kv_bytes      = 0;
+    int64_t compute_bytes = 0;
+};
+
+// One chat context: the llama_context plus the tokens currently resident in seq 0, so
+// consecutive prompts that share a prefix (system prompt, history) skip re-encoding it.
+struct llama_session {
+    llama_context *ctx = nullptr;
+    std::vector<llama_token> cached;
+    // Same for the worker's extra parallel sequences 1..n_seq_max-1
+    std::vector<std::vector<llama_token>> seq_cached;
+    // Sequence the latest request of the highest priority seen finished on (the chat's), which
+    // session_state_save snapshots; -1 once a lower-priority request had to take it over
+    llama_seq_id state_seq = 0;
+    int32_t state_priority = INT32_MIN;
+    std::string model_path;           // used to fingerprint state snapshots
+    llama_context_params cparams{};   // params the context was created with
+    session_config config;            // resolved shape (budget applied, n_ctx as allocated)
+    session_footprint footprint;
+    session_threads threads;          // pools attached to ctx (and the draft's)
+    ggml_threadpool_t tp_decode = nullptr;
+    ggml_threadpool_t tp_batch  = nullptr;
+
+    // Optional speculative decoding: a small same-vocab draft model proposes tokens that are
+    // verified in one batched target decode. n_draft adapts to the observed acceptance rate.
+    llama_session *draft = nullptr;
+    int32_t n_draft_max = 0;
+    int32_t n_draft     = 0;
+
+    // Prompt-lookup drafting, used when no draft model is attached (lookup_ngram 0 = off)
+    int32_t lookup_ngram     = 0;
+    int32_t lookup_draft_max = 0;
+    int32_t lookup_draft     = 0;
+
+    // Held by whoever is using the context (worker generation, state save/load, reconfigure)
+    std::mutex busy;
+    gen_worker *worker = nullptr;   // started on the first worker_submit
+
+    // Only reads the vocab, so counting never waits for `busy`
+    token_count_cache token_counts;
+};
+
+// Completion codes passed to on_complete (and StreamCallback.onComplete)
+enum gen_status : int32_t {
+    GEN_DONE      = 0,
+    GEN_CANCELLED = 1,
+    GEN_FAILED    = 2,
+};
+
+// Matches LlamaNative.PRIORITY_INTERACTIVE
+static constexpr int32_t GEN_PRIORITY_INTERACTIVE = 10;
+
+// Inter-token latency histogram: bucket i counts gaps below 2^i ms, the last one the rest
+static constexpr int32_t GEN_LATENCY_BUCKETS = 12;
+
+// What one request cost, measured on the worker. Durations are wall-clock microseconds; with
+// several sequences in flight each one's phases include the steps it shared with the others.
+struct gen_telemetry {
+    gen_status status = GEN_DONE;
+
+    int32_t prompt_tokens    = 0;   // tokenized prompt
+    int32_t reused_tokens    = 0;   // prefix already in the KV cache
+    int32_t prefilled_tokens = 0;   // prompt tokens decoded for this request
+    int32_t generated_tokens = 0;   // sampled tokens whose text reached on_token
+    int32_t drafted_tokens   = 0;   // speculative / prompt-lookup drafts
+    int32_t accepted_tokens  = 0;
+    int32_t context_shifts   = 0;   // times the KV window slid forward (prompt truncation included)
+    int32_t discarded_tokens = 0;   // tokens those shifts dropped after n_keep
+
+    int64_t queue_us        = 0;    // submit -> admitted into a sequence
+    int64_t tokenize_us     = 0;
+    int64_t prefill_us      = 0;    // tokenized -> whole prompt in the KV cache
+    int32_t prefill_ubatches = 0;   // n_ubatch-sized pieces the prefill was computed in
+    int64_t first_sample_us = 0;    // sampling the first token
+    int64_t sample_us       = 0;    // all sampling, first token included
+    int64_t decode_us       = 0;    // first token -> finished
+    int32_t decode_steps    = 0;    // llama_decode calls after the first token
+    int64_t first_token_us  = 0;    // submit -> first token sampled
+    int64_t total_us        = 0;    // submit -> finished
+
+    std::vector<int32_t> token_us;  // gap before each token after the first
+    int64_t latency_p50_us = 0, latency_p95_us = 0, latency_p99_us = 0;
+    int32_t latency_hist[GEN_LATENCY_BUCKETS] = {};
+
+    int32_t kv_cells_used  = 0;     // all sequences, when the request finished
+    int32_t kv_cells_total = 0;
+    int32_t n_threads       = 0;    // what the context actually ran with
+    int32_t n_threads_batch = 0;
+    int32_t n_batch  = 0;
+    int32_t n_ubatch = 0;
+};
+
+// Per-request callbacks, invoked on the worker thread. on_token gets the detokenized output as
+// it becomes final: whole UTF-8 characters only, stop strings cut off, so one call may cover
+// part of a token or several. Returning false ends the request. on_telemetry comes right
+// before on_complete for every request that got as far as a sequence; on_complete is always
+// the last call and is made exactly once.
+struct gen_callbacks {
+    std::function<bool(const std::string& text)> on_token;
+    std::function<void(const gen_telemetry& telemetry)> on_telemetry;
+    std::function<void(gen_status status)> on_complete;
+};
+
+// One queued or running generation
+struct gen_request {
+    int64_t id = 0;
+    int32_t priority = 0;
+    uint64_t seq = 0;                 // FIFO order within a priority
+    int64_t t_submit_us = 0;
+    std::string prompt;
+    int32_t max_tokens = 0;
+    int32_t n_keep = 0;               // leading prompt tokens (system turn) context shifts keep
+    std::vector<std::string> stop;    // output ends before the first of these (kept out of on_token)
+    gen_callbacks cb;
+    std::atomic<bool> cancel{false};
+};
+
+// Per-session generation thread. Requests wait in a heap ordered by priority, then arrival,
+// and up to n_seq_max of them decode together, one sequence each, in shared batches.
+// Cancellation is cooperative and checked between decode steps.
+struct gen_worker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::shared_ptr<gen_request>> queue;
+    std::vector<std::shared_ptr<gen_request>> running;
+    uint64_t next_seq = 0;
+    bool stop = false;
+    std::function<void()> on_thread_start;   // e.g. attach the thread to the JVM
+    std::function<void()> on_thread_stop;
+};
+
+// Embedding-only context over a GGUF embedding model. Many texts are packed into one
+// llama_decode call, one seq_id each, and pooled per sequence.
+struct llama_embedder {
+    llama_context *ctx = nullptr;
+    int32_t n_embd    = 0;
+    int32_t n_batch   = 0;   // tokens per decode (== n_ubatch, non-causal models need the whole batch at once)
+    int32_t n_seq_max = 0;   // texts per decode
+    int32_t n_max_tok = 0;   // per-text truncation
+};
+
+// Streaming document ingestion (ingest_file / ingest_text). Chunks are cut on the embedding
+// model's tokens at content-defined points, so an edit only changes the chunks around it.
+struct ingest_config {
+    int32_t chunk_tokens   = 160;        // target tokens per chunk (min half, max one and a half)
+    int32_t overlap_tokens = 24;         // tokens repeated from the end of the previous chunk
+    size_t  buffer_bytes   = 64 * 1024;  // read size; lines longer than this are split
+    size_t  queue_chunks   = 64;         // chunks buffered between the chunker and the embedder
+};
+
+struct ingest_chunk {
+    int32_t  index = 0;
+    uint64_t hash  = 0;                  // of the tokens below: equal hash, equal embedding
+    std::string text;
+    std::vector<llama_token> tokens;     // as embedded, with the model's special tokens
+};
+
+struct ingest_stats {
+    uint64_t bytes_read  = 0;
+    uint64_t bytes_total = 0;
+    int32_t  chunks   = 0;
+    int32_t  embedded = 0;
+    int32_t  reused   = 0;               // hash known to the caller (or repeated), not embedded
+    int64_t  t_us     = 0;
+};
+
+// Both run on the calling thread. on_chunk gets each chunk's L2-normalized vector, or nullptr
+// for a reused one; reused chunks are reported as soon as they are cut, the others once their
+// batch is embedded, so indices may arrive out of order. Returning false cancels the ingestion.
+struct ingest_callbacks {
+    std::function<bool(const ingest_chunk&, const float *vector)> on_chunk;
+    std::function<void(const ingest_stats&)> on_progress;
+};
+
+// ---------- logging ----------
+
+// Info lines are dropped when verbose is off (errors are always printed). Default: on.
+void core_log_set_verbose(bool verbose);
+
+// ---------- helpers ----------
+
+// Tokenize with parse_special=true so chat headers are treated as single tokens
+std::vector<llama_token> tokenize_with_specials(const llama_vocab *vocab, const char *text);
+// Plain-text tokenization for embedding inputs (no chat headers to parse)
+std::vector<llama_token> tokenize_plain(const llama_vocab *vocab, const char *text, int32_t len);
+// Thread count used by the app: the requested value capped at the usable cores (all of them for <= 0)
+int clamp_threads(int nThreads);
+
+// ---------- streaming text ----------
+
+// Output of one sequence on its way to on_token. Text is held back while it ends inside a
+// UTF-8 character or could still grow into one of the stop strings.
+struct text_stream {
+    std::vector<std::string> stops;
+    std::string held;
+};
+
+// Length of the longest prefix of s[0, n) that doesn't end inside a UTF-8 character
+size_t utf8_complete_len(const char *s, size_t n);
+// Appends a token's bytes and replaces *out with the text that is now safe to deliver (often
+// empty). Returns false once a stop string matched; *out then ends right before it.
+bool   text_stream_push(text_stream& ts, const char *bytes, size_t n, std::string *out);
+// Releases what is still held at the end of a sequence, minus a dangling partial character
+void   text_stream_flush(text_stream& ts, std::string *out);
+
+// ---------- threading ----------
+
+// Cores this process may run on grouped by capacity (cpu_capacity, else max frequency),
+// fastest group first. A single group when the kernel exposes neither.
+std::vector<std::vector<int32_t>> cpu_clusters();
+// `threads` threads: decode on every cluster but the slowest, batch across all cores
+session_threads session_threads_for(int threads);
+
+// ---------- model cache ----------
+
+// Weights are loaded once per file and shared by every context opened on them (chat, draft,
+// embeddings). Entries are refcounted; the model is freed when its last handle is released.
+llama_model *model_acquire(const std::string& path, bool use_mmap, bool use_mlock, bool prefetch);
+bool         model_retain(const llama_model *model);
+void         model_release(const llama_model *model);
+std::string  model_path_of(const llama_model *model);
+
+// ---------- sessions ----------
+
+// Validates cfg against the model (supported cache types, flash attention for a quantized V
+// cache, n_ubatch <= n_batch, n_ctx <= training context) and applies its memory budget
+session_config    session_plan_config(const llama_model *model, session_config cfg);
+session_footprint session_estimate_footprint(const llama_model *model, const session_config& cfg);
+// Chat context over an already-acquired model; the session takes over that model reference.
+// cfg goes through session_plan_config first.
+llama_session *session_create(llama_model *model, const std::string& path, int threads,
+                              const session_config& cfg = session_config());
+// Stops the worker (completing its requests as cancelled) and frees the context and draft
+void    session_free(llama_session *s);
+// Drops every sequence from the KV cache (and the draft's)
+void    session_clear(llama_session *s);
+// Replaces the session's threadpools with session_threads_for(threads)
+void    session_set_threads(llama_session *s, int threads);
+// Replaces them with explicit pools; false (old pools kept) if one can't be created
+bool    session_set_thread_pools(llama_session *s, const session_threads& threads);
+// Times a prefill of n_prefill tokens and n_decode single-token steps for each candidate
+// (fastest 1..k clusters x all or half of their cores), keeps the best pool for each kind of
+// step and returns it. Runs on its own thread so the caller's affinity is untouched; leaves
+// the KV cache empty.
+thread_calibration session_calibrate_threads(llama_session *s, int32_t n_prefill, int32_t n_decode);
+// One throwaway decode so the first real prompt doesn't pay for page faults and graph
+// allocation. Leaves the KV cache empty. Returns the time taken in ms.
+int64_t session_warmup(llama_session *s);
+
+// Loads a same-vocab draft model for speculative decoding, replacing any attached one.
+// Returns false (speculation stays off) if it can't be loaded or its vocab differs.
+bool    session_attach_draft(llama_session *s, const std::string& path, int32_t n_draft_max);
+void    session_detach_draft(llama_session *s);
+// Prompt-lookup drafting with n-grams of up to ngram tokens (0 disables it)
+void    session_configure_lookup(llama_session *s, int32_t ngram, int32_t n_draft_max);
+
+// Seq 0 snapshots with a fingerprint sidecar (`path.meta`), written atomically. Save returns
+// the snapshot size in bytes (0 on failure); load returns the restored token count or -1.
+size_t  session_state_save(llama_session *s, const std::string& path);
+int32_t session_state_load(llama_session *s, const std::string& path);
+
+// ---------- token counting ----------
+
+// Exact token counts for many texts against the session's vocab, with special tokens parsed as
+// in the prompt. add_special adds BOS (for a whole prompt); leave it off for prompt fragments.
+void session_count_tokens(llama_session *s, const std::vector<std::string>& texts, bool add_special,
+                          std::vector<int32_t> *out);
+// Walks items in priority order and keeps each one that still fits `budget` (each kept item
+// after the first also costs `sep_tokens`). Returns the kept indices in ascending order.
+std::vector<int32_t> pack_token_budget(const std::vector<int32_t>& counts, int32_t budget, int32_t sep_tokens);
+
+// ---------- generation worker ----------
+
+// Queues a request on the session's worker, starting it with make_worker() if needed, and
+// returns the request id. Callbacks arrive on the worker thread.
+int64_t worker_submit(llama_session *session, std::shared_ptr<gen_request> req,
+                      const std::function<gen_worker *()>& make_worker);
+// A running request stops before its next decode step; a queued one is removed and completed
+// on the calling thread. Returns false if the request already finished.
+bool    worker_cancel(llama_session *session, int64_t request_id);
+// Cancels the running requests, completes the queued ones as cancelled and joins the thread
+void    worker_stop(llama_session *session);
+
+// ---------- embeddings ----------
+
+// Returns nullptr and sets *error if the model can't be loaded or used for embeddings
+llama_embedder *embedder_create(const std::string& path, int threads, std::string *error);
+void            embedder_free(llama_embedder *emb);
+// Embeds all texts in as few llama_decode calls as possible into a row-major
+// [texts x n_embd] matrix of L2-normalized vectors. Texts that tokenize to nothing yield zero rows.
+bool            embedder_embed(llama_embedder *emb, const std::vector<std::string>& texts, std::vector<float> *out);
+// Same for texts already tokenized (with the model's special tokens), each cut to n_max_tok
+bool            embedder_embed_tokens(llama_embedder *emb, const std::vector<std::vector<llama_token>>& texts,
+                                      std::vector<float> *out);
+
+// ---------- ingestion ----------
+
+// Reads the file through a bounded buffer on a helper thread that tokenizes and cuts chunks
+// into a bounded queue, while the calling thread embeds them in full batches. Memory stays
+// flat in the file size. Chunks whose hash is in `known` are reported but not embedded.
+// Returns false and sets *error on I/O or decode failure (not on cancellation).
+bool ingest_file(llama_embedder *emb, const std::string& path, const ingest_config& cfg,
+                 const std::unordered_set<uint64_t>& known, const ingest_callbacks& cb,
+                 ingest_stats *stats, std::string *error);
+// Same over text already in memory
+bool ingest_text(llama_embedder *emb, const char *text, size_t len, const ingest_config& cfg,
+                 const std::unordered_set<uint64_t>& known, const ingest_callbacks& cb,
+                 ingest_stats *stats, std::string *error);
@@ -1,461 +1,765 @@
-#include "llama.h"
+#include "llama_core.h"
+#include <algorithm>
 #include <android/log.h>
 #include <cstring>
 #include <jni.h>
 #include <memory>
+#include <mutex>
 #include <string>
-#include <thread>
+#include <unordered_set>
 #include <vector>
-#include <algorithm>
-#include <cctype>
-#include "ggml.h"
 
 #define LOG_TAG "LLAMA_JNI"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO,  LOG_TAG, __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 
+// JNI bindings for LlamaNative. Context handles are llama_session pointers, model handles
+// llama_model pointers and embedder handles llama_embedder pointers; the work itself lives in
+// llama_core.cpp.
+
 extern "C" {
 
 // ---------- helpers ----------
 
-// Clear a llama_batch in a way that's compatible with older headers
-static inline void batch_clear_compat(llama_batch* b) {
-    for (int i = 0; i < b->n_tokens; ++i) {
-        b->token[i]     = 0;
-        b->pos[i]       = 0;
-        b->n_seq_id[i]  = 0;
-        b->seq_id[i][0] = 0;
-        b->logits[i]    = 0;
-    }
-    b->n_tokens = 0;
-}
-
-// Tokenize with parse_special=true so chat headers are treated as single tokens
-static std::vector<llama_token> tokenize_with_specials(const llama_vocab* vocab, const char* text) {
-    int32_t needed = llama_tokenize(vocab, text, (int32_t)strlen(text),
-                                    nullptr, 0,
-            /*add_special=*/true,
-            /*parse_special=*/true);
-    if (needed < 0) needed = -needed;
-    std::vector<llama_token> out(needed);
-    int32_t got = llama_tokenize(vocab, text, (int32_t)strlen(text),
-                                 out.data(), (int32_t)out.size(),
-            /*add_special=*/true,
-            /*parse_special=*/true);
-    if (got < 0) {
-        out.clear();
-    } else {
-        out.resize(got);
+static bool get_string(JNIEnv *env, jstring s, std::string *out) {
+    const char *chars = s ? env->GetStringUTFChars(s, nullptr) : nullptr;
+    if (!chars) return false;
+    out->assign(chars);
+    env->ReleaseStringUTFChars(s, chars);
+    return true;
+}
+
+// Null elements come back as empty strings
+static std::vector<std::string> get_string_array(JNIEnv *env, jobjectArray arr) {
+    const jsize n = arr ? env->GetArrayLength(arr) : 0;
+    std::vector<std::string> out((size_t) n);
+    for (jsize i = 0; i < n; ++i) {
+        auto s = (jstring) env->GetObjectArrayElement(arr, i);
+        if (s) {
+            get_string(env, s, &out[i]);
+            env->DeleteLocalRef(s);
+        }
     }
     return out;
 }
 
-// Stop on real special tokens (EOS, EOT, ChatML <|im_end|>) with a fallback
-static inline bool should_stop_generation(llama_token tok,
-                                          const llama_vocab* vocab,
-                                          llama_token tok_eos,
-                                          llama_token tok_im_end,
-                                          llama_token tok_eot) {
-    if (tok == tok_eos) return true;
-    if (tok_eot != -1 && tok == tok_eot) return true;       // Llama 3 end-of-turn
-    if (tok_im_end != -1 && tok == tok_im_end) return true; // ChatML <|im_end|>
-    if (llama_vocab_is_eog(vocab, tok)) return true;        // fallback
-    return false;
+static jintArray new_int_array(JNIEnv *env, const std::vector<int32_t>& values) {
+    jintArray result = env->NewIntArray((jsize) values.size());
+    if (result) env->SetIntArrayRegion(result, 0, (jsize) values.size(), reinterpret_cast<const jint *>(values.data()));
+    return result;
 }
 
-// Best-effort KV clear compatible with older llama.cpp
-static inline void kv_clear_compat(llama_context* ctx) {
-#if defined(LLAMA_KV_CACHE_CLEAR) || defined(LLAMA_API_KV_CACHE_CLEAR)
-    llama_kv_cache_clear(ctx);
-#else
-    llama_kv_self_clear(ctx);
-#endif
+// Cache types arrive as ggml_type values (ContextConfig.KvCacheType); anything else is f16
+static ggml_type kv_type_of(jint type) {
+    switch (type) {
+        case GGML_TYPE_Q8_0: return GGML_TYPE_Q8_0;
+        case GGML_TYPE_Q4_0: return GGML_TYPE_Q4_0;
+        default:             return GGML_TYPE_F16;
+    }
 }
 
+static session_config make_session_config(jint nCtx, jint nBatch, jint nUbatch, jint typeK, jint typeV,
+                                          jboolean flashAttn, jint memoryBudgetMb) {
+    session_config cfg;
+    cfg.n_ctx            = nCtx;
+    cfg.n_batch          = nBatch;
+    cfg.n_ubatch         = nUbatch;
+    cfg.type_k           = kv_type_of(typeK);
+    cfg.type_v           = kv_type_of(typeV);
+    cfg.flash_attn       = flashAttn == JNI_TRUE;
+    cfg.memory_budget_mb = memoryBudgetMb;
+    return cfg;
+}
+
+// Layout read by ContextInfo.fromNative
+static jlongArray new_context_info(JNIEnv *env, const session_config& cfg, const session_footprint& fp) {
+    const jlong v[] = {cfg.n_ctx, cfg.n_batch, cfg.n_ubatch, cfg.type_k, cfg.type_v,
+                       cfg.flash_attn ? 1 : 0, fp.kv_bytes, fp.compute_bytes};
+    const jsize n = (jsize) (sizeof(v) / sizeof(v[0]));
+    jlongArray result = env->NewLongArray(n);
+    if (result) env->SetLongArrayRegion(result, 0, n, v);
+    return result;
+}
 
 // ---------- JNI: init / free ----------
 
+// Loads (or reuses) the weights for `path`. The returned handle keeps them resident until
+// llamaModelRelease, independently of any context created on top of them.
 JNIEXPORT jlong JNICALL
-Java_edu_upt_assistant_LlamaNative_llamaCreate(JNIEnv *env, jclass, jstring modelPathJ, jint nThreads) {
-    const char *path = env->GetStringUTFChars(modelPathJ, nullptr);
-    if (!path) {
+Java_edu_upt_assistant_LlamaNative_llamaModelLoad(JNIEnv *env, jclass, jstring modelPathJ,
+                                                  jboolean useMmap, jboolean useMlock, jboolean prefetch) {
+    std::string model_path;
+    if (!get_string(env, modelPathJ, &model_path)) {
         jclass ioe = env->FindClass("java/io/IOException");
         env->ThrowNew(ioe, "Failed to get model path");
         return 0;
     }
 
-    llama_model_params mparams = llama_model_default_params();
-    llama_model *model = llama_model_load_from_file(path, mparams);
-    env->ReleaseStringUTFChars(modelPathJ, path);
+    llama_model *model = model_acquire(model_path, useMmap == JNI_TRUE, useMlock == JNI_TRUE, prefetch == JNI_TRUE);
     if (!model) {
         jclass ioe = env->FindClass("java/io/IOException");
         env->ThrowNew(ioe, "Failed to load model");
         return 0;
     }
+    return reinterpret_cast<jlong>(model);
+}
 
-    llama_context_params cparams = llama_context_default_params();
-    cparams.n_ctx           = 1536;
-    cparams.n_batch         = 256;
-    cparams.n_ubatch        = 64;
-    int threads = (nThreads > 0 ? nThreads : 8);
-    threads = std::max(6, std::min(threads, 8)); // 6–8 threads
-    cparams.n_threads       = threads;
-    cparams.n_threads_batch = threads;
-#ifdef LLAMA_KV_8
-    cparams.type_kv         = LLAMA_KV_8;
-#endif
-
-    LOGI("Using %d threads (ctx=%d, batch=%d, ubatch=%d)", threads, cparams.n_ctx, cparams.n_batch, cparams.n_ubatch);
-
-    llama_context *ctx = llama_init_from_model(model, cparams);
-    if (!ctx) {
-        llama_model_free(model);
+JNIEXPORT void JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaModelRelease(JNIEnv *, jclass, jlong modelPtr) {
+    model_release(reinterpret_cast<llama_model *>(modelPtr));
+}
+
+// New chat context over a handle from llamaModelLoad. Only the KV cache and compute buffers
+// are allocated; the weights are shared. memoryBudgetMb > 0 overrides nCtx/nUbatch.
+JNIEXPORT jlong JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaContextCreate(JNIEnv *env, jclass, jlong modelPtr, jint nThreads,
+                                                      jint nCtx, jint nBatch, jint nUbatch, jint typeK, jint typeV,
+                                                      jboolean flashAttn, jint memoryBudgetMb) {
+    auto *model = reinterpret_cast<llama_model *>(modelPtr);
+    if (!model || !model_retain(model)) {
+        jclass exc = env->FindClass("java/lang/IllegalStateException");
+        env->ThrowNew(exc, "Invalid model handle");
+        return 0;
+    }
+    const session_config cfg = make_session_config(nCtx, nBatch, nUbatch, typeK, typeV, flashAttn, memoryBudgetMb);
+    llama_session *session = session_create(model, model_path_of(model), clamp_threads(nThreads), cfg);
+    if (!session) {
+        model_release(model);
         jclass ioe = env->FindClass("java/io/IOException");
         env->ThrowNew(ioe, "Failed to init context");
         return 0;
     }
+    LOGI("Context initialized");
+    return reinterpret_cast<jlong>(session);
+}
 
-#ifdef NDEBUG
-    LOGI("JNI build: Release");
-#else
-    LOGI("JNI build: Debug");
-#endif
+// What a context with this config would get (budget applied) and its footprint, without
+// allocating anything
+JNIEXPORT jlongArray JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaContextPlan(JNIEnv *env, jclass, jlong modelPtr, jint nCtx, jint nBatch,
+                                                    jint nUbatch, jint typeK, jint typeV, jboolean flashAttn,
+                                                    jint memoryBudgetMb) {
+    auto *model = reinterpret_cast<llama_model *>(modelPtr);
+    if (!model) return nullptr;
+    const session_config cfg = session_plan_config(
+        model, make_session_config(nCtx, nBatch, nUbatch, typeK, typeV, flashAttn, memoryBudgetMb));
+    return new_context_info(env, cfg, session_estimate_footprint(model, cfg));
+}
 
-    LOGI("Context initialized");
-    return reinterpret_cast<jlong>(ctx);
+// The live context's resolved config and footprint
+JNIEXPORT jlongArray JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaContextInfo(JNIEnv *env, jclass, jlong ctxPtr) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    return session ? new_context_info(env, session->config, session->footprint) : nullptr;
 }
 
 JNIEXPORT void JNICALL
 Java_edu_upt_assistant_LlamaNative_llamaFree(JNIEnv *, jclass, jlong ctxPtr) {
-    auto *ctx = reinterpret_cast<llama_context *>(ctxPtr);
-    if (ctx) {
-        const llama_model *model = llama_get_model(ctx);
-        llama_free(ctx);
-        if (model) llama_model_free(const_cast<llama_model *>(model));
-        LOGI("Context and model freed");
-    }
+    session_free(reinterpret_cast<llama_session *>(ctxPtr));
+}
+
+// Applies a new thread count to the live context (and its draft) without touching the KV cache:
+// decode on all but the slowest cores, batch on all of them
+JNIEXPORT void JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaSetThreads(JNIEnv *, jclass, jlong ctxPtr, jint nThreads) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    if (session) session_set_threads(session, clamp_threads(nThreads));
+}
+
+// Runs one throwaway decode so the first real prompt doesn't pay for page faults, graph
+// allocation and backend init. Leaves the KV cache empty. Returns the time taken in ms.
+JNIEXPORT jlong JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaWarmup(JNIEnv *, jclass, jlong ctxPtr) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    return session ? (jlong) session_warmup(session) : -1;
 }
 
 JNIEXPORT void JNICALL
 Java_edu_upt_assistant_LlamaNative_llamaKvCacheClear(JNIEnv *, jclass, jlong ctxPtr) {
-    auto *ctx = reinterpret_cast<llama_context *>(ctxPtr);
-    if (ctx) {
-        kv_clear_compat(ctx);
-        LOGI("KV cache cleared");
-    }
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    if (session) session_clear(session);
 }
 
-// ---------- JNI: synchronous generate ----------
+// ---------- JNI: threading ----------
 
-JNIEXPORT jstring JNICALL
-Java_edu_upt_assistant_LlamaNative_llamaGenerate(JNIEnv *env, jclass, jlong ctxPtr, jstring promptJ, jint maxTokens) {
-    auto *ctx = reinterpret_cast<llama_context *>(ctxPtr);
-    if (!ctx) {
-        jclass exc = env->FindClass("java/lang/IllegalStateException");
-        env->ThrowNew(exc, "Invalid context");
-        return nullptr;
-    }
+static thread_spec get_thread_spec(JNIEnv *env, jint nThreads, jintArray cpus, jint nice) {
+    thread_spec t;
+    t.n_threads = std::max<jint>(1, nThreads);
+    t.nice = nice;
+    const jsize n = cpus ? env->GetArrayLength(cpus) : 0;
+    t.cpus.resize((size_t) n);
+    if (n > 0) env->GetIntArrayRegion(cpus, 0, n, reinterpret_cast<jint *>(t.cpus.data()));
+    return t;
+}
 
-    // Always start from a clean slate for seq_id=0 to avoid collisions
-    kv_clear_compat(ctx);
-    // llama_reset_timings(ctx); // not available in your build
+static void put_thread_spec(std::vector<int32_t> *out, const thread_spec& t) {
+    out->push_back(t.n_threads);
+    out->push_back(t.nice);
+    out->push_back((int32_t) t.cpus.size());
+    out->insert(out->end(), t.cpus.begin(), t.cpus.end());
+}
 
-    const char *prompt = env->GetStringUTFChars(promptJ, nullptr);
-    if (!prompt) {
+// Decode pool for single-token steps, batch pool for prefill and multi-sequence steps. Empty
+// cpus arrays leave placement to the kernel. Returns false (old pools kept) on failure.
+JNIEXPORT jboolean JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaSetThreadPools(JNIEnv *env, jclass, jlong ctxPtr,
+                                                       jint decodeThreads, jintArray decodeCpus, jint decodeNice,
+                                                       jint batchThreads, jintArray batchCpus, jint batchNice) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    if (!session) return JNI_FALSE;
+    session_threads t;
+    t.decode = get_thread_spec(env, decodeThreads, decodeCpus, decodeNice);
+    t.batch  = get_thread_spec(env, batchThreads, batchCpus, batchNice);
+    return session_set_thread_pools(session, t) ? JNI_TRUE : JNI_FALSE;
+}
+
+// Times the candidate pools and applies the fastest. Layout read by ThreadCalibration.fromNative:
+// candidates, decode us/token, prefill us/token, then decode and batch pools as
+// (threads, nice, cpu count, cpus...).
+JNIEXPORT jintArray JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaCalibrateThreads(JNIEnv *env, jclass, jlong ctxPtr,
+                                                         jint nPrefill, jint nDecode) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    if (!session) return nullptr;
+    const thread_calibration c = session_calibrate_threads(session, nPrefill, nDecode);
+    if (c.candidates == 0) return nullptr;
+    std::vector<int32_t> v = {c.candidates, (int32_t) (c.decode_ms_per_token * 1000.0),
+                              (int32_t) (c.prefill_ms_per_token * 1000.0)};
+    put_thread_spec(&v, c.threads.decode);
+    put_thread_spec(&v, c.threads.batch);
+    return new_int_array(env, v);
+}
+
+// ---------- JNI: speculative decoding ----------
+
+// Loads a small draft model with the same vocabulary as the target; generation then drafts
+// up to nDraftMax tokens per step with it. Replaces any previously attached draft.
+// Returns false (speculation stays off) if the model can't be loaded or its vocab differs.
+JNIEXPORT jboolean JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaDraftAttach(JNIEnv *env, jclass, jlong ctxPtr, jstring draftPathJ, jint nDraftMax) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    std::string draft_path;
+    if (!session || !get_string(env, draftPathJ, &draft_path)) return JNI_FALSE;
+    return session_attach_draft(session, draft_path, nDraftMax) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT void JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaDraftDetach(JNIEnv *, jclass, jlong ctxPtr) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    if (session) session_detach_draft(session);
+}
+
+// Enables prompt-lookup drafting with n-grams of up to ngramSize tokens (0 disables it).
+// Ignored while a draft model is attached.
+JNIEXPORT void JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaLookupConfigure(JNIEnv *, jclass, jlong ctxPtr, jint ngramSize, jint nDraftMax) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    if (session) session_configure_lookup(session, ngramSize, nDraftMax);
+}
+
+// ---------- JNI: sequence state snapshots ----------
+
+// Writes seq 0 (KV + token list) to `path` and its fingerprint to `path.meta`.
+// Returns the snapshot size in bytes, or 0 on failure.
+JNIEXPORT jlong JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaStateSave(JNIEnv *env, jclass, jlong ctxPtr, jstring pathJ) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    std::string path;
+    if (!session || !get_string(env, pathJ, &path)) return 0;
+    return (jlong) session_state_save(session, path);
+}
+
+// Restores seq 0 from a snapshot written by llamaStateSave. Returns the number of restored
+// tokens, or -1 if the snapshot is missing, stale or unreadable (the cache is left empty).
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaStateLoad(JNIEnv *env, jclass, jlong ctxPtr, jstring pathJ) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    std::string path;
+    if (!session || !get_string(env, pathJ, &path)) return -1;
+    return (jint) session_state_load(session, path);
+}
+
+// ---------- JNI: token counting ----------
+
+// Exact token counts for all texts in one call, memoized per context. addSpecial counts the
+// BOS a whole prompt gets; leave it off for fragments that end up inside a prompt.
+JNIEXPORT jintArray JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaCountTokens(JNIEnv *env, jclass, jlong ctxPtr, jobjectArray textsJ, jboolean addSpecial) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    if (!session) {
         jclass exc = env->FindClass("java/lang/IllegalStateException");
-        env->ThrowNew(exc, "Failed to get prompt string");
+        env->ThrowNew(exc, "Invalid context");
         return nullptr;
     }
+    std::vector<int32_t> counts;
+    session_count_tokens(session, get_string_array(env, textsJ), addSpecial == JNI_TRUE, &counts);
+    return new_int_array(env, counts);
+}
 
-    const llama_model *model = llama_get_model(ctx);
-    if (!model) {
-        env->ReleaseStringUTFChars(promptJ, prompt);
+// Counts the fragments and returns the (ascending) indices of those that fit budgetTokens when
+// taken in array order, each kept one after the first adding separatorTokens
+JNIEXPORT jintArray JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaPackTokens(JNIEnv *env, jclass, jlong ctxPtr, jobjectArray textsJ,
+                                                   jint budgetTokens, jint separatorTokens) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    if (!session) {
         jclass exc = env->FindClass("java/lang/IllegalStateException");
-        env->ThrowNew(exc, "Model not initialized");
+        env->ThrowNew(exc, "Invalid context");
         return nullptr;
     }
-    const llama_vocab *vocab = llama_model_get_vocab(model);
-    if (!vocab) {
-        env->ReleaseStringUTFChars(promptJ, prompt);
-        jclass exc = env->FindClass("java/lang/IllegalStateException");
-        env->ThrowNew(exc, "Vocab not initialized");
-        return nullptr;
+    std::vector<int32_t> counts;
+    session_count_tokens(session, get_string_array(env, textsJ), /*add_special=*/false, &counts);
+    return new_int_array(env, pack_token_budget(counts, budgetTokens, separatorTokens));
+}
+
+// ---------- JNI: streaming generate ----------
+
+// Worker whose thread is attached to the JVM so it can call back into Kotlin
+static gen_worker *make_jni_worker(JNIEnv *env) {
+    JavaVM *vm = nullptr;
+    env->GetJavaVM(&vm);
+    auto *w = new gen_worker();
+    w->on_thread_start = [vm]() {
+        JNIEnv *thread_env = nullptr;
+        if (vm->AttachCurrentThread(&thread_env, nullptr) != JNI_OK) LOGE("Generation worker failed to attach to the JVM");
+    };
+    w->on_thread_stop = [vm]() { vm->DetachCurrentThread(); };
+    return w;
+}
+
+// Order of GenerationTelemetry.fromNative's `values` array; keep in sync with the Kotlin side
+enum telemetry_field : int32_t {
+    TEL_STATUS, TEL_PROMPT_TOKENS, TEL_REUSED_TOKENS, TEL_PREFILLED_TOKENS, TEL_GENERATED_TOKENS,
+    TEL_DRAFTED_TOKENS, TEL_ACCEPTED_TOKENS, TEL_QUEUE_US, TEL_TOKENIZE_US, TEL_PREFILL_US,
+    TEL_PREFILL_UBATCHES, TEL_FIRST_SAMPLE_US, TEL_SAMPLE_US, TEL_DECODE_US, TEL_DECODE_STEPS,
+    TEL_FIRST_TOKEN_US, TEL_TOTAL_US, TEL_LATENCY_P50_US, TEL_LATENCY_P95_US, TEL_LATENCY_P99_US,
+    TEL_KV_CELLS_USED, TEL_KV_CELLS_TOTAL, TEL_N_THREADS, TEL_N_THREADS_BATCH, TEL_N_BATCH,
+    TEL_N_UBATCH, TEL_CONTEXT_SHIFTS, TEL_DISCARDED_TOKENS, TEL_COUNT
+};
+
+static jobject new_telemetry(JNIEnv *e, jclass cls, jmethodID from_native, const gen_telemetry& t) {
+    jlong v[TEL_COUNT];
+    v[TEL_STATUS]           = t.status;
+    v[TEL_PROMPT_TOKENS]    = t.prompt_tokens;
+    v[TEL_REUSED_TOKENS]    = t.reused_tokens;
+    v[TEL_PREFILLED_TOKENS] = t.prefilled_tokens;
+    v[TEL_GENERATED_TOKENS] = t.generated_tokens;
+    v[TEL_DRAFTED_TOKENS]   = t.drafted_tokens;
+    v[TEL_ACCEPTED_TOKENS]  = t.accepted_tokens;
+    v[TEL_QUEUE_US]         = t.queue_us;
+    v[TEL_TOKENIZE_US]      = t.tokenize_us;
+    v[TEL_PREFILL_US]       = t.prefill_us;
+    v[TEL_PREFILL_UBATCHES] = t.prefill_ubatches;
+    v[TEL_FIRST_SAMPLE_US]  = t.first_sample_us;
+    v[TEL_SAMPLE_US]        = t.sample_us;
+    v[TEL_DECODE_US]        = t.decode_us;
+    v[TEL_DECODE_STEPS]     = t.decode_steps;
+    v[TEL_FIRST_TOKEN_US]   = t.first_token_us;
+    v[TEL_TOTAL_US]         = t.total_us;
+    v[TEL_LATENCY_P50_US]   = t.latency_p50_us;
+    v[TEL_LATENCY_P95_US]   = t.latency_p95_us;
+    v[TEL_LATENCY_P99_US]   = t.latency_p99_us;
+    v[TEL_KV_CELLS_USED]    = t.kv_cells_used;
+    v[TEL_KV_CELLS_TOTAL]   = t.kv_cells_total;
+    v[TEL_N_THREADS]        = t.n_threads;
+    v[TEL_N_THREADS_BATCH]  = t.n_threads_batch;
+    v[TEL_N_BATCH]          = t.n_batch;
+    v[TEL_N_UBATCH]         = t.n_ubatch;
+    v[TEL_CONTEXT_SHIFTS]   = t.context_shifts;
+    v[TEL_DISCARDED_TOKENS] = t.discarded_tokens;
+
+    jlongArray values = e->NewLongArray(TEL_COUNT);
+    jintArray hist = e->NewIntArray(GEN_LATENCY_BUCKETS);
+    jobject obj = nullptr;
+    if (values && hist) {
+        e->SetLongArrayRegion(values, 0, TEL_COUNT, v);
+        e->SetIntArrayRegion(hist, 0, GEN_LATENCY_BUCKETS, reinterpret_cast<const jint *>(t.latency_hist));
+        obj = e->CallStaticObjectMethod(cls, from_native, values, hist);
     }
+    if (values) e->DeleteLocalRef(values);
+    if (hist) e->DeleteLocalRef(hist);
+    return obj;
+}
 
-    // Tokenize with special parsing
-    std::vector<llama_token> tokens = tokenize_with_specials(vocab, prompt);
-    env->ReleaseStringUTFChars(promptJ, prompt);
-    if (tokens.empty()) {
-        LOGE("Tokenization failed");
-        return env->NewStringUTF("");
+// Direct ByteBuffer a request's text is written into (llamaSubmitText). Pending bytes are
+// always one contiguous run; onText(start, len) hands it over and, since Kotlin decodes it
+// before returning, the run after it can reuse the space. A run that doesn't fit in the rest
+// of the buffer is flushed and restarts at offset 0.
+struct text_ring {
+    jobject buffer = nullptr;         // global ref keeping the ByteBuffer alive
+    char   *base = nullptr;
+    size_t  capacity = 0;
+    size_t  start = 0, len = 0;       // pending bytes
+    size_t  flush_bytes = 0;          // notify once this many bytes are pending...
+    int64_t flush_us = 0;             // ...or this long after the last notification
+    int64_t t_flush = 0;              // 0: the first text goes out at once
+};
+
+// Binds a Kotlin StreamCallback to a request. Calls can come from the worker thread or, for a
+// request cancelled while queued, from the canceller's thread, so each one looks up the
+// current thread's JNIEnv. With a ring, text goes through onText in coalesced runs instead of
+// one onToken string per call.
+static gen_callbacks make_jni_callbacks(JNIEnv *env, jobject callback, std::shared_ptr<text_ring> ring = nullptr) {
+    JavaVM *vm = nullptr;
+    env->GetJavaVM(&vm);
+    jclass cbCls = env->GetObjectClass(callback);
+    jmethodID onToken     = env->GetMethodID(cbCls, "onToken", "(Ljava/lang/String;)V");
+    jmethodID onText      = ring ? env->GetMethodID(cbCls, "onText", "(II)V") : nullptr;
+    jmethodID onTelemetry = env->GetMethodID(cbCls, "onTelemetry", "(Ledu/upt/assistant/GenerationTelemetry;)V");
+    jmethodID onComplete  = env->GetMethodID(cbCls, "onComplete", "(I)V");
+    if (env->ExceptionCheck()) env->ExceptionClear();
+    env->DeleteLocalRef(cbCls);
+    // Resolved here: FindClass on the worker thread would only see the system class loader
+    jclass telCls = nullptr;
+    jmethodID fromNative = nullptr;
+    if (jclass local = env->FindClass("edu/upt/assistant/GenerationTelemetry")) {
+        telCls = (jclass) env->NewGlobalRef(local);
+        env->DeleteLocalRef(local);
+        fromNative = env->GetStaticMethodID(telCls, "fromNative", "([J[I)Ledu/upt/assistant/GenerationTelemetry;");
     }
-    const int32_t ntok = (int32_t)tokens.size();
-    LOGI("Tokenized prompt: %d tokens", ntok);
-
-    // Prefill in chunks
-    const int n_batch = 256;
-    llama_batch batch = llama_batch_init(n_batch, 0, 1);
-
-    for (int32_t cur = 0; cur < ntok; ) {
-        batch_clear_compat(&batch);
-        const int32_t nb = std::min(n_batch, ntok - cur);
-        for (int i = 0; i < nb; ++i) {
-            const int32_t pos = cur + i;
-            const bool set_logits = (pos == ntok - 1); // request logits only on final prefill token
-            batch.token[i]     = tokens[pos];
-            batch.pos[i]       = pos;
-            batch.n_seq_id[i]  = 1;
-            batch.seq_id[i][0] = 0;
-            batch.logits[i]    = set_logits ? 1 : 0;
+    if (env->ExceptionCheck()) env->ExceptionClear();
+    jobject cb = env->NewGlobalRef(callback);
+
+    auto current_env = [vm]() {
+        JNIEnv *e = nullptr;
+        vm->GetEnv(reinterpret_cast<void **>(&e), JNI_VERSION_1_6);
+        return e;
+    };
+    auto check = [](JNIEnv *e, const char *what) {
+        if (!e->ExceptionCheck()) return true;
+        e->ExceptionClear();
+        LOGE("Java exception in %s callback", what);
+        return false;
+    };
+
+    // Hands the pending run to Kotlin; false if the callback threw
+    auto flush = [=](JNIEnv *e) {
+        if (!ring || ring->len == 0) return true;
+        e->CallVoidMethod(cb, onText, (jint) ring->start, (jint) ring->len);
+        ring->start += ring->len;
+        ring->len = 0;
+        ring->t_flush = ggml_time_us();
+        return check(e, "text");
+    };
+
+    gen_callbacks c;
+    if (ring) {
+        c.on_token = [=](const std::string& text) {
+            if (!onText) return false;
+            JNIEnv *e = current_env();
+            const char *p = text.data();
+            size_t n = text.size();
+            while (n > 0) {
+                size_t room = ring->capacity - ring->start - ring->len;
+                if (room < n && ring->start + ring->len > 0) {
+                    if (!flush(e)) return false;
+                    ring->start = 0;
+                    room = ring->capacity;
+                }
+                size_t k = std::min(n, room);
+                // Longer than the whole buffer: split between characters
+                if (k < n && utf8_complete_len(p, k) > 0) k = utf8_complete_len(p, k);
+                memcpy(ring->base + ring->start + ring->len, p, k);
+                ring->len += k;
+                p += k;
+                n -= k;
+                if (n > 0 && !flush(e)) return false;
+            }
+            if (ring->len >= ring->flush_bytes || ggml_time_us() - ring->t_flush >= ring->flush_us) return flush(e);
+            return true;
+        };
+    } else {
+        c.on_token = [=](const std::string& text) {
+            if (!onToken) return false;
+            JNIEnv *e = current_env();
+            jstring textJ = e->NewStringUTF(text.c_str());
+            if (!textJ) return check(e, "token");
+            e->CallVoidMethod(cb, onToken, textJ);
+            e->DeleteLocalRef(textJ);
+            return check(e, "token");
+        };
+    }
+    c.on_telemetry = [=](const gen_telemetry& t) {
+        JNIEnv *e = current_env();
+        flush(e);
+        if (!onTelemetry || !fromNative) return;
+        jobject tel = new_telemetry(e, telCls, fromNative, t);
+        if (!tel) { check(e, "telemetry"); return; }
+        e->CallVoidMethod(cb, onTelemetry, tel);
+        e->DeleteLocalRef(tel);
+        check(e, "telemetry");
+    };
+    c.on_complete = [=](gen_status status) {
+        JNIEnv *e = current_env();
+        flush(e);
+        if (onComplete) {
+            e->CallVoidMethod(cb, onComplete, (jint) status);
+            check(e, "completion");
         }
-        batch.n_tokens = nb;
+        e->DeleteGlobalRef(cb);
+        if (telCls) e->DeleteGlobalRef(telCls);
+        if (ring) e->DeleteGlobalRef(ring->buffer);
+    };
+    return c;
+}
 
-        if (llama_decode(ctx, batch) != 0) {
-            LOGE("Batch decode failed at pos %d", cur);
-            llama_batch_free(batch);
-            return env->NewStringUTF("");
-        }
-        cur += nb;
-    }
+static std::shared_ptr<gen_request> make_jni_request(JNIEnv *env, jstring promptJ, jint maxTokens,
+                                                     jint priority, jint nKeep, jobject callback,
+                                                     std::shared_ptr<text_ring> ring = nullptr) {
+    const char *prompt = env->GetStringUTFChars(promptJ, nullptr);
+    if (!prompt) return nullptr;
+    auto req = std::make_shared<gen_request>();
+    req->priority   = priority;
+    req->prompt     = prompt;
+    req->max_tokens = maxTokens;
+    req->n_keep     = nKeep;
+    req->cb         = make_jni_callbacks(env, callback, std::move(ring));
+    env->ReleaseStringUTFChars(promptJ, prompt);
+    return req;
+}
 
-    // Sampler chain tuned for CPU: repeat penalty, top-k, top-p, temp
-    // (consider dynatemp/xtc samplers if available)
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler *sampler = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(sampler, llama_sampler_init_penalties(64, 1.1f, 0.0f, 0.0f));
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_k(30));
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_p(0.9f, 1));
-    llama_sampler_chain_add(sampler, llama_sampler_init_temp(0.7f));
-    llama_sampler_chain_add(sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-
-    // Stop tokens
-    const llama_token tok_eos = llama_vocab_eos(vocab);
-    const llama_token tok_eot = llama_vocab_eot(vocab); // may be -1
-    llama_token tok_im_end = -1;
-    llama_token tok_gemma_eot = -1;
-    {
-        // ChatML end
-        static const char* IM_END = "<|im_end|>";
-        llama_token tmp[8];
-        int32_t n1 = llama_tokenize(vocab, IM_END, (int32_t)strlen(IM_END),
-                                    tmp, 8, /*add_special=*/true, /*parse_special=*/true);
-        if (n1 == 1) tok_im_end = tmp[0];
-
-        // Gemma end-of-turn
-        static const char* GEMMA_EOT = "<end_of_turn>";
-        int32_t n2 = llama_tokenize(vocab, GEMMA_EOT, (int32_t)strlen(GEMMA_EOT),
-                                    tmp, 8, /*add_special=*/true, /*parse_special=*/true);
-        if (n2 == 1) tok_gemma_eot = tmp[0];
+// Queues a streaming generation on the session's worker thread and returns its request id
+// immediately. Up to n_seq_max requests decode together; callbacks (onToken, onTelemetry,
+// onComplete) arrive on the worker thread and onComplete is always the last. nKeep leading
+// prompt tokens survive context shifts when the conversation outgrows n_ctx.
+JNIEXPORT jlong JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaSubmit(JNIEnv *env, jclass, jlong ctxPtr, jstring promptJ,
+                                               jint maxTokens, jint priority, jint nKeep, jobject callback) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    if (!session || !callback) {
+        jclass exc = env->FindClass("java/lang/IllegalStateException");
+        env->ThrowNew(exc, "Invalid context or callback");
+        return 0;
     }
+    std::shared_ptr<gen_request> req = make_jni_request(env, promptJ, maxTokens, priority, nKeep, callback);
+    if (!req) return 0;
+    return (jlong) worker_submit(session, req, [env] { return make_jni_worker(env); });
+}
 
-    // Decode loop
-    std::string output;
-    output.reserve(std::max(16, (int)maxTokens * 4));
-    int n_cur = ntok;
-    bool first = true;
-
-    for (int i = 0; i < maxTokens; ++i) {
-        llama_token next;
-        if (first) {
-            llama_sampler *s_first = llama_sampler_chain_init(sparams);
-            llama_sampler_chain_add(s_first, llama_sampler_init_penalties(64, 1.1f, 0.0f, 0.0f));
-            llama_sampler_chain_add(s_first, llama_sampler_init_top_k(30));
-            llama_sampler_chain_add(s_first, llama_sampler_init_top_p(0.9f, 1));
-            llama_sampler_chain_add(s_first, llama_sampler_init_temp(0.2f));
-            llama_sampler_chain_add(s_first, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-            next = llama_sampler_sample(s_first, ctx, -1);
-            llama_sampler_free(s_first);
-            first = false;
-        } else {
-            next = llama_sampler_sample(sampler, ctx, -1);
-        }
-        if (should_stop_generation(next, vocab, tok_eos, tok_im_end, tok_eot) || (tok_gemma_eot != -1 && next == tok_gemma_eot))
-            break;
-
-        const char *piece = llama_vocab_get_text(vocab, next);
-        if (!piece) break;
-
-        std::string t(piece);
-        if (t == "▁") t = " ";
-        else if (t.size() >= 3 && t.substr(0, 3) == "▁") t = " " + t.substr(3);
-        output += t;
-
-        batch_clear_compat(&batch);
-        batch.n_tokens     = 1;
-        batch.token[0]     = next;
-        batch.pos[0]       = n_cur++;
-        batch.n_seq_id[0]  = 1;
-        batch.seq_id[0][0] = 0;
-        batch.logits[0]    = 1;
-
-        if (llama_decode(ctx, batch) != 0) {
-            LOGE("Decode token failed");
-            break;
-        }
+// llamaSubmit with the text streamed through `buffer` (a direct ByteBuffer of at least 64
+// bytes): the worker writes UTF-8 into it and calls onText(offset, length) once flushBytes are
+// pending or flushMs have passed since the last call, and before onTelemetry / onComplete.
+// Generation ends before the first match of any of `stops`, which never reaches onText.
+JNIEXPORT jlong JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaSubmitText(JNIEnv *env, jclass, jlong ctxPtr, jstring promptJ,
+                                                   jint maxTokens, jint priority, jint nKeep, jobjectArray stopsJ,
+                                                   jobject bufferJ, jint flushBytes, jint flushMs, jobject callback) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    if (!session || !callback) {
+        jclass exc = env->FindClass("java/lang/IllegalStateException");
+        env->ThrowNew(exc, "Invalid context or callback");
+        return 0;
+    }
+    auto ring = std::make_shared<text_ring>();
+    ring->base     = bufferJ ? static_cast<char *>(env->GetDirectBufferAddress(bufferJ)) : nullptr;
+    ring->capacity = ring->base ? (size_t) env->GetDirectBufferCapacity(bufferJ) : 0;
+    if (ring->capacity < 64) {
+        jclass exc = env->FindClass("java/lang/IllegalArgumentException");
+        env->ThrowNew(exc, "Text buffer must be a direct ByteBuffer of at least 64 bytes");
+        return 0;
+    }
+    ring->flush_bytes = (size_t) std::max(1, std::min(flushBytes, (jint) ring->capacity));
+    ring->flush_us    = (int64_t) std::max(0, flushMs) * 1000;
+    ring->buffer      = env->NewGlobalRef(bufferJ);
+    std::shared_ptr<gen_request> req = make_jni_request(env, promptJ, maxTokens, priority, nKeep, callback, ring);
+    if (!req) {
+        env->DeleteGlobalRef(ring->buffer);
+        return 0;
     }
+    for (auto &stop : get_string_array(env, stopsJ)) {
+        if (!stop.empty()) req->stop.push_back(std::move(stop));
+    }
+    return (jlong) worker_submit(session, req, [env] { return make_jni_worker(env); });
+}
 
-    llama_sampler_free(sampler);
-    llama_batch_free(batch);
+// Requests cancellation. A running request stops before its next decode step; a queued one is
+// removed and completed (onComplete(CANCELLED)) on the calling thread. Returns false if the
+// request already finished.
+JNIEXPORT jboolean JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaCancel(JNIEnv *, jclass, jlong ctxPtr, jlong requestId) {
+    auto *session = reinterpret_cast<llama_session *>(ctxPtr);
+    return session && worker_cancel(session, (int64_t) requestId) ? JNI_TRUE : JNI_FALSE;
+}
 
-    llama_perf_context_print(ctx);
+// ---------- JNI: embeddings ----------
 
-    while (!output.empty() && std::isspace((unsigned char)output.back())) output.pop_back();
-    return env->NewStringUTF(output.c_str());
+JNIEXPORT jlong JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaEmbedCreate(JNIEnv *env, jclass, jstring modelPathJ, jint nThreads) {
+    std::string path;
+    if (!get_string(env, modelPathJ, &path)) {
+        jclass ioe = env->FindClass("java/io/IOException");
+        env->ThrowNew(ioe, "Failed to get embedding model path");
+        return 0;
+    }
+    std::string error;
+    llama_embedder *emb = embedder_create(path, clamp_threads(nThreads), &error);
+    if (!emb) {
+        jclass ioe = env->FindClass("java/io/IOException");
+        env->ThrowNew(ioe, error.c_str());
+        return 0;
+    }
+    return reinterpret_cast<jlong>(emb);
 }
 
-// ---------- JNI: streaming generate ----------
-
 JNIEXPORT void JNICALL
-Java_edu_upt_assistant_LlamaNative_llamaGenerateStream(JNIEnv *env, jclass, jlong ctxPtr,
-                                                       jstring promptJ, jint maxTokens, jobject callback) {
-    auto *ctx = reinterpret_cast<llama_context *>(ctxPtr);
-    if (!ctx || !callback) { LOGE("Invalid context or callback"); return; }
-
-    // Always clear KV first to avoid overlapping seq_id=0 history
-    kv_clear_compat(ctx);
-    // llama_reset_timings(ctx); // not available in your build
+Java_edu_upt_assistant_LlamaNative_llamaEmbedFree(JNIEnv *, jclass, jlong embPtr) {
+    embedder_free(reinterpret_cast<llama_embedder *>(embPtr));
+}
 
-    const char *prompt = env->GetStringUTFChars(promptJ, nullptr);
-    if (!prompt) { LOGE("Failed to get prompt"); return; }
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaEmbedDim(JNIEnv *, jclass, jlong embPtr) {
+    auto *emb = reinterpret_cast<llama_embedder *>(embPtr);
+    return emb ? emb->n_embd : 0;
+}
 
-    const llama_model *model = llama_get_model(ctx);
-    if (!model) { env->ReleaseStringUTFChars(promptJ, prompt); LOGE("Model not initialized"); return; }
-    const llama_vocab *vocab = llama_model_get_vocab(model);
-    if (!vocab) { env->ReleaseStringUTFChars(promptJ, prompt); LOGE("Vocab not initialized"); return; }
+// Embeds all texts in as few llama_decode calls as possible and returns a row-major
+// [texts.length x dim] matrix of L2-normalized vectors. Texts that tokenize to nothing yield zero rows.
+JNIEXPORT jfloatArray JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaEmbedBatch(JNIEnv *env, jclass, jlong embPtr, jobjectArray textsJ) {
+    auto *emb = reinterpret_cast<llama_embedder *>(embPtr);
+    if (!emb) {
+        jclass exc = env->FindClass("java/lang/IllegalStateException");
+        env->ThrowNew(exc, "Invalid embedding context");
+        return nullptr;
+    }
+    const std::vector<std::string> texts = get_string_array(env, textsJ);
+    std::vector<float> out;
+    if (!embedder_embed(emb, texts, &out)) {
+        jclass exc = env->FindClass("java/lang/IllegalStateException");
+        env->ThrowNew(exc, "Embedding decode failed");
+        return nullptr;
+    }
+    jfloatArray result = env->NewFloatArray((jsize) out.size());
+    if (result) env->SetFloatArrayRegion(result, 0, (jsize) out.size(), out.data());
+    return result;
+}
 
-    std::vector<llama_token> tokens = tokenize_with_specials(vocab, prompt);
-    env->ReleaseStringUTFChars(promptJ, prompt);
-    if (tokens.empty()) { LOGE("Tokenization failed"); return; }
-    const int32_t ntok = (int32_t)tokens.size();
-    LOGI("Streaming: tokenized prompt %d tokens", ntok);
-
-    const int n_batch = 256;
-    llama_batch batch = llama_batch_init(n_batch, 0, 1);
-
-    const int64_t t0 = ggml_time_us();
-
-    // Prefill
-    for (int32_t cur = 0; cur < ntok; ) {
-        batch_clear_compat(&batch);
-        const int32_t nb = std::min(n_batch, ntok - cur);
-        for (int i = 0; i < nb; ++i) {
-            const int32_t pos = cur + i;
-            const bool set_logits = (pos == ntok - 1);
-            batch.token[i]     = tokens[pos];
-            batch.pos[i]       = pos;
-            batch.n_seq_id[i]  = 1;
-            batch.seq_id[i][0] = 0;
-            batch.logits[i]    = set_logits ? 1 : 0;
-        }
-        batch.n_tokens = nb;
+// ---------- JNI: ingestion ----------
+
+// Chunk text is cut on token boundaries, which may split a character: decode it leniently
+// through String(byte[], UTF_8) rather than NewStringUTF
+static jstring new_string_lenient(JNIEnv *env, const std::string& text) {
+    struct string_ctor { jclass cls; jmethodID init; jobject utf8; };
+    static const string_ctor sc = [env] {
+        jclass cls = env->FindClass("java/lang/String");
+        jclass charsets = env->FindClass("java/nio/charset/StandardCharsets");
+        jfieldID f = env->GetStaticFieldID(charsets, "UTF_8", "Ljava/nio/charset/Charset;");
+        jobject cs = env->GetStaticObjectField(charsets, f);
+        string_ctor r{(jclass) env->NewGlobalRef(cls), env->GetMethodID(cls, "<init>", "([BLjava/nio/charset/Charset;)V"),
+                      env->NewGlobalRef(cs)};
+        env->DeleteLocalRef(cs);
+        env->DeleteLocalRef(charsets);
+        env->DeleteLocalRef(cls);
+        return r;
+    }();
+    jbyteArray bytes = env->NewByteArray((jsize) text.size());
+    if (!bytes) return nullptr;
+    env->SetByteArrayRegion(bytes, 0, (jsize) text.size(), reinterpret_cast<const jbyte *>(text.data()));
+    auto s = (jstring) env->NewObject(sc.cls, sc.init, bytes, sc.utf8);
+    env->DeleteLocalRef(bytes);
+    return s;
+}
 
-        if (llama_decode(ctx, batch) != 0) {
-            LOGE("Streaming batch decode failed at pos %d", cur);
-            llama_batch_free(batch);
-            return;
-        }
-        cur += nb;
+// Runs ingest_file (pathJ) or ingest_text (textJ) with the callback's onChunk/onProgress and
+// returns {chunks, embedded, reused}, or null with a pending exception
+static jintArray ingest_jni(JNIEnv *env, jlong embPtr, jstring pathJ, jstring textJ, jint chunkTokens,
+                            jint overlapTokens, jlongArray knownJ, jobject callback) {
+    auto *emb = reinterpret_cast<llama_embedder *>(embPtr);
+    if (!emb || !callback) {
+        jclass exc = env->FindClass("java/lang/IllegalStateException");
+        env->ThrowNew(exc, emb ? "Missing ingest callback" : "Invalid embedding context");
+        return nullptr;
+    }
+    std::string source;
+    if (!get_string(env, pathJ ? pathJ : textJ, &source)) {
+        jclass ioe = env->FindClass("java/io/IOException");
+        env->ThrowNew(ioe, "Failed to get ingest source");
+        return nullptr;
     }
 
-    const int64_t t_prefill_done = ggml_time_us();
+    ingest_config cfg;
+    if (chunkTokens > 0) cfg.chunk_tokens = chunkTokens;
+    if (overlapTokens >= 0) cfg.overlap_tokens = std::min(overlapTokens, cfg.chunk_tokens / 2);
 
-    // Java callbacks
-    jclass cbCls = env->GetObjectClass(callback);
-    jmethodID onToken = env->GetMethodID(cbCls, "onToken", "(Ljava/lang/String;)V");
-    jmethodID onTimings = env->GetMethodID(cbCls, "onTimings", "(JJ)V");
-    if (!onToken || !onTimings) { LOGE("Failed to find callback methods"); llama_batch_free(batch); return; }
-
-    // Sampler
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler *sampler = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_p(0.9f, 1));
-    llama_sampler_chain_add(sampler, llama_sampler_init_temp(0.7f));
-    llama_sampler_chain_add(sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-
-    // Stop tokens
-    const llama_token tok_eos = llama_vocab_eos(vocab);
-    const llama_token tok_eot = llama_vocab_eot(vocab);
-    llama_token tok_im_end = -1;
-    llama_token tok_gemma_eot = -1;
-    {
-        llama_token tmp[8];
-
-        // ChatML end
-        const char *s1 = "<|im_end|>";
-        int32_t n1 = llama_tokenize(vocab, s1, (int32_t)strlen(s1),
-                                    tmp, 8, /*add_special=*/true, /*parse_special=*/true);
-        if (n1 == 1) tok_im_end = tmp[0];
-
-        // Gemma end-of-turn
-        const char *s2 = "<end_of_turn>";
-        int32_t n2 = llama_tokenize(vocab, s2, (int32_t)strlen(s2),
-                                    tmp, 8, /*add_special=*/true, /*parse_special=*/true);
-        if (n2 == 1) tok_gemma_eot = tmp[0];
+    std::unordered_set<uint64_t> known;
+    const jsize n_known = knownJ ? env->GetArrayLength(knownJ) : 0;
+    if (n_known > 0) {
+        std::vector<jlong> hashes((size_t) n_known);
+        env->GetLongArrayRegion(knownJ, 0, n_known, hashes.data());
+        known.insert(hashes.begin(), hashes.end());
     }
 
-    int n_cur = ntok;
-    bool logged_first_sample = false;
-
-    bool first = true;
-    for (int i = 0; i < maxTokens; ++i) {
-        llama_token next;
-        if (first) {
-            llama_sampler *s_first = llama_sampler_chain_init(sparams);
-            llama_sampler_chain_add(s_first, llama_sampler_init_top_k(40));
-            llama_sampler_chain_add(s_first, llama_sampler_init_top_p(0.9f, 1));
-            llama_sampler_chain_add(s_first, llama_sampler_init_temp(0.2f)); // <-- colder
-            llama_sampler_chain_add(s_first, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-            next = llama_sampler_sample(s_first, ctx, -1);
-            llama_sampler_free(s_first);
-            first = false;
-        } else {
-            next = llama_sampler_sample(sampler, ctx, -1);
+    jclass cbCls = env->GetObjectClass(callback);
+    jmethodID onChunk = env->GetMethodID(cbCls, "onChunk", "(IJLjava/lang/String;[F)Z");
+    jmethodID onProgress = env->GetMethodID(cbCls, "onProgress", "(JJIII)V");
+    env->DeleteLocalRef(cbCls);
+    if (!onChunk || !onProgress) return nullptr;   // NoSuchMethodError pending
+
+    // A Java exception cancels the run and is left pending for the caller
+    bool threw = false;
+    ingest_callbacks cb;
+    cb.on_chunk = [&](const ingest_chunk& c, const float *vector) {
+        jstring chunkJ = new_string_lenient(env, c.text);
+        jfloatArray vectorJ = nullptr;
+        if (chunkJ && vector) {
+            vectorJ = env->NewFloatArray(emb->n_embd);
+            if (vectorJ) env->SetFloatArrayRegion(vectorJ, 0, emb->n_embd, vector);
         }
-
-        if (!logged_first_sample) {
-            const int64_t t_first = ggml_time_us();
-            const jlong prefill_ms = (t_prefill_done - t0) / 1000;
-            const jlong first_sample_ms = (t_first - t_prefill_done) / 1000;
-            env->CallVoidMethod(callback, onTimings, prefill_ms, first_sample_ms);
-            if (env->ExceptionCheck()) { env->ExceptionClear(); LOGE("Java exception in timings callback"); break; }
-            logged_first_sample = true;
-        }
-
-        if (should_stop_generation(next, vocab, tok_eos, tok_im_end, tok_eot) || (tok_gemma_eot != -1 && next == tok_gemma_eot)) break;
-
-        const char *piece = llama_vocab_get_text(vocab, next);
-        if (!piece) break;
-
-        std::string t(piece);
-        if (t == "▁") t = " ";
-        else if (t.size() >= 3 && t.substr(0, 3) == "▁") t = " " + t.substr(3);
-
-        jstring pieceJ = env->NewStringUTF(t.c_str());
-        if (pieceJ) {
-            env->CallVoidMethod(callback, onToken, pieceJ);
-            env->DeleteLocalRef(pieceJ);
-            if (env->ExceptionCheck()) { env->ExceptionClear(); LOGE("Java exception in callback"); break; }
+        jboolean keep = JNI_FALSE;
+        if (chunkJ && (vectorJ || !vector)) {
+            keep = env->CallBooleanMethod(callback, onChunk, (jint) c.index, (jlong) c.hash, chunkJ, vectorJ);
         }
+        if (vectorJ) env->DeleteLocalRef(vectorJ);
+        if (chunkJ) env->DeleteLocalRef(chunkJ);
+        threw = env->ExceptionCheck();
+        return !threw && keep == JNI_TRUE;
+    };
+    cb.on_progress = [&](const ingest_stats& st) {
+        if (threw) return;
+        env->CallVoidMethod(callback, onProgress, (jlong) st.bytes_read, (jlong) st.bytes_total,
+                            (jint) st.chunks, (jint) st.embedded, (jint) st.reused);
+        threw = env->ExceptionCheck();
+    };
+
+    ingest_stats stats;
+    std::string error;
+    const bool ok = pathJ ? ingest_file(emb, source, cfg, known, cb, &stats, &error)
+                          : ingest_text(emb, source.data(), source.size(), cfg, known, cb, &stats, &error);
+    if (threw) return nullptr;
+    if (!ok) {
+        LOGE("Ingestion failed: %s", error.c_str());
+        jclass ioe = env->FindClass("java/io/IOException");
+        env->ThrowNew(ioe, error.c_str());
+        return nullptr;
+    }
+    return new_int_array(env, {stats.chunks, stats.embedded, stats.reused});
+}
 
-        batch_clear_compat(&batch);
-        batch.n_tokens     = 1;
-        batch.token[0]     = next;
-        batch.pos[0]       = n_cur++;
-        batch.n_seq_id[0]  = 1;
-        batch.seq_id[0][0] = 0;
-        batch.logits[0]    = 1;
-
-        if (llama_decode(ctx, batch) != 0) {
-            LOGE("Streaming decode token failed");
-            break;
-        }
+// Streams the file at pathJ through the chunker and embedder. Hashes in knownJ (from an
+// earlier import) are reported to onChunk with a null vector instead of being embedded.
+JNIEXPORT jintArray JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaEmbedIngestFile(JNIEnv *env, jclass, jlong embPtr, jstring pathJ,
+                                                        jint chunkTokens, jint overlapTokens,
+                                                        jlongArray knownJ, jobject callback) {
+    if (!pathJ) {
+        jclass ioe = env->FindClass("java/io/IOException");
+        env->ThrowNew(ioe, "Failed to get ingest path");
+        return nullptr;
     }
+    return ingest_jni(env, embPtr, pathJ, nullptr, chunkTokens, overlapTokens, knownJ, callback);
+}
 
-    llama_sampler_free(sampler);
-    llama_batch_free(batch);
-    llama_perf_context_print(ctx);
-    LOGI("Streaming generation completed");
+// Same over text already in memory
+JNIEXPORT jintArray JNICALL
+Java_edu_upt_assistant_LlamaNative_llamaEmbedIngestText(JNIEnv *env, jclass, jlong embPtr, jstring textJ,
+                                                        jint chunkTokens, jint overlapTokens,
+                                                        jlongArray knownJ, jobject callback) {
+    if (!textJ) {
+        jclass ioe = env->FindClass("java/io/IOException");
+        env->ThrowNew(ioe, "Failed to get ingest text");
+        return nullptr;
+    }
+    return ingest_jni(env, embPtr, nullptr, textJ, chunkTokens, overlapTokens, knownJ, callback);
 }
 
 } // extern "C"
@@ -0,0 +1,217 @@
+#include "lexical_index.h"
+#include "test_util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <random>
+#include <unistd.h>
+
+namespace {
+
+std::vector<std::string> terms(const std::string & text) {
+    std::vector<std::string> out;
+    lexical_index::tokenize(text, &out);
+    return out;
+}
+
+void test_tokenize() {
+    using words = std::vector<std::string>;
+    CHECK((terms("The user's Favorite FILES are sci-fi") == words{"user", "favorite", "file", "sci", "fi"}));
+    // Stop words and one-letter words carry nothing
+    CHECK(terms("it is a I x, and the").empty());
+    // Plurals fold onto the singular; -ss, -us and -is are not plurals
+    CHECK((terms("queries cats boxes status analysis glass") ==
+           words{"query", "cat", "boxe", "status", "analysis", "glass"}));
+    // Unicode punctuation separates words; non-ASCII letters stay inside them
+    CHECK((terms("\xe2\x80\x9c" "Dune" "\xe2\x80\x9d caf\xc3\xa9\xe2\x80\x99s\xe2\x80\x94really") ==
+           words{"dune", "caf\xc3\xa9", "really"}));
+    // English clitics are dropped, other apostrophes split words
+    CHECK((terms("don't we're l'avion O'Neil") == words{"don", "avion", "neil"}));
+}
+
+// Reference BM25 (k1 = 1.2, b = 0.75) by brute force. Dead docs still count towards document
+// frequencies and N until compaction, as in the index.
+struct ref_doc {
+    int64_t id;
+    std::vector<std::string> terms;
+    bool alive;
+};
+
+std::vector<std::pair<float, int64_t>> brute_bm25(const std::vector<ref_doc> & docs, const std::string & query, size_t k) {
+    std::map<std::string, int> qtf;
+    for (const auto & t : terms(query)) qtf[t]++;
+    std::map<std::string, double> df;
+    double total_len = 0;
+    size_t live = 0;
+    for (const auto & d : docs) {
+        std::map<std::string, int> seen;
+        for (const auto & t : d.terms) seen[t] = 1;
+        for (const auto & s : seen) df[s.first]++;
+        if (d.alive) {
+            total_len += (double) d.terms.size();
+            ++live;
+        }
+    }
+    const double n = (double) docs.size();
+    const float avg = live ? std::max(1.0f, (float) (total_len / (double) live)) : 1.0f;
+
+    std::vector<std::pair<float, int64_t>> hits;
+    for (const auto & d : docs) {
+        if (!d.alive) continue;
+        std::map<std::string, int> tf;
+        for (const auto & t : d.terms) tf[t]++;
+        float score = 0;
+        bool matched = false;
+        for (const auto & [term, count] : qtf) {
+            auto it = tf.find(term);
+            if (it == tf.end()) continue;
+            matched = true;
+            const float idf  = (float) std::log(1.0 + (n - df[term] + 0.5) / (df[term] + 0.5));
+            const float norm = 1.2f * (1 - 0.75f + 0.75f * (float) d.terms.size() / avg);
+            score += (float) count * idf * (float) it->second * 2.2f / ((float) it->second + norm);
+        }
+        if (matched) hits.emplace_back(score, d.id);
+    }
+    std::sort(hits.begin(), hits.end(), [](const auto & a, const auto & b) { return a.first > b.first; });
+    if (hits.size() > k) hits.resize(k);
+    return hits;
+}
+
+// Block-max WAND must return exactly the brute-force top-k scores
+bool matches_brute(const lexical_index & idx, const std::vector<ref_doc> & docs, const std::string & query, size_t k) {
+    std::vector<int64_t> ids(k);
+    std::vector<float> scores(k);
+    const size_t n = idx.search(query, k, ids.data(), scores.data());
+    const auto expected = brute_bm25(docs, query, k);
+    if (n != expected.size()) return false;
+    for (size_t i = 0; i < n; ++i) {
+        if (std::fabs(scores[i] - expected[i].first) > 1e-3f * std::max(1.0f, expected[i].first)) return false;
+    }
+    return true;
+}
+
+void copy_file(const std::string & from, const std::string & to) {
+    std::error_code ec;
+    std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec);
+}
+
+void test_search_and_persistence() {
+    const std::string dir = test_dir("lexical_index_test");
+    const std::string path = dir + "/docs.lidx";
+
+    // Zipf-ish term frequencies over a synthetic vocabulary, so lists span many blocks
+    std::mt19937 rng(7);
+    const auto word = [&]() {
+        const double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return "w" + std::to_string(std::min(499, (int) std::pow(500.0, u) - 1)) + "x";
+    };
+    const auto text = [&](int len) {
+        std::string t;
+        for (int j = 0; j < len; ++j) t += word() + " ";
+        return t;
+    };
+
+    std::vector<ref_doc> docs;
+    std::vector<int64_t> ids;
+    std::vector<std::string> texts;
+    for (int i = 0; i < 800; ++i) {
+        ids.push_back(1000 + i);
+        texts.push_back(text(5 + (int) (rng() % 60)));
+        docs.push_back({ids.back(), terms(texts.back()), true});
+    }
+    std::vector<std::string> queries;
+    for (int i = 0; i < 30; ++i) queries.push_back(text(1 + (int) (rng() % 4)));
+    const auto all_match = [&](const lexical_index & idx, size_t k) {
+        return std::all_of(queries.begin(), queries.end(),
+                           [&](const std::string & q) { return matches_brute(idx, docs, q, k); });
+    };
+
+    lexical_index * idx = lexical_index::open(path);
+    CHECK(idx != nullptr);
+    if (!idx) return;
+    CHECK(idx->add(ids.data(), texts.data(), ids.size()) == ids.size());
+    CHECK(idx->size() == ids.size());
+    CHECK(all_match(*idx, 1));
+    CHECK(all_match(*idx, 10));
+    CHECK(all_match(*idx, 50));
+
+    // Deletes and replacements leave dead postings behind
+    std::vector<int64_t> removed;
+    for (int i = 0; i < 800; i += 7) removed.push_back(1000 + i);
+    CHECK(idx->remove(removed.data(), removed.size()) == removed.size());
+    for (int64_t id : removed) docs[(size_t) (id - 1000)].alive = false;
+    for (int i = 1; i < 800; i += 13) {
+        const int64_t id = 1000 + i;
+        const std::string t = "replacement " + word();
+        idx->add(&id, &t, 1);
+        docs[(size_t) i].alive = false;
+        docs.push_back({id, terms(t), true});
+    }
+    CHECK(!idx->contains(1000));
+    CHECK(idx->contains(1001));
+    CHECK(all_match(*idx, 10));
+    CHECK(matches_brute(*idx, docs, "replacement", 20));
+
+    // A crash now leaves the snapshot plus the journal: replay them, ignoring a torn last record
+    const std::string crashed = dir + "/crashed.lidx";
+    copy_file(path, crashed);
+    copy_file(path + ".log", crashed + ".log");
+    const int fd = ::open((crashed + ".log").c_str(), O_WRONLY | O_APPEND);
+    CHECK(fd >= 0);
+    if (fd >= 0) {
+        const uint8_t torn[6] = {1, 0, 0, 0, 0xff, 0xff};
+        CHECK(write(fd, torn, sizeof(torn)) == (ssize_t) sizeof(torn));
+        close(fd);
+    }
+    lexical_index * replayed = lexical_index::open(crashed);
+    CHECK(replayed != nullptr);
+    if (replayed) {
+        CHECK(replayed->size() == idx->size());
+        CHECK(all_match(*replayed, 10));
+        // Still appendable after dropping the torn record
+        const int64_t id = 5;
+        const std::string t = "zebra crossing";
+        CHECK(replayed->add(&id, &t, 1) == 1);
+        delete replayed;
+        replayed = lexical_index::open(crashed);
+        CHECK(replayed && replayed->contains(5));
+        delete replayed;
+    }
+
+    // Clean shutdown writes a snapshot that reopens to the same results
+    delete idx;
+    idx = lexical_index::open(path);
+    CHECK(idx != nullptr);
+    if (!idx) return;
+    CHECK(all_match(*idx, 10));
+
+    // With over a quarter of the docs dead, save() drops their postings and statistics
+    removed.clear();
+    for (int i = 1; i < 800; i += 2) removed.push_back(1000 + i);
+    idx->remove(removed.data(), removed.size());
+    for (auto & d : docs) {
+        if (std::find(removed.begin(), removed.end(), d.id) != removed.end()) d.alive = false;
+    }
+    CHECK(idx->save());
+    docs.erase(std::remove_if(docs.begin(), docs.end(), [](const ref_doc & d) { return !d.alive; }), docs.end());
+    CHECK(idx->size() == docs.size());
+    CHECK(all_match(*idx, 10));
+    delete idx;
+
+    idx = lexical_index::open(path);
+    CHECK(idx && idx->size() == docs.size());
+    if (idx) CHECK(all_match(*idx, 10));
+    delete idx;
+    std::filesystem::remove_all(dir);
+}
+
+} // namespace
+
+int main() {
+    test_tokenize();
+    test_search_and_persistence();
+    return test_result("lexical_index_test");
+}
@@ -0,0 +1,78 @@
+#include "llama_core.h"
+#include "test_util.h"
+
+namespace {
+
+// Feeds `pieces` through a text_stream and returns everything delivered (flushed at the end
+// unless a stop string matched)
+std::string stream(const std::vector<std::string> & stops, const std::vector<std::string> & pieces, bool * stopped) {
+    text_stream ts;
+    ts.stops = stops;
+    std::string delivered, out;
+    *stopped = false;
+    for (const auto & p : pieces) {
+        const bool more = text_stream_push(ts, p.data(), p.size(), &out);
+        delivered += out;
+        if (!more) {
+            *stopped = true;
+            return delivered;
+        }
+    }
+    text_stream_flush(ts, &out);
+    return delivered + out;
+}
+
+void test_text_stream() {
+    bool stopped = false;
+    CHECK(stream({}, {"Hello", ", ", "world"}, &stopped) == "Hello, world" && !stopped);
+
+    // A character split across tokens is held until it is complete
+    {
+        text_stream ts;
+        std::string out;
+        CHECK(text_stream_push(ts, "caf\xc3", 4, &out) && out == "caf");
+        CHECK(text_stream_push(ts, "\xa9!", 2, &out) && out == "\xc3\xa9!");
+    }
+    // ... and a dangling partial character is dropped at the end
+    CHECK(stream({}, {"ok\xe2\x80"}, &stopped) == "ok");
+
+    // Stop strings split across tokens end the text right before them
+    CHECK(stream({"</s>", "User:"}, {"Sure thing. Us", "er: hi"}, &stopped) == "Sure thing. " && stopped);
+    CHECK(stream({"</s>"}, {"done<", "/", "s>", "tail"}, &stopped) == "done" && stopped);
+    // A held prefix that stops matching is released
+    CHECK(stream({"User:"}, {"Us", "ually"}, &stopped) == "Usually" && !stopped);
+    {
+        text_stream ts;
+        ts.stops = {"User:"};
+        std::string out;
+        CHECK(text_stream_push(ts, "a Us", 4, &out) && out == "a ");
+        CHECK(text_stream_push(ts, "e", 1, &out) && out.empty());   // "Use" may still become "User:"
+        CHECK(text_stream_push(ts, "d", 1, &out) && out == "Used");
+    }
+    // The earliest of several stop strings wins
+    CHECK(stream({"##", "#"}, {"x # y ## z"}, &stopped) == "x " && stopped);
+
+    CHECK(utf8_complete_len("ab\xc3\xa9", 4) == 4);
+    CHECK(utf8_complete_len("ab\xc3", 3) == 2);
+    CHECK(utf8_complete_len("\xf0\x9f\x98", 3) == 0);
+}
+
+void test_pack_token_budget() {
+    using idx = std::vector<int32_t>;
+    // Greedy in priority order: a too-large item is skipped, smaller later ones still fit
+    CHECK((pack_token_budget({5, 10, 3, 4}, 12, 1) == idx{0, 2}));
+    // The first item pays no separator
+    CHECK((pack_token_budget({6, 6}, 12, 0) == idx{0, 1}));
+    CHECK((pack_token_budget({6, 6}, 12, 1) == idx{0}));
+    CHECK((pack_token_budget({13, 2}, 12, 1) == idx{1}));
+    CHECK(pack_token_budget({1, 2}, 0, 0).empty());
+    CHECK(pack_token_budget({}, 100, 1).empty());
+}
+
+} // namespace
+
+int main() {
+    test_text_stream();
+    test_pack_token_budget();
+    return test_result("llama_core_test");
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+// Minimal checks for the host tests (no model needed): failures are printed and counted, and
+// main() returns test_result() so ctest sees them.
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+inline int & test_failures() {
+    static int n = 0;
+    return n;
+}
+
+#define CHECK(cond)                                                                   \
+    do {                                                                              \
+        if (!(cond)) {                                                                \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++test_failures();                                                        \
+        }                                                                             \
+    } while (0)
+
+// Fresh, empty directory for one test's files under the system temp dir
+inline std::string test_dir(const char * name) {
+    const auto dir = std::filesystem::temp_directory_path() / name;
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    return dir.string();
+}
+
+inline int test_result(const char * name) {
+    if (test_failures() == 0) {
+        std::printf("%s: ok\n", name);
+        return 0;
+    }
+    std::printf("%s: %d check(s) failed\n", name, test_failures());
+    return 1;
+}
@@ -0,0 +1,197 @@
+#include "vector_index.h"
+#include "test_util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <random>
+
+namespace {
+
+constexpr uint32_t DIM = 64;
+
+std::vector<float> random_vectors(std::mt19937 & rng, size_t n) {
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<float> v(n * DIM);
+    for (auto & x : v) x = dist(rng);
+    return v;
+}
+
+float cosine(const float * a, const float * b) {
+    double dot = 0, na = 0, nb = 0;
+    for (uint32_t i = 0; i < DIM; ++i) {
+        dot += (double) a[i] * b[i];
+        na  += (double) a[i] * a[i];
+        nb  += (double) b[i] * b[i];
+    }
+    return (float) (dot / std::sqrt(na * nb));
+}
+
+struct result {
+    std::vector<int64_t> ids;
+    std::vector<float> scores;
+};
+
+result search(const vector_index & idx, const float * q, size_t k, float min_score = -1.0f) {
+    result r{std::vector<int64_t>(k), std::vector<float>(k)};
+    const size_t n = idx.search(q, k, min_score, r.ids.data(), r.scores.data());
+    r.ids.resize(n);
+    r.scores.resize(n);
+    return r;
+}
+
+// The float path is exact; int8 keeps most of the true top-k with cosines close to exact
+void test_quantized_topk(const std::string & dir) {
+    std::mt19937 rng(11);
+    const size_t n = 2000, k = 10;
+    const auto vectors = random_vectors(rng, n);
+    std::vector<int64_t> ids(n);
+    for (size_t i = 0; i < n; ++i) ids[i] = (int64_t) i;
+
+    vector_index * exact = vector_index::open(dir + "/f32.vidx", DIM, false);
+    vector_index * quant = vector_index::open(dir + "/i8.vidx", DIM, true);
+    CHECK(exact && quant);
+    if (!exact || !quant) return;
+    CHECK(exact->add(ids.data(), vectors.data(), n) == n);
+    CHECK(quant->add(ids.data(), vectors.data(), n) == n);
+
+    const auto queries = random_vectors(rng, 20);
+    for (size_t qi = 0; qi < 20; ++qi) {
+        const float * q = queries.data() + qi * DIM;
+        std::vector<std::pair<float, int64_t>> brute;
+        for (size_t i = 0; i < n; ++i) brute.emplace_back(cosine(q, vectors.data() + i * DIM), (int64_t) i);
+        std::partial_sort(brute.begin(), brute.begin() + k, brute.end(), std::greater<>());
+
+        const result f = search(*exact, q, k);
+        CHECK(f.ids.size() == k);
+        for (size_t i = 0; i < f.ids.size(); ++i) {
+            CHECK(f.ids[i] == brute[i].second);
+            CHECK(std::fabs(f.scores[i] - brute[i].first) < 1e-4f);
+        }
+
+        const result q8 = search(*quant, q, k);
+        CHECK(q8.ids.size() == k);
+        size_t overlap = 0;
+        for (size_t i = 0; i < q8.ids.size(); ++i) {
+            overlap += std::count(f.ids.begin(), f.ids.end(), q8.ids[i]);
+            const float truth = cosine(q, vectors.data() + (size_t) q8.ids[i] * DIM);
+            CHECK(std::fabs(q8.scores[i] - truth) < 0.03f);
+            if (i > 0) CHECK(q8.scores[i] <= q8.scores[i - 1]);
+        }
+        CHECK(overlap >= 7);
+    }
+    // min_score cuts the tail
+    const result top = search(*exact, queries.data(), 50, 0.2f);
+    CHECK(std::all_of(top.scores.begin(), top.scores.end(), [](float s) { return s >= 0.2f; }));
+    delete exact;
+    delete quant;
+}
+
+void test_tombstones_and_compaction(const std::string & dir) {
+    std::mt19937 rng(5);
+    const std::string path = dir + "/tomb.vidx";
+    const size_t n = 300;
+    auto vectors = random_vectors(rng, n);
+    std::vector<int64_t> ids(n);
+    for (size_t i = 0; i < n; ++i) ids[i] = 100 + (int64_t) i;
+
+    vector_index * idx = vector_index::open(path, DIM, true);
+    CHECK(idx != nullptr);
+    if (!idx) return;
+    idx->add(ids.data(), vectors.data(), n);
+
+    // Even ids go away and never come back from search
+    std::vector<int64_t> removed;
+    for (size_t i = 0; i < n; i += 2) removed.push_back(ids[i]);
+    CHECK(idx->remove(removed.data(), removed.size()) == removed.size());
+    CHECK(idx->remove(removed.data(), 1) == 0);
+    CHECK(idx->size() == n - removed.size());
+    CHECK(!idx->contains(100));
+    CHECK(idx->contains(101));
+    for (size_t i = 0; i < n; i += 2) {
+        const result r = search(*idx, vectors.data() + i * DIM, 5);
+        for (int64_t id : r.ids) CHECK((id - 100) % 2 == 1);
+    }
+
+    // Replacing an id serves the new vector
+    const auto fresh = random_vectors(rng, 1);
+    const int64_t replaced = 101;
+    idx->add(&replaced, fresh.data(), 1);
+    CHECK(idx->size() == n - removed.size());
+    std::vector<float> stored(DIM);
+    CHECK(idx->get(replaced, stored.data()));
+    CHECK(cosine(stored.data(), fresh.data()) > 0.99f);
+    const result self = search(*idx, fresh.data(), 1);
+    CHECK(self.ids.size() == 1 && self.ids[0] == replaced);
+
+    // Compaction reclaims the tombstones without changing any answer
+    const auto queries = random_vectors(rng, 10);
+    std::vector<result> before;
+    for (size_t qi = 0; qi < 10; ++qi) before.push_back(search(*idx, queries.data() + qi * DIM, 10));
+    CHECK(idx->compact() > 0);
+    CHECK(idx->mapped());
+    CHECK(idx->compact() == 0);
+    CHECK(idx->size() == n - removed.size());
+    for (size_t qi = 0; qi < 10; ++qi) CHECK(search(*idx, queries.data() + qi * DIM, 10).ids == before[qi].ids);
+
+    // ... and the compacted file reopens to the same state and keeps taking appends
+    delete idx;
+    idx = vector_index::open(path, DIM, true);
+    CHECK(idx && idx->size() == n - removed.size());
+    if (!idx) return;
+    for (size_t qi = 0; qi < 10; ++qi) CHECK(search(*idx, queries.data() + qi * DIM, 10).ids == before[qi].ids);
+    const int64_t appended = 7;
+    CHECK(idx->add(&appended, fresh.data(), 1) == 1);
+    CHECK(idx->contains(appended));
+    delete idx;
+
+    // Another dimension starts the file over
+    idx = vector_index::open(path, DIM / 2, true);
+    CHECK(idx && idx->size() == 0);
+    delete idx;
+}
+
+// A replace that died after publishing the new record but before tombstoning the old one
+// leaves two live records for one id; the newer must win on open and the older be dropped
+void test_interrupted_replace(const std::string & dir) {
+    std::mt19937 rng(9);
+    const std::string path = dir + "/replace.vidx";
+    const auto vectors = random_vectors(rng, 2);
+    const int64_t ids[2] = {1, 2};
+
+    vector_index * idx = vector_index::open(path, DIM, false);
+    CHECK(idx != nullptr);
+    if (!idx) return;
+    CHECK(idx->add(ids, vectors.data(), 2) == 2);
+    delete idx;
+
+    // Relabel slot 1 as id 1 (64-byte header, then float records of 16 + DIM * 4 bytes)
+    {
+        std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(64 + 16 + DIM * sizeof(float));
+        f.write((const char *) &ids[0], sizeof(ids[0]));
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        idx = vector_index::open(path, DIM, false);
+        CHECK(idx && idx->size() == 1);
+        if (!idx) return;
+        std::vector<float> stored(DIM);
+        CHECK(idx->get(1, stored.data()));
+        CHECK(cosine(stored.data(), vectors.data() + DIM) > 0.999f);
+        const result r = search(*idx, vectors.data(), 5);
+        CHECK(r.ids.size() == 1 && r.ids[0] == 1);
+        delete idx;
+    }
+}
+
+} // namespace
+
+int main() {
+    const std::string dir = test_dir("vector_index_test");
+    test_quantized_topk(dir);
+    test_tombstones_and_compaction(dir);
+    test_interrupted_replace(dir);
+    std::filesystem::remove_all(dir);
+    return test_result("vector_index_test");
+}
@@ -0,0 +1,434 @@
+#include "vector_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr uint32_t VIDX_MAGIC     = 0x58444956; // "VIDX"
+constexpr uint32_t VIDX_VERSION   = 1;
+constexpr uint32_t FLAG_DELETED   = 1u;
+constexpr size_t   HEADER_SIZE    = 64;
+constexpr size_t   RECORD_PREFIX  = 16;          // id + flags + scale
+constexpr uint64_t MIN_CAPACITY   = 256;         // records
+
+struct vidx_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dim;
+    uint32_t quant;
+    uint64_t n_records;
+    uint8_t  reserved[40];
+};
+static_assert(sizeof(vidx_header) == HEADER_SIZE, "header must be 64 bytes");
+
+inline size_t record_size(uint32_t dim, bool quant) {
+    const size_t payload = quant ? dim : (size_t) dim * sizeof(float);
+    return (RECORD_PREFIX + payload + 15) & ~(size_t) 15;
+}
+
+// ---------- kernels ----------
+
+float dot_f32(const float * a, const float * b, size_t n) {
+    size_t i = 0;
+    float s = 0.0f;
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i),     vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    s = vaddvq_f32(vaddq_f32(acc0, acc1));
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+    }
+    __m128 lo = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    lo = _mm_hadd_ps(lo, lo);
+    lo = _mm_hadd_ps(lo, lo);
+    s = _mm_cvtss_f32(lo);
+#endif
+    for (; i < n; ++i) s += a[i] * b[i];
+    return s;
+}
+
+// Values are quantized to [-127, 127], so pairwise int16 sums cannot overflow.
+int32_t dot_i8(const int8_t * a, const int8_t * b, size_t n) {
+    size_t i = 0;
+    int32_t s = 0;
+#if defined(__aarch64__) && defined(__ARM_FEATURE_DOTPROD)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 16 <= n; i += 16) {
+        acc = vdotq_s32(acc, vld1q_s8(a + i), vld1q_s8(b + i));
+    }
+    s = vaddvq_s32(acc);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 16 <= n; i += 16) {
+        const int8x16_t va = vld1q_s8(a + i);
+        const int8x16_t vb = vld1q_s8(b + i);
+        int16x8_t p = vmull_s8(vget_low_s8(va), vget_low_s8(vb));
+        p = vmlal_high_s8(p, va, vb);
+        acc = vpadalq_s16(acc, p);
+    }
+    s = vaddvq_s32(acc);
+#elif defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (; i + 32 <= n; i += 32) {
+        const __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        const __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        // maddubs needs unsigned x signed: |a| * (b with a's sign)
+        const __m256i p16 = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(p16, ones));
+    }
+    __m128i lo = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    lo = _mm_hadd_epi32(lo, lo);
+    lo = _mm_hadd_epi32(lo, lo);
+    s = _mm_cvtsi128_si32(lo);
+#endif
+    for (; i < n; ++i) s += (int32_t) a[i] * (int32_t) b[i];
+    return s;
+}
+
+// Symmetric per-vector int8 quantization; returns the scale (x ~= q * scale)
+float quantize_i8(const float * v, int8_t * q, size_t n) {
+    float amax = 0.0f;
+    for (size_t i = 0; i < n; ++i) amax = std::max(amax, std::fabs(v[i]));
+    const float scale = amax / 127.0f;
+    const float inv = scale > 0.0f ? 1.0f / scale : 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        q[i] = (int8_t) std::lround(std::max(-127.0f, std::min(127.0f, v[i] * inv)));
+    }
+    return scale;
+}
+
+void l2_normalize(const float * v, float * out, size_t n) {
+    const float sum = dot_f32(v, v, n);
+    const float inv = sum > 0.0f ? 1.0f / std::sqrt(sum) : 0.0f;
+    for (size_t i = 0; i < n; ++i) out[i] = v[i] * inv;
+}
+
+} // namespace
+
+vector_index::~vector_index() {
+    if (base_) {
+        sync_header();
+        msync(base_, mapped_, MS_SYNC);
+    }
+    unmap();
+    if (fd_ >= 0) {
+        // Give back the unused growth capacity
+        if (ftruncate(fd_, (off_t) (HEADER_SIZE + n_records_ * rec_size_)) != 0) {
+            // harmless: the header count bounds what is read back
+        }
+        close(fd_);
+    }
+}
+
+vector_index * vector_index::open(const std::string & path, uint32_t dim, bool quantize) {
+    if (dim == 0) return nullptr;
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return nullptr;
+
+    auto * idx = new vector_index();
+    idx->path_     = path;
+    idx->fd_       = fd;
+    idx->dim_      = dim;
+    idx->quant_    = quantize;
+    idx->rec_size_ = record_size(dim, quantize);
+
+    struct stat st{};
+    fstat(fd, &st);
+    vidx_header hdr{};
+    bool fresh = true;
+    if ((size_t) st.st_size >= HEADER_SIZE && pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t) sizeof(hdr)) {
+        fresh = hdr.magic != VIDX_MAGIC || hdr.version != VIDX_VERSION ||
+                hdr.dim != dim || hdr.quant != (uint32_t) quantize;
+    }
+    if (fresh) {
+        hdr = {};
+        hdr.magic   = VIDX_MAGIC;
+        hdr.version = VIDX_VERSION;
+        hdr.dim     = dim;
+        hdr.quant   = (uint32_t) quantize;
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)) {
+            delete idx;
+            return nullptr;
+        }
+        st.st_size = HEADER_SIZE;
+    }
+
+    // Trust the header count only as far as the file actually extends
+    const uint64_t on_disk = ((uint64_t) st.st_size - HEADER_SIZE) / idx->rec_size_;
+    idx->n_records_ = std::min<uint64_t>(hdr.n_records, on_disk);
+    if (!idx->reserve(std::max<uint64_t>(idx->n_records_, MIN_CAPACITY))) {
+        delete idx;
+        return nullptr;
+    }
+
+    for (uint64_t slot = 0; slot < idx->n_records_; ++slot) {
+        const uint8_t * rec = idx->record(slot);
+        int64_t id; uint32_t flags;
+        memcpy(&id, rec, sizeof(id));
+        memcpy(&flags, rec + 8, sizeof(flags));
+        if (flags & FLAG_DELETED) continue;
+        auto [it, inserted] = idx->slots_.try_emplace(id, slot);
+        if (!inserted) {
+            // add() died between publishing a replacement and tombstoning the old version
+            uint32_t deleted = FLAG_DELETED;
+            memcpy(idx->record(it->second) + 8, &deleted, sizeof(deleted));
+            it->second = slot;
+        }
+    }
+    return idx;
+}
+
+bool vector_index::map_file(size_t bytes) {
+    void * p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) return false;
+    base_   = (uint8_t *) p;
+    mapped_ = bytes;
+    return true;
+}
+
+void vector_index::unmap() {
+    if (base_) munmap(base_, mapped_);
+    base_   = nullptr;
+    mapped_ = 0;
+}
+
+// Grows the file (and mapping) geometrically so appends stay amortized O(1)
+bool vector_index::reserve(uint64_t n_records) {
+    const size_t needed = HEADER_SIZE + n_records * rec_size_;
+    if (base_ && needed <= mapped_) return true;
+
+    size_t cap = std::max(needed, mapped_ * 2);
+    cap = std::max(cap, HEADER_SIZE + MIN_CAPACITY * rec_size_);
+    if (base_) {
+        sync_header();
+        msync(base_, mapped_, MS_ASYNC);
+    }
+    unmap();
+    if (ftruncate(fd_, (off_t) cap) != 0) return false;
+    return map_file(cap);
+}
+
+void vector_index::sync_header() {
+    auto * hdr = (vidx_header *) base_;
+    hdr->n_records = n_records_;
+}
+
+uint8_t * vector_index::record(uint64_t slot) const {
+    return base_ + HEADER_SIZE + slot * rec_size_;
+}
+
+void vector_index::write_record(uint8_t * rec, int64_t id, const float * v) {
+    std::vector<float> unit(dim_);
+    l2_normalize(v, unit.data(), dim_);
+
+    const uint32_t flags = 0;
+    float scale = 1.0f;
+    memset(rec, 0, rec_size_);
+    if (quant_) {
+        scale = quantize_i8(unit.data(), (int8_t *) (rec + RECORD_PREFIX), dim_);
+    } else {
+        memcpy(rec + RECORD_PREFIX, unit.data(), (size_t) dim_ * sizeof(float));
+    }
+    memcpy(rec, &id, sizeof(id));
+    memcpy(rec + 8, &flags, sizeof(flags));
+    memcpy(rec + 12, &scale, sizeof(scale));
+}
+
+size_t vector_index::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return slots_.size();
+}
+
+size_t vector_index::add(const int64_t * ids, const float * vectors, size_t n) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (!reserve(n_records_ + n)) return 0;
+
+    std::vector<uint64_t> replaced;
+    for (size_t i = 0; i < n; ++i) {
+        write_record(record(n_records_), ids[i], vectors + i * (size_t) dim_);
+        auto [it, inserted] = slots_.try_emplace(ids[i], n_records_);
+        if (!inserted) {
+            replaced.push_back(it->second);
+            it->second = n_records_;
+        }
+        ++n_records_;
+    }
+    // Records first, then the count that publishes them, then the tombstones on the versions
+    // they replace. The mapping is shared, so each store lands in the file even if the process
+    // dies: before the count the old vectors are intact, after it open() resolves a duplicate id
+    // to its newer record.
+    sync_header();
+    for (uint64_t slot : replaced) {
+        uint32_t flags = FLAG_DELETED;
+        memcpy(record(slot) + 8, &flags, sizeof(flags));
+    }
+    msync(base_, mapped_, MS_ASYNC);
+    return n;
+}
+
+size_t vector_index::remove(const int64_t * ids, size_t n) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (!reserve(n_records_)) return 0;
+    size_t removed = 0;
+    for (size_t i = 0; i < n; ++i) {
+        auto it = slots_.find(ids[i]);
+        if (it == slots_.end()) continue;
+        uint32_t flags = FLAG_DELETED;
+        memcpy(record(it->second) + 8, &flags, sizeof(flags));
+        slots_.erase(it);
+        ++removed;
+    }
+    if (removed) msync(base_, mapped_, MS_ASYNC);
+    return removed;
+}
+
+bool vector_index::contains(int64_t id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return slots_.count(id) != 0;
+}
+
+bool vector_index::get(int64_t id, float * out) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = slots_.find(id);
+    if (it == slots_.end() || !base_) return false;
+    const uint8_t * rec = record(it->second);
+    if (quant_) {
+        float scale;
+        memcpy(&scale, rec + 12, sizeof(scale));
+        const auto * q = (const int8_t *) (rec + RECORD_PREFIX);
+        for (uint32_t i = 0; i < dim_; ++i) out[i] = q[i] * scale;
+    } else {
+        memcpy(out, rec + RECORD_PREFIX, (size_t) dim_ * sizeof(float));
+    }
+    return true;
+}
+
+float vector_index::score(const uint8_t * rec, const float * q, const int8_t * q8, float q_scale) const {
+    if (quant_) {
+        float scale;
+        memcpy(&scale, rec + 12, sizeof(scale));
+        return (float) dot_i8(q8, (const int8_t *) (rec + RECORD_PREFIX), dim_) * q_scale * scale;
+    }
+    return dot_f32(q, (const float *) (rec + RECORD_PREFIX), dim_);
+}
+
+size_t vector_index::search(const float * query, size_t k, float min_score,
+                            int64_t * out_ids, float * out_scores) const {
+    if (k == 0) return 0;
+    std::vector<float>  q(dim_);
+    std::vector<int8_t> q8;
+    float q_scale = 1.0f;
+    l2_normalize(query, q.data(), dim_);
+    if (quant_) {
+        q8.resize(dim_);
+        q_scale = quantize_i8(q.data(), q8.data(), dim_);
+    }
+
+    // Bounded min-heap: the root is the weakest of the current top-k
+    using hit = std::pair<float, int64_t>;
+    std::vector<hit> heap;
+    heap.reserve(k + 1);
+    const auto cmp = std::greater<hit>();
+
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    const uint64_t n_records = base_ ? n_records_ : 0;
+    for (uint64_t slot = 0; slot < n_records; ++slot) {
+        const uint8_t * rec = record(slot);
+        uint32_t flags;
+        memcpy(&flags, rec + 8, sizeof(flags));
+        if (flags & FLAG_DELETED) continue;
+
+        const float s = score(rec, q.data(), q8.data(), q_scale);
+        if (s < min_score) continue;
+        if (heap.size() == k && s <= heap.front().first) continue;
+
+        int64_t id;
+        memcpy(&id, rec, sizeof(id));
+        heap.emplace_back(s, id);
+        std::push_heap(heap.begin(), heap.end(), cmp);
+        if (heap.size() > k) {
+            std::pop_heap(heap.begin(), heap.end(), cmp);
+            heap.pop_back();
+        }
+    }
+    lock.unlock();
+
+    std::sort_heap(heap.begin(), heap.end(), cmp); // descending by score
+    for (size_t i = 0; i < heap.size(); ++i) {
+        out_scores[i] = heap[i].first;
+        out_ids[i]    = heap[i].second;
+    }
+    return heap.size();
+}
+
+size_t vector_index::compact() {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    const uint64_t n_live = slots_.size();
+    if (n_live == n_records_ || !base_) return 0;
+
+    const std::string tmp = path_ + ".tmp";
+    const int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return 0;
+
+    vidx_header hdr = *(const vidx_header *) base_;
+    hdr.n_records = n_live;
+    bool ok = write(fd, &hdr, sizeof(hdr)) == (ssize_t) sizeof(hdr);
+
+    std::unordered_map<int64_t, uint64_t> slots;
+    slots.reserve(n_live);
+    for (uint64_t slot = 0; ok && slot < n_records_; ++slot) {
+        const uint8_t * rec = record(slot);
+        uint32_t flags;
+        memcpy(&flags, rec + 8, sizeof(flags));
+        if (flags & FLAG_DELETED) continue;
+        int64_t id;
+        memcpy(&id, rec, sizeof(id));
+        ok = write(fd, rec, rec_size_) == (ssize_t) rec_size_;
+        const uint64_t new_slot = slots.size();
+        slots[id] = new_slot;
+    }
+    ok = ok && fsync(fd) == 0 && rename(tmp.c_str(), path_.c_str()) == 0;
+    if (!ok) {
+        close(fd);
+        unlink(tmp.c_str());
+        return 0;
+    }
+
+    const size_t reclaimed = (size_t) (n_records_ - n_live) * rec_size_;
+    unmap();
+    close(fd_);
+    fd_        = fd;
+    n_records_ = n_live;
+    slots_     = std::move(slots);
+    // On failure the compacted file is still intact on disk: base_ stays null (see mapped())
+    // until add() maps it again or the caller reopens it
+    reserve(std::max<uint64_t>(n_records_, MIN_CAPACITY));
+    return reclaimed;
+}
+
+bool vector_index::mapped() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return base_ != nullptr;
+}
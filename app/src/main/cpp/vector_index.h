@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Append-only, memory-mapped store of fixed-dimension vectors keyed by int64 id.
+//
+// File layout: a 64-byte header followed by fixed-size records
+//   [int64 id][uint32 flags][float scale][payload]
+// where payload is `dim` floats, or `dim` int8 values (symmetric, per-vector scale) when
+// quantized. Records are appended and the header count is bumped afterwards, so a torn
+// append is simply ignored on the next open. A replaced version is tombstoned only after
+// the count is published; should both survive a crash, open() keeps the newer one. Deletes
+// set a tombstone flag; compact() rewrites the live records into a fresh file.
+//
+// Vectors are L2-normalized on insert and queries are normalized too, so scores are cosines.
+class vector_index {
+public:
+    ~vector_index();
+
+    // Opens `path`, creating it if missing. An existing file with a different dim or
+    // quantization is discarded (callers re-add their vectors). Returns nullptr on I/O error.
+    static vector_index * open(const std::string & path, uint32_t dim, bool quantize);
+
+    uint32_t dim() const { return dim_; }
+    size_t   size() const;                      // live (non-deleted) vectors
+
+    // Inserts or replaces `n` row-major vectors. Returns the number written.
+    size_t add(const int64_t * ids, const float * vectors, size_t n);
+    // Tombstones the given ids. Returns the number actually deleted.
+    size_t remove(const int64_t * ids, size_t n);
+    bool   contains(int64_t id) const;
+    // Copies the stored (dequantized, normalized) vector into `out[dim]`.
+    bool   get(int64_t id, float * out) const;
+
+    // Top-k by cosine similarity, best first. Writes up to k results and returns the count.
+    size_t search(const float * query, size_t k, float min_score, int64_t * out_ids, float * out_scores) const;
+
+    // Drops tombstoned records from the file. Returns the number of bytes reclaimed.
+    size_t compact();
+    // False once the file could not be mapped again (after compact()): lookups come back
+    // empty and add() retries the mapping. Callers should reopen the index.
+    bool   mapped() const;
+
+private:
+    vector_index() = default;
+
+    bool   map_file(size_t bytes);
+    bool   reserve(uint64_t n_records);
+    void   unmap();
+    void   sync_header();
+    uint8_t * record(uint64_t slot) const;
+    void   write_record(uint8_t * rec, int64_t id, const float * v);
+    float  score(const uint8_t * rec, const float * q, const int8_t * q8, float q_scale) const;
+
+    std::string path_;
+    int         fd_       = -1;
+    uint8_t *   base_     = nullptr;
+    size_t      mapped_   = 0;
+    uint32_t    dim_      = 0;
+    bool        quant_    = false;
+    size_t      rec_size_ = 0;
+    uint64_t    n_records_ = 0;                  // appended records, including tombstones
+    std::unordered_map<int64_t, uint64_t> slots_; // id -> slot of its live record
+
+    mutable std::shared_mutex mutex_;
+};
@@ -0,0 +1,147 @@
+#include "vector_index.h"
+#include <algorithm>
+#include <android/log.h>
+#include <jni.h>
+#include <string>
+#include <vector>
+
+#define LOG_TAG "VECTOR_INDEX"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO,  LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+extern "C" {
+
+// ---------- helpers ----------
+
+static vector_index *index_or_throw(JNIEnv *env, jlong handle) {
+    auto *idx = reinterpret_cast<vector_index *>(handle);
+    if (!idx) {
+        jclass exc = env->FindClass("java/lang/IllegalStateException");
+        env->ThrowNew(exc, "Invalid vector index");
+    }
+    return idx;
+}
+
+// ---------- JNI: open / close ----------
+
+JNIEXPORT jlong JNICALL
+Java_edu_upt_assistant_VectorIndexNative_open(JNIEnv *env, jclass, jstring pathJ, jint dim, jboolean quantize) {
+    const char *path = env->GetStringUTFChars(pathJ, nullptr);
+    vector_index *idx = vector_index::open(path, (uint32_t) dim, quantize == JNI_TRUE);
+    if (!idx) {
+        LOGE("Failed to open vector index %s", path);
+        env->ReleaseStringUTFChars(pathJ, path);
+        jclass exc = env->FindClass("java/lang/RuntimeException");
+        env->ThrowNew(exc, "Failed to open vector index");
+        return 0;
+    }
+    LOGI("Opened %s: %zu vectors, dim=%d, int8=%d", path, idx->size(), dim, quantize == JNI_TRUE);
+    env->ReleaseStringUTFChars(pathJ, path);
+    return reinterpret_cast<jlong>(idx);
+}
+
+JNIEXPORT void JNICALL
+Java_edu_upt_assistant_VectorIndexNative_close(JNIEnv *, jclass, jlong handle) {
+    delete reinterpret_cast<vector_index *>(handle);
+}
+
+// ---------- JNI: mutation ----------
+
+// `vectors` is row-major [ids.size * dim]
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_VectorIndexNative_add(JNIEnv *env, jclass, jlong handle, jlongArray idsJ, jfloatArray vectorsJ) {
+    vector_index *idx = index_or_throw(env, handle);
+    if (!idx) return 0;
+    const jsize n = env->GetArrayLength(idsJ);
+    if ((size_t) env->GetArrayLength(vectorsJ) != (size_t) n * idx->dim()) {
+        jclass exc = env->FindClass("java/lang/IllegalArgumentException");
+        env->ThrowNew(exc, "vectors.size must be ids.size * dim");
+        return 0;
+    }
+    jlong *ids = env->GetLongArrayElements(idsJ, nullptr);
+    jfloat *vectors = env->GetFloatArrayElements(vectorsJ, nullptr);
+    const size_t added = idx->add(reinterpret_cast<const int64_t *>(ids), vectors, (size_t) n);
+    env->ReleaseFloatArrayElements(vectorsJ, vectors, JNI_ABORT);
+    env->ReleaseLongArrayElements(idsJ, ids, JNI_ABORT);
+    return (jint) added;
+}
+
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_VectorIndexNative_delete(JNIEnv *env, jclass, jlong handle, jlongArray idsJ) {
+    vector_index *idx = index_or_throw(env, handle);
+    if (!idx) return 0;
+    const jsize n = env->GetArrayLength(idsJ);
+    jlong *ids = env->GetLongArrayElements(idsJ, nullptr);
+    const size_t removed = idx->remove(reinterpret_cast<const int64_t *>(ids), (size_t) n);
+    env->ReleaseLongArrayElements(idsJ, ids, JNI_ABORT);
+    return (jint) removed;
+}
+
+JNIEXPORT jlong JNICALL
+Java_edu_upt_assistant_VectorIndexNative_compact(JNIEnv *env, jclass, jlong handle) {
+    vector_index *idx = index_or_throw(env, handle);
+    if (!idx) return 0;
+    const size_t reclaimed = idx->compact();
+    if (reclaimed) LOGI("Compacted vector index, reclaimed %zu bytes", reclaimed);
+    if (!idx->mapped()) LOGE("Vector index could not be mapped again after compaction");
+    return (jlong) reclaimed;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_edu_upt_assistant_VectorIndexNative_isMapped(JNIEnv *env, jclass, jlong handle) {
+    vector_index *idx = index_or_throw(env, handle);
+    return idx && idx->mapped() ? JNI_TRUE : JNI_FALSE;
+}
+
+// ---------- JNI: lookup / search ----------
+
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_VectorIndexNative_count(JNIEnv *env, jclass, jlong handle) {
+    vector_index *idx = index_or_throw(env, handle);
+    return idx ? (jint) idx->size() : 0;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_edu_upt_assistant_VectorIndexNative_contains(JNIEnv *env, jclass, jlong handle, jlong id) {
+    vector_index *idx = index_or_throw(env, handle);
+    return idx && idx->contains((int64_t) id) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_edu_upt_assistant_VectorIndexNative_get(JNIEnv *env, jclass, jlong handle, jlong id) {
+    vector_index *idx = index_or_throw(env, handle);
+    if (!idx) return nullptr;
+    std::vector<float> v(idx->dim());
+    if (!idx->get((int64_t) id, v.data())) return nullptr;
+    jfloatArray out = env->NewFloatArray((jsize) v.size());
+    env->SetFloatArrayRegion(out, 0, (jsize) v.size(), v.data());
+    return out;
+}
+
+// Fills caller-owned outIds/outScores (capacity >= k), best first, and returns the hit count.
+// Reusing the output arrays keeps the per-query path free of JVM allocations.
+JNIEXPORT jint JNICALL
+Java_edu_upt_assistant_VectorIndexNative_search(JNIEnv *env, jclass, jlong handle, jfloatArray queryJ,
+                                                jint k, jfloat minScore, jlongArray outIdsJ, jfloatArray outScoresJ) {
+    vector_index *idx = index_or_throw(env, handle);
+    if (!idx) return 0;
+    if ((uint32_t) env->GetArrayLength(queryJ) != idx->dim()) {
+        jclass exc = env->FindClass("java/lang/IllegalArgumentException");
+        env->ThrowNew(exc, "query.size must equal the index dimension");
+        return 0;
+    }
+    const jsize cap = std::min(env->GetArrayLength(outIdsJ), env->GetArrayLength(outScoresJ));
+    const size_t topk = (size_t) std::max(0, std::min<jint>(k, cap));
+
+    std::vector<float> query(idx->dim());
+    env->GetFloatArrayRegion(queryJ, 0, (jsize) query.size(), query.data());
+    std::vector<int64_t> ids(topk);
+    std::vector<float> scores(topk);
+    const size_t n = idx->search(query.data(), topk, minScore, ids.data(), scores.data());
+
+    env->SetLongArrayRegion(outIdsJ, 0, (jsize) n, reinterpret_cast<const jlong *>(ids.data()));
+    env->SetFloatArrayRegion(outScoresJ, 0, (jsize) n, scores.data());
+    return (jint) n;
+}
+
+} // extern "C"
@@ -0,0 +1,61 @@
+package edu.upt.assistant
+
+/** K/V cache element types the native context accepts; [ggmlType] is the ggml_type value. */
+enum class KvCacheType(val ggmlType: Int, val label: String) {
+  F16(1, "f16"),
+  Q8_0(8, "q8_0"),
+  Q4_0(2, "q4_0");
+
+  companion object {
+    fun fromLabel(label: String?): KvCacheType = entries.firstOrNull { it.label == label } ?: F16
+    fun fromGgmlType(type: Int): KvCacheType = entries.firstOrNull { it.ggmlType == type } ?: F16
+  }
+}
+
+/**
+ * Shape of a chat context (session_config). With [memoryBudgetMb] > 0 the native side picks the
+ * largest nCtx/nUbatch whose KV cache and compute buffers fit in it; a quantized V cache turns
+ * flash attention on.
+ */
+data class ContextConfig(
+  val nCtx: Int = DEFAULT_N_CTX,
+  val nBatch: Int = 256,
+  val nUbatch: Int = 64,
+  val typeK: KvCacheType = KvCacheType.F16,
+  val typeV: KvCacheType = KvCacheType.F16,
+  val flashAttn: Boolean = false,
+  val memoryBudgetMb: Int = 0,
+) {
+  companion object {
+    const val DEFAULT_N_CTX = 1536
+  }
+}
+
+/** What a context actually got, with its memory footprint besides the weights (estimated natively). */
+data class ContextInfo(
+  val nCtx: Int,
+  val nBatch: Int,
+  val nUbatch: Int,
+  val typeK: KvCacheType,
+  val typeV: KvCacheType,
+  val flashAttn: Boolean,
+  val kvBytes: Long,
+  val computeBytes: Long,
+) {
+  val kvMb: Double get() = kvBytes / (1024.0 * 1024.0)
+  val computeMb: Double get() = computeBytes / (1024.0 * 1024.0)
+
+  companion object {
+    /** Layout written by new_context_info in llama_jni.cpp. */
+    fun fromNative(values: LongArray): ContextInfo = ContextInfo(
+      nCtx = values[0].toInt(),
+      nBatch = values[1].toInt(),
+      nUbatch = values[2].toInt(),
+      typeK = KvCacheType.fromGgmlType(values[3].toInt()),
+      typeV = KvCacheType.fromGgmlType(values[4].toInt()),
+      flashAttn = values[5] != 0L,
+      kvBytes = values[6],
+      computeBytes = values[7],
+    )
+  }
+}
@@ -0,0 +1,88 @@
+package edu.upt.assistant
+
+/**
+ * What one generation request cost, measured natively on the worker thread (gen_telemetry).
+ * Token counts are exact; durations are microseconds. With several requests decoding together
+ * each one's phases include the batched steps it shared with the others.
+ */
+data class GenerationTelemetry(
+  val status: Int,
+  val promptTokens: Int,
+  val reusedTokens: Int,
+  val prefilledTokens: Int,
+  val generatedTokens: Int,
+  val draftedTokens: Int,
+  val acceptedTokens: Int,
+  val queueUs: Long,
+  val tokenizeUs: Long,
+  val prefillUs: Long,
+  val prefillUbatches: Int,
+  val firstSampleUs: Long,
+  val sampleUs: Long,
+  val decodeUs: Long,
+  val decodeSteps: Int,
+  val firstTokenUs: Long,
+  val totalUs: Long,
+  val latencyP50Us: Long,
+  val latencyP95Us: Long,
+  val latencyP99Us: Long,
+  /** Inter-token gaps: bucket i counts gaps below 2^i ms, the last bucket the rest. */
+  val latencyHistogram: List<Int>,
+  val kvCellsUsed: Int,
+  val kvCellsTotal: Int,
+  val nThreads: Int,
+  val nThreadsBatch: Int,
+  val nBatch: Int,
+  val nUbatch: Int,
+  /** Window slides when the conversation outgrew n_ctx, and the tokens they dropped. */
+  val contextShifts: Int,
+  val discardedTokens: Int,
+) {
+  val prefillMs: Long get() = prefillUs / 1000
+  val firstSampleMs: Long get() = firstSampleUs / 1000
+  val firstTokenMs: Long get() = firstTokenUs / 1000
+  val decodeMs: Long get() = decodeUs / 1000
+
+  /** Tokens per second after the first one; 0 when fewer than two tokens came out. */
+  val decodeSpeed: Double
+    get() = if (generatedTokens > 1 && decodeUs > 0) (generatedTokens - 1) * 1_000_000.0 / decodeUs else 0.0
+
+  /** Histogram as "n0|n1|..." for CSV columns. */
+  fun histogramString(): String = latencyHistogram.joinToString("|")
+
+  companion object {
+    /** Built by llama_jni.cpp; the index order matches its telemetry_field enum. */
+    @JvmStatic
+    fun fromNative(values: LongArray, histogram: IntArray): GenerationTelemetry = GenerationTelemetry(
+      status = values[0].toInt(),
+      promptTokens = values[1].toInt(),
+      reusedTokens = values[2].toInt(),
+      prefilledTokens = values[3].toInt(),
+      generatedTokens = values[4].toInt(),
+      draftedTokens = values[5].toInt(),
+      acceptedTokens = values[6].toInt(),
+      queueUs = values[7],
+      tokenizeUs = values[8],
+      prefillUs = values[9],
+      prefillUbatches = values[10].toInt(),
+      firstSampleUs = values[11],
+      sampleUs = values[12],
+      decodeUs = values[13],
+      decodeSteps = values[14].toInt(),
+      firstTokenUs = values[15],
+      totalUs = values[16],
+      latencyP50Us = values[17],
+      latencyP95Us = values[18],
+      latencyP99Us = values[19],
+      latencyHistogram = histogram.toList(),
+      kvCellsUsed = values[20].toInt(),
+      kvCellsTotal = values[21].toInt(),
+      nThreads = values[22].toInt(),
+      nThreadsBatch = values[23].toInt(),
+      nBatch = values[24].toInt(),
+      nUbatch = values[25].toInt(),
+      contextShifts = values[26].toInt(),
+      discardedTokens = values[27].toInt(),
+    )
+  }
+}
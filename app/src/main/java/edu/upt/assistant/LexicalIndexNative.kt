@@ -0,0 +1,53 @@
+package edu.upt.assistant
+
+/**
+ * Native BM25 inverted index (see cpp/lexical_index.h): compressed posting lists searched with
+ * block-max WAND, persisted as a snapshot plus a journal of changes since.
+ */
+object LexicalIndexNative {
+  init {
+    try {
+      System.loadLibrary("llama_jni")
+    } catch (e: UnsatisfiedLinkError) {
+      throw RuntimeException("Failed to load llama_jni library", e)
+    }
+  }
+
+  @JvmStatic external fun open(path: String): Long
+  /** Also writes the snapshot if anything changed since the last [save]. */
+  @JvmStatic external fun close(handle: Long)
+  /** Inserts or replaces texts; [texts] is parallel to [ids]. */
+  @JvmStatic external fun add(handle: Long, ids: LongArray, texts: Array<String>): Int
+  @JvmStatic external fun delete(handle: Long, ids: LongArray): Int
+  /** Snapshots the index (dropping deleted postings once they pile up) and empties the journal. */
+  @JvmStatic external fun save(handle: Long): Boolean
+  @JvmStatic external fun count(handle: Long): Int
+  @JvmStatic external fun contains(handle: Long, id: Long): Boolean
+  /** Writes up to [k] BM25 hits (best first) into the caller's arrays and returns the hit count. */
+  @JvmStatic external fun search(
+    handle: Long,
+    query: String,
+    k: Int,
+    outIds: LongArray,
+    outScores: FloatArray
+  ): Int
+  /**
+   * Fuses the BM25 top [candidates] for [query] with the cosine top [candidates] (>= [minVectorScore])
+   * for [vector] in the vector index [vectorHandle] by reciprocal rank; pass 0 / null to search
+   * one side only. Fills the caller's arrays (best first) and returns the hit count; a hit that
+   * was not a vector candidate has vector score -1, one that was not a BM25 candidate has 0.
+   */
+  @JvmStatic external fun hybridSearch(
+    handle: Long,
+    vectorHandle: Long,
+    query: String,
+    vector: FloatArray?,
+    k: Int,
+    candidates: Int,
+    minVectorScore: Float,
+    outIds: LongArray,
+    outScores: FloatArray,
+    outVectorScores: FloatArray,
+    outLexicalScores: FloatArray
+  ): Int
+}
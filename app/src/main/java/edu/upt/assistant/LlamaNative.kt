@@ -1,11 +1,55 @@
 package edu.upt.assistant
 
+import kotlinx.coroutines.suspendCancellableCoroutine
+import java.nio.ByteBuffer
+import kotlin.coroutines.resume
+
 interface StreamCallback {
+  /** Output text as it becomes final: whole characters, stop strings removed. */
   fun onToken(token: String)
-  fun onTimings(prefillMs: Long, firstSampleDelayMs: Long)
+  /** [LlamaNative.llamaSubmitText] only: [length] UTF-8 bytes at [offset] of its buffer, valid during this call. */
+  fun onText(offset: Int, length: Int) {}
+  /** Exact counts and phase timings, once per request right before [onComplete]. */
+  fun onTelemetry(telemetry: GenerationTelemetry) {}
+  /** Last callback of a [LlamaNative.llamaSubmit] request; status is one of LlamaNative.STATUS_*. */
+  fun onComplete(status: Int) {}
+}
+
+/** Chunks of a [LlamaNative.llamaEmbedIngestFile] / [LlamaNative.llamaEmbedIngestText] run, on the calling thread. */
+interface IngestCallback {
+  /**
+   * [vector] is null for a chunk whose [hash] was passed as known (or repeated earlier in the
+   * text) and so was not embedded. Indices may arrive out of order. Return false to stop.
+   */
+  fun onChunk(index: Int, hash: Long, text: String, vector: FloatArray?): Boolean
+  fun onProgress(bytesRead: Long, bytesTotal: Long, chunks: Int, embedded: Int, reused: Int) {}
+}
+
+/**
+ * Direct buffer native code streams a request's UTF-8 output through. Text is handed over in
+ * runs of up to [flushBytes], or after [flushMs] since the last run, rather than per token.
+ */
+class TextStreamBuffer(capacity: Int = 4096, val flushBytes: Int = 256, val flushMs: Int = 50) {
+  val buffer: ByteBuffer = ByteBuffer.allocateDirect(capacity)
+  private val bytes = ByteArray(capacity)
+
+  /** Called from onText, before native code writes over the run again. */
+  fun decode(offset: Int, length: Int): String {
+    buffer.position(offset)
+    buffer.get(bytes, 0, length)
+    return String(bytes, 0, length, Charsets.UTF_8)
+  }
 }
 
 object LlamaNative {
+  // Request priorities for llamaSubmit: higher runs first, FIFO within a priority
+  const val PRIORITY_BACKGROUND = 0
+  const val PRIORITY_INTERACTIVE = 10
+
+  const val STATUS_DONE = 0
+  const val STATUS_CANCELLED = 1
+  const val STATUS_FAILED = 2
+
   init {
     try {
       System.loadLibrary("llama_jni")
@@ -14,14 +58,161 @@ object LlamaNative {
     }
   }
 
-  @JvmStatic external fun llamaCreate(modelPath: String, nThreads: Int): Long
-  @JvmStatic external fun llamaGenerate(ctxPtr: Long, prompt: String, maxTokens: Int): String
-  @JvmStatic external fun llamaGenerateStream(
+  // Weights are cached natively and refcounted per file: contexts can be rebuilt (or their
+  // thread count changed) without reloading the model
+  @JvmStatic external fun llamaModelLoad(modelPath: String, useMmap: Boolean, useMlock: Boolean, prefetch: Boolean): Long
+  @JvmStatic external fun llamaModelRelease(modelPtr: Long)
+  @JvmStatic external fun llamaContextCreate(
+    modelPtr: Long,
+    nThreads: Int,
+    nCtx: Int,
+    nBatch: Int,
+    nUbatch: Int,
+    typeK: Int,
+    typeV: Int,
+    flashAttn: Boolean,
+    memoryBudgetMb: Int
+  ): Long
+  // Resolved config + footprint as a ContextInfo.fromNative array: for a config before creating
+  // a context (nothing is allocated), or for a live context
+  @JvmStatic external fun llamaContextPlan(
+    modelPtr: Long,
+    nCtx: Int,
+    nBatch: Int,
+    nUbatch: Int,
+    typeK: Int,
+    typeV: Int,
+    flashAttn: Boolean,
+    memoryBudgetMb: Int
+  ): LongArray?
+  @JvmStatic external fun llamaContextInfo(ctxPtr: Long): LongArray?
+  @JvmStatic external fun llamaSetThreads(ctxPtr: Long, nThreads: Int)
+  // Separate threadpools for single-token decode and for prefill, each with its own cores
+  // (empty = any) and nice value
+  @JvmStatic external fun llamaSetThreadPools(
+    ctxPtr: Long,
+    decodeThreads: Int,
+    decodeCpus: IntArray,
+    decodeNice: Int,
+    batchThreads: Int,
+    batchCpus: IntArray,
+    batchNice: Int
+  ): Boolean
+  /** Times a few prefill/decode steps per core set and thread count and applies the fastest; blocks. */
+  @JvmStatic external fun llamaCalibrateThreads(ctxPtr: Long, nPrefill: Int, nDecode: Int): IntArray?
+  /** One throwaway decode so the first prompt doesn't pay for lazy init; returns its duration in ms. */
+  @JvmStatic external fun llamaWarmup(ctxPtr: Long): Long
+
+  // Non-blocking generation on the context's native worker thread. Returns a request id;
+  // callbacks arrive on the worker thread and end with onComplete. Up to 4 requests decode
+  // together in shared batches (one KV sequence each), so background work can run alongside chat.
+  // When a conversation outgrows n_ctx the window slides, always keeping the first nKeep tokens.
+  @JvmStatic external fun llamaSubmit(
     ctxPtr: Long,
     prompt: String,
     maxTokens: Int,
+    priority: Int,
+    nKeep: Int,
     callback: StreamCallback
-  )
+  ): Long
+  // llamaSubmit with the output written into buffer (a direct ByteBuffer, see TextStreamBuffer)
+  // and reported through onText in coalesced runs; generation ends before the first of stops
+  @JvmStatic external fun llamaSubmitText(
+    ctxPtr: Long,
+    prompt: String,
+    maxTokens: Int,
+    priority: Int,
+    nKeep: Int,
+    stops: Array<String>,
+    buffer: ByteBuffer,
+    flushBytes: Int,
+    flushMs: Int,
+    callback: StreamCallback
+  ): Long
+  /** Stops the request before its next decode step (or drops it from the queue). */
+  @JvmStatic external fun llamaCancel(ctxPtr: Long, requestId: Long): Boolean
   @JvmStatic external fun llamaKvCacheClear(ctxPtr: Long)
+  @JvmStatic external fun llamaStateSave(ctxPtr: Long, path: String): Long
+  @JvmStatic external fun llamaStateLoad(ctxPtr: Long, path: String): Int
   @JvmStatic external fun llamaFree(ctxPtr: Long)
-}
\ No newline at end of file
+
+  // Exact token counts against the context's vocab, memoized natively (LRU keyed by text hash).
+  // addSpecial counts the BOS of a whole prompt; leave it off for fragments inside a prompt.
+  @JvmStatic external fun llamaCountTokens(ctxPtr: Long, texts: Array<String>, addSpecial: Boolean): IntArray
+  /** Ascending indices of the fragments kept, in array order, under [budgetTokens]. */
+  @JvmStatic external fun llamaPackTokens(ctxPtr: Long, texts: Array<String>, budgetTokens: Int, separatorTokens: Int): IntArray
+
+  // Speculative decoding with a small same-vocab draft model (streaming path only)
+  @JvmStatic external fun llamaDraftAttach(ctxPtr: Long, draftModelPath: String, nDraftMax: Int): Boolean
+  @JvmStatic external fun llamaDraftDetach(ctxPtr: Long)
+  /** Draft-free prompt lookup over prompt + output n-grams; ngramSize 0 turns it off. */
+  @JvmStatic external fun llamaLookupConfigure(ctxPtr: Long, ngramSize: Int, nDraftMax: Int)
+
+  // Embedding contexts (separate GGUF embedding model, pooled + L2-normalized vectors)
+  @JvmStatic external fun llamaEmbedCreate(modelPath: String, nThreads: Int): Long
+  @JvmStatic external fun llamaEmbedDim(embPtr: Long): Int
+  /** Returns a row-major [texts.size x dim] matrix. */
+  @JvmStatic external fun llamaEmbedBatch(embPtr: Long, texts: Array<String>): FloatArray
+  @JvmStatic external fun llamaEmbedFree(embPtr: Long)
+  /**
+   * Streams a file through the embedding model's tokenizer into ~chunkTokens-token chunks
+   * (overlapTokens repeated), embedding all but the [known] hashes. Returns [chunks, embedded, reused].
+   */
+  @JvmStatic external fun llamaEmbedIngestFile(
+    embPtr: Long, path: String, chunkTokens: Int, overlapTokens: Int, known: LongArray, callback: IngestCallback
+  ): IntArray
+  @JvmStatic external fun llamaEmbedIngestText(
+    embPtr: Long, text: String, chunkTokens: Int, overlapTokens: Int, known: LongArray, callback: IngestCallback
+  ): IntArray
+
+  fun contextCreate(modelPtr: Long, nThreads: Int, config: ContextConfig): Long = with(config) {
+    llamaContextCreate(modelPtr, nThreads, nCtx, nBatch, nUbatch, typeK.ggmlType, typeV.ggmlType, flashAttn, memoryBudgetMb)
+  }
+
+  fun contextPlan(modelPtr: Long, config: ContextConfig): ContextInfo? = with(config) {
+    llamaContextPlan(modelPtr, nCtx, nBatch, nUbatch, typeK.ggmlType, typeV.ggmlType, flashAttn, memoryBudgetMb)
+  }?.let(ContextInfo::fromNative)
+
+  fun contextInfo(ctxPtr: Long): ContextInfo? = llamaContextInfo(ctxPtr)?.let(ContextInfo::fromNative)
+
+  fun setThreadConfig(ctxPtr: Long, config: ThreadConfig): Boolean = llamaSetThreadPools(
+    ctxPtr,
+    config.decode.nThreads, config.decode.cpus.toIntArray(), config.decode.nice,
+    config.batch.nThreads, config.batch.cpus.toIntArray(), config.batch.nice
+  )
+
+  fun calibrateThreads(ctxPtr: Long, nPrefill: Int = 64, nDecode: Int = 8): ThreadCalibration? =
+    llamaCalibrateThreads(ctxPtr, nPrefill, nDecode)?.let(ThreadCalibration::fromNative)
+
+  /**
+   * Submits a request and suspends until its onComplete. Output reaches callback.onToken in
+   * coalesced chunks through a direct buffer, ending before the first of [stops]. Cancelling
+   * the calling coroutine cancels the native request, so abandoned generations stop decoding
+   * right away.
+   */
+  suspend fun generate(
+    ctxPtr: Long,
+    prompt: String,
+    maxTokens: Int,
+    priority: Int,
+    callback: StreamCallback,
+    nKeep: Int = 0,
+    stops: List<String> = emptyList(),
+    stream: TextStreamBuffer = TextStreamBuffer()
+  ): Int = suspendCancellableCoroutine { cont ->
+    val requestId = llamaSubmitText(
+      ctxPtr, prompt, maxTokens, priority, nKeep, stops.toTypedArray(),
+      stream.buffer, stream.flushBytes, stream.flushMs,
+      object : StreamCallback by callback {
+        override fun onText(offset: Int, length: Int) {
+          callback.onToken(stream.decode(offset, length))
+        }
+        override fun onComplete(status: Int) {
+          callback.onComplete(status)
+          cont.resume(status)
+        }
+      }
+    )
+    cont.invokeOnCancellation { llamaCancel(ctxPtr, requestId) }
+  }
+}
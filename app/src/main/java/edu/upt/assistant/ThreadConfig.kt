@@ -0,0 +1,72 @@
+package edu.upt.assistant
+
+/** One native threadpool (thread_spec): thread count, the cores it may use (empty = any) and its nice value. */
+data class ThreadPoolSpec(
+  val nThreads: Int,
+  val cpus: List<Int> = emptyList(),
+  val nice: Int = 0,
+) {
+  /** "threads@cpu,cpu,...~nice" */
+  fun encode(): String = "$nThreads@${cpus.joinToString(",")}~$nice"
+
+  companion object {
+    fun decode(text: String): ThreadPoolSpec? {
+      val threads = text.substringBefore('@').toIntOrNull() ?: return null
+      val cpus = text.substringAfter('@', "").substringBefore('~')
+      val nice = text.substringAfter('~', "0").toIntOrNull() ?: return null
+      return ThreadPoolSpec(
+        nThreads = threads,
+        cpus = if (cpus.isEmpty()) emptyList() else cpus.split(',').map { it.toIntOrNull() ?: return null },
+        nice = nice,
+      )
+    }
+  }
+}
+
+/**
+ * Threadpools of a context (session_threads): [decode] runs single-token steps, which are
+ * latency-bound and belong on the big cores; [batch] runs prefill, which scales with every core.
+ */
+data class ThreadConfig(val decode: ThreadPoolSpec, val batch: ThreadPoolSpec) {
+  /** "decode;batch", the format kept in SettingsKeys.threadConfigForModel. */
+  fun encode(): String = "${decode.encode()};${batch.encode()}"
+
+  companion object {
+    fun decode(text: String?): ThreadConfig? {
+      val parts = text?.split(';') ?: return null
+      if (parts.size != 2) return null
+      return ThreadConfig(ThreadPoolSpec.decode(parts[0]) ?: return null, ThreadPoolSpec.decode(parts[1]) ?: return null)
+    }
+  }
+}
+
+/** Result of [LlamaNative.calibrateThreads]; the pools are already applied to the context. */
+data class ThreadCalibration(
+  val config: ThreadConfig,
+  val decodeMsPerToken: Double,
+  val prefillMsPerToken: Double,
+  val candidates: Int,
+) {
+  companion object {
+    /** Layout written by llamaCalibrateThreads in llama_jni.cpp. */
+    fun fromNative(values: IntArray): ThreadCalibration {
+      var i = 3
+      fun spec(): ThreadPoolSpec {
+        val threads = values[i]
+        val nice = values[i + 1]
+        val n = values[i + 2]
+        val cpus = values.copyOfRange(i + 3, i + 3 + n).toList()
+        i += 3 + n
+        return ThreadPoolSpec(threads, cpus, nice)
+      }
+      val decode = spec()
+      val batch = spec()
+      return ThreadCalibration(
+        config = ThreadConfig(decode, batch),
+        decodeMsPerToken = values[1] / 1000.0,
+        prefillMsPerToken = values[2] / 1000.0,
+        candidates = values[0],
+      )
+    }
+  }
+}
@@ -0,0 +1,37 @@
+package edu.upt.assistant
+
+/**
+ * Native memory-mapped vector index (see cpp/vector_index.h). Vectors are L2-normalized on
+ * insert, optionally stored as int8, and searched with SIMD dot products + a top-k heap.
+ */
+object VectorIndexNative {
+  init {
+    try {
+      System.loadLibrary("llama_jni")
+    } catch (e: UnsatisfiedLinkError) {
+      throw RuntimeException("Failed to load llama_jni library", e)
+    }
+  }
+
+  @JvmStatic external fun open(path: String, dim: Int, quantize: Boolean): Long
+  @JvmStatic external fun close(handle: Long)
+  /** Inserts or replaces vectors; [vectors] is row-major [ids.size x dim]. */
+  @JvmStatic external fun add(handle: Long, ids: LongArray, vectors: FloatArray): Int
+  @JvmStatic external fun delete(handle: Long, ids: LongArray): Int
+  /** Rewrites the file without deleted records; returns the bytes reclaimed. */
+  @JvmStatic external fun compact(handle: Long): Long
+  /** False after a failed remap (see compact); reopen the index then. */
+  @JvmStatic external fun isMapped(handle: Long): Boolean
+  @JvmStatic external fun count(handle: Long): Int
+  @JvmStatic external fun contains(handle: Long, id: Long): Boolean
+  @JvmStatic external fun get(handle: Long, id: Long): FloatArray?
+  /** Writes up to [k] hits (best first) into the caller's arrays and returns the hit count. */
+  @JvmStatic external fun search(
+    handle: Long,
+    query: FloatArray,
+    k: Int,
+    minScore: Float,
+    outIds: LongArray,
+    outScores: FloatArray
+  ): Int
+}
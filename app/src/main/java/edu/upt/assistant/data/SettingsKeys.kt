@@ -22,7 +22,27 @@ object SettingsKeys {
   val MAX_TOKENS     = intPreferencesKey("max_tokens")         // default 96
   val TEMP           = floatPreferencesKey("temp")             // default 0.7f
   val MEMORY_ENABLED = booleanPreferencesKey("memory_enabled") // default true
+  val KV_SNAPSHOT_BUDGET_MB = intPreferencesKey("kv_snapshot_budget_mb") // default 64
+  // Model loading: mmap weights (default true), pin them with mlock (default false),
+  // prefetch the file before loading (default true), warm-up decode after (re)init (default true)
+  val MODEL_USE_MMAP  = booleanPreferencesKey("model_use_mmap")
+  val MODEL_USE_MLOCK = booleanPreferencesKey("model_use_mlock")
+  val MODEL_PREFETCH  = booleanPreferencesKey("model_prefetch")
+  val MODEL_WARMUP    = booleanPreferencesKey("model_warmup")
+  // Chat context: K/V cache types ("f16", "q8_0", "q4_0"; default f16), flash attention
+  // (default false), and a KV + compute-buffer budget that sizes n_ctx/n_ubatch (0 = fixed 1536)
+  val CTX_CACHE_TYPE_K     = stringPreferencesKey("ctx_cache_type_k")
+  val CTX_CACHE_TYPE_V     = stringPreferencesKey("ctx_cache_type_v")
+  val CTX_FLASH_ATTN       = booleanPreferencesKey("ctx_flash_attn")
+  val CTX_MEMORY_BUDGET_MB = intPreferencesKey("ctx_memory_budget_mb")
 
   fun nThreadsForModel(url: String) = intPreferencesKey("n_threads_${url.hashCode()}")
+  // Calibrated decode/batch threadpools (ThreadConfig.encode) for this model on this device
+  fun threadConfigForModel(url: String, device: String) =
+    stringPreferencesKey("thread_config_${url.hashCode()}_${device.hashCode()}")
+  // URL of a small same-vocab GGUF used for speculative decoding with this model; unset = off
+  fun draftModelForModel(url: String) = stringPreferencesKey("draft_model_${url.hashCode()}")
+  // Max n-gram size for prompt-lookup drafting with this model; 0 = off, default 3
+  fun lookupNgramForModel(url: String) = intPreferencesKey("lookup_ngram_${url.hashCode()}")
 
 }
@@ -10,7 +10,7 @@ data class DocumentEntity(
     val content: String,
     val contentType: String = "text/plain",
     val chunks: String, // JSON array of text chunks
-    val embeddings: String, // JSON array of embedding vectors
+    val embeddings: String, // legacy JSON vectors, "[]" once moved into the native vector index
     val metadata: String = "{}", // JSON metadata
     val createdAt: Long = System.currentTimeMillis(),
     val updatedAt: Long = System.currentTimeMillis()
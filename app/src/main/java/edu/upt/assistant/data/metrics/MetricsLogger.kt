@@ -21,6 +21,23 @@ data class GenerationMetrics(
     val historyTokens: Int,
     val retrievedCtxTokens: Int,
     val outputTokens: Int,
+    val reusedTokens: Int = 0,
+    val prefilledTokens: Int = 0,
+    val draftedTokens: Int = 0,
+    val acceptedTokens: Int = 0,
+    val loadTimeMs: Long = 0,
+    val warmupTimeMs: Long = 0,
+    val queueTimeMs: Long = 0,
+    val tokenizeTimeMs: Long = 0,
+    val sampleTimeMs: Long = 0,
+    val prefillUbatches: Int = 0,
+    val decodeP50Ms: Double = 0.0,
+    val decodeP95Ms: Double = 0.0,
+    val decodeP99Ms: Double = 0.0,
+    val latencyHistogram: String = "",
+    val kvCellsUsed: Int = 0,
+    val kvCellsTotal: Int = 0,
+    val contextShifts: Int = 0,
     val promptId: String,
     val category: String,
     val ragEnabled: Boolean,
@@ -52,6 +69,23 @@ data class GenerationMetrics(
             historyTokens,
             retrievedCtxTokens,
             outputTokens,
+            reusedTokens,
+            prefilledTokens,
+            draftedTokens,
+            acceptedTokens,
+            loadTimeMs,
+            warmupTimeMs,
+            queueTimeMs,
+            tokenizeTimeMs,
+            sampleTimeMs,
+            prefillUbatches,
+            decodeP50Ms,
+            decodeP95Ms,
+            decodeP99Ms,
+            latencyHistogram,
+            kvCellsUsed,
+            kvCellsTotal,
+            contextShifts,
             promptId,
             category,
             ragEnabled,
@@ -71,7 +105,7 @@ data class GenerationMetrics(
 object MetricsLogger {
     private const val FILE_NAME = "generation_metrics.csv"
     private const val HEADER =
-        "timestamp,prefill_ms,first_sample_ms,first_token_ms,decode_ms,decode_speed,battery_delta,temp_start,temp_end,prompt_chars,prompt_tokens,history_tokens,retrieved_ctx_tokens,output_tokens,prompt_id,category,rag_enabled,memory_enabled,top_k,max_tokens,n_threads,n_batch,n_ubatch,model,passed,output\n"
+        "timestamp,prefill_ms,first_sample_ms,first_token_ms,decode_ms,decode_speed,battery_delta,temp_start,temp_end,prompt_chars,prompt_tokens,history_tokens,retrieved_ctx_tokens,output_tokens,reused_tokens,prefilled_tokens,drafted_tokens,accepted_tokens,load_ms,warmup_ms,queue_ms,tokenize_ms,sample_ms,prefill_ubatches,decode_p50_ms,decode_p95_ms,decode_p99_ms,latency_hist,kv_cells_used,kv_cells_total,context_shifts,prompt_id,category,rag_enabled,memory_enabled,top_k,max_tokens,n_threads,n_batch,n_ubatch,model,passed,output\n"
     private const val HEADER_LENGTH = HEADER.length
 
     fun getFile(context: Context): File = File(context.applicationContext.filesDir, FILE_NAME)
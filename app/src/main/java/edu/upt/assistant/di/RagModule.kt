@@ -15,6 +15,7 @@ import edu.upt.assistant.data.local.db.MessageDao
 import edu.upt.assistant.data.local.db.MemoryDao
 import edu.upt.assistant.domain.ChatRepository
 import edu.upt.assistant.domain.ChatRepositoryImpl
+import edu.upt.assistant.domain.ModelDownloadManager
 import edu.upt.assistant.domain.memory.MemoryRepository
 import edu.upt.assistant.domain.rag.ConditionalChatRepository
 import edu.upt.assistant.domain.rag.DocumentProcessor
@@ -33,7 +34,10 @@ object RagModule {
 
     @Provides
     @Singleton
-    fun provideVectorStore(@ApplicationContext context: Context): VectorStore = VectorStore(context)
+    fun provideVectorStore(
+        @ApplicationContext context: Context,
+        modelDownloadManager: ModelDownloadManager
+    ): VectorStore = VectorStore(context, modelDownloadManager)
 
     @Provides
     @Singleton
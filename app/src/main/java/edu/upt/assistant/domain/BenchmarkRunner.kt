@@ -78,7 +78,8 @@ class BenchmarkRunner @Inject constructor(
             when (prompt.category) {
                 "memory_setup" -> prompt.insert_memory?.let { ragRepository.addMemory(it) }
                 "rag_setup" -> if (prompt.doc_id != null && prompt.doc_text != null) {
-                    ragRepository.addDocument(prompt.doc_id, prompt.doc_text)
+                    // Stable id, so re-runs update the document instead of adding copies
+                    ragRepository.replaceDocument("benchmark-${prompt.doc_id}", prompt.doc_id, prompt.doc_text)
                 }
             }
         }
@@ -1,13 +1,20 @@
 package edu.upt.assistant.domain
 
 import android.content.Context
+import android.os.Build
 import android.util.Log
 import androidx.datastore.core.DataStore
 import androidx.datastore.preferences.core.Preferences
+import androidx.datastore.preferences.core.edit
 import androidx.room.withTransaction
 import dagger.hilt.android.qualifiers.ApplicationContext
+import edu.upt.assistant.ContextConfig
+import edu.upt.assistant.ContextInfo
+import edu.upt.assistant.GenerationTelemetry
+import edu.upt.assistant.KvCacheType
 import edu.upt.assistant.LlamaNative
 import edu.upt.assistant.StreamCallback
+import edu.upt.assistant.ThreadConfig
 import edu.upt.assistant.data.SettingsKeys
 import edu.upt.assistant.data.local.db.AppDatabase
 import edu.upt.assistant.data.local.db.ConversationDao
@@ -19,6 +26,7 @@ import edu.upt.assistant.data.metrics.MetricsLogger
 import edu.upt.assistant.domain.prompts.PromptTemplateFactory
 import edu.upt.assistant.ui.screens.Conversation
 import edu.upt.assistant.ui.screens.Message
+import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Deferred
 import kotlinx.coroutines.Dispatchers
@@ -28,15 +36,16 @@ import kotlinx.coroutines.channels.awaitClose
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.channelFlow
 import kotlinx.coroutines.flow.distinctUntilChanged
+import kotlinx.coroutines.flow.drop
 import kotlinx.coroutines.flow.first
 import kotlinx.coroutines.flow.map
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.runBlocking
-import kotlinx.coroutines.withContext
 import java.text.ParseException
 import java.text.SimpleDateFormat
 import java.util.Date
 import java.util.Locale
+import java.util.concurrent.atomic.AtomicLong
 import javax.inject.Inject
 import javax.inject.Singleton
 
@@ -47,21 +56,40 @@ class ChatRepositoryImpl @Inject constructor(
     private val modelDownloadManager: ModelDownloadManager,
     private val dataStore: DataStore<Preferences>,
     @ApplicationContext private val appContext: Context,
-    private val db: AppDatabase
+    private val db: AppDatabase,
+    private val kvSnapshots: KvSnapshotStore
 ) : ChatRepository {
 
     private val scope = CoroutineScope(SupervisorJob() + Dispatchers.IO)
     private var llamaCtxDeferred: Deferred<Long>? = null
+    // Native model handle shared by successive contexts; see acquireModel
+    private var modelHandle: Long = 0L
+    private var modelHandlePath: String? = null
+    private var pendingLoadMs: Long = 0L
+    private var pendingWarmupMs: Long = 0L
     private var threadCount: Int = 0
     private var modelName: String = ""
+    // Conversation whose tokens currently sit in the context's KV cache
+    private var activeConversationId: String? = null
+    // Live context for token counting (0 while none is ready)
+    @Volatile private var countingCtx: Long = 0L
+
+    /** Exact prompt budgeting against the current model's vocab; estimates until a context exists. */
+    val tokenCounter = TokenCounter { countingCtx }
+
+    // Resolved size and memory footprint of the live context
+    @Volatile private var contextInfo: ContextInfo? = null
+
+    /** KV cells of the live context (the default size until one exists), the budget for whole prompts. */
+    val contextTokens: Int get() = contextInfo?.nCtx ?: ContextConfig.DEFAULT_N_CTX
 
     init {
         observeModelChanges()
     }
 
     companion object {
-        private const val N_BATCH = 256
-        private const val N_UBATCH = 64
+        private const val N_DRAFT_MAX = 8
+        private const val DEFAULT_LOOKUP_NGRAM = 3
         private val LONG_RESPONSE_REGEX = Regex("6\\s*(?:-|\u2013)\\s*7\\s+sentences", RegexOption.IGNORE_CASE)
     }
     suspend fun getModelUrl(): String {
@@ -69,6 +97,9 @@ class ChatRepositoryImpl @Inject constructor(
     }
 
     private fun initLlamaContext(): Deferred<Long> {
+        // A context created by an init that then fails or is cancelled (destroyLlamaContext) is
+        // never handed out, so it is freed here; a delivered one belongs to the deferred's holder
+        val created = AtomicLong(0L)
         return scope.async {
             Log.d("ChatRepository", "Initializing llama context")
             val url = getModelUrl()
@@ -81,30 +112,137 @@ class ChatRepositoryImpl @Inject constructor(
             Log.d("ChatRepository", "Model path: $modelPath")
 
             val prefs = dataStore.data.first()
-            val configured = prefs[SettingsKeys.nThreadsForModel(url)] ?: prefs[SettingsKeys.N_THREADS]
-            val optimal = minOf(8, maxOf(6, Runtime.getRuntime().availableProcessors() / 2))
-            threadCount = configured ?: optimal
+            threadCount = resolveThreads(prefs, url)
 
             modelName = java.io.File(modelPath).name
-            val ctx = LlamaNative.llamaCreate(
-                modelPath,
-                threadCount
-            )
+            val loadStart = System.currentTimeMillis()
+            val model = acquireModel(modelPath, prefs)
+            val ctx = LlamaNative.contextCreate(model, threadCount, contextConfig(prefs))
             if (ctx == 0L) {
                 Log.e("ChatRepository", "Failed to create llama context")
                 throw IllegalStateException("Failed to create llama context")
             }
-            Log.d("ChatRepository", "Llama context created: $ctx")
+            contextInfo = LlamaNative.contextInfo(ctx)?.also { info ->
+                Log.d("ChatRepository", "Llama context created: $ctx, n_ctx ${info.nCtx}, n_ubatch ${info.nUbatch}, " +
+                    "kv ${info.typeK.label}/${info.typeV.label}, flash_attn ${info.flashAttn}, " +
+                    "KV ${"%.1f".format(info.kvMb)} MB, compute ${"%.1f".format(info.computeMb)} MB")
+            }
+            created.set(ctx)
+            applyThreadConfig(ctx, prefs, url)
+            attachDraftModel(ctx, prefs[SettingsKeys.draftModelForModel(url)])
+            LlamaNative.llamaLookupConfigure(ctx, prefs[SettingsKeys.lookupNgramForModel(url)] ?: DEFAULT_LOOKUP_NGRAM, N_DRAFT_MAX)
+            pendingLoadMs = System.currentTimeMillis() - loadStart
+            pendingWarmupMs = if (prefs[SettingsKeys.MODEL_WARMUP] != false) LlamaNative.llamaWarmup(ctx) else 0L
+            Log.d("ChatRepository", "PERFORMANCE: Context ready, load ${pendingLoadMs}ms, warm-up ${pendingWarmupMs}ms")
+            countingCtx = ctx
             ctx
-        }.also { llamaCtxDeferred = it }
+        }.also { deferred ->
+            deferred.invokeOnCompletion { cause -> if (cause != null) freeLlamaContext(created.getAndSet(0L)) }
+            llamaCtxDeferred = deferred
+        }
+    }
+
+    // Weights outlive contexts: only a different file (or mmap/mlock change) reloads them
+    private fun acquireModel(modelPath: String, prefs: Preferences): Long {
+        if (modelHandle != 0L && modelHandlePath == modelPath) return modelHandle
+        releaseModel()
+        modelHandle = LlamaNative.llamaModelLoad(
+            modelPath,
+            prefs[SettingsKeys.MODEL_USE_MMAP] ?: true,
+            prefs[SettingsKeys.MODEL_USE_MLOCK] ?: false,
+            prefs[SettingsKeys.MODEL_PREFETCH] ?: true
+        )
+        modelHandlePath = modelPath
+        return modelHandle
+    }
+
+    private fun releaseModel() {
+        if (modelHandle != 0L) {
+            LlamaNative.llamaModelRelease(modelHandle)
+            Log.d("ChatRepository", "Released model: $modelHandlePath")
+        }
+        modelHandle = 0L
+        modelHandlePath = null
+    }
+
+    private fun contextConfig(prefs: Preferences) = ContextConfig(
+        typeK = KvCacheType.fromLabel(prefs[SettingsKeys.CTX_CACHE_TYPE_K]),
+        typeV = KvCacheType.fromLabel(prefs[SettingsKeys.CTX_CACHE_TYPE_V]),
+        flashAttn = prefs[SettingsKeys.CTX_FLASH_ATTN] ?: false,
+        memoryBudgetMb = prefs[SettingsKeys.CTX_MEMORY_BUDGET_MB] ?: 0
+    )
+
+    private fun configuredThreads(prefs: Preferences, url: String): Int? =
+        prefs[SettingsKeys.nThreadsForModel(url)] ?: prefs[SettingsKeys.N_THREADS]
+
+    private fun resolveThreads(prefs: Preferences, url: String): Int {
+        val optimal = minOf(8, maxOf(6, Runtime.getRuntime().availableProcessors() / 2))
+        return configuredThreads(prefs, url) ?: calibratedThreads(prefs, url)?.decode?.nThreads ?: optimal
+    }
+
+    // Calibration is only valid for the SoC it ran on (restored backups, core hotplug)
+    private val deviceTag: String
+        get() = "${Build.HARDWARE}/${Build.MODEL}/${Runtime.getRuntime().availableProcessors()}"
+
+    private fun calibratedThreads(prefs: Preferences, url: String): ThreadConfig? =
+        ThreadConfig.decode(prefs[SettingsKeys.threadConfigForModel(url, deviceTag)])
+
+    /**
+     * Puts decode and prefill on the calibrated threadpools. A configured thread count wins unless
+     * it is the calibrated one; with neither, the first context of a model on this device calibrates.
+     */
+    private suspend fun applyThreadConfig(ctx: Long, prefs: Preferences, url: String) {
+        val calibrated = calibratedThreads(prefs, url)
+        if (calibrated != null && calibrated.decode.nThreads == threadCount) {
+            LlamaNative.setThreadConfig(ctx, calibrated)
+            return
+        }
+        if (calibrated != null || configuredThreads(prefs, url) != null) return
+        val start = System.currentTimeMillis()
+        val result = LlamaNative.calibrateThreads(ctx) ?: return
+        Log.d("ChatRepository", "PERFORMANCE: Thread calibration over ${result.candidates} candidates took " +
+            "${System.currentTimeMillis() - start}ms: decode ${result.config.decode} " +
+            "(${"%.1f".format(result.decodeMsPerToken)} ms/token), prefill ${result.config.batch} " +
+            "(${"%.1f".format(result.prefillMsPerToken)} ms/token)")
+        threadCount = result.config.decode.nThreads
+        dataStore.edit { it[SettingsKeys.threadConfigForModel(url, deviceTag)] = result.config.encode() }
+    }
+
+    /**
+     * Load and warm-up time of the context (re)init that the next turn waited on, then zeroes
+     * them so only the first turn after a settings change reports them.
+     */
+    fun takeSetupTimings(): Pair<Long, Long> {
+        val timings = pendingLoadMs to pendingWarmupMs
+        pendingLoadMs = 0L
+        pendingWarmupMs = 0L
+        return timings
+    }
+
+    // Speculative decoding is opt-in per model; it changes decode speed, never the output
+    private suspend fun attachDraftModel(ctx: Long, draftUrl: String?) {
+        if (draftUrl.isNullOrBlank()) return
+        if (!modelDownloadManager.isModelAvailable(draftUrl)) {
+            Log.w("ChatRepository", "Draft model not downloaded yet, starting download")
+            modelDownloadManager.startDownload(draftUrl, scope)
+            return
+        }
+        val attached = LlamaNative.llamaDraftAttach(ctx, modelDownloadManager.getModelPath(draftUrl), N_DRAFT_MAX)
+        Log.d("ChatRepository", "Draft model ${if (attached) "attached" else "rejected"}: $draftUrl")
     }
 
     // Lazily initialize the native llama context
     private suspend fun getLlamaContext(): Long {
-        val deferred = llamaCtxDeferred ?: initLlamaContext()
+        val deferred = synchronized(this) { llamaCtxDeferred ?: initLlamaContext() }
         return deferred.await()
     }
 
+    // The context if it is already built, without triggering init
+    private suspend fun liveLlamaContext(): Long? {
+        val deferred = llamaCtxDeferred
+        return if (deferred != null && deferred.isCompleted && !deferred.isCancelled) deferred.await() else null
+    }
+
     private fun observeModelChanges() {
         scope.launch {
             dataStore.data
@@ -113,37 +251,129 @@ class ChatRepositoryImpl @Inject constructor(
                 .collect { newModelUrl ->
                     Log.d("ChatRepository", "Model changed to $newModelUrl, resetting llama context")
                     destroyLlamaContext()
+                    releaseModel()
                     // Update template for new model
                     currentTemplate = PromptTemplateFactory.getTemplateForModel(newModelUrl)
                     // Clear managers so they get recreated with new template
                     managers.clear()
+                    // Load and warm the new model now rather than on the first message
+                    if (modelDownloadManager.isModelAvailable(newModelUrl)) {
+                        try {
+                            getLlamaContext()
+                        } catch (e: Exception) {
+                            Log.w("ChatRepository", "Preloading model failed: ${e.message}")
+                        }
+                    }
+                }
+        }
+        scope.launch {
+            dataStore.data
+                .map { prefs ->
+                    val url = prefs[SettingsKeys.SELECTED_MODEL] ?: ModelDownloadManager.DEFAULT_MODEL_URL
+                    resolveThreads(prefs, url) to calibratedThreads(prefs, url)
+                }
+                .distinctUntilChanged()
+                .collect { (threads, calibrated) ->
+                    // Threads are a context setting; the KV cache and weights stay as they are
+                    liveLlamaContext()?.let { ctx ->
+                        if (calibrated != null && calibrated.decode.nThreads == threads) {
+                            LlamaNative.setThreadConfig(ctx, calibrated)
+                        } else {
+                            LlamaNative.llamaSetThreads(ctx, threads)
+                        }
+                        threadCount = threads
+                    }
+                }
+        }
+        scope.launch {
+            dataStore.data
+                .map { prefs -> (prefs[SettingsKeys.MODEL_USE_MMAP] ?: true) to (prefs[SettingsKeys.MODEL_USE_MLOCK] ?: false) }
+                .distinctUntilChanged()
+                .drop(1)
+                .collect {
+                    // Load options only apply to a fresh load of the weights
+                    destroyLlamaContext()
+                    releaseModel()
+                }
+        }
+        scope.launch {
+            dataStore.data
+                .map { prefs ->
+                    val url = prefs[SettingsKeys.SELECTED_MODEL] ?: ModelDownloadManager.DEFAULT_MODEL_URL
+                    prefs[SettingsKeys.draftModelForModel(url)]
                 }
+                .distinctUntilChanged()
+                .drop(1)
+                .collect { destroyLlamaContext() } // rebuild with/without the draft model; weights stay cached
         }
         scope.launch {
             dataStore.data
-                .map { it[SettingsKeys.N_THREADS] }
+                .map { prefs -> contextConfig(prefs) }
                 .distinctUntilChanged()
-                .collect { destroyLlamaContext() } // rebuild with new threads
+                .drop(1)
+                .collect { destroyLlamaContext() } // cache types and size are fixed at creation; weights stay cached
+        }
+        scope.launch {
+            dataStore.data
+                .map { prefs ->
+                    val url = prefs[SettingsKeys.SELECTED_MODEL] ?: ModelDownloadManager.DEFAULT_MODEL_URL
+                    prefs[SettingsKeys.lookupNgramForModel(url)] ?: DEFAULT_LOOKUP_NGRAM
+                }
+                .distinctUntilChanged()
+                .collect { ngram ->
+                    // Cheap to change in place; no need to rebuild the context
+                    liveLlamaContext()?.let { LlamaNative.llamaLookupConfigure(it, ngram, N_DRAFT_MAX) }
+                }
         }
     }
 
     private fun destroyLlamaContext() {
-        llamaCtxDeferred?.let {
-            if (it.isCompleted) {
-                val ctx = runBlocking { it.await() }
-                if (ctx != 0L) {
-                    try {
-                        LlamaNative.llamaFree(ctx)
-                        Log.d("ChatRepository", "Destroyed old llama context: $ctx")
-                    } catch (e: Exception) {
-                        Log.e("ChatRepository", "Failed to destroy llama context", e)
-                    }
-                }
+        llamaCtxDeferred?.let { deferred ->
+            // An init still in flight frees its own context once cancelled; one that completes
+            // anyway (or already has) is freed here once its result is in
+            deferred.cancel()
+            deferred.invokeOnCompletion { cause ->
+                if (cause == null) freeLlamaContext(runBlocking { deferred.await() })
             }
-            // Cancel the deferred if still active
-            it.cancel()
         }
         llamaCtxDeferred = null
+        activeConversationId = null
+    }
+
+    private fun freeLlamaContext(ctx: Long) {
+        if (ctx == 0L) return
+        if (countingCtx == ctx) {
+            countingCtx = 0L
+            contextInfo = null
+        }
+        try {
+            LlamaNative.llamaFree(ctx)
+            Log.d("ChatRepository", "Destroyed old llama context: $ctx")
+        } catch (e: Exception) {
+            Log.e("ChatRepository", "Failed to destroy llama context", e)
+        }
+    }
+
+    /**
+     * Returns the shared context primed for [conversationId]: when switching conversations the
+     * last KV snapshot of the target conversation is restored so its prompt prefix isn't re-prefilled.
+     */
+    suspend fun getLlamaContextFor(conversationId: String): Long {
+        val ctx = getLlamaContext()
+        if (activeConversationId != conversationId) {
+            kvSnapshots.restore(ctx, conversationId, modelName)
+            activeConversationId = conversationId
+        }
+        return ctx
+    }
+
+    suspend fun saveKvSnapshot(ctx: Long, conversationId: String) {
+        val budgetMb = dataStore.data.first()[SettingsKeys.KV_SNAPSHOT_BUDGET_MB] ?: KvSnapshotStore.DEFAULT_BUDGET_MB
+        try {
+            kvSnapshots.save(ctx, conversationId, modelName, budgetMb)
+        } catch (e: Exception) {
+            Log.w("ChatRepository", "Failed to save KV snapshot: ${e.message}")
+        }
     }
 
     // Keep a ConversationManager per conversation
@@ -192,8 +422,9 @@ class ChatRepositoryImpl @Inject constructor(
         }
 
         try {
-            val ctx = getLlamaContext()
+            val ctx = getLlamaContextFor(conversationId)
             Log.d("ChatRepository", "Got llama context: $ctx")
+            val (loadTimeMs, warmupTimeMs) = takeSetupTimings()
 
             val startBattery = MetricsLogger.batteryLevel(appContext)
             val startTemp = MetricsLogger.deviceTemperature(appContext)
@@ -215,10 +446,15 @@ class ChatRepositoryImpl @Inject constructor(
 
             // 2) prepare prompt
             val manager = managers.getOrPut(conversationId) { 
-                ConversationManager(currentSystemPrompt, promptTemplate = currentTemplate)
+                ConversationManager(
+                    currentSystemPrompt,
+                    maxTokens = { contextTokens },
+                    promptTemplate = currentTemplate,
+                    tokenCounter = tokenCounter
+                )
             }
             val prompt = manager.buildPrompt(text)
-            val historyTokens = manager.getHistory().sumOf { it.content.length / 4 }
+            val historyTokens = tokenCounter.count(manager.getHistory().map { it.content }).sum()
             val retrievedCtxTokens = 0
             manager.appendUser(text)
             Log.d("ChatRepository", "Prompt prepared: $prompt")
@@ -226,64 +462,71 @@ class ChatRepositoryImpl @Inject constructor(
             // 3) stream tokens
             val llamaStartTime = System.currentTimeMillis()
             var firstTokenTime: Long? = null
-            var nativePrefill: Long = 0
-            var nativeFirstSample: Long = 0
-            var tokenCount = 0
-            val promptTokens = prompt.length / 4
+            var telemetry: GenerationTelemetry? = null
+            var chunkCount = 0
             val maxTokens = dataStore.data.first()[SettingsKeys.MAX_TOKENS] ?: 96
-            Log.d(
-                "ChatRepository",
-                "PERFORMANCE: Prompt tokens: $promptTokens (history $historyTokens), n_ctx: 1536, n_batch: $N_BATCH, n_ubatch: $N_UBATCH"
-            )
 
             val builder = StringBuilder()
             var generationFailed = false
-            withContext(Dispatchers.IO) {
-                Log.d("ChatRepository", "Starting token generation at ${System.currentTimeMillis()}")
-                try {
-                    LlamaNative.llamaGenerateStream(
-                        ctx,
-                        prompt,
-                        maxTokens,  // Reduced for faster first token
-                        object : StreamCallback {
-                            override fun onTimings(prefillMs: Long, firstSampleDelayMs: Long) {
-                                nativePrefill = prefillMs
-                                nativeFirstSample = firstSampleDelayMs
+            Log.d("ChatRepository", "Starting token generation at ${System.currentTimeMillis()}")
+            // The system turn survives context shifts if the chat outgrows n_ctx
+            val nKeep = manager.systemPrefixTokens(prompt)
+            try {
+                // Runs on the context's native worker; cancelling this flow stops the decode
+                val status = LlamaNative.generate(
+                    ctx,
+                    prompt,
+                    maxTokens,  // Reduced for faster first token
+                    LlamaNative.PRIORITY_INTERACTIVE,
+                    object : StreamCallback {
+                        override fun onTelemetry(t: GenerationTelemetry) {
+                            telemetry = t
+                        }
+                        override fun onToken(token: String) {
+                            if (firstTokenTime == null) {
+                                firstTokenTime = System.currentTimeMillis()
+                                Log.d("ChatRepository", "🚀 PERFORMANCE: First token after ${firstTokenTime!! - llamaStartTime}ms")
                             }
-                            override fun onToken(token: String) {
-                                if (firstTokenTime == null) {
-                                    firstTokenTime = System.currentTimeMillis()
-                                    Log.d("ChatRepository", "🚀 PERFORMANCE: First token after ${firstTokenTime!! - llamaStartTime}ms")
-                                }
-
-                                Log.d("ChatRepository", "Generated token: $token")
-                                tokenCount++
-
-                                val normalized = normalizeToken(token)
-                                val output = if (builder.isEmpty()) normalized.trimStart() else normalized
-
-                                val success = trySend(output).isSuccess
-                                if (success) {
-                                    builder.append(output)
-                                }
+
+                            Log.d("ChatRepository", "Generated text: $token")
+                            chunkCount++
+
+                            val output = if (builder.isEmpty()) token.trimStart() else token
+
+                            val success = trySend(output).isSuccess
+                            if (success) {
+                                builder.append(output)
                             }
                         }
-                    )
-                } catch (e: Throwable) {
+                    },
+                    nKeep = nKeep,
+                    stops = currentTemplate.stopStrings
+                )
+                if (status == LlamaNative.STATUS_FAILED) {
                     generationFailed = true
-                    Log.e("ChatRepository", "Error during streaming", e)
-                    val msg = if (e.message?.contains("llama_decode") == true || e is OutOfMemoryError) {
-                        "Sorry, I ran out of memory. Could you try again with a shorter context?"
-                    } else {
-                        "Error: Failed to generate response"
+                    Log.e("ChatRepository", "Native decode failed after $chunkCount chunks")
+                    if (builder.isEmpty()) {
+                        val msg = "Sorry, I ran out of memory. Could you try again with a shorter context?"
+                        builder.append(msg)
+                        trySend(msg)
                     }
-                    builder.clear()
-                    builder.append(msg)
-                    trySend(msg)
                 }
+            } catch (e: CancellationException) {
+                throw e
+            } catch (e: Throwable) {
+                generationFailed = true
+                Log.e("ChatRepository", "Error during streaming", e)
+                val msg = if (e.message?.contains("llama_decode") == true || e is OutOfMemoryError) {
+                    "Sorry, I ran out of memory. Could you try again with a shorter context?"
+                } else {
+                    "Error: Failed to generate response"
+                }
+                builder.clear()
+                builder.append(msg)
+                trySend(msg)
             }
 
-            LlamaNative.llamaKvCacheClear(ctx)
+            if (!generationFailed) saveKvSnapshot(ctx, conversationId)
 
             // 4) after streaming, persist assistant message
             val reply = builder.toString()
@@ -305,7 +548,7 @@ class ChatRepositoryImpl @Inject constructor(
             }
             Log.d("ChatRepository", "Assistant message saved")
 
-            if (!generationFailed && expectsLongAnswer && tokenCount < 20) {
+            if (!generationFailed && expectsLongAnswer && (telemetry?.generatedTokens ?: chunkCount) < 20) {
                 val followUp = "Want me to continue?"
                 val followUpTime = System.currentTimeMillis()
                 db.withTransaction {
@@ -324,15 +567,21 @@ class ChatRepositoryImpl @Inject constructor(
 
             val endBattery = MetricsLogger.batteryLevel(appContext)
             val endTemp = MetricsLogger.deviceTemperature(appContext)
-            val prefillTime = if (nativePrefill > 0) nativePrefill else (firstTokenTime ?: replyTime) - llamaStartTime
-            val firstSampleDelay = nativeFirstSample
-            val firstTokenTotal = prefillTime + firstSampleDelay
-            val decodeTimeMs = replyTime - (firstTokenTime ?: replyTime)
-            val decodeSpeed = if (decodeTimeMs > 0) tokenCount / (decodeTimeMs / 1000.0) else 0.0
-            Log.d(
-                "ChatRepository",
-                "PERFORMANCE: Token counts - prompt: $promptTokens, output: $tokenCount"
-            )
+            // Native telemetry is exact; wall-clock fallbacks only when the request never ran
+            val tel = telemetry
+            val prefillTime = tel?.prefillMs ?: ((firstTokenTime ?: replyTime) - llamaStartTime)
+            val firstSampleDelay = tel?.firstSampleMs ?: 0L
+            val firstTokenTotal = tel?.firstTokenMs ?: prefillTime
+            val decodeTimeMs = tel?.decodeMs ?: (replyTime - (firstTokenTime ?: replyTime))
+            val decodeSpeed = tel?.decodeSpeed ?: 0.0
+            if (tel != null) {
+                Log.d(
+                    "ChatRepository",
+                    "PERFORMANCE: Token counts - prompt: ${tel.promptTokens}, output: ${tel.generatedTokens}, reused: ${tel.reusedTokens}, " +
+                        "prefilled: ${tel.prefilledTokens} in ${tel.prefillUbatches} ubatches, KV ${tel.kvCellsUsed}/${tel.kvCellsTotal}, " +
+                        "n_batch ${tel.nBatch}, n_ubatch ${tel.nUbatch}, threads ${tel.nThreads}/${tel.nThreadsBatch}"
+                )
+            }
             val metrics = GenerationMetrics(
                 timestamp = replyTime,
                 prefillTimeMs = prefillTime,
@@ -344,19 +593,36 @@ class ChatRepositoryImpl @Inject constructor(
                 startTempC = startTemp,
                 endTempC = endTemp,
                 promptChars = prompt.length,
-                promptTokens = promptTokens,
+                promptTokens = tel?.promptTokens ?: 0,
                 historyTokens = historyTokens,
                 retrievedCtxTokens = retrievedCtxTokens,
-                outputTokens = tokenCount,
+                outputTokens = tel?.generatedTokens ?: chunkCount,
+                reusedTokens = tel?.reusedTokens ?: 0,
+                prefilledTokens = tel?.prefilledTokens ?: 0,
+                draftedTokens = tel?.draftedTokens ?: 0,
+                acceptedTokens = tel?.acceptedTokens ?: 0,
+                loadTimeMs = loadTimeMs,
+                warmupTimeMs = warmupTimeMs,
+                queueTimeMs = (tel?.queueUs ?: 0L) / 1000,
+                tokenizeTimeMs = (tel?.tokenizeUs ?: 0L) / 1000,
+                sampleTimeMs = (tel?.sampleUs ?: 0L) / 1000,
+                prefillUbatches = tel?.prefillUbatches ?: 0,
+                decodeP50Ms = (tel?.latencyP50Us ?: 0L) / 1000.0,
+                decodeP95Ms = (tel?.latencyP95Us ?: 0L) / 1000.0,
+                decodeP99Ms = (tel?.latencyP99Us ?: 0L) / 1000.0,
+                latencyHistogram = tel?.histogramString() ?: "",
+                kvCellsUsed = tel?.kvCellsUsed ?: 0,
+                kvCellsTotal = tel?.kvCellsTotal ?: 0,
+                contextShifts = tel?.contextShifts ?: 0,
                 promptId = conversationId,
                 category = "",
                 ragEnabled = false,
                 memoryEnabled = false,
                 topK = 0,
                 maxTokens = maxTokens,
-                nThreads = threadCount,
-                nBatch = N_BATCH,
-                nUbatch = N_UBATCH,
+                nThreads = tel?.nThreads ?: threadCount,
+                nBatch = tel?.nBatch ?: 0,
+                nUbatch = tel?.nUbatch ?: 0,
                 model = modelName
             )
             MetricsLogger.log(appContext, metrics)
@@ -373,6 +639,8 @@ class ChatRepositoryImpl @Inject constructor(
     override suspend fun deleteConversation(conversationId: String) {
         Log.d("ChatRepository", "Deleting conversation: $conversationId")
         convDao.deleteById(conversationId)
+        kvSnapshots.deleteConversation(conversationId)
+        if (activeConversationId == conversationId) activeConversationId = null
     }
 
     override fun isModelReady(): Boolean {
@@ -387,16 +655,6 @@ class ChatRepositoryImpl @Inject constructor(
     // Public methods for RAG repository access
     suspend fun getLlamaContextPublic(): Long = getLlamaContext()
     
-    fun normalizeTokenPublic(token: String): String = normalizeToken(token)
-
-    private fun normalizeToken(token: String): String {
-        return token
-            .replace("▁", " ")            // SentencePiece space
-            .replace("Ġ", " ")            // BPE space
-            .replace("Ċ", "\n")          // BPE newline
-            .replace("Äł", " ")           // Qwen space artefact
-    }
-
     // -- Helpers to convert between Entity ⇄ Domain --
     private fun ConversationEntity.toDomain() =
         Conversation(id, title, lastMessage, formatTimestamp(timestamp))
@@ -1,5 +1,6 @@
 package edu.upt.assistant.domain
 
+import edu.upt.assistant.ContextConfig
 import edu.upt.assistant.domain.prompts.ConversationMessage
 import edu.upt.assistant.domain.prompts.MessageRole
 import edu.upt.assistant.domain.prompts.PromptTemplate
@@ -13,8 +14,10 @@ class ConversationManager(
 Respond naturally and directly to the user's messages. 
 Keep responses focused and avoid generating lengthy or fictional conversations.
 Only respond as the Assistant - do not continue the conversation or create additional exchanges.""",
-    private val maxTokens: Int = 1536,  // Reduced to match n_ctx for better performance
-    private val promptTemplate: PromptTemplate = GenericPromptTemplate()
+    // The live context's n_ctx, read on every trim so a resized context takes effect at once
+    private val maxTokens: () -> Int = { ContextConfig.DEFAULT_N_CTX },
+    private val promptTemplate: PromptTemplate = GenericPromptTemplate(),
+    private val tokenCounter: TokenCounter = TokenCounter.ESTIMATE
 ) {
     private val history = ArrayDeque<Message>()
 
@@ -55,17 +58,40 @@ Only respond as the Assistant - do not continue the conversation or create addit
         )
     }
     
+    /**
+     * Tokens at the start of [prompt] that belong to the system turn, for LlamaNative.generate's
+     * nKeep: context shifts slide the conversation but never drop the instructions.
+     */
+    fun systemPrefixTokens(prompt: String): Int {
+        val bare = promptTemplate.buildPrompt(systemPrompt, emptyList(), "")
+        return tokenCounter.countPrompt(prompt.commonPrefixWith(bare))
+    }
+
     fun getHistory(): List<Message> {
         return history.toList()
     }
 
+    // The prompt is counted once; when it is over budget the messages are counted in one batch
+    // (cached natively, so mostly free) and the template's per-message overhead is derived from
+    // the difference, so dropping pairs needs no further prompt rebuilds.
     private fun trimIfNeeded(text: String) {
-        fun estimateTokens() = buildPrompt(text).length / 4
-        while (history.size > 2 && estimateTokens() > maxTokens) {
-            // Remove oldest USER+ASSISTANT pair
+        if (history.size <= 2) return
+        var total = tokenCounter.countPrompt(buildPrompt(text))
+        if (total <= maxTokens()) return
+
+        val bare = promptTemplate.buildPrompt(systemPrompt, emptyList(), text)
+        val counts = tokenCounter.count(listOf(bare) + history.map { it.content })
+        val perMessage = ((total - counts.sum()) / history.size).coerceAtLeast(0)
+        var next = 1
+        fun dropFirst() {
             history.removeFirst()
+            total -= counts[next++] + perMessage
+        }
+        while (history.size > 2 && total > maxTokens()) {
+            // Remove oldest USER+ASSISTANT pair
+            dropFirst()
             if (history.firstOrNull()?.role == Role.USER) {
-                history.removeFirst()
+                dropFirst()
             }
         }
     }
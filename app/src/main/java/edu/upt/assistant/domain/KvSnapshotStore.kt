@@ -0,0 +1,93 @@
+package edu.upt.assistant.domain
+
+import android.content.Context
+import android.util.Log
+import dagger.hilt.android.qualifiers.ApplicationContext
+import edu.upt.assistant.LlamaNative
+import java.io.File
+import java.security.MessageDigest
+import javax.inject.Inject
+import javax.inject.Singleton
+
+/**
+ * On-disk KV state snapshots, one per (conversation, model) pair.
+ *
+ * The native side writes `<key>.kv` plus a `<key>.kv.meta` fingerprint and refuses to load a
+ * snapshot taken with different weights, context size or KV types. This class only handles
+ * naming, LRU bookkeeping (file mtime) and keeping the directory under a byte budget.
+ */
+@Singleton
+class KvSnapshotStore @Inject constructor(
+    @ApplicationContext context: Context
+) {
+
+    companion object {
+        private const val TAG = "KvSnapshotStore"
+        private const val EXT = ".kv"
+        private const val META_EXT = ".meta"
+        const val DEFAULT_BUDGET_MB = 64
+    }
+
+    private val dir = File(context.cacheDir, "kv_snapshots").apply { mkdirs() }
+
+    fun save(ctx: Long, conversationId: String, modelName: String, budgetMb: Int = DEFAULT_BUDGET_MB) {
+        val file = snapshotFile(conversationId, modelName)
+        val bytes = LlamaNative.llamaStateSave(ctx, file.absolutePath)
+        if (bytes > 0) {
+            Log.d(TAG, "Saved snapshot for $conversationId ($bytes bytes)")
+            evict(budgetMb.toLong() * 1024 * 1024)
+        }
+    }
+
+    /** Returns the number of restored tokens, or -1 if there was no usable snapshot. */
+    fun restore(ctx: Long, conversationId: String, modelName: String): Int {
+        val file = snapshotFile(conversationId, modelName)
+        if (!file.exists()) return -1
+        val start = System.currentTimeMillis()
+        val restored = LlamaNative.llamaStateLoad(ctx, file.absolutePath)
+        if (restored < 0) {
+            // Stale (different model/params) or corrupt: drop it so it doesn't count against the budget
+            delete(file)
+            return -1
+        }
+        file.setLastModified(System.currentTimeMillis())
+        Log.d(TAG, "Restored $restored tokens for $conversationId in ${System.currentTimeMillis() - start}ms")
+        return restored
+    }
+
+    fun deleteConversation(conversationId: String) {
+        val prefix = hash(conversationId) + "-"
+        dir.listFiles { f -> f.name.startsWith(prefix) && f.name.endsWith(EXT) }
+            ?.forEach { delete(it) }
+    }
+
+    /** Deletes least-recently-used snapshots until the directory fits in [budgetBytes]. */
+    fun evict(budgetBytes: Long) {
+        val snapshots = dir.listFiles { f -> f.name.endsWith(EXT) }
+            ?.sortedByDescending { it.lastModified() }
+            ?: return
+        var used = 0L
+        for (file in snapshots) {
+            used += file.length() + metaFile(file).length()
+            if (used > budgetBytes) {
+                Log.d(TAG, "Evicting snapshot ${file.name}")
+                delete(file)
+            }
+        }
+    }
+
+    private fun snapshotFile(conversationId: String, modelName: String): File =
+        File(dir, "${hash(conversationId)}-${hash(modelName)}$EXT")
+
+    private fun metaFile(file: File): File = File(file.path + META_EXT)
+
+    private fun delete(file: File) {
+        file.delete()
+        metaFile(file).delete()
+    }
+
+    private fun hash(s: String): String =
+        MessageDigest.getInstance("SHA-1").digest(s.toByteArray())
+            .take(8)
+            .joinToString("") { "%02x".format(it) }
+}
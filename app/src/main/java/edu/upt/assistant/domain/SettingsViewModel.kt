@@ -123,6 +123,29 @@ class SettingsViewModel @Inject constructor(
     dataStore.edit { prefs -> prefs[SettingsKeys.N_THREADS] = threads }
   }
 
+  /** Draft GGUF used for speculative decoding with [modelUrl]; null turns it off. */
+  fun setDraftModelForModel(modelUrl: String, draftUrl: String?) = viewModelScope.launch {
+    dataStore.edit { prefs ->
+      val key = SettingsKeys.draftModelForModel(modelUrl)
+      if (draftUrl.isNullOrBlank()) prefs.remove(key) else prefs[key] = draftUrl
+    }
+  }
+
+  /** Max n-gram size for prompt-lookup drafting with [modelUrl]; 0 turns it off. */
+  fun setLookupNgramForModel(modelUrl: String, ngram: Int) = viewModelScope.launch {
+    dataStore.edit { prefs -> prefs[SettingsKeys.lookupNgramForModel(modelUrl)] = ngram }
+  }
+
+  /** Weight loading options; mmap/mlock take effect on the next model load. */
+  fun setModelLoadOptions(useMmap: Boolean, useMlock: Boolean, prefetch: Boolean, warmup: Boolean) = viewModelScope.launch {
+    dataStore.edit { prefs ->
+      prefs[SettingsKeys.MODEL_USE_MMAP] = useMmap
+      prefs[SettingsKeys.MODEL_USE_MLOCK] = useMlock
+      prefs[SettingsKeys.MODEL_PREFETCH] = prefetch
+      prefs[SettingsKeys.MODEL_WARMUP] = warmup
+    }
+  }
+
   fun setMaxTokens(max: Int) = viewModelScope.launch {
     dataStore.edit { prefs -> prefs[SettingsKeys.MAX_TOKENS] = max }
   }
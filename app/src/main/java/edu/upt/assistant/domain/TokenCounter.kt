@@ -0,0 +1,54 @@
+package edu.upt.assistant.domain
+
+import edu.upt.assistant.LlamaNative
+
+/**
+ * Token counts for prompt budgeting. With a live context ([ctxPtr] != 0) counts are exact and
+ * come from the native LRU, many texts per JNI call; without one they fall back to the old
+ * chars/4 estimate so prompts can still be assembled before the model is up.
+ */
+class TokenCounter(private val ctxPtr: () -> Long) {
+
+    companion object {
+        /** Always estimates; for callers that never have a context. */
+        val ESTIMATE = TokenCounter { 0L }
+
+        private fun estimate(text: String): Int = (text.length / 4).coerceAtLeast(1)
+    }
+
+    /** Counts for fragments that end up inside a prompt (no BOS). */
+    fun count(texts: List<String>): IntArray {
+        if (texts.isEmpty()) return IntArray(0)
+        val ctx = ctxPtr()
+        return if (ctx != 0L) LlamaNative.llamaCountTokens(ctx, texts.toTypedArray(), false)
+        else IntArray(texts.size) { estimate(texts[it]) }
+    }
+
+    fun count(text: String): Int = count(listOf(text))[0]
+
+    /** A whole prompt as the generator will see it, BOS included. */
+    fun countPrompt(prompt: String): Int {
+        val ctx = ctxPtr()
+        return if (ctx != 0L) LlamaNative.llamaCountTokens(ctx, arrayOf(prompt), true)[0] else estimate(prompt)
+    }
+
+    /**
+     * Walks [texts] in priority order and keeps each one that still fits [budget]; every kept
+     * item after the first also costs [separatorTokens]. Returns the kept indices, ascending.
+     */
+    fun pack(texts: List<String>, budget: Int, separatorTokens: Int = 0): IntArray {
+        if (texts.isEmpty()) return IntArray(0)
+        val ctx = ctxPtr()
+        if (ctx != 0L) return LlamaNative.llamaPackTokens(ctx, texts.toTypedArray(), budget, separatorTokens)
+        val kept = ArrayList<Int>()
+        var used = 0
+        texts.forEachIndexed { i, text ->
+            val cost = estimate(text) + if (kept.isEmpty()) 0 else separatorTokens
+            if (used + cost <= budget) {
+                used += cost
+                kept += i
+            }
+        }
+        return kept.toIntArray()
+    }
+}
@@ -3,16 +3,15 @@ package edu.upt.assistant.domain.memory
 import android.util.Log
 import edu.upt.assistant.data.local.db.MemoryDao
 import edu.upt.assistant.data.local.db.MemoryEntity
+import edu.upt.assistant.domain.rag.VectorIndex
 import edu.upt.assistant.domain.rag.VectorStore
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.first
 import kotlinx.coroutines.launch
-import java.util.concurrent.ConcurrentHashMap
 import javax.inject.Inject
 import javax.inject.Singleton
-import kotlin.math.sqrt
 
 @Singleton
 class MemoryRepository @Inject constructor(
@@ -22,20 +21,24 @@ class MemoryRepository @Inject constructor(
     companion object {
         private const val TAG = "MemoryRepository"
         private const val MIN_SIMILARITY_THRESHOLD = 0.20f // tune as needed
+        // BM25 a keyword-only match needs when there is no query embedding to vouch for it
+        private const val MIN_LEXICAL_SCORE = 3.0f
+        private const val MMR_CANDIDATE_FACTOR = 4
+        private const val MIN_MMR_CANDIDATES = 16
     }
 
-    // In-memory embedding cache (L2-normalized for fast cosine via dot)
-    private val embedCache = ConcurrentHashMap<String, FloatArray>()
+    // Native on-disk index of memory embeddings (normalized, so scores are cosines)
+    private val index = vectorStore.openIndex("memories")
+    // Title + content + keywords of each memory, same ids, for BM25 and hybrid retrieval
+    private val lexical = vectorStore.openLexicalIndex("memories")
 
     init {
         // Best-effort background warm-up so first query isn't O(N) embedding
         CoroutineScope(Dispatchers.IO).launch {
             try {
-                val all = memoryDao.getAll().first()
-                all.forEach { m ->
-                    ensureCached(m)
-                }
-                Log.d(TAG, "Embedding cache warmed: ${embedCache.size} items")
+                ensureIndexed(memoryDao.getAll().first())
+                lexical.save()
+                Log.d(TAG, "Memory index warmed: ${index.count()} items")
             } catch (t: Throwable) {
                 Log.w(TAG, "Warm-up skipped: ${t.message}")
             }
@@ -59,7 +62,7 @@ class MemoryRepository @Inject constructor(
         }
         if (existing != null) {
             Log.d(TAG, "Duplicate memory detected, skipping insert: ${existing.id}")
-            ensureCached(existing) // make sure cache has it
+            ensureIndexed(listOf(existing)) // make sure the index has it
             return existing.id
         }
 
@@ -73,13 +76,8 @@ class MemoryRepository @Inject constructor(
 
         memoryDao.upsert(memory)
 
-        // Precompute & cache embedding once
-        try {
-            val emb = l2Normalize(vectorStore.generateEmbedding(memory.content))
-            embedCache[memory.id] = emb
-        } catch (t: Throwable) {
-            Log.w(TAG, "Failed to embed new memory ${memory.id}: ${t.message}")
-        }
+        // Precompute & index embedding once
+        ensureIndexed(listOf(memory))
 
         Log.d(TAG, "Memory added successfully: ${memory.id}")
         return memory.id
@@ -88,64 +86,52 @@ class MemoryRepository @Inject constructor(
     suspend fun search(query: String, topK: Int = 3): List<MemoryEntity> {
         Log.d(TAG, "Searching memories for query: $query")
 
-        // 1) Load all memories & ensure embeddings are cached (lazy, only missing ones)
+        // 1) Load all memories & ensure embeddings are indexed (lazy, only missing ones)
         val memories = memoryDao.getAll().first()
         if (memories.isEmpty()) {
             Log.d(TAG, "No memories found in database")
             return emptyList()
         }
-        memories.forEach { ensureCached(it) }
+        ensureIndexed(memories)
 
-        // 2) Try to embed query (L2-normalized). If embedding fails, we'll fall back to keyword search.
-        val q = try {
-            l2Normalize(vectorStore.generateEmbedding(query))
+        // 2) Try to embed query. Without the embedding model, or if embedding fails, we'll fall
+        //    back to keyword search.
+        val q = if (!vectorStore.ensureEmbedder()) null else try {
+            vectorStore.generateEmbedding(query)
         } catch (t: Throwable) {
             Log.e(TAG, "Embedding failed for query", t)
             null
         }
 
-        // 3) Score (cosine = dot since everything is L2-normalized)
-        val scored = if (q != null) {
-            memories.mapNotNull { m ->
-                val emb = embedCache[m.id] ?: return@mapNotNull null
-                val dot = dot(q, emb)
-                MemoryMatch(m, dot, emb)
-            }
-        } else emptyList()
-
-        if (scored.isEmpty()) {
-            val queryTerms = query.lowercase().split(Regex("\\W+")).filter { it.length > 2 }
-            if (queryTerms.isNotEmpty()) {
-                val fallback = memories.filter { mem ->
-                    val lower = mem.content.lowercase()
-                    queryTerms.any { lower.contains(it) }
-                }
-                return fallback.take(topK)
-            }
+        // 3) BM25 and cosine candidates fused by rank in one native call (BM25 alone if the
+        //    embedding failed); over-fetch so MMR has candidates to diversify from
+        val candidates = maxOf(topK * MMR_CANDIDATE_FACTOR, MIN_MMR_CANDIDATES)
+        // Fusion ranks every BM25 hit, even one sharing a single common term with the query: with
+        // an embedding keep only hits at or above the cosine floor, without one a BM25 floor
+        val hits = lexical.hybridSearch(index, query, q, candidates, candidates, MIN_SIMILARITY_THRESHOLD)
+            .filter { if (q != null) it.vectorScore != null else it.lexicalScore >= MIN_LEXICAL_SCORE }
+        if (hits.isEmpty()) {
+            Log.d(TAG, "No relevant memories found")
             return emptyList()
         }
 
-        // 4) Filter by threshold
-        val sorted = scored.sortedByDescending { it.similarity }
-        val base = sorted.filter { it.similarity >= MIN_SIMILARITY_THRESHOLD }
+        // Fused scores only order hits; rescale them to 0..1 so MMR weighs relevance against
+        // diversity the way it did with cosines
+        val byId = memories.associateBy { VectorIndex.idOf(it.id) }
+        val best = hits.first().score
+        val worst = hits.last().score
+        val scored = hits.mapNotNull { hit ->
+            val m = byId[hit.id] ?: return@mapNotNull null
+            val relevance = if (best > worst) (hit.score - worst) / (best - worst) else 1f
+            MemoryMatch(m, relevance, index.get(hit.id) ?: FloatArray(0))
+        }
 
-        // 5) Apply MMR with correct K
-        val k = minOf(topK, base.size)
-        val mmr = applyMmr(base, k = k, lambda = 0.7f)
+        // 4) Apply MMR with correct K (hits are already best-first)
+        val k = minOf(topK, scored.size)
+        val mmr = applyMmr(scored, k = k, lambda = 0.7f)
 
         Log.d(TAG, "Found ${mmr.size} relevant memories after MMR (k=$k)")
-        val result = mmr.map { it.memory }
-        if (result.isEmpty()) {
-            val queryTerms = query.lowercase().split(Regex("\\W+")).filter { it.length > 2 }
-            if (queryTerms.isNotEmpty()) {
-                val fallback = memories.filter { mem ->
-                    val lower = mem.content.lowercase()
-                    queryTerms.any { lower.contains(it) }
-                }
-                return fallback.take(topK)
-            }
-        }
-        return result
+        return mmr.map { it.memory }
     }
 
     fun getAllMemories(): Flow<List<MemoryEntity>> = memoryDao.getAll()
@@ -154,43 +140,40 @@ class MemoryRepository @Inject constructor(
     suspend fun deleteMemory(id: String) {
         Log.d(TAG, "Deleting memory: $id")
         memoryDao.delete(id)
-        embedCache.remove(id)
+        index.delete(longArrayOf(VectorIndex.idOf(id)))
+        lexical.delete(longArrayOf(VectorIndex.idOf(id)))
     }
 
     // --- helpers ---
 
-    // Ensure cache has an embedding for this memory (compute if missing)
-    private suspend fun ensureCached(m: MemoryEntity) {
-        if (embedCache.containsKey(m.id)) return
+    // Embed all memories missing from the index (new, or the embedding dimension changed) in one
+    // batch once the embedding model is loaded, and add any missing from the BM25 index
+    private suspend fun ensureIndexed(memories: List<MemoryEntity>) {
+        val unindexed = memories.filter { !lexical.contains(VectorIndex.idOf(it.id)) }
+        if (unindexed.isNotEmpty()) {
+            lexical.add(LongArray(unindexed.size) { VectorIndex.idOf(unindexed[it].id) }, unindexed.map { lexicalText(it) })
+        }
+
+        if (!vectorStore.ensureEmbedder()) return
+        val dim = vectorStore.dimension()
+        val missing = memories.filter { !index.contains(VectorIndex.idOf(it.id), dim) }
+        if (missing.isEmpty()) return
         try {
-            val emb = l2Normalize(vectorStore.generateEmbedding(m.content))
-            embedCache[m.id] = emb
+            val vectors = vectorStore.generateEmbeddings(missing.map { it.content })
+            if (vectors.any { it.size != dim }) return
+            index.add(LongArray(missing.size) { VectorIndex.idOf(missing[it].id) }, vectors)
         } catch (t: Throwable) {
-            Log.w(TAG, "Failed to embed memory ${m.id}: ${t.message}")
+            Log.w(TAG, "Failed to embed ${missing.size} memories: ${t.message}")
         }
     }
 
-    private fun l2Normalize(v: FloatArray): FloatArray {
-        var sum = 0.0
-        for (x in v) sum += x * x
-        val n = sqrt(sum).toFloat()
-        if (n == 0f) return v
-        val out = FloatArray(v.size)
-        for (i in v.indices) out[i] = v[i] / n
-        return out
-    }
-
-    private fun dot(a: FloatArray, b: FloatArray): Float {
-        var s = 0.0
-        val n = minOf(a.size, b.size)
-        for (i in 0 until n) s += a[i] * b[i]
-        return s.toFloat()
-    }
+    private fun lexicalText(memory: MemoryEntity): String =
+        listOfNotNull(memory.title, memory.content, memory.keywords.replace(',', ' ')).joinToString(" ")
 }
 
 data class MemoryMatch(
     val memory: MemoryEntity,
-    val similarity: Float,          // cosine similarity to query
+    val similarity: Float,          // relevance to the query, 0..1
     val embedding: FloatArray       // L2-normalized memory embedding
 ) {
     override fun equals(other: Any?): Boolean {
@@ -2,6 +2,8 @@
 package edu.upt.assistant.domain.prompts
 
 class GemmaPromptTemplate : PromptTemplate {
+    override val stopStrings = listOf("<end_of_turn>", "<start_of_turn>")
+
     override fun buildPrompt(
         systemPrompt: String,
         conversationHistory: List<ConversationMessage>,
@@ -1,6 +1,8 @@
 package edu.upt.assistant.domain.prompts
 
 class GenericPromptTemplate : PromptTemplate {
+    override val stopStrings = listOf("\nUser:")
+
     override fun buildPrompt(
         systemPrompt: String,
         conversationHistory: List<ConversationMessage>,
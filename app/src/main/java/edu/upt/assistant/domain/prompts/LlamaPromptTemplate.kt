@@ -1,6 +1,8 @@
 package edu.upt.assistant.domain.prompts
 
 class LlamaPromptTemplate : PromptTemplate {
+    override val stopStrings = listOf("<|eot_id|>", "<|start_header_id|>")
+
     override fun buildPrompt(
         systemPrompt: String,
         conversationHistory: List<ConversationMessage>,
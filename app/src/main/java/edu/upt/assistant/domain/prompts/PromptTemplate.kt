@@ -6,6 +6,9 @@ interface PromptTemplate {
         conversationHistory: List<ConversationMessage>,
         currentUserMessage: String
     ): String
+
+    /** Text that means the model left its turn; generation stops before it (matched natively). */
+    val stopStrings: List<String> get() = emptyList()
 }
 
 data class ConversationMessage(
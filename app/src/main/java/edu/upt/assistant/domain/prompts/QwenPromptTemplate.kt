@@ -1,6 +1,8 @@
 package edu.upt.assistant.domain.prompts
 
 class QwenPromptTemplate : PromptTemplate {
+    override val stopStrings = listOf("<|im_end|>", "<|im_start|>")
+
     override fun buildPrompt(
         systemPrompt: String,
         conversationHistory: List<ConversationMessage>,
@@ -9,9 +9,10 @@ class DocumentProcessor {
     
     companion object {
         private const val TAG = "DocumentProcessor"
-        // RAG-friendly defaults: 512–800 char chunks with 50–80% overlap
+        // Only used until the embedding model is available (VectorStore.ingestText chunks on its
+        // tokens otherwise); a small overlap keeps context without embedding most text twice
         private const val CHUNK_SIZE = 700
-        private const val CHUNK_OVERLAP = 420 // ~60% overlap
+        private const val CHUNK_OVERLAP = 100
     }
 
     suspend fun processDocument(
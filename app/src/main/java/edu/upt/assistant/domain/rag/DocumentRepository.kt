@@ -1,13 +1,25 @@
 package edu.upt.assistant.domain.rag
 
 import android.util.Log
+import edu.upt.assistant.IngestCallback
 import edu.upt.assistant.data.local.db.DocumentDao
 import edu.upt.assistant.data.local.db.DocumentEntity
+import kotlinx.coroutines.Job
+import kotlinx.coroutines.currentCoroutineContext
+import kotlinx.coroutines.ensureActive
 import kotlinx.coroutines.flow.Flow
+import kotlinx.coroutines.flow.MutableStateFlow
+import kotlinx.coroutines.flow.StateFlow
+import kotlinx.coroutines.flow.asStateFlow
 import kotlinx.coroutines.flow.map
 import kotlinx.coroutines.flow.first
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
+import kotlinx.serialization.Serializable
 import kotlinx.serialization.encodeToString
 import kotlinx.serialization.json.Json
+import java.io.File
+import java.util.UUID
 import javax.inject.Inject
 import javax.inject.Singleton
 
@@ -21,12 +33,51 @@ class DocumentRepository @Inject constructor(
     companion object {
         private const val TAG = "DocumentRepository"
         private const val MIN_SIMILARITY_THRESHOLD = 0.3f // Minimum similarity score to consider a chunk relevant
+        // BM25 a chunk needs to be kept on keywords alone, without clearing the cosine floor
+        private const val MIN_LEXICAL_SCORE = 3.0f
+        private const val CANDIDATE_FACTOR = 4
+        // Embedded chunks are handed to the indexes in groups of this many
+        private const val INDEX_FLUSH_CHUNKS = 32
+        // Characters of a streamed file kept as the document's displayed content
+        private const val FILE_PREVIEW_CHARS = 4096
     }
     
     private val json = Json { ignoreUnknownKeys = true }
-    
+
+    // Chunk vectors live in a native mmap'd index keyed by chunkIds(entity): per chunk hash for
+    // streamed documents, per chunk position for ones chunked by DocumentProcessor
+    private val index = vectorStore.openIndex("documents")
+    // Chunk texts, same ids, for BM25 and hybrid retrieval
+    private val lexical = vectorStore.openLexicalIndex("documents")
+    private val indexLock = Mutex()
+    // Dimension the index was last reconciled with the documents table at (0 = not yet)
+    @Volatile private var indexedDim = 0
+    @Volatile private var lexicalIndexed = false
+    // id -> chunk text/location, rebuilt lazily after documents change
+    @Volatile private var chunkRefs: Map<Long, ChunkRef>? = null
+
+    private val _ingestProgress = MutableStateFlow<IngestProgress?>(null)
+    /** The document import in progress, null when idle. */
+    val ingestProgress: StateFlow<IngestProgress?> = _ingestProgress.asStateFlow()
+
+    // Kept in DocumentEntity.metadata: hash of each chunk's tokens, in chunk order
+    @Serializable
+    private data class ChunkMetadata(val chunkHashes: List<Long> = emptyList())
+
+    private data class ChunkRef(
+        val documentId: String,
+        val documentTitle: String,
+        val chunkIndex: Int,
+        val text: String
+    )
+
     suspend fun initialize() {
-        vectorStore.initialize()
+        val entities = documentDao.getAllDocuments().first()
+        if (vectorStore.ensureEmbedder()) ensureIndexed(vectorStore.dimension(), entities)
+        ensureLexicalIndexed(entities)
+        val reclaimed = index.compact()
+        if (reclaimed > 0) Log.d(TAG, "Compacted document index, reclaimed $reclaimed bytes")
+        lexical.save()
     }
     
     fun getAllDocuments(): Flow<List<RagDocument>> {
@@ -48,35 +99,186 @@ class DocumentRepository @Inject constructor(
         }
     }
     
-    suspend fun addDocument(title: String, content: String, contentType: String = "text/plain"): String {
+    /** Imports [content] as a new document and returns its id. */
+    suspend fun addDocument(title: String, content: String, contentType: String = "text/plain"): String =
+        importDocument(null, title, contentType, content,
+            ingest = { known, callback -> vectorStore.ingestText(content, known, callback) },
+            fallback = { content })
+
+    /**
+     * Re-imports [content] in place of document [documentId] (created if there is none): chunks
+     * whose tokens are unchanged keep their vectors, so only edited regions are embedded again.
+     */
+    suspend fun replaceDocument(
+        documentId: String,
+        title: String,
+        content: String,
+        contentType: String = "text/plain"
+    ): String =
+        importDocument(documentId, title, contentType, content,
+            ingest = { known, callback -> vectorStore.ingestText(content, known, callback) },
+            fallback = { content })
+
+    /**
+     * Same as [addDocument] for a file, streamed from disk through a bounded buffer so memory
+     * stays flat in its size. Only the first few KB are kept as the document's content.
+     */
+    suspend fun addDocumentFile(title: String, file: File, contentType: String = "text/plain"): String =
+        importDocument(null, title, contentType, readPreview(file),
+            ingest = { known, callback -> vectorStore.ingestFile(file, known, callback) },
+            fallback = { file.readText() })
+
+    /** Same as [replaceDocument] for a file, streamed as in [addDocumentFile]. */
+    suspend fun replaceDocumentFile(
+        documentId: String,
+        title: String,
+        file: File,
+        contentType: String = "text/plain"
+    ): String =
+        importDocument(documentId, title, contentType, readPreview(file),
+            ingest = { known, callback -> vectorStore.ingestFile(file, known, callback) },
+            fallback = { file.readText() })
+
+    // Imports a new document (replacing == null) or re-imports over document `replacing`
+    private suspend fun importDocument(
+        replacing: String?,
+        title: String,
+        contentType: String,
+        content: String,
+        ingest: suspend (LongArray, IngestCallback) -> IntArray?,
+        fallback: suspend () -> String
+    ): String {
         Log.d(TAG, "Adding document: $title")
-        
-        val processed = documentProcessor.processDocument(title, content, contentType)
-        
-        // Generate embeddings for each chunk
-        val embeddings = processed.chunks.map { chunk ->
-            vectorStore.generateEmbedding(chunk)
+        val embedderReady = vectorStore.ensureEmbedder()
+        val existing = replacing?.let { documentDao.getDocumentById(it) }
+        val documentId = replacing ?: UUID.randomUUID().toString()
+        val oldIds = existing?.let { chunkIds(it) }.orEmpty().toSet()
+        // Only hashes whose vectors are still indexed (same embedding model) can be skipped
+        val dim = vectorStore.dimension()
+        val known = if (!embedderReady) LongArray(0) else existing?.let { chunkHashes(it) }.orEmpty()
+            .filter { index.contains(hashChunkId(documentId, it), dim) }
+            .toLongArray()
+
+        val texts = HashMap<Int, String>()
+        val hashes = HashMap<Int, Long>()
+        val added = mutableListOf<Long>()
+        val pendingIds = mutableListOf<Long>()
+        val pendingVectors = mutableListOf<FloatArray>()
+        val pendingTexts = mutableListOf<String>()
+        fun flush() {
+            if (pendingIds.isEmpty()) return
+            val ids = pendingIds.toLongArray()
+            index.add(ids, pendingVectors)
+            lexical.add(ids, pendingTexts)
+            added += pendingIds
+            pendingIds.clear()
+            pendingVectors.clear()
+            pendingTexts.clear()
         }
-        
-        val entity = DocumentEntity(
-            id = processed.id,
-            title = processed.title,
-            content = processed.content,
-            contentType = processed.contentType,
-            chunks = json.encodeToString(processed.chunks),
-            embeddings = json.encodeToString(embeddings.map { it.toList() }),
-            metadata = "{}"
-        )
-        
-        documentDao.insertDocument(entity)
-        Log.d(TAG, "Document added successfully: ${processed.id}")
-        
-        return processed.id
+
+        val job = currentCoroutineContext()[Job]
+        val callback = object : IngestCallback {
+            override fun onChunk(index: Int, hash: Long, text: String, vector: FloatArray?): Boolean {
+                texts[index] = text
+                hashes[index] = hash
+                val id = hashChunkId(documentId, hash)
+                if (vector != null) {
+                    pendingIds += id
+                    pendingVectors += vector
+                    pendingTexts += text
+                    if (pendingIds.size >= INDEX_FLUSH_CHUNKS) flush()
+                } else if (!lexical.contains(id)) {
+                    lexical.add(longArrayOf(id), listOf(text))
+                }
+                return job?.isActive != false
+            }
+
+            override fun onProgress(bytesRead: Long, bytesTotal: Long, chunks: Int, embedded: Int, reused: Int) {
+                _ingestProgress.value = IngestProgress(title, bytesRead, bytesTotal, chunks, embedded, reused)
+            }
+        }
+
+        var completed = false
+        try {
+            val chunks: List<String>
+            val chunkHashes: List<Long>
+            val ids: List<Long>
+            if (embedderReady && ingest(known, callback) != null) {
+                flush()
+                currentCoroutineContext().ensureActive()
+                val order = texts.keys.sorted()
+                chunks = order.map { texts.getValue(it) }
+                chunkHashes = order.map { hashes.getValue(it) }
+                ids = chunkHashes.map { hashChunkId(documentId, it) }
+            } else {
+                // No embedding model yet: character chunks, searchable by keyword only until
+                // ensureIndexed embeds them once the model is loaded
+                chunks = documentProcessor.processDocument(title, fallback(), contentType).chunks
+                chunkHashes = emptyList()
+                ids = List(chunks.size) { chunkId(documentId, it) }
+                lexical.add(ids.toLongArray(), chunks)
+                added += ids
+            }
+
+            val now = System.currentTimeMillis()
+            val entity = DocumentEntity(
+                id = documentId,
+                title = title,
+                content = content,
+                contentType = contentType,
+                chunks = json.encodeToString(chunks),
+                embeddings = "[]",
+                metadata = json.encodeToString(ChunkMetadata(chunkHashes)),
+                createdAt = existing?.createdAt ?: now,
+                updatedAt = now
+            )
+            documentDao.insertDocument(entity)
+            indexLock.withLock {
+                val stale = (oldIds - ids.toSet()).toLongArray()
+                index.delete(stale)
+                lexical.delete(stale)
+                // Not embedded, or with another model than the index was reconciled for: reconcile
+                // on the next search
+                if (!embedderReady || vectorStore.dimension() != indexedDim) indexedDim = 0
+                chunkRefs = null
+            }
+            completed = true
+            Log.d(TAG, "Document ${if (existing != null) "re-imported" else "added"}: $documentId (${chunks.size} chunks)")
+        } finally {
+            _ingestProgress.value = null
+            if (!completed) {
+                // Cancelled or failed: drop what this run added on top of the old document
+                val orphans = added.filter { it !in oldIds }.toLongArray()
+                index.delete(orphans)
+                lexical.delete(orphans)
+            }
+        }
+        return documentId
+    }
+
+    private fun readPreview(file: File): String = file.bufferedReader().use { reader ->
+        val buf = CharArray(FILE_PREVIEW_CHARS)
+        var n = 0
+        while (n < buf.size) {
+            val read = reader.read(buf, n, buf.size - n)
+            if (read < 0) break
+            n += read
+        }
+        String(buf, 0, n)
     }
     
     suspend fun deleteDocument(documentId: String) {
         Log.d(TAG, "Deleting document: $documentId")
+        val entity = documentDao.getDocumentById(documentId)
         documentDao.deleteDocumentById(documentId)
+        if (entity != null) {
+            indexLock.withLock {
+                val ids = chunkIds(entity).toLongArray()
+                index.delete(ids)
+                lexical.delete(ids)
+                chunkRefs = null
+            }
+        }
     }
     
     suspend fun searchSimilarContent(
@@ -88,139 +290,155 @@ class DocumentRepository @Inject constructor(
         Log.d(TAG, "Searching for similar content: $query")
         
         Log.d(TAG, "TIMING: Starting embedding generation at ${System.currentTimeMillis()}")
-        val queryEmbedding = try {
+        val queryEmbedding = if (!vectorStore.ensureEmbedder()) null else try {
             vectorStore.generateEmbedding(query)
         } catch (t: Throwable) {
             Log.e(TAG, "Failed to generate query embedding, falling back to keyword search", t)
             null
         }
-        if (queryEmbedding == null) {
-            val entities = documentDao.getAllDocuments().first()
-            val queryTerms = query.lowercase().split(Regex("\\W+")).filter { it.length > 2 }
-            if (queryTerms.isNotEmpty()) {
-                val fallback = mutableListOf<RetrievedChunk>()
-                entities.forEach { entity ->
-                    try {
-                        val chunks: List<String> = json.decodeFromString(entity.chunks)
-                        chunks.forEachIndexed { idx, text ->
-                            val lower = text.lowercase()
-                            if (queryTerms.any { lower.contains(it) }) {
-                                fallback.add(
-                                    RetrievedChunk(
-                                        text = text,
-                                        similarity = 1.0f,
-                                        documentId = entity.id,
-                                        documentTitle = entity.title,
-                                        chunkIndex = idx
-                                    )
-                                )
-                            }
-                        }
-                    } catch (e: Exception) {
-                        Log.e(TAG, "Error processing document '${entity.title}' for fallback", e)
-                    }
-                }
-                return fallback.take(topK)
+        if (queryEmbedding != null) {
+            Log.d(TAG, "TIMING: Embedding generation completed at ${System.currentTimeMillis()}")
+        }
+        val refs = ensureReady(queryEmbedding?.size)
+
+        Log.d(TAG, "TIMING: Starting native hybrid search at ${System.currentTimeMillis()}")
+        // BM25 and cosine candidates fused by rank in one native call (BM25 alone without an
+        // embedding); over-fetch so near-duplicate suppression below still leaves topK results.
+        // Fusion ranks every BM25 hit, even one sharing a single common term with the query, so a
+        // hit must clear the cosine floor (vectorScore set) or the BM25 floor to reach the context
+        val hits = lexical.hybridSearch(
+            index, query, queryEmbedding, topK * CANDIDATE_FACTOR, topK * CANDIDATE_FACTOR, minSimilarity
+        ).filter { it.vectorScore != null || it.lexicalScore >= MIN_LEXICAL_SCORE }
+        Log.d(TAG, "TIMING: Native hybrid search completed at ${System.currentTimeMillis()}")
+
+        val result = mutableListOf<RetrievedChunk>()
+        val kept = mutableListOf<LexicalIndex.HybridHit>()
+        val usedEmbeddings = mutableListOf<FloatArray>()
+        for (hit in hits) {
+            val ref = refs[hit.id] ?: continue
+            val emb = index.get(hit.id)
+            if (emb == null || usedEmbeddings.none { vectorStore.cosineSimilarity(emb, it) > 0.8f }) {
+                result.add(
+                    RetrievedChunk(
+                        text = ref.text,
+                        score = hit.score,
+                        similarity = hit.vectorScore,
+                        lexicalScore = hit.lexicalScore,
+                        documentId = ref.documentId,
+                        documentTitle = ref.documentTitle,
+                        chunkIndex = ref.chunkIndex
+                    )
+                )
+                kept.add(hit)
+                emb?.let { usedEmbeddings.add(it) }
             }
-            return emptyList()
+            if (result.size >= topK) break
         }
-        Log.d(TAG, "TIMING: Embedding generation completed at ${System.currentTimeMillis()}")
-        Log.d(TAG, "Generated query embedding")
+        
+        Log.d(TAG, "TIMING: Search completed at ${System.currentTimeMillis()}")
+        Log.d(TAG, "Search completed. ${hits.size} fused hits, returning top ${result.size}")
+        kept.forEach { hit ->
+            Log.d(TAG, "Chunk fused=${hit.score} cosine=${hit.vectorScore} bm25=${hit.lexicalScore}")
+        }
+
+        return result
+    }
 
-        // Get current snapshot of documents instead of collecting indefinitely
-        Log.d(TAG, "TIMING: Starting database query at ${System.currentTimeMillis()}")
+    // Reconciles the indexes with the documents table (for vectors of dimension [dim], if any)
+    // and returns the chunk refs. The table is only read when one of them is stale, so a warm
+    // search costs the native lookup alone.
+    private suspend fun ensureReady(dim: Int?): Map<Long, ChunkRef> {
+        chunkRefs?.let { refs ->
+            if (lexicalIndexed && (dim == null || indexedDim == dim)) return refs
+        }
         val entities = documentDao.getAllDocuments().first()
-        Log.d(TAG, "TIMING: Database query completed at ${System.currentTimeMillis()}")
-        Log.d(TAG, "Retrieved ${entities.size} documents from database")
-        
-        Log.d(TAG, "TIMING: Starting document processing at ${System.currentTimeMillis()}")
-        // store chunks with their embeddings for deduplication
-        val retrievedChunks = mutableListOf<Pair<RetrievedChunk, FloatArray>>()
-        
-        entities.forEach { entity ->
+        if (dim != null) ensureIndexed(dim, entities)
+        ensureLexicalIndexed(entities)
+        return chunkRefs ?: buildChunkRefs(entities).also { chunkRefs = it }
+    }
+
+    // Adds any chunk missing from the index (first run after upgrading, embedding model/dimension
+    // change, or a lost index file). Legacy JSON vectors are reused when they still fit.
+    private suspend fun ensureIndexed(dim: Int, entities: List<DocumentEntity>) = indexLock.withLock {
+        if (indexedDim == dim) return@withLock
+        var added = 0
+        for (entity in entities) {
             try {
                 val chunks: List<String> = json.decodeFromString(entity.chunks)
-                val embeddings: List<FloatArray> = json.decodeFromString<List<List<Float>>>(entity.embeddings)
-                    .map { it.toFloatArray() }
-                
-                Log.d(TAG, "Processing document '${entity.title}' with ${chunks.size} chunks")
-                
-                val similarChunks = vectorStore.findSimilarChunks(
-                    queryEmbedding = queryEmbedding,
-                    chunks = chunks,
-                    embeddings = embeddings,
-                    topK = topK
-                )
-
-                Log.d(TAG, "Found ${similarChunks.size} similar chunks in '${entity.title}'")
+                val ids = chunkIds(entity)
+                val missing = chunks.indices.filter { !index.contains(ids[it], dim) }
+                if (missing.isEmpty()) continue
 
-                similarChunks.forEach { similar ->
-                    val chunk = RetrievedChunk(
-                        text = similar.text,
-                        similarity = similar.similarity,
-                        documentId = entity.id,
-                        documentTitle = entity.title,
-                        chunkIndex = similar.index
-                    )
-                    retrievedChunks.add(chunk to embeddings[similar.index])
+                val legacy = json.decodeFromString<List<List<Float>>>(entity.embeddings)
+                val vectors = if (legacy.size == chunks.size && legacy.all { it.size == dim }) {
+                    missing.map { legacy[it].toFloatArray() }
+                } else {
+                    vectorStore.generateEmbeddings(missing.map { chunks[it] })
                 }
+                if (vectors.any { it.size != dim }) continue
+                added += index.add(LongArray(missing.size) { ids[missing[it]] }, vectors)
+                if (legacy.isNotEmpty()) documentDao.updateDocument(entity.copy(embeddings = "[]"))
             } catch (e: Exception) {
-                Log.e(TAG, "Error processing document '${entity.title}'", e)
+                Log.e(TAG, "Error indexing document '${entity.title}'", e)
             }
         }
-        
-        Log.d(TAG, "TIMING: Starting filtering and sorting at ${System.currentTimeMillis()}")
-        val filtered = retrievedChunks
-            .filter { it.first.similarity >= minSimilarity }
-            .sortedByDescending { it.first.similarity }
+        if (added > 0) Log.d(TAG, "Indexed $added missing chunks (dim=$dim)")
+        indexedDim = dim
+    }
 
-        val result = mutableListOf<RetrievedChunk>()
-        val usedEmbeddings = mutableListOf<FloatArray>()
-        for ((chunk, emb) in filtered) {
-            if (usedEmbeddings.none { vectorStore.cosineSimilarity(emb, it) > 0.8f }) {
-                result.add(chunk)
-                usedEmbeddings.add(emb)
+    private fun buildChunkRefs(entities: List<DocumentEntity>): Map<Long, ChunkRef> {
+        val refs = HashMap<Long, ChunkRef>()
+        entities.forEach { entity ->
+            try {
+                val chunks: List<String> = json.decodeFromString(entity.chunks)
+                val ids = chunkIds(entity)
+                chunks.forEachIndexed { idx, text ->
+                    refs[ids[idx]] = ChunkRef(entity.id, entity.title, idx, text)
+                }
+            } catch (e: Exception) {
+                Log.e(TAG, "Error processing document '${entity.title}'", e)
             }
-            if (result.size >= topK) break
-        }
-        
-        Log.d(TAG, "TIMING: Search completed at ${System.currentTimeMillis()}")
-        Log.d(TAG, "Search completed. ${retrievedChunks.size} total chunks, ${filtered.size} above threshold ($minSimilarity), returning top ${result.size}")
-        result.forEach { chunk ->
-            Log.d(TAG, "Chunk similarity: ${chunk.similarity} from '${chunk.documentTitle}'")
         }
+        return refs
+    }
 
-        if (result.isEmpty()) {
-            Log.d(TAG, "No similar chunks found, falling back to keyword search")
-            val queryTerms = query.lowercase().split(Regex("\\W+")).filter { it.length > 2 }
-            if (queryTerms.isNotEmpty()) {
-                val fallback = mutableListOf<RetrievedChunk>()
-                entities.forEach { entity ->
-                    try {
-                        val chunks: List<String> = json.decodeFromString(entity.chunks)
-                        chunks.forEachIndexed { idx, text ->
-                            val lower = text.lowercase()
-                            if (queryTerms.any { lower.contains(it) }) {
-                                fallback.add(
-                                    RetrievedChunk(
-                                        text = text,
-                                        similarity = 1.0f,
-                                        documentId = entity.id,
-                                        documentTitle = entity.title,
-                                        chunkIndex = idx
-                                    )
-                                )
-                            }
-                        }
-                    } catch (e: Exception) {
-                        Log.e(TAG, "Error processing document '${entity.title}' for fallback", e)
-                    }
-                }
-                return fallback.take(topK)
+    // Adds any chunk missing from the BM25 index (first run after upgrading, or a lost index file)
+    private suspend fun ensureLexicalIndexed(entities: List<DocumentEntity>) = indexLock.withLock {
+        if (lexicalIndexed) return@withLock
+        var added = 0
+        for (entity in entities) {
+            try {
+                val chunks: List<String> = json.decodeFromString(entity.chunks)
+                val ids = chunkIds(entity)
+                val missing = chunks.indices.filter { !lexical.contains(ids[it]) }
+                if (missing.isEmpty()) continue
+                added += lexical.add(LongArray(missing.size) { ids[missing[it]] }, missing.map { chunks[it] })
+            } catch (e: Exception) {
+                Log.e(TAG, "Error indexing document '${entity.title}' for keyword search", e)
             }
         }
+        if (added > 0) Log.d(TAG, "Indexed $added missing chunks for keyword search")
+        lexicalIndexed = true
+    }
 
-        return result
+    private fun chunkId(documentId: String, chunkIndex: Int): Long =
+        VectorIndex.idOf("$documentId#$chunkIndex")
+
+    private fun hashChunkId(documentId: String, hash: Long): Long =
+        VectorIndex.idOf("$documentId#h$hash")
+
+    private fun chunkHashes(entity: DocumentEntity): List<Long> = try {
+        json.decodeFromString<ChunkMetadata>(entity.metadata).chunkHashes
+    } catch (e: Exception) {
+        emptyList()
+    }
+
+    // Index ids of the entity's chunks, in chunk order
+    private fun chunkIds(entity: DocumentEntity): List<Long> {
+        val count = json.decodeFromString<List<String>>(entity.chunks).size
+        val hashes = chunkHashes(entity)
+        return if (hashes.size == count) hashes.map { hashChunkId(entity.id, it) }
+        else List(count) { chunkId(entity.id, it) }
     }
     
     suspend fun getDocumentCount(): Int {
@@ -240,9 +458,20 @@ data class RagDocument(
     val updatedAt: Long
 )
 
+data class IngestProgress(
+    val title: String,
+    val bytesRead: Long,
+    val bytesTotal: Long,
+    val chunks: Int,
+    val embedded: Int,
+    val reused: Int
+)
+
 data class RetrievedChunk(
     val text: String,
-    val similarity: Float,
+    val score: Float,               // reciprocal rank fusion of the two below; orders the results
+    val similarity: Float?,         // cosine, null when only BM25 matched (or no embedding model)
+    val lexicalScore: Float,        // BM25, 0 when only the vector search matched
     val documentId: String,
     val documentTitle: String,
     val chunkIndex: Int
@@ -0,0 +1,113 @@
+package edu.upt.assistant.domain.rag
+
+import edu.upt.assistant.LexicalIndexNative
+import java.io.File
+
+/**
+ * Owns one native BM25 index file, keyed by the same ids as the [VectorIndex] it is paired with
+ * so [hybridSearch] can fuse both in a single native call. An unreadable file starts empty;
+ * callers notice via [contains] and re-add what is missing.
+ */
+class LexicalIndex(private val file: File) {
+
+    data class Hit(val id: Long, val score: Float)
+
+    /** [score] is the fused rank score; [vectorScore] is null unless the hit was a vector candidate. */
+    data class HybridHit(val id: Long, val score: Float, val vectorScore: Float?, val lexicalScore: Float)
+
+    private var handle = 0L
+
+    // Reused across searches so the hot path doesn't allocate result buffers
+    private var outIds = LongArray(0)
+    private var outScores = FloatArray(0)
+    private var outVectorScores = FloatArray(0)
+    private var outLexicalScores = FloatArray(0)
+
+    @Synchronized
+    fun add(ids: LongArray, texts: List<String>): Int {
+        if (ids.isEmpty()) return 0
+        open()
+        return LexicalIndexNative.add(handle, ids, texts.toTypedArray())
+    }
+
+    @Synchronized
+    fun delete(ids: LongArray): Int {
+        if (ids.isEmpty()) return 0
+        open()
+        return LexicalIndexNative.delete(handle, ids)
+    }
+
+    @Synchronized
+    fun contains(id: Long): Boolean {
+        open()
+        return LexicalIndexNative.contains(handle, id)
+    }
+
+    @Synchronized
+    fun search(query: String, k: Int): List<Hit> {
+        open()
+        reserve(k)
+        val n = LexicalIndexNative.search(handle, query, k, outIds, outScores)
+        return List(n) { Hit(outIds[it], outScores[it]) }
+    }
+
+    /**
+     * Reciprocal rank fusion of BM25 over [query] and cosine over [vector] in [vectors] (skipped
+     * when [vector] is null, e.g. the embedder failed), each contributing its top [candidates].
+     */
+    @Synchronized
+    fun hybridSearch(
+        vectors: VectorIndex,
+        query: String,
+        vector: FloatArray?,
+        k: Int,
+        candidates: Int,
+        minVectorScore: Float
+    ): List<HybridHit> {
+        open()
+        reserve(k)
+        val search = { vectorHandle: Long ->
+            LexicalIndexNative.hybridSearch(
+                handle, vectorHandle, query, vector, k, candidates, minVectorScore,
+                outIds, outScores, outVectorScores, outLexicalScores
+            )
+        }
+        val n = if (vector != null) vectors.withHandle(vector.size, search) else search(0L)
+        return List(n) {
+            HybridHit(
+                id = outIds[it],
+                score = outScores[it],
+                vectorScore = outVectorScores[it].takeIf { s -> s > -1f },
+                lexicalScore = outLexicalScores[it]
+            )
+        }
+    }
+
+    @Synchronized
+    fun save(): Boolean = handle != 0L && LexicalIndexNative.save(handle)
+
+    @Synchronized
+    fun count(): Int = if (handle == 0L) 0 else LexicalIndexNative.count(handle)
+
+    @Synchronized
+    fun close() {
+        if (handle != 0L) {
+            LexicalIndexNative.close(handle)
+            handle = 0L
+        }
+    }
+
+    private fun reserve(k: Int) {
+        if (outIds.size >= k) return
+        outIds = LongArray(k)
+        outScores = FloatArray(k)
+        outVectorScores = FloatArray(k)
+        outLexicalScores = FloatArray(k)
+    }
+
+    private fun open() {
+        if (handle != 0L) return
+        file.parentFile?.mkdirs()
+        handle = LexicalIndexNative.open(file.absolutePath)
+    }
+}
@@ -1,9 +1,9 @@
 package edu.upt.assistant.domain.rag
 
 import android.content.Context
-import android.os.Process
 import android.util.Log
 import dagger.hilt.android.qualifiers.ApplicationContext
+import edu.upt.assistant.GenerationTelemetry
 import edu.upt.assistant.LlamaNative
 import edu.upt.assistant.StreamCallback
 import edu.upt.assistant.data.local.db.ConversationDao
@@ -15,6 +15,7 @@ import edu.upt.assistant.data.metrics.MetricsLogger
 import edu.upt.assistant.domain.ChatRepository
 import edu.upt.assistant.domain.ChatRepositoryImpl
 import edu.upt.assistant.domain.ConversationManager
+import edu.upt.assistant.domain.TokenCounter
 import edu.upt.assistant.domain.memory.KeywordExtractor
 import edu.upt.assistant.domain.memory.MemoryRepository
 import edu.upt.assistant.domain.prompts.ConversationMessage
@@ -23,13 +24,13 @@ import edu.upt.assistant.domain.prompts.PromptTemplateFactory
 import edu.upt.assistant.domain.utils.ModelUtils.fileNameFrom
 import edu.upt.assistant.ui.screens.Conversation
 import edu.upt.assistant.ui.screens.Message
+import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.channels.awaitClose
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.channelFlow
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.runBlocking
-import kotlinx.coroutines.withContext
 import javax.inject.Inject
 import javax.inject.Singleton
 
@@ -54,10 +55,6 @@ class RagChatRepository @Inject constructor(
         private const val TAG = "RagChatRepository"
         private const val MAX_CTX_TOKENS = 220
         private const val MAX_MEM_TOKENS = 80
-        private const val N_BATCH = 256
-        private const val N_UBATCH = 64
-
-        private fun estTokens(s: String): Int = (s.length / 4).coerceAtLeast(1)
 
         private fun extractQuant(modelUrl: String): String {
             val file = modelUrl.substringAfterLast('/').substringAfterLast('\\')
@@ -151,6 +148,10 @@ class RagChatRepository @Inject constructor(
             )
             convDao.upsert(ConversationEntity(conversationId, conversationId, text, now))
 
+            // Context first: token budgeting below counts against its vocab
+            val ctx = baseRepository.getLlamaContextFor(conversationId)
+            val tokens = baseRepository.tokenCounter
+
             // fetch memory + optional doc ctx
             Log.d(TAG, "TIMING: Starting memory/doc retrieval at ${System.currentTimeMillis()}")
             val docTopK = 4
@@ -160,7 +161,7 @@ class RagChatRepository @Inject constructor(
                 Log.e(TAG, "Error retrieving memory", e); emptyList()
             }
             val docCtx = try {
-                if (ragEnabled) retrieveContext(text) else ""
+                if (ragEnabled) retrieveContext(text, tokens) else ""
             } catch (e: Exception) {
                 Log.e(TAG, "Error retrieving context", e); ""
             }
@@ -182,10 +183,15 @@ class RagChatRepository @Inject constructor(
                     content = msg.content
                 )
             }
-            val historyTokens = prevHistory.sumOf { it.content.length / 4 }
-            val retrievedCtxTokens = if (docCtx.isNotBlank()) docCtx.length / 4 else 0
-
-            val manager = ConversationManager(currentSystemPrompt, promptTemplate = currentTemplate)
+            val historyTokens = tokens.count(prevHistory.map { it.content }).sum()
+            val retrievedCtxTokens = if (docCtx.isNotBlank()) tokens.count(docCtx) else 0
+
+            val manager = ConversationManager(
+                currentSystemPrompt,
+                maxTokens = { baseRepository.contextTokens },
+                promptTemplate = currentTemplate,
+                tokenCounter = tokens
+            )
             prevHistory.forEach {
                 when (it.role) {
                     MessageRole.USER -> manager.appendUser(it.content)
@@ -198,14 +204,8 @@ class RagChatRepository @Inject constructor(
             val currentMessage = buildString {
                 if (memoryEnabled && memoryHits.isNotEmpty()) {
                     appendLine("PERSONAL MEMORY")
-                    var memBudget = MAX_MEM_TOKENS
-                    for (m in memoryHits) {
-                        val line = "- " + trimToSentenceBoundary(m.content.trim())
-                        val tks = estTokens(line)
-                        if (tks > memBudget) break
-                        appendLine(line)
-                        memBudget -= tks
-                    }
+                    val lines = memoryHits.map { "- " + trimToSentenceBoundary(it.content.trim()) }
+                    for (i in tokens.pack(lines, MAX_MEM_TOKENS, separatorTokens = 1)) appendLine(lines[i])
                     appendLine("---")
                 }
                 if (ragEnabled && docCtx.isNotBlank()) {
@@ -221,8 +221,7 @@ class RagChatRepository @Inject constructor(
             val tPromptStart = System.currentTimeMillis()
             val prompt = manager.buildPromptWithHistory(prevHistory, currentMessage)
             val tPromptEnd = System.currentTimeMillis()
-            val promptTokens = prompt.length / 4
-            Log.d(TAG, "PERFORMANCE: Prompt build ${tPromptEnd - tPromptStart}ms, ~${promptTokens} tok (history ${historyTokens} ctx ${retrievedCtxTokens})")
+            Log.d(TAG, "PERFORMANCE: Prompt build ${tPromptEnd - tPromptStart}ms, ${prompt.length} chars (history ${historyTokens} ctx ${retrievedCtxTokens} tok)")
             Log.d(TAG, "===== FULL PROMPT SENT TO MODEL =====")
             Log.d(TAG, prompt)
             Log.d(TAG, "===== END OF PROMPT =====")
@@ -234,44 +233,51 @@ class RagChatRepository @Inject constructor(
 
             val llamaStart = System.currentTimeMillis()
             var firstTokenTime: Long? = null
-            var nativePrefill: Long = 0
-            var nativeFirstSample: Long = 0
-            var pieceCount = 0 // streamed pieces (approx)
+            var telemetry: GenerationTelemetry? = null
+            var pieceCount = 0
             val builder = StringBuilder()
+            val (loadTimeMs, warmupTimeMs) = baseRepository.takeSetupTimings()
+            var generationFailed = false
 
-            withContext(Dispatchers.IO) {
-                try {
-                    Process.setThreadPriority(Process.THREAD_PRIORITY_DISPLAY)
-                    LlamaNative.llamaGenerateStream(
-                        baseRepository.getLlamaContextPublic(),
-                        prompt,
-                        maxTokensCfg,
-                        object : StreamCallback {
-                            override fun onTimings(prefillMs: Long, firstSampleDelayMs: Long) {
-                                nativePrefill = prefillMs
-                                nativeFirstSample = firstSampleDelayMs
-                            }
-                            override fun onToken(tokenPiece: String) {
-                                if (firstTokenTime == null) {
-                                    firstTokenTime = System.currentTimeMillis()
-                                    Log.d(TAG, "PERFORMANCE: First token after ${firstTokenTime!! - llamaStart}ms")
-                                }
-                                if (tokenPiece.contains("<end_of_turn>") || tokenPiece.contains("<|im_end|>")) {
-                                    return
-                                }
-                                pieceCount++
-
-                                val normalized = baseRepository.normalizeTokenPublic(tokenPiece)
-                                val out = if (builder.isEmpty()) normalized.trimStart() else normalized
-                                if (trySend(out).isSuccess) builder.append(out)
+            // The system turn survives context shifts if the chat outgrows n_ctx
+            val nKeep = manager.systemPrefixTokens(prompt)
+            try {
+                // Runs on the context's native worker; cancelling this flow stops the decode
+                val status = LlamaNative.generate(
+                    ctx,
+                    prompt,
+                    maxTokensCfg,
+                    LlamaNative.PRIORITY_INTERACTIVE,
+                    object : StreamCallback {
+                        override fun onTelemetry(t: GenerationTelemetry) {
+                            telemetry = t
+                        }
+                        override fun onToken(tokenPiece: String) {
+                            if (firstTokenTime == null) {
+                                firstTokenTime = System.currentTimeMillis()
+                                Log.d(TAG, "PERFORMANCE: First token after ${firstTokenTime!! - llamaStart}ms")
                             }
+                            pieceCount++
+
+                            val out = if (builder.isEmpty()) tokenPiece.trimStart() else tokenPiece
+                            if (trySend(out).isSuccess) builder.append(out)
                         }
-                    )
-                } catch (e: Exception) {
-                    Log.e(TAG, "Error during streaming", e)
-                    trySend("Error: Failed to generate response")
+                    },
+                    nKeep = nKeep,
+                    stops = currentTemplate.stopStrings
+                )
+                if (status == LlamaNative.STATUS_FAILED) {
+                    generationFailed = true
+                    Log.e(TAG, "Native decode failed after $pieceCount pieces")
                 }
+            } catch (e: CancellationException) {
+                throw e
+            } catch (e: Exception) {
+                generationFailed = true
+                Log.e(TAG, "Error during streaming", e)
+                trySend("Error: Failed to generate response")
             }
+            if (!generationFailed) baseRepository.saveKvSnapshot(ctx, conversationId)
 
             val reply = builder.toString().trim()
             manager.appendUser(text)
@@ -282,13 +288,18 @@ class RagChatRepository @Inject constructor(
             val endBattery = MetricsLogger.batteryLevel(appContext)
             val endTempC   = MetricsLogger.deviceTemperature(appContext)
 
-            val prefillMs       = if (nativePrefill > 0) nativePrefill else (firstTokenTime ?: replyTime) - llamaStart
-            val firstSample     = nativeFirstSample
-            val firstTokenTotal = prefillMs + firstSample
-            val decodeMs        = replyTime - (firstTokenTime ?: replyTime)
-
-            val outputTokApprox = estTokens(builder.toString()).coerceAtLeast(pieceCount)
-            val decodeSpeed     = if (decodeMs > 0) outputTokApprox / (decodeMs / 1000.0) else 0.0
+            // Native telemetry is exact; wall-clock fallbacks only when the request never ran
+            val tel             = telemetry
+            val prefillMs       = tel?.prefillMs ?: ((firstTokenTime ?: replyTime) - llamaStart)
+            val firstSample     = tel?.firstSampleMs ?: 0L
+            val firstTokenTotal = tel?.firstTokenMs ?: prefillMs
+            val decodeMs        = tel?.decodeMs ?: (replyTime - (firstTokenTime ?: replyTime))
+            val outputTokens    = tel?.generatedTokens ?: pieceCount
+            val decodeSpeed     = tel?.decodeSpeed ?: 0.0
+            if (tel != null) {
+                Log.d(TAG, "PERFORMANCE: prompt ${tel.promptTokens} tok (${tel.reusedTokens} reused), output ${tel.generatedTokens} tok, " +
+                    "decode p50 ${tel.latencyP50Us / 1000.0}ms p95 ${tel.latencyP95Us / 1000.0}ms, KV ${tel.kvCellsUsed}/${tel.kvCellsTotal}")
+            }
 
             try {
                 MetricsLogger.log(
@@ -304,19 +315,36 @@ class RagChatRepository @Inject constructor(
                         startTempC        = startTempC,
                         endTempC          = endTempC,
                         promptChars       = prompt.length,
-                        promptTokens      = promptTokens,
+                        promptTokens      = tel?.promptTokens ?: 0,
                         historyTokens     = historyTokens,
                         retrievedCtxTokens= retrievedCtxTokens,
-                        outputTokens      = outputTokApprox,
+                        outputTokens      = outputTokens,
+                        reusedTokens      = tel?.reusedTokens ?: 0,
+                        prefilledTokens   = tel?.prefilledTokens ?: 0,
+                        draftedTokens     = tel?.draftedTokens ?: 0,
+                        acceptedTokens    = tel?.acceptedTokens ?: 0,
+                        loadTimeMs        = loadTimeMs,
+                        warmupTimeMs      = warmupTimeMs,
+                        queueTimeMs       = (tel?.queueUs ?: 0L) / 1000,
+                        tokenizeTimeMs    = (tel?.tokenizeUs ?: 0L) / 1000,
+                        sampleTimeMs      = (tel?.sampleUs ?: 0L) / 1000,
+                        prefillUbatches   = tel?.prefillUbatches ?: 0,
+                        decodeP50Ms       = (tel?.latencyP50Us ?: 0L) / 1000.0,
+                        decodeP95Ms       = (tel?.latencyP95Us ?: 0L) / 1000.0,
+                        decodeP99Ms       = (tel?.latencyP99Us ?: 0L) / 1000.0,
+                        latencyHistogram  = tel?.histogramString() ?: "",
+                        kvCellsUsed       = tel?.kvCellsUsed ?: 0,
+                        kvCellsTotal      = tel?.kvCellsTotal ?: 0,
+                        contextShifts     = tel?.contextShifts ?: 0,
                         promptId          = conversationId,
                         category          = "",
                         ragEnabled        = ragEnabled,
                         memoryEnabled     = memoryEnabled,
                         topK              = if (ragEnabled) docTopK else 0,
                         maxTokens         = maxTokensCfg,
-                        nThreads          = nThreadsCfg,
-                        nBatch            = N_BATCH,
-                        nUbatch           = N_UBATCH,
+                        nThreads          = tel?.nThreads ?: nThreadsCfg,
+                        nBatch            = tel?.nBatch ?: 0,
+                        nUbatch           = tel?.nUbatch ?: 0,
                         model             = fileNameFrom(modelUrl)
                     )
                 )
@@ -335,6 +363,8 @@ class RagChatRepository @Inject constructor(
             )
             convDao.upsert(ConversationEntity(conversationId, conversationId, reply, replyTime))
             Log.d(TAG, "Assistant response saved")
+        } catch (e: CancellationException) {
+            throw e
         } catch (e: Exception) {
             Log.e(TAG, "Error in RAG sendMessage", e)
             trySend("Error: ${e.message ?: "Unable to generate response"}")
@@ -344,21 +374,23 @@ class RagChatRepository @Inject constructor(
         awaitClose { /* no-op */ }
     }
 
-    private suspend fun retrieveContext(query: String): String {
+    private suspend fun retrieveContext(query: String, tokens: TokenCounter): String {
         return try {
             val retrieved = documentRepository.searchSimilarContent(query, topK = 4)
             if (retrieved.isEmpty()) {
                 Log.d(TAG, "No relevant context found for query: $query")
                 return ""
             }
+            val texts = retrieved.map { it.text.trim() }
+            val counts = tokens.count(texts)
             var budget = MAX_CTX_TOKENS
             val sb = StringBuilder()
-            for (chunk in retrieved) {
-                val text = chunk.text.trim()
-                val tks = estTokens(text)
+            for ((i, text) in texts.withIndex()) {
+                val tks = counts[i] + if (sb.isEmpty()) 0 else 1
                 if (tks > budget) {
-                    val trimmed = trimToSentenceBoundary(text.take(budget * 4))
-                    if (trimmed.isNotBlank() && estTokens(trimmed) <= budget) {
+                    // Cut the first chunk that doesn't fit to its share of the budget, then verify
+                    val trimmed = trimToSentenceBoundary(text.take(text.length * budget / tks))
+                    if (trimmed.isNotBlank() && tokens.count(trimmed) < budget) {
                         sb.appendLine(trimmed)
                     }
                     break
@@ -379,6 +411,13 @@ class RagChatRepository @Inject constructor(
     suspend fun addDocument(title: String, content: String, contentType: String = "text/plain"): String =
         documentRepository.addDocument(title, content, contentType)
 
+    suspend fun replaceDocument(
+        documentId: String,
+        title: String,
+        content: String,
+        contentType: String = "text/plain"
+    ): String = documentRepository.replaceDocument(documentId, title, content, contentType)
+
     suspend fun addMemory(
         content: String,
         title: String? = null,
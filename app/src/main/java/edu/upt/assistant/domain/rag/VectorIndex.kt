@@ -0,0 +1,105 @@
+package edu.upt.assistant.domain.rag
+
+import edu.upt.assistant.VectorIndexNative
+import java.io.File
+
+/**
+ * Owns the native vector index files named [name] under [dir], one per dimension
+ * (`name-768.vidx`). The index is (re)opened lazily with the dimension of the vectors it is
+ * given, so switching embedding models switches files instead of wiping one; callers notice
+ * via [contains] and re-add what is missing.
+ */
+class VectorIndex(private val dir: File, private val name: String, private val quantize: Boolean = true) {
+
+    data class Hit(val id: Long, val score: Float)
+
+    private var handle = 0L
+    private var dim = 0
+
+    // Reused across searches so the hot path doesn't allocate result buffers
+    private var outIds = LongArray(0)
+    private var outScores = FloatArray(0)
+
+    @Synchronized
+    fun add(ids: LongArray, vectors: List<FloatArray>): Int {
+        if (ids.isEmpty()) return 0
+        val d = vectors.first().size
+        open(d)
+        val flat = FloatArray(ids.size * d)
+        vectors.forEachIndexed { i, v -> v.copyInto(flat, i * d) }
+        return VectorIndexNative.add(handle, ids, flat)
+    }
+
+    @Synchronized
+    fun delete(ids: LongArray): Int =
+        if (handle == 0L || ids.isEmpty()) 0 else VectorIndexNative.delete(handle, ids)
+
+    /** True if [id] is indexed with vectors of dimension [dimension]. */
+    @Synchronized
+    fun contains(id: Long, dimension: Int): Boolean {
+        open(dimension)
+        return VectorIndexNative.contains(handle, id)
+    }
+
+    @Synchronized
+    fun get(id: Long): FloatArray? = if (handle == 0L) null else VectorIndexNative.get(handle, id)
+
+    @Synchronized
+    fun search(query: FloatArray, k: Int, minScore: Float): List<Hit> {
+        open(query.size)
+        if (outIds.size < k) {
+            outIds = LongArray(k)
+            outScores = FloatArray(k)
+        }
+        val n = VectorIndexNative.search(handle, query, k, minScore, outIds, outScores)
+        return List(n) { Hit(outIds[it], outScores[it]) }
+    }
+
+    /** Runs [block] with the native handle opened for [dimension], e.g. for [LexicalIndex.hybridSearch]. */
+    @Synchronized
+    fun <T> withHandle(dimension: Int, block: (Long) -> T): T {
+        open(dimension)
+        return block(handle)
+    }
+
+    @Synchronized
+    fun compact(): Long {
+        if (handle == 0L) return 0L
+        val reclaimed = VectorIndexNative.compact(handle)
+        // The compacted file is intact on disk but unmapped: reopen it on next use
+        if (!VectorIndexNative.isMapped(handle)) close()
+        return reclaimed
+    }
+
+    @Synchronized
+    fun count(): Int = if (handle == 0L) 0 else VectorIndexNative.count(handle)
+
+    @Synchronized
+    fun close() {
+        if (handle != 0L) {
+            VectorIndexNative.close(handle)
+            handle = 0L
+            dim = 0
+        }
+    }
+
+    private fun open(dimension: Int) {
+        if (handle != 0L && dim == dimension) return
+        close()
+        dir.mkdirs()
+        handle = VectorIndexNative.open(File(dir, "$name-$dimension.vidx").absolutePath, dimension, quantize)
+        dim = dimension
+    }
+
+    companion object {
+        /** Stable 64-bit id (FNV-1a) for string keys such as "docId#chunk" or memory UUIDs. */
+        fun idOf(key: String): Long {
+            var h = -0x340d631b7bdddcdbL // FNV offset basis 0xcbf29ce484222325
+            for (c in key) {
+                h = h xor c.code.toLong()
+                h *= 0x100000001b3L
+            }
+            return h
+        }
+    }
+}
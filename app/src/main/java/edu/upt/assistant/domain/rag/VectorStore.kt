@@ -2,83 +2,146 @@ package edu.upt.assistant.domain.rag
 
 import android.content.Context
 import android.util.Log
-import org.tensorflow.lite.Interpreter
-import org.tensorflow.lite.support.common.FileUtil
+import edu.upt.assistant.IngestCallback
+import edu.upt.assistant.LlamaNative
+import edu.upt.assistant.domain.ModelDownloadManager
+import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.SupervisorJob
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
 import kotlinx.coroutines.withContext
-import java.nio.MappedByteBuffer
+import java.io.File
 import kotlin.math.*
 
-class VectorStore(private val context: Context) {
-    
+class VectorStore(
+    private val context: Context,
+    private val modelDownloadManager: ModelDownloadManager
+) {
+
     companion object {
         private const val TAG = "VectorStore"
-        private const val MODEL_FILE = "universal_sentence_encoder.tflite"
-        private const val EMBEDDING_DIM = 512
+        const val EMBEDDING_MODEL_URL =
+            "https://huggingface.co/nomic-ai/nomic-embed-text-v1.5-GGUF/resolve/main/nomic-embed-text-v1.5.Q8_0.gguf"
+        private const val FALLBACK_EMBEDDING_DIM = 512
+        // Document chunks for streaming ingestion, in embedding model tokens
+        const val INGEST_CHUNK_TOKENS = 160
+        const val INGEST_OVERLAP_TOKENS = 24
     }
-    
-    private var interpreter: Interpreter? = null
-    
+
+    // Native llama.cpp embedding context (0 until the GGUF embedding model is available)
+    @Volatile private var embedder: Long = 0L
+    // The native context is single-threaded; serialize encode calls
+    private val lock = Mutex()
+    private val downloadScope = CoroutineScope(SupervisorJob() + Dispatchers.IO)
+
     suspend fun initialize() = withContext(Dispatchers.IO) {
-        try {
-            Log.d(TAG, "Initializing vector store")
-            val model = loadModelFile()
-            interpreter = Interpreter(model)
-            Log.d(TAG, "Vector store initialized successfully with TFLite model")
-        } catch (e: Exception) {
-            Log.w(TAG, "TFLite model not found, using simple embeddings fallback")
-            // Don't throw - just use simple embeddings
+        lock.withLock {
+            if (embedder != 0L) return@withLock
+            if (!modelDownloadManager.isModelAvailable(EMBEDDING_MODEL_URL)) {
+                Log.w(TAG, "Embedding model not downloaded yet, starting download")
+                modelDownloadManager.startDownload(EMBEDDING_MODEL_URL, downloadScope)
+                return@withLock
+            }
+            try {
+                val threads = minOf(8, maxOf(6, Runtime.getRuntime().availableProcessors() / 2))
+                embedder = LlamaNative.llamaEmbedCreate(
+                    modelDownloadManager.getModelPath(EMBEDDING_MODEL_URL),
+                    threads
+                )
+                Log.d(TAG, "Native embedder ready (dim=${LlamaNative.llamaEmbedDim(embedder)})")
+            } catch (e: Exception) {
+                Log.e(TAG, "Failed to create native embedder", e)
+                embedder = 0L
+            }
         }
     }
-    
-    private fun loadModelFile(): MappedByteBuffer {
-        return try {
-            FileUtil.loadMappedFile(context, MODEL_FILE)
-        } catch (e: Exception) {
-            Log.w(TAG, "TFLite model not found, using simple embeddings")
-            throw e
+
+    /**
+     * True once the native embedding model is loaded (loading it if it has been downloaded).
+     * Until then [generateEmbeddings] returns bag-of-words vectors, which must not be stored in
+     * or searched against a persistent [VectorIndex].
+     */
+    suspend fun ensureEmbedder(): Boolean {
+        if (embedder == 0L) initialize()
+        return embedder != 0L
+    }
+
+    /** Dimension of the vectors [generateEmbeddings] currently produces. */
+    fun dimension(): Int =
+        if (embedder != 0L) LlamaNative.llamaEmbedDim(embedder) else FALLBACK_EMBEDDING_DIM
+
+    /** Opens (or creates) the named on-disk vector index under filesDir/vectors, one file per dimension. */
+    fun openIndex(name: String): VectorIndex {
+        val dir = File(context.filesDir, "vectors")
+        File(dir, "$name.vidx").delete() // single file from before indexes were keyed by dimension
+        return VectorIndex(dir, name)
+    }
+
+    /** Opens (or creates) the named BM25 index next to the vector index of the same name. */
+    fun openLexicalIndex(name: String): LexicalIndex = LexicalIndex(File(context.filesDir, "vectors/$name.lidx"))
+
+    suspend fun generateEmbedding(text: String): FloatArray = generateEmbeddings(listOf(text)).first()
+
+    /** Embeds all [texts] in one native call; vectors come back L2-normalized. */
+    suspend fun generateEmbeddings(texts: List<String>): List<FloatArray> = withContext(Dispatchers.Default) {
+        if (texts.isEmpty()) return@withContext emptyList()
+        if (embedder == 0L) initialize()
+
+        val start = System.currentTimeMillis()
+        val matrix = lock.withLock {
+            if (embedder == 0L) null
+            else LlamaNative.llamaEmbedBatch(embedder, texts.toTypedArray())
+        }
+        if (matrix != null) {
+            val dim = matrix.size / texts.size
+            Log.d(TAG, "TIMING: Embedded ${texts.size} texts in ${System.currentTimeMillis() - start}ms")
+            return@withContext List(texts.size) { i -> matrix.copyOfRange(i * dim, (i + 1) * dim) }
         }
+
+        // Only until the embedding model has been downloaded; these vectors are lexical, not semantic
+        Log.w(TAG, "Native embedder unavailable, using hashed bag-of-words embeddings")
+        texts.map { generateSimpleEmbedding(it) }
     }
-    
-    suspend fun generateEmbedding(text: String): FloatArray = withContext(Dispatchers.Default) {
-        Log.d(TAG, "TIMING: Starting embedding generation for text length ${text.length} at ${System.currentTimeMillis()}")
-        interpreter?.let { interpreter ->
-            try {
-                val input = arrayOf(text)
-                val output = Array(1) { FloatArray(EMBEDDING_DIM) }
-                
-                Log.d(TAG, "TIMING: About to run TFLite inference at ${System.currentTimeMillis()}")
-                interpreter.run(input, output)
-                Log.d(TAG, "TIMING: TFLite inference completed at ${System.currentTimeMillis()}")
-                return@withContext output[0]
-            } catch (e: Exception) {
-                Log.e(TAG, "Error generating embedding with TFLite", e)
-            }
+
+    /**
+     * Streams [file] through the native chunker and embedder, see [LlamaNative.llamaEmbedIngestFile].
+     * Returns [chunks, embedded, reused], or null while the embedding model is unavailable.
+     */
+    suspend fun ingestFile(file: File, known: LongArray, callback: IngestCallback): IntArray? =
+        ingest { LlamaNative.llamaEmbedIngestFile(it, file.path, INGEST_CHUNK_TOKENS, INGEST_OVERLAP_TOKENS, known, callback) }
+
+    /** Same as [ingestFile] for text already in memory. */
+    suspend fun ingestText(text: String, known: LongArray, callback: IngestCallback): IntArray? =
+        ingest { LlamaNative.llamaEmbedIngestText(it, text, INGEST_CHUNK_TOKENS, INGEST_OVERLAP_TOKENS, known, callback) }
+
+    // Holds the embedder for the whole run: the chunker thread feeds it, callbacks arrive here
+    private suspend fun ingest(run: (Long) -> IntArray): IntArray? = withContext(Dispatchers.Default) {
+        if (embedder == 0L) initialize()
+        val start = System.currentTimeMillis()
+        lock.withLock {
+            if (embedder == 0L) null else run(embedder)
+        }?.also { (chunks, embedded, reused) ->
+            Log.d(TAG, "TIMING: Ingested $chunks chunks ($embedded embedded, $reused reused) in ${System.currentTimeMillis() - start}ms")
         }
-        
-        // Fallback to simple hash-based embedding
-        Log.d(TAG, "TIMING: Using simple embedding fallback at ${System.currentTimeMillis()}")
-        val result = generateSimpleEmbedding(text)
-        Log.d(TAG, "TIMING: Simple embedding completed at ${System.currentTimeMillis()}")
-        result
     }
-    
+
     private fun generateSimpleEmbedding(text: String): FloatArray {
         val words = text.lowercase().split(Regex("\\W+")).filter { it.isNotEmpty() }
-        val embedding = FloatArray(EMBEDDING_DIM)
-        
+        val embedding = FloatArray(FALLBACK_EMBEDDING_DIM)
+
         // Simple word-based feature extraction
         words.forEachIndexed { index, word ->
             val hash = word.hashCode()
-            val idx1 = abs(hash) % EMBEDDING_DIM
-            val idx2 = abs(hash / 31) % EMBEDDING_DIM
-            val idx3 = abs(hash / 37) % EMBEDDING_DIM
-            
+            val idx1 = abs(hash) % FALLBACK_EMBEDDING_DIM
+            val idx2 = abs(hash / 31) % FALLBACK_EMBEDDING_DIM
+            val idx3 = abs(hash / 37) % FALLBACK_EMBEDDING_DIM
+
             embedding[idx1] += 1.0f
             embedding[idx2] += 0.5f
             embedding[idx3] += 0.25f
         }
-        
+
         // Normalize
         val norm = sqrt(embedding.map { it * it }.sum())
         if (norm > 0) {
@@ -86,27 +149,27 @@ class VectorStore(private val context: Context) {
                 embedding[i] /= norm
             }
         }
-        
+
         return embedding
     }
-    
+
     fun cosineSimilarity(a: FloatArray, b: FloatArray): Float {
         if (a.size != b.size) return 0f
-        
+
         var dotProduct = 0f
         var normA = 0f
         var normB = 0f
-        
+
         for (i in a.indices) {
             dotProduct += a[i] * b[i]
             normA += a[i] * a[i]
             normB += b[i] * b[i]
         }
-        
+
         val denominator = sqrt(normA) * sqrt(normB)
         return if (denominator > 0) dotProduct / denominator else 0f
     }
-    
+
     fun findSimilarChunks(
         queryEmbedding: FloatArray,
         chunks: List<String>,
@@ -120,16 +183,18 @@ class VectorStore(private val context: Context) {
                 index = index
             )
         }
-        
+
         return similarities
             .sortedByDescending { it.similarity }
             .take(topK)
             .filter { it.similarity > 0.1f } // Minimum similarity threshold
     }
-    
+
     fun close() {
-        interpreter?.close()
-        interpreter = null
+        if (embedder != 0L) {
+            LlamaNative.llamaEmbedFree(embedder)
+            embedder = 0L
+        }
     }
 }
 
@@ -137,4 +202,4 @@ data class SimilarChunk(
     val text: String,
     val similarity: Float,
     val index: Int
-)
\ No newline at end of file
+)
@@ -86,11 +86,6 @@ fun ChatRoute(
             vm.dismissMemorySuggestion()
         }
     }
-    
-    // Clear KV cache when conversation changes
-    LaunchedEffect(conversationId) {
-        vm.clearKvCacheForConversation(conversationId)
-    }
 
     Scaffold(
         topBar = {
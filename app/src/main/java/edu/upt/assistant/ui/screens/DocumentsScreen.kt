@@ -25,6 +25,7 @@ fun DocumentsScreen(
     viewModel: DocumentsViewModel = hiltViewModel()
 ) {
     val documents by viewModel.documents.collectAsState()
+    val ingestProgress by viewModel.ingestProgress.collectAsState()
     var showAddDialog by remember { mutableStateOf(false) }
     
 
@@ -51,6 +52,19 @@ fun DocumentsScreen(
                 .padding(paddingValues)
                 .padding(16.dp)
         ) {
+            ingestProgress?.let { progress ->
+                val fraction = if (progress.bytesTotal > 0) progress.bytesRead.toFloat() / progress.bytesTotal else 0f
+                Text(
+                    text = "Indexing ${progress.title}: ${progress.chunks} chunks, ${progress.reused} unchanged",
+                    style = MaterialTheme.typography.bodySmall
+                )
+                LinearProgressIndicator(
+                    progress = { fraction },
+                    modifier = Modifier
+                        .fillMaxWidth()
+                        .padding(vertical = 8.dp)
+                )
+            }
             if (documents.isEmpty()) {
                 EmptyDocumentsState(
                     onAddDocument = { showAddDialog = true }
@@ -5,6 +5,7 @@ import androidx.lifecycle.ViewModel
 import androidx.lifecycle.viewModelScope
 import dagger.hilt.android.lifecycle.HiltViewModel
 import edu.upt.assistant.domain.rag.DocumentRepository
+import edu.upt.assistant.domain.rag.IngestProgress
 import edu.upt.assistant.domain.rag.RagChatRepository
 import edu.upt.assistant.domain.ChatRepository
 import edu.upt.assistant.domain.rag.RagDocument
@@ -28,6 +29,8 @@ class DocumentsViewModel @Inject constructor(
     
     private val _isLoading = MutableStateFlow(false)
     val isLoading: StateFlow<Boolean> = _isLoading.asStateFlow()
+
+    val ingestProgress: StateFlow<IngestProgress?> = documentRepository.ingestProgress
     
     // Use stateIn to create a robust StateFlow from the repository
     val documents: StateFlow<List<RagDocument>> = documentRepository.getAllDocuments()